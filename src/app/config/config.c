@@ -518,11 +518,23 @@ static const config_var_t option_vars_[] = {
       LINELIST_S, RendConfigLines, NULL),
   /* HRPR */
   VAR("HiddenServicePoWDefensesEnabled", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServicePoWQueueRate", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServicePoWQueueBurst", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServicePoWQueueMaxDepth", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServicePoWQueueMaxAge", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServiceIntroduce2RatePerSec",
+      LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServiceIntroduce2BurstPerSec",
+      LINELIST_S, RendConfigLines, NULL),
   VAR("HiddenServiceStatistics", BOOL, HiddenServiceStatistics_option, "1"),
   V(HidServAuth,                 LINELIST, NULL),
   V(ClientOnionAuthDir,          FILENAME, NULL),
+  V(ClientOnionLazyDecryption,   BOOL,     "0"),
+  V(ClientOnionPoWSolverThreads, POSINT,   "0"),
   OBSOLETE("CloseHSClientCircuitsImmediatelyOnTimeout"),
   OBSOLETE("CloseHSServiceRendCircuitsImmediatelyOnTimeout"),
+  V(HiddenServiceCircuitPool,    POSINT,   "0"),
+  V(HiddenServiceIntroduce2MaxPerLoop, POSINT, "0"),
   V_IMMUTABLE(HiddenServiceSingleHopMode,  BOOL,     "0"),
   V_IMMUTABLE(HiddenServiceNonAnonymousMode,BOOL,    "0"),
   V(HTTPProxy,                   STRING,   NULL),
@@ -559,9 +571,11 @@ static const config_var_t option_vars_[] = {
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    POSINT,     "32"),
   V(MaxConsensusAgeForDiffs,     INTERVAL, "0 seconds"),
+  V(MaxHSDirCacheBytes,          MEMUNIT,  "0"),
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
+  V(OffloadRelayCellCrypto,      BOOL,     "0"),
   V(MaxUnparseableDescSizeToLog, MEMUNIT, "10 MB"),
   VPORT(MetricsPort),
   V(MetricsPortPolicy,           LINELIST, NULL),
@@ -3445,6 +3459,14 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
     }
   }
 
+  if (options->HiddenServiceCircuitPool > MAX_HS_CIRCUIT_POOL) {
+    tor_asprintf(msg,
+                 "HiddenServiceCircuitPool must be at most %d, but "
+                 "was set to %d", MAX_HS_CIRCUIT_POOL,
+                 options->HiddenServiceCircuitPool);
+    return -1;
+  }
+
   if (options->MaxClientCircuitsPending <= 0 ||
       options->MaxClientCircuitsPending > MAX_MAX_CLIENT_CIRCUITS_PENDING) {
     tor_asprintf(msg,
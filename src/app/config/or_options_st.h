@@ -340,6 +340,14 @@ struct or_options_t {
    * directly.
    */
   int HiddenServiceNonAnonymousMode;
+  /** Maximum number of INTRODUCE2 cells, across all our onion services, that
+   * we decrypt during a single run of the main loop. 0 means no limit. */
+  int HiddenServiceIntroduce2MaxPerLoop;
+  /** Number of clean internal circuits to keep ready for our onion services
+   * to extend to their introduction and rendezvous points. Values below the
+   * default pool size leave it unchanged. */
+  int HiddenServiceCircuitPool;
+#define MAX_HS_CIRCUIT_POOL 1024
 
   int ConnLimit; /**< Demanded minimum number of simultaneous connections. */
   int ConnLimit_; /**< Maximum allowed number of simultaneous connections. */
@@ -409,6 +417,9 @@ struct or_options_t {
                              * waiting for this many seconds. If zero, use
                              * our default internal timeout schedule. */
   int MaxOnionQueueDelay; /*< DOCDOC */
+  /** If true, hand the relay cell crypto of circuits where we are a middle
+   * hop to the cpuworkers. */
+  int OffloadRelayCellCrypto;
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
@@ -433,6 +444,12 @@ struct or_options_t {
                                * services */
   char *ClientOnionAuthDir; /**< Directory to keep client
                              * onion service authorization secret keys */
+  /** Boolean: if set, cache fetched onion service descriptors with only
+   * their plaintext layer decoded and decrypt them when first needed. */
+  int ClientOnionLazyDecryption;
+  /** HRPR: How many cpuworkers to split an onion service PoW solve across.
+   * 0 means one per CPU. */
+  int ClientOnionPoWSolverThreads;
   char *ContactInfo; /**< Contact info to be published in the directory. */
 
   int HeartbeatPeriod; /**< Log heartbeat messages after this many seconds
@@ -604,6 +621,10 @@ struct or_options_t {
                  * referencing this option directly. (Except for routermode
                  * and relay_config, which do direct checks.) */
 
+  /** If nonzero, the onion service descriptors cached as an HSDir are kept
+   * under this many bytes by evicting the least recently used ones. */
+  uint64_t MaxHSDirCacheBytes;
+
   char *VirtualAddrNetworkIPv4; /**< Address and mask to hand out for virtual
                                  * MAPADDRESS requests for IPv4 addresses */
   char *VirtualAddrNetworkIPv6; /**< Address and mask to hand out for virtual
@@ -1228,7 +1228,9 @@ run_tor_main_loop(void)
   directory_info_has_arrived(now, 1, 0);
 
   if (server_mode(get_options()) || dir_server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
+    /* launch cpuworkers. Need to do this *after* we've read the onion key.
+     * Clients that need them, e.g. to solve onion service PoW puzzles, get
+     * them on first use from cpuworker_queue_work(). */
     cpu_init();
   }
   consdiffmgr_enable_background_compression();
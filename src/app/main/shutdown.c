@@ -25,6 +25,7 @@
 #include "core/or/circuitpadding.h"
 #include "core/or/connection_edge.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -130,6 +131,7 @@ tor_free_all(int postfork)
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  packed_cell_free_all();
   connection_edge_free_all();
   scheduler_free_all();
   nodelist_free_all();
@@ -24,77 +24,95 @@
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
+/** Offset of the 4-byte integrity field within a relay cell payload; see
+ * relay_header_pack(). */
+#define RELAY_INTEGRITY_OFFSET 5
+/** Length of the integrity field of a relay cell. */
+#define RELAY_INTEGRITY_LEN 4
+
 /** Update digest from the payload of cell. Assign integrity part to
  * cell.
  */
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
-
   crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  crypto_digest_get_digest(digest,
+                           (char*)cell->payload + RELAY_INTEGRITY_OFFSET,
+                           RELAY_INTEGRITY_LEN);
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
  *
- * Update digest from the payload of cell (with the integrity part set
- * to 0). If the integrity part is valid, return 1, else restore digest
- * and cell to their original state and return 0.
+ * Update the digest of <b>crypto</b> for <b>direction</b> from the payload
+ * of cell (with the integrity part set to 0). If the integrity part is
+ * valid, return 1, else leave digest and cell in their original state and
+ * return 0.
+ *
+ * The payload is hashed into the preallocated scratch digest of
+ * <b>crypto</b>, which becomes the circuit digest only if the cell matches:
+ * so a cell that isn't ours costs no copy to restore the digest.
  */
-static int
-relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
+int
+relay_crypto_digest_matches(relay_crypto_t *crypto,
+                            cell_direction_t direction, cell_t *cell)
 {
-  uint32_t received_integrity, calculated_integrity;
-  relay_header_t rh;
-  crypto_digest_checkpoint_t backup_digest;
+  crypto_digest_t **digestp;
+  crypto_digest_t *tmp;
+  uint8_t *integrity = cell->payload + RELAY_INTEGRITY_OFFSET;
+  uint8_t received_integrity[RELAY_INTEGRITY_LEN];
+  uint8_t calculated_integrity[RELAY_INTEGRITY_LEN];
 
-  crypto_digest_checkpoint(&backup_digest, digest);
+  tor_assert(crypto);
+  tor_assert(crypto->scratch_digest);
 
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(&received_integrity, rh.integrity, 4);
-  memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
-
-//  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
-//    received_integrity[0], received_integrity[1],
-//    received_integrity[2], received_integrity[3]);
-
-  crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
-
-  int rv = 1;
-
-  if (calculated_integrity != received_integrity) {
-//    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
-// (%d vs %d).", received_integrity, calculated_integrity);
-    /* restore digest to its old form */
-    crypto_digest_restore(digest, &backup_digest);
-    /* restore the relay header */
-    memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
-    rv = 0;
+  digestp = (direction == CELL_DIRECTION_OUT) ? &crypto->f_digest
+                                              : &crypto->b_digest;
+
+  memcpy(received_integrity, integrity, RELAY_INTEGRITY_LEN);
+  memset(integrity, 0, RELAY_INTEGRITY_LEN);
+
+  crypto_digest_assign(crypto->scratch_digest, *digestp);
+  crypto_digest_add_bytes(crypto->scratch_digest, (char*) cell->payload,
+                          CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(crypto->scratch_digest,
+                           (char*) calculated_integrity, RELAY_INTEGRITY_LEN);
+
+  if (tor_memneq(calculated_integrity, received_integrity,
+                 RELAY_INTEGRITY_LEN)) {
+    /* restore the relay header; the digest was never touched. */
+    memcpy(integrity, received_integrity, RELAY_INTEGRITY_LEN);
+    return 0;
   }
 
-  memwipe(&backup_digest, 0, sizeof(backup_digest));
-  return rv;
+  /* The scratch state is the digest state right after this cell: keep it,
+   * and reuse the old one as scratch. */
+  tmp = *digestp;
+  *digestp = crypto->scratch_digest;
+  crypto->scratch_digest = tmp;
+  return 1;
 }
 
-/** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
- * (in place).
+/** Apply the cipher of <b>crypto</b> for cells going in <b>direction</b> to
+ * <b>n_cells</b> cell payloads stored contiguously in <b>payloads</b> (in
+ * place). CELL_DIRECTION_OUT uses the forward cipher, and CELL_DIRECTION_IN
+ * the backward one.
  *
  * Note that we use the same operation for encrypting and for decrypting.
- */
+ * This is equivalent to running the cipher over each payload in order, but
+ * makes a single cipher call. */
 void
-relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
+relay_crypto_crypt_payloads(relay_crypto_t *crypto,
+                            cell_direction_t direction,
+                            uint8_t *payloads, int n_cells)
 {
-  crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
+  crypto_cipher_t *cipher;
+
+  tor_assert(n_cells >= 0);
+  cipher = (direction == CELL_DIRECTION_OUT) ? crypto->f_crypto :
+                                               crypto->b_crypto;
+  crypto_cipher_crypt_inplace(cipher, (char *) payloads,
+                              (size_t)n_cells * CELL_PAYLOAD_SIZE);
 }
 
 /** Return the sendme_digest within the <b>crypto</b> object. */
@@ -173,7 +191,7 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
         relay_header_unpack(&rh, cell->payload);
         if (rh.recognized == 0) {
           /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(cpath_get_incoming_digest(thishop), cell)) {
+          if (cpath_incoming_digest_matches(thishop, cell)) {
             *recognized = 1;
             *layer_hint = thishop;
             return 0;
@@ -186,26 +204,54 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
-      /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+      relay_crypto_crypt_relayed_cell(&TO_OR_CIRCUIT(circ)->crypto, cell,
+                                      CELL_DIRECTION_IN, recognized);
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
-    /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
+    relay_crypto_crypt_relayed_cell(&TO_OR_CIRCUIT(circ)->crypto, cell,
+                                    CELL_DIRECTION_OUT, recognized);
+  }
+  return 0;
+}
+
+/** Do the en/decryption for <b>cell</b>, arriving in <b>cell_direction</b>
+ * on a circuit that we are not the origin of and whose state for this hop is
+ * <b>crypto</b>. This is the part of relay_decrypt_cell() that only touches
+ * <b>crypto</b> and <b>cell</b>, so it may run outside the main thread.
+ *
+ * If cell_direction == CELL_DIRECTION_IN, we're in the middle: encrypt one
+ * layer.
+ *
+ * If cell_direction == CELL_DIRECTION_OUT, decrypt one layer, and set
+ * *<b>recognized</b> to 1 if the cell is for us.
+ */
+void
+relay_crypto_crypt_relayed_cell(relay_crypto_t *crypto, cell_t *cell,
+                                cell_direction_t cell_direction,
+                                char *recognized)
+{
+  relay_header_t rh;
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+  tor_assert(crypto);
+  tor_assert(cell);
+  tor_assert(recognized);
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+  if (cell_direction == CELL_DIRECTION_IN) {
+    /* We're in the middle. Encrypt one layer. */
+    relay_crypto_crypt_payloads(crypto, CELL_DIRECTION_IN, cell->payload, 1);
+    return;
+  }
+
+  /* We're in the middle. Decrypt one layer. */
+  relay_crypto_crypt_payloads(crypto, CELL_DIRECTION_OUT, cell->payload, 1);
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_crypto_digest_matches(crypto, CELL_DIRECTION_OUT, cell)) {
+      *recognized = 1;
     }
   }
-  return 0;
 }
 
 /**
@@ -248,13 +294,31 @@ void
 relay_encrypt_cell_inbound(cell_t *cell,
                            or_circuit_t *or_circ)
 {
-  relay_set_digest(or_circ->crypto.b_digest, cell);
+  relay_crypto_encrypt_cell_inbound(&or_circ->crypto, cell,
+                   sendme_sending_cell_digest_is_next(TO_CIRCUIT(or_circ),
+                                                      NULL));
+}
+
+/**
+ * Encrypt a cell <b>cell</b> that we are creating and sending towards the
+ * origin, using the hop state <b>crypto</b>. If <b>record_sendme_digest</b>
+ * is true, record the cell digest as the SENDME digest.
+ *
+ * Like relay_crypto_crypt_relayed_cell(), this only touches <b>crypto</b>
+ * and <b>cell</b>.
+ */
+void
+relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto, cell_t *cell,
+                                  bool record_sendme_digest)
+{
+  relay_set_digest(crypto->b_digest, cell);
 
   /* Record cell digest as the SENDME digest if need be. */
-  sendme_record_sending_cell_digest(TO_CIRCUIT(or_circ), NULL);
+  if (record_sendme_digest)
+    relay_crypto_record_sendme_digest(crypto, false);
 
   /* encrypt one layer */
-  relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
+  relay_crypto_crypt_payloads(crypto, CELL_DIRECTION_IN, cell->payload, 1);
 }
 
 /**
@@ -270,6 +334,7 @@ relay_crypto_clear(relay_crypto_t *crypto)
   crypto_cipher_free(crypto->b_crypto);
   crypto_digest_free(crypto->f_digest);
   crypto_digest_free(crypto->b_digest);
+  crypto_digest_free(crypto->scratch_digest);
 }
 
 /** Initialize <b>crypto</b> from the key material in key_data.
@@ -302,7 +367,8 @@ relay_crypto_init(relay_crypto_t *crypto,
   tor_assert(crypto);
   tor_assert(key_data);
   tor_assert(!(crypto->f_crypto || crypto->b_crypto ||
-             crypto->f_digest || crypto->b_digest));
+             crypto->f_digest || crypto->b_digest ||
+             crypto->scratch_digest));
 
   /* Basic key size validation */
   if (is_hs_v3 && BUG(key_data_len != HS_NTOR_KEY_EXPANSION_KDF_OUT_LEN)) {
@@ -331,6 +397,7 @@ relay_crypto_init(relay_crypto_t *crypto,
 
   crypto_digest_add_bytes(crypto->f_digest, key_data, digest_len);
   crypto_digest_add_bytes(crypto->b_digest, key_data+digest_len, digest_len);
+  crypto->scratch_digest = crypto_digest_dup(crypto->f_digest);
 
   crypto->f_crypto = crypto_cipher_new_with_bits(key_data+(2*digest_len),
                                                 cipher_key_bits);
@@ -370,4 +437,5 @@ relay_crypto_assert_ok(const relay_crypto_t *crypto)
   tor_assert(crypto->b_crypto);
   tor_assert(crypto->f_digest);
   tor_assert(crypto->b_digest);
+  tor_assert(crypto->scratch_digest);
 }
@@ -23,6 +23,12 @@ void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 
+void relay_crypto_crypt_relayed_cell(relay_crypto_t *crypto, cell_t *cell,
+                                     cell_direction_t cell_direction,
+                                     char *recognized);
+void relay_crypto_encrypt_cell_inbound(relay_crypto_t *crypto, cell_t *cell,
+                                       bool record_sendme_digest);
+
 void relay_crypto_clear(relay_crypto_t *crypto);
 
 void relay_crypto_assert_ok(const relay_crypto_t *crypto);
@@ -32,11 +38,14 @@ uint8_t *relay_crypto_get_sendme_digest(relay_crypto_t *crypto);
 void relay_crypto_record_sendme_digest(relay_crypto_t *crypto,
                                        bool is_foward_digest);
 
-void
-relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in);
+void relay_crypto_crypt_payloads(relay_crypto_t *crypto,
+                                 cell_direction_t direction,
+                                 uint8_t *payloads, int n_cells);
 
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell);
+int relay_crypto_digest_matches(relay_crypto_t *crypto,
+                                cell_direction_t direction, cell_t *cell);
 
 #endif /* !defined(TOR_RELAY_CRYPTO_H) */
 
@@ -14,7 +14,9 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and, if OffloadRelayCellCrypto is set, for crypting the relay
+ *          cells of circuits that we are a middle hop of.
  *  </ul>
  **/
 #include "core/or/or.h"
@@ -26,14 +28,22 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "core/or/onion.h"
+#include "core/or/relay.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/or/sendme.h"
 #include "feature/relay/circuitbuild_relay.h"
 #include "feature/relay/onion_queue.h"
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
+#include "feature/relay/routermode.h"
 #include "lib/evloop/workqueue.h"
 #include "core/crypto/onion_crypto.h"
 
+#include "tor_queue.h"
+
+#include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
 
 static void queue_pending_tasks(void);
 
@@ -488,13 +498,18 @@ queue_pending_tasks(void)
   }
 }
 
-/** DOCDOC */
+/** Queue <b>fn</b> to run on a cpuworker with <b>arg</b>, and
+ * <b>reply_fn</b> to run on the main thread once it is done. Launch the
+ * cpuworkers first if nothing has needed them yet: only relays start them
+ * at boot. */
 MOCK_IMPL(workqueue_entry_t *,
 cpuworker_queue_work,(workqueue_priority_t priority,
                       workqueue_reply_t (*fn)(void *, void *),
                       void (*reply_fn)(void *),
                       void *arg))
 {
+  if (!threadpool)
+    cpu_init();
   tor_assert(threadpool);
 
   return threadpool_queue_work_priority(threadpool,
@@ -595,3 +610,484 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
     circ->workqueue_entry = NULL;
   }
 }
+
+/* Relay cell crypto.
+ *
+ * When OffloadRelayCellCrypto is set, the relay cells of a circuit that we
+ * are a middle hop of are not crypted as they arrive. They are queued on the
+ * circuit instead, and a cpuworker crypts a run of them at a time. Only one
+ * job per circuit is in flight at once, and the circuit's relay_crypto_t is
+ * handed over to the job for its duration: so the cells of a circuit are
+ * crypted in the order they arrived, and the main thread never touches that
+ * state while a worker does. Once the job returns, the main thread relays
+ * the cells exactly as circuit_receive_relay_cell() would have. */
+
+typedef struct relay_crypto_queue_t relay_crypto_queue_t;
+
+/** Largest number of cells that a single relay crypto job handles. */
+#define RELAY_CRYPTO_JOB_MAX_CELLS 64
+/** Largest number of cells that may wait for a cpuworker on one circuit. We
+ * close the circuit if a peer sends us more than that: with well-behaved
+ * peers, this is bounded by the circuit windows in both directions. */
+#define RELAY_CRYPTO_MAX_QUEUED_CELLS (2 * CIRCWINDOW_START_MAX)
+
+/** A relay cell waiting to be crypted by a cpuworker. */
+typedef struct relay_crypto_item_t {
+  TOR_SIMPLEQ_ENTRY(relay_crypto_item_t) next;
+  /** The cell itself, crypted in place. */
+  cell_t cell;
+  /** The direction the cell is going in. */
+  cell_direction_t direction;
+  /** For cells we originated: the stream that sent the cell, if any. */
+  streamid_t on_stream;
+  /** True iff we originated this cell: it is going towards the origin and
+   * needs its digest set before being encrypted. */
+  unsigned int originated : 1;
+  /** For cells we originated: true iff this cell's digest must be recorded
+   * as the SENDME digest. */
+  unsigned int record_sendme_digest : 1;
+  /** Set by the cpuworker: true iff the cell is for us. */
+  char recognized;
+} relay_crypto_item_t;
+
+/** A run of relay cells handed to a cpuworker, with the crypto state they
+ * need. */
+typedef struct relay_crypto_job_t {
+  /** The circuit the cells belong to. */
+  or_circuit_t *circ;
+  /** The circuit's crypto state, which the job owns while in flight. */
+  relay_crypto_t crypto;
+  /** The workqueue entry for this job. */
+  workqueue_entry_t *workqueue_entry;
+  /** Number of cells in <b>items</b>. */
+  int n_items;
+  /** Set by the cpuworker: number of cells it crypted. It stops after a
+   * recognized cell, since handling that cell may use the crypto state. */
+  int n_done;
+  /** The cells, in the order they arrived. */
+  relay_crypto_item_t *items[RELAY_CRYPTO_JOB_MAX_CELLS];
+} relay_crypto_job_t;
+
+/** The relay cells of a circuit waiting for, or being crypted by, a
+ * cpuworker. */
+struct relay_crypto_queue_t {
+  /** Cells not yet handed to a cpuworker, in arrival order. */
+  TOR_SIMPLEQ_HEAD(relay_crypto_item_simpleq_t, relay_crypto_item_t) head;
+  /** Number of cells in <b>head</b>. */
+  int n;
+  /** The job in flight for this circuit, if any. */
+  relay_crypto_job_t *job;
+};
+
+/** Total number of bytes allocated for relay cells waiting for, or being
+ * crypted by, a cpuworker. */
+static size_t relay_crypto_total_allocation = 0;
+
+/** Return the total number of bytes allocated for relay cells waiting for,
+ * or being crypted by, a cpuworker. */
+size_t
+cpuworker_relay_crypto_get_total_allocation(void)
+{
+  return relay_crypto_total_allocation;
+}
+
+/** Return true iff we should hand the relay cells of <b>circ</b> to the
+ * cpuworkers. We do this only for circuits where we are a plain middle hop:
+ * on any other circuit, the main thread uses the crypto state for cells of
+ * its own too often for handing it over to pay off. */
+static bool
+relay_crypto_offload_allowed(const or_circuit_t *circ)
+{
+  const or_options_t *options = get_options();
+  const circuit_t *c = &circ->base_;
+  int i;
+
+  if (!options->OffloadRelayCellCrypto || !server_mode(options))
+    return false;
+  if (c->purpose != CIRCUIT_PURPOSE_OR || !c->n_chan || !circ->p_chan)
+    return false;
+  if (circ->rend_splice || circ->n_streams || circ->resolving_streams)
+    return false;
+  for (i = 0; i < CIRCPAD_MAX_MACHINES; ++i) {
+    if (c->padding_machine[i])
+      return false;
+  }
+  return true;
+}
+
+/** Return true iff a cpuworker currently holds the crypto state of
+ * <b>circ</b>. */
+bool
+cpuworker_circ_relay_crypto_in_flight(const or_circuit_t *circ)
+{
+  return circ->relay_crypto_queue && circ->relay_crypto_queue->job;
+}
+
+/** Return true iff a relay cell arriving on <b>circ</b> must go through
+ * cpuworker_queue_relay_cell(): either because we offload this circuit's
+ * crypto, or because earlier cells are still queued for it. */
+bool
+cpuworker_relay_cell_wants_offload(const or_circuit_t *circ)
+{
+  const relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  if (q && (q->job || q->n))
+    return true;
+  return relay_crypto_offload_allowed(circ);
+}
+
+/** Free <b>item</b>, wiping the cell it holds. */
+static void
+relay_crypto_item_free_(relay_crypto_item_t *item)
+{
+  if (!item)
+    return;
+  relay_crypto_total_allocation -= sizeof(*item);
+  memwipe(item, 0, sizeof(*item));
+  tor_free(item);
+}
+#define relay_crypto_item_free(item) \
+  FREE_AND_NULL(relay_crypto_item_t, relay_crypto_item_free_, (item))
+
+/** Free every cell in the queue <b>q</b>. */
+static void
+relay_crypto_queue_clear(relay_crypto_queue_t *q)
+{
+  relay_crypto_item_t *item;
+  while ((item = TOR_SIMPLEQ_FIRST(&q->head))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(&q->head, next);
+    relay_crypto_item_free(item);
+  }
+  q->n = 0;
+}
+
+/** Free <b>job</b>, its cells and the crypto state it holds. */
+static void
+relay_crypto_job_free_(relay_crypto_job_t *job)
+{
+  int i;
+  if (!job)
+    return;
+  relay_crypto_clear(&job->crypto);
+  for (i = 0; i < job->n_items; ++i)
+    relay_crypto_item_free(job->items[i]);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+#define relay_crypto_job_free(job) \
+  FREE_AND_NULL(relay_crypto_job_t, relay_crypto_job_free_, (job))
+
+/** Give the crypto state held by <b>job</b> back to its circuit, and put the
+ * cells it did not crypt back at the front of the circuit's queue. */
+static void
+relay_crypto_job_return(relay_crypto_job_t *job)
+{
+  or_circuit_t *circ = job->circ;
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  int i;
+
+  tor_assert(q->job == job);
+  q->job = NULL;
+  memcpy(&circ->crypto, &job->crypto, sizeof(circ->crypto));
+  memset(&job->crypto, 0, sizeof(job->crypto));
+
+  for (i = job->n_items - 1; i >= job->n_done; --i) {
+    TOR_SIMPLEQ_INSERT_HEAD(&q->head, job->items[i], next);
+    ++q->n;
+    job->items[i] = NULL;
+  }
+  job->n_items = job->n_done;
+}
+
+/** Relay or deliver <b>item</b>, which has been crypted, on <b>circ</b>,
+ * just as circuit_receive_relay_cell() or circuit_package_relay_cell()
+ * would have. */
+static void
+relay_crypto_item_finish(or_circuit_t *circ, relay_crypto_item_t *item)
+{
+  circuit_t *c = TO_CIRCUIT(circ);
+  int reason;
+
+  if (c->marked_for_close)
+    return;
+
+  if (item->originated) {
+    if (circ->p_chan) {
+      append_cell_to_circuit_queue(c, circ->p_chan, &item->cell,
+                                   CELL_DIRECTION_IN, item->on_stream);
+    }
+    return;
+  }
+
+  reason = circuit_receive_crypted_relay_cell(&item->cell, c, item->direction,
+                                              NULL, item->recognized);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL, "circuit_receive_relay_cell "
+           "(%s) failed. Closing.",
+           item->direction == CELL_DIRECTION_OUT ? "forward" : "backward");
+    circuit_mark_for_close(c, -reason);
+  }
+}
+
+/** Crypt <b>item</b> with the crypto state <b>crypto</b>. */
+static void
+relay_crypto_item_crypt(relay_crypto_t *crypto, relay_crypto_item_t *item)
+{
+  if (item->originated) {
+    relay_crypto_encrypt_cell_inbound(crypto, &item->cell,
+                                      item->record_sendme_digest);
+  } else {
+    relay_crypto_crypt_relayed_cell(crypto, &item->cell, item->direction,
+                                    &item->recognized);
+  }
+}
+
+/** Implementation function for relay crypto jobs. */
+static workqueue_reply_t
+cpuworker_relay_crypto_threadfn(void *state_, void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  int i;
+  (void)state_;
+
+  for (i = 0; i < job->n_items; ++i) {
+    relay_crypto_item_t *item = job->items[i];
+    relay_crypto_item_crypt(&job->crypto, item);
+    if (item->recognized) {
+      /* The main thread may need the digest state as it is right after this
+       * cell, so leave the rest to it. */
+      ++i;
+      break;
+    }
+  }
+  job->n_done = i;
+  return WQ_RPL_REPLY;
+}
+
+static void relay_crypto_queue_run(or_circuit_t *circ);
+
+/** Handle a reply from the worker threads to a relay crypto job. */
+static void
+cpuworker_relay_crypto_replyfn(void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  int i;
+
+  if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
+    /* The circuit was freed while the job was pending; see
+     * cpuworker_onion_handshake_replyfn(). */
+    log_debug(LD_OR, "Circuit died while relay crypto was pending.");
+    circ->base_.magic = 0;
+    tor_free(circ);
+    relay_crypto_job_free(job);
+    return;
+  }
+
+  relay_crypto_job_return(job);
+  for (i = 0; i < job->n_items; ++i) {
+    relay_crypto_item_finish(circ, job->items[i]);
+  }
+  relay_crypto_job_free(job);
+
+  relay_crypto_queue_run(circ);
+}
+
+/** Crypt and handle, on the main thread, all the cells queued on
+ * <b>circ</b>. Only call this when no job is in flight for <b>circ</b>. */
+static void
+relay_crypto_queue_run_here(or_circuit_t *circ)
+{
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  relay_crypto_item_t *item;
+
+  while ((item = TOR_SIMPLEQ_FIRST(&q->head))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(&q->head, next);
+    --q->n;
+    if (!TO_CIRCUIT(circ)->marked_for_close) {
+      relay_crypto_item_crypt(&circ->crypto, item);
+      relay_crypto_item_finish(circ, item);
+    }
+    relay_crypto_item_free(item);
+  }
+}
+
+/** Hand the next run of cells queued on <b>circ</b> to a cpuworker, unless
+ * one is already working on this circuit. If the circuit no longer
+ * qualifies for offloading, crypt the queued cells here instead. */
+static void
+relay_crypto_queue_run(or_circuit_t *circ)
+{
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  relay_crypto_job_t *job;
+  workqueue_entry_t *queue_entry;
+
+  if (!q || q->job)
+    return;
+  if (TO_CIRCUIT(circ)->marked_for_close) {
+    relay_crypto_queue_clear(q);
+    return;
+  }
+  if (!q->n)
+    return;
+  if (!relay_crypto_offload_allowed(circ)) {
+    relay_crypto_queue_run_here(circ);
+    return;
+  }
+
+  job = tor_malloc_zero(sizeof(relay_crypto_job_t));
+  job->circ = circ;
+  while (job->n_items < RELAY_CRYPTO_JOB_MAX_CELLS &&
+         !TOR_SIMPLEQ_EMPTY(&q->head)) {
+    job->items[job->n_items++] = TOR_SIMPLEQ_FIRST(&q->head);
+    TOR_SIMPLEQ_REMOVE_HEAD(&q->head, next);
+    --q->n;
+  }
+  memcpy(&job->crypto, &circ->crypto, sizeof(job->crypto));
+  memset(&circ->crypto, 0, sizeof(circ->crypto));
+  q->job = job;
+
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_relay_crypto_threadfn,
+                                     cpuworker_relay_crypto_replyfn,
+                                     job);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue relay crypto on threadpool");
+    relay_crypto_job_return(job);
+    relay_crypto_job_free(job);
+    relay_crypto_queue_run_here(circ);
+    return;
+  }
+  job->workqueue_entry = queue_entry;
+}
+
+/** Return the queue of cells waiting for a cpuworker on <b>circ</b>,
+ * creating it if needed. Return NULL, after marking <b>circ</b> for close,
+ * if it has too many cells queued already. */
+static relay_crypto_queue_t *
+relay_crypto_queue_get(or_circuit_t *circ)
+{
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  if (!q) {
+    q = circ->relay_crypto_queue = tor_malloc_zero(sizeof(*q));
+    TOR_SIMPLEQ_INIT(&q->head);
+  }
+  if (PREDICT_UNLIKELY(q->n >= RELAY_CRYPTO_MAX_QUEUED_CELLS)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Circuit has %d cells waiting for a cpuworker, maximum allowed is "
+           "%d. Closing circuit for safety reasons.",
+           q->n, RELAY_CRYPTO_MAX_QUEUED_CELLS);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    return NULL;
+  }
+  return q;
+}
+
+/** Queue a copy of <b>item</b> on <b>circ</b>, and start a job for it if
+ * none is in flight. */
+static void
+relay_crypto_queue_add(or_circuit_t *circ, const relay_crypto_item_t *item)
+{
+  relay_crypto_queue_t *q = relay_crypto_queue_get(circ);
+  relay_crypto_item_t *copy;
+  if (!q)
+    return;
+  copy = tor_memdup(item, sizeof(*item));
+  relay_crypto_total_allocation += sizeof(*copy);
+  TOR_SIMPLEQ_INSERT_TAIL(&q->head, copy, next);
+  ++q->n;
+  relay_crypto_queue_run(circ);
+}
+
+/** Queue the relay <b>cell</b>, received on <b>circ</b> in
+ * <b>cell_direction</b>, for a cpuworker to crypt. Once it has, the cell is
+ * handled as by circuit_receive_relay_cell(). Call this only if
+ * cpuworker_relay_cell_wants_offload() returned true for <b>circ</b>.
+ *
+ * Return 0 on success, or -<b>reason</b> on failure. */
+int
+cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell,
+                           cell_direction_t cell_direction)
+{
+  relay_crypto_item_t item;
+
+  memset(&item, 0, sizeof(item));
+  memcpy(&item.cell, cell, sizeof(item.cell));
+  item.direction = cell_direction;
+  relay_crypto_queue_add(circ, &item);
+  memwipe(&item, 0, sizeof(item));
+  return 0;
+}
+
+/** Queue <b>cell</b>, which we are sending towards the origin of
+ * <b>circ</b> from the stream <b>on_stream</b>, behind the cells that a
+ * cpuworker is crypting for <b>circ</b>. Once it is encrypted, append it to
+ * the circuit queue as circuit_package_relay_cell() would have. Call this
+ * only if cpuworker_circ_relay_crypto_in_flight() returned true for
+ * <b>circ</b>.
+ *
+ * Return 0 on success, or -1 on failure. */
+int
+cpuworker_queue_relay_cell_inbound(or_circuit_t *circ, const cell_t *cell,
+                                   streamid_t on_stream)
+{
+  relay_crypto_item_t item;
+
+  memset(&item, 0, sizeof(item));
+  memcpy(&item.cell, cell, sizeof(item.cell));
+  item.direction = CELL_DIRECTION_IN;
+  item.on_stream = on_stream;
+  item.originated = 1;
+  item.record_sendme_digest =
+    sendme_sending_cell_digest_is_next(TO_CIRCUIT(circ), NULL);
+  relay_crypto_queue_add(circ, &item);
+  memwipe(&item, 0, sizeof(item));
+  return 0;
+}
+
+/** Free the relay cells queued on <b>circ</b> that no cpuworker has taken
+ * yet, and return the number of bytes recovered. Used to reclaim memory
+ * from a circuit marked for close: cells in a job in flight are freed when
+ * its reply comes back. */
+size_t
+cpuworker_circ_relay_crypto_free_queued(or_circuit_t *circ)
+{
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  size_t n;
+
+  if (!q)
+    return 0;
+  n = q->n;
+  relay_crypto_queue_clear(q);
+  return n * sizeof(relay_crypto_item_t);
+}
+
+/** Release the relay cells queued on <b>circ</b>, which is about to be
+ * freed, and cancel its pending relay crypto job if we can. Return true iff
+ * a cpuworker still holds a job for <b>circ</b>: in that case, the circuit's
+ * memory must stay around until the reply comes back. */
+bool
+cpuworker_cancel_circ_relay_crypto(or_circuit_t *circ)
+{
+  relay_crypto_queue_t *q = circ->relay_crypto_queue;
+  bool in_flight = false;
+
+  if (!q)
+    return false;
+
+  if (q->job) {
+    relay_crypto_job_t *job = workqueue_entry_cancel(q->job->workqueue_entry);
+    if (job) {
+      /* It successfully cancelled. */
+      tor_assert(job == q->job);
+      relay_crypto_job_free(job);
+    } else {
+      /* The reply function will free the job and the circuit. */
+      in_flight = true;
+    }
+    q->job = NULL;
+  }
+
+  relay_crypto_queue_clear(q);
+  tor_free(circ->relay_crypto_queue);
+  return in_flight;
+}
@@ -33,5 +33,15 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+bool cpuworker_relay_cell_wants_offload(const or_circuit_t *circ);
+bool cpuworker_circ_relay_crypto_in_flight(const or_circuit_t *circ);
+int cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell,
+                               cell_direction_t cell_direction);
+int cpuworker_queue_relay_cell_inbound(or_circuit_t *circ, const cell_t *cell,
+                                       streamid_t on_stream);
+size_t cpuworker_circ_relay_crypto_free_queued(or_circuit_t *circ);
+bool cpuworker_cancel_circ_relay_crypto(or_circuit_t *circ);
+size_t cpuworker_relay_crypto_get_total_allocation(void);
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
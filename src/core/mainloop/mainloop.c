@@ -82,6 +82,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_cache.h"
 #include "feature/hs/hs_client.h"
+#include "feature/hs/hs_common.h"
 #include "feature/hs/hs_service.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -2016,6 +2017,7 @@ clean_caches_callback(time_t now, const or_options_t *options)
   rend_cache_clean(now, REND_CACHE_TYPE_SERVICE);
   hs_cache_clean_as_client(now);
   hs_cache_clean_as_dir(now);
+  hs_clean_blinded_key_cache();
   microdesc_cache_rebuild(NULL, 0);
 #define CLEAN_CACHES_INTERVAL (30*60)
   return CLEAN_CACHES_INTERVAL;
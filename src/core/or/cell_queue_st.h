@@ -21,6 +21,9 @@ struct packed_cell_t {
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
+  /** Slab this cell was allocated from, or NULL if it wasn't allocated by
+   * packed_cell_new(). */
+  struct packed_cell_slab_t *slab;
 };
 
 /** A queue of cells on a circuit, waiting to be added to the
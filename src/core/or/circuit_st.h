@@ -17,7 +17,6 @@
 #include "lib/container/handles.h"
 
 #include "core/or/cell_queue_st.h"
-#include "ext/ht.h"
 
 struct hs_token_t;
 struct circpad_machine_spec_t;
@@ -214,9 +213,6 @@ struct circuit_t {
   /** If set, points to an HS token that this circuit might be carrying.
    *  Used by the HS circuitmap.  */
   struct hs_token_t *hs_token;
-  /** Hashtable node: used to look up the circuit by its HS token using the HS
-      circuitmap. */
-  HT_ENTRY(circuit_t) hs_circuitmap_node;
 
   /** Adaptive Padding state machines: these are immutable. The state machines
    *  that come from the consensus are saved to a global structure, to avoid
@@ -76,6 +76,7 @@
 #include "lib/crypt_ops/crypto_dh.h"
 #include "feature/dircommon/directory.h"
 #include "feature/client/entrynodes.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_circuitmap.h"
@@ -1186,6 +1187,9 @@ circuit_free_(circuit_t *circ)
     hs_ident_circuit_free(ocirc->hs_ident);
     ocirc->hs_ident = NULL;
 
+    /* The PoW job, if any, was cancelled by the HS cleanup above. */
+    tor_free(ocirc->hs_pow_solution);
+
     tor_free(ocirc->dest_address);
     if (ocirc->socks_username) {
       memwipe(ocirc->socks_username, 0x12, ocirc->socks_username_len);
@@ -1206,6 +1210,8 @@ circuit_free_(circuit_t *circ)
     tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
 
     should_free = (ocirc->workqueue_entry == NULL);
+    if (cpuworker_cancel_circ_relay_crypto(ocirc))
+      should_free = 0;
 
     relay_crypto_clear(&ocirc->crypto);
 
@@ -2655,6 +2661,7 @@ circuits_handle_oom(size_t current_allocation)
   int conn_idx;
   size_t mem_to_recover;
   size_t mem_recovered=0;
+  size_t n_cells_dropped=0;
   int n_circuits_killed=0;
   int n_dirconns_killed=0;
   uint32_t now_ts;
@@ -2713,7 +2720,7 @@ circuits_handle_oom(size_t current_allocation)
    * aggressively. */
   conn_idx = 0;
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
+    size_t cells_alloc;
     size_t freed;
 
     /* Free storage in any non-linked directory connections that have buffered
@@ -2737,18 +2744,24 @@ circuits_handle_oom(size_t current_allocation)
       ++conn_idx;
     }
 
-    /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
+    /* Now, kill the circuit. Its cells only give memory back once a whole
+     * slab is empty, so count the slabs that were actually released. */
+    n_cells_dropped += n_cells_in_circ_queues(circ);
+    cells_alloc = cell_queues_get_total_allocation();
     const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
     if (! circ->marked_for_close) {
       circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     }
     marked_circuit_free_cells(circ);
+    packed_cell_release_empty_slabs();
     freed = marked_circuit_free_stream_bytes(circ);
+    if (! CIRCUIT_IS_ORIGIN(circ)) {
+      freed += cpuworker_circ_relay_crypto_free_queued(TO_OR_CIRCUIT(circ));
+    }
 
     ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
+    mem_recovered += cells_alloc - cell_queues_get_total_allocation();
     mem_recovered += half_stream_alloc;
     mem_recovered += freed;
 
@@ -2758,11 +2771,12 @@ circuits_handle_oom(size_t current_allocation)
 
  done_recovering_mem:
 
-  log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
-             "%d circuits remain alive. Also killed %d non-linked directory "
-             "connections.",
+  log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits "
+             "with %"TOR_PRIuSZ" queued cells; %d circuits remain alive. "
+             "Also killed %d non-linked directory connections.",
              mem_recovered,
              n_circuits_killed,
+             n_cells_dropped,
              smartlist_len(circlist) - n_circuits_killed,
              n_dirconns_killed);
 }
@@ -2816,7 +2830,7 @@ assert_circuit_ok,(const circuit_t *c))
   if (c->state == CIRCUIT_STATE_OPEN ||
       c->state == CIRCUIT_STATE_GUARD_WAIT) {
     tor_assert(!c->n_chan_create_cell);
-    if (or_circ) {
+    if (or_circ && !cpuworker_circ_relay_crypto_in_flight(or_circ)) {
       relay_crypto_assert_ok(&or_circ->crypto);
     }
   }
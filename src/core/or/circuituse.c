@@ -1147,17 +1147,60 @@ needs_exit_circuits(time_t now, int *needs_uptime, int *needs_capacity)
 /* Hidden services need at least this many internal circuits */
 #define SUFFICIENT_UPTIME_INTERNAL_HS_SERVERS 3
 
+/* Launch at most this many circuits for the hidden service circuit pool in
+ * a single run, so that a large pool fills up quickly without launching all
+ * of it at once. */
+#define MAX_HS_SERVER_CIRCUIT_LAUNCHES 8
+
+/* Return true iff this tor instance runs any hidden service. */
+static int
+have_hs_services(void)
+{
+  return rend_num_services() || hs_service_get_num_services();
+}
+
+/* Return how many clean internal circuits needing uptime we keep around for
+ * our hidden services. They extend those circuits to their introduction and
+ * rendezvous points instead of building new ones. */
+STATIC int
+hs_server_circuit_pool_size(const or_options_t *options)
+{
+  return MAX(SUFFICIENT_UPTIME_INTERNAL_HS_SERVERS,
+             options->HiddenServiceCircuitPool);
+}
+
+/* Return how many hidden service server circuits to launch in a single run
+ * of the predictor, given that we have <b>num_uptime_internal</b> of them and
+ * that <b>n_unused_left</b> more clean circuits fit under our limit. We only
+ * launch several at once when the pool was configured larger than the
+ * default; otherwise we launch one per run, as we always did. */
+STATIC int
+hs_server_circuits_to_launch(const or_options_t *options,
+                             int num_uptime_internal, int n_unused_left)
+{
+  int n_launch;
+
+  if (options->HiddenServiceCircuitPool <=
+      SUFFICIENT_UPTIME_INTERNAL_HS_SERVERS) {
+    return 1;
+  }
+  n_launch = hs_server_circuit_pool_size(options) - num_uptime_internal;
+  n_launch = MIN(n_launch, n_unused_left);
+  n_launch = MIN(n_launch, MAX_HS_SERVER_CIRCUIT_LAUNCHES);
+  return MAX(n_launch, 1);
+}
+
 /* Return true if we need any more hidden service server circuits.
  * HS servers only need an internal circuit. */
 STATIC int
 needs_hs_server_circuits(time_t now, int num_uptime_internal)
 {
-  if (!rend_num_services() && !hs_service_get_num_services()) {
+  if (!have_hs_services()) {
     /* No services, we don't need anything. */
     goto no_need;
   }
 
-  if (num_uptime_internal >= SUFFICIENT_UPTIME_INTERNAL_HS_SERVERS) {
+  if (num_uptime_internal >= hs_server_circuit_pool_size(get_options())) {
     /* We have sufficient amount of internal circuit. */
     goto no_need;
   }
@@ -1257,6 +1300,7 @@ circuit_predict_and_launch_new(void)
   int num=0, num_internal=0, num_uptime_internal=0;
   int hidserv_needs_uptime=0, hidserv_needs_capacity=1;
   int port_needs_uptime=0, port_needs_capacity=1;
+  int max_unused = MAX_UNUSED_OPEN_CIRCUITS;
   time_t now = time(NULL);
   int flags = 0;
 
@@ -1275,8 +1319,15 @@ circuit_predict_and_launch_new(void)
   }
   SMARTLIST_FOREACH_END(circ);
 
+  /* A hidden service circuit pool larger than the default comes on top of
+   * the other clean circuits. */
+  if (have_hs_services()) {
+    max_unused += hs_server_circuit_pool_size(get_options()) -
+                  SUFFICIENT_UPTIME_INTERNAL_HS_SERVERS;
+  }
+
   /* If that's enough, then stop now. */
-  if (num >= MAX_UNUSED_OPEN_CIRCUITS)
+  if (num >= max_unused)
     return;
 
   if (needs_exit_circuits(now, &port_needs_uptime, &port_needs_capacity)) {
@@ -1293,14 +1344,21 @@ circuit_predict_and_launch_new(void)
   }
 
   if (needs_hs_server_circuits(now, num_uptime_internal)) {
+    int i, n_launch;
+
     flags = (CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_NEED_UPTIME |
              CIRCLAUNCH_IS_INTERNAL);
+    n_launch = hs_server_circuits_to_launch(get_options(),
+                                            num_uptime_internal,
+                                            max_unused - num);
 
     log_info(LD_CIRC,
-             "Have %d clean circs (%d internal), need another internal "
-             "circ for my hidden service.",
-             num, num_internal);
-    circuit_launch_predicted_hs_circ(flags);
+             "Have %d clean circs (%d internal), need %d more internal "
+             "circ(s) for my hidden service.",
+             num, num_internal, n_launch);
+    for (i = 0; i < n_launch; i++) {
+      circuit_launch_predicted_hs_circ(flags);
+    }
     return;
   }
 
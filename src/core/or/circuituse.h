@@ -93,6 +93,10 @@ STATIC int needs_exit_circuits(time_t now,
                                int *port_needs_capacity);
 STATIC int needs_hs_server_circuits(time_t now,
                                     int num_uptime_internal);
+STATIC int hs_server_circuit_pool_size(const or_options_t *options);
+STATIC int hs_server_circuits_to_launch(const or_options_t *options,
+                                        int num_uptime_internal,
+                                        int n_unused_left);
 
 STATIC int needs_hs_client_circuits(time_t now,
                                     int *needs_uptime,
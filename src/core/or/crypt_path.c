@@ -179,20 +179,21 @@ cpath_free(crypt_path_t *victim)
 /** Encrypt or decrypt <b>payload</b> using the crypto of <b>cpath</b>. Actual
  *  operation decided by <b>is_decrypt</b>.  */
 void
-cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt)
+cpath_crypt_cell(crypt_path_t *cpath, uint8_t *payload, bool is_decrypt)
 {
-  if (is_decrypt) {
-    relay_crypt_one_payload(cpath->pvt_crypto.b_crypto, payload);
-  } else {
-    relay_crypt_one_payload(cpath->pvt_crypto.f_crypto, payload);
-  }
+  relay_crypto_crypt_payloads(&cpath->pvt_crypto,
+                              is_decrypt ? CELL_DIRECTION_IN :
+                                           CELL_DIRECTION_OUT,
+                              payload, 1);
 }
 
-/** Getter for the incoming digest of <b>cpath</b>. */
-struct crypto_digest_t *
-cpath_get_incoming_digest(const crypt_path_t *cpath)
+/** Does the incoming digest of <b>cpath</b> indicate that <b>cell</b> is
+ * for us? See relay_crypto_digest_matches(). */
+int
+cpath_incoming_digest_matches(crypt_path_t *cpath, cell_t *cell)
 {
-  return cpath->pvt_crypto.b_digest;
+  return relay_crypto_digest_matches(&cpath->pvt_crypto, CELL_DIRECTION_IN,
+                                     cell);
 }
 
 /** Set the right integrity digest on the outgoing <b>cell</b> based on the
@@ -22,10 +22,10 @@ cpath_free(crypt_path_t *victim);
 void cpath_extend_linked_list(crypt_path_t **head_ptr, crypt_path_t *new_hop);
 
 void
-cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt);
+cpath_crypt_cell(crypt_path_t *cpath, uint8_t *payload, bool is_decrypt);
 
-struct crypto_digest_t *
-cpath_get_incoming_digest(const crypt_path_t *cpath);
+int
+cpath_incoming_digest_matches(crypt_path_t *cpath, cell_t *cell);
 
 void cpath_sendme_record_cell_digest(crypt_path_t *cpath,
                                      bool is_foward_digest);
@@ -28,6 +28,11 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_t *workqueue_entry;
+  /** Relay cells waiting for a cpuworker to crypt them, and the job in
+   * flight if any. NULL unless OffloadRelayCellCrypto has been used on this
+   * circuit. While a job is in flight, it holds the contents of
+   * <b>crypto</b>. Used only in cpuworker.c */
+  struct relay_crypto_queue_t *relay_crypto_queue;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
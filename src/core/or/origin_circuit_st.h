@@ -135,6 +135,14 @@ struct origin_circuit_t {
    * is for both introduction and rendezvous circuit. */
   struct hs_ident_circuit_t *hs_ident;
 
+  /** HRPR: On a client introduction circuit, the PoW solve that a cpuworker
+   * is doing for the INTRODUCE1 cell we will send on it, if any. */
+  struct hs_pow_solve_job_t *hs_pow_job;
+
+  /** HRPR: On a client introduction circuit, the PoW solution to put in the
+   * INTRODUCE1 cell once it has been solved. */
+  struct hs_pow_solution_t *hs_pow_solution;
+
   /** Holds the data that the entry guard system uses to track the
    * status of the guard this circuit is using, and thereby to determine
    * whether this circuit can be used. */
@@ -190,6 +198,10 @@ struct origin_circuit_t {
    * (in host byte order) for response comparison. */
   uint32_t pathbias_probe_nonce;
 
+  /** HRPR: On a client rendezvous circuit, the PoW effort of the solution we
+   * sent in the INTRODUCE1 cell for it, if hs_with_pow_circ is set. */
+  uint32_t hs_pow_effort;
+
   /** Set iff this is a hidden-service circuit which has timed out
    * according to our current circuit-build timeout, but which has
    * been kept around because it might still succeed in connecting to
@@ -70,6 +70,7 @@
 #include "feature/relay/circuitbuild_relay.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/hs/hs_cache.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
@@ -226,10 +227,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -238,6 +237,14 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  /* If this circuit's crypto is handled by the cpuworkers, the rest of this
+   * function runs once they have crypted the cell. */
+  if (!CIRCUIT_IS_ORIGIN(circ) &&
+      cpuworker_relay_cell_wants_offload(TO_OR_CIRCUIT(circ))) {
+    return cpuworker_queue_relay_cell(TO_OR_CIRCUIT(circ), cell,
+                                      cell_direction);
+  }
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -245,6 +252,25 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_crypted_relay_cell(cell, circ, cell_direction,
+                                            layer_hint, recognized);
+}
+
+/** Handle a relay <b>cell</b> received on <b>circ</b> in
+ * <b>cell_direction</b>, once relay_decrypt_cell() has crypted it and set
+ * <b>layer_hint</b> and <b>recognized</b>: deliver it if it is for us, or
+ * relay it otherwise. See circuit_receive_relay_cell().
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   crypt_path_t *layer_hint, char recognized)
+{
+  channel_t *chan = NULL;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -409,6 +435,12 @@ circuit_package_relay_cell, (cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (cpuworker_circ_relay_crypto_in_flight(or_circ)) {
+      /* A cpuworker holds this circuit's crypto: it will encrypt the cell
+       * after the ones it has, and we'll queue it then. */
+      ++stats_n_relay_cells_relayed;
+      return cpuworker_queue_relay_cell_inbound(or_circ, cell, on_stream);
+    }
     relay_encrypt_cell_inbound(cell, or_circ);
     chan = or_circ->p_chan;
   }
@@ -2500,20 +2532,170 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** Keep at most this many slabs with no allocated cell around for reuse. */
+#define PACKED_CELL_MAX_EMPTY_SLABS 16
+
+/** A chunk of memory holding PACKED_CELL_SLAB_N_CELLS packed cells. Packed
+ * cells are allocated and freed for every cell we queue, so we take them from
+ * slabs rather than from the general purpose allocator. */
+typedef struct packed_cell_slab_t {
+  /** Entry in either partial_slabs or empty_slabs. Full slabs are in no
+   * list. */
+  TOR_LIST_ENTRY(packed_cell_slab_t) node;
+  /** Free cells of this slab, linked through their next field. */
+  packed_cell_t *free_cells;
+  /** Number of cells in free_cells. */
+  int n_free;
+  packed_cell_t cells[PACKED_CELL_SLAB_N_CELLS];
+} packed_cell_slab_t;
+
+/** Slabs with both allocated and free cells, except for the first one which
+ * may have no allocated cell. We allocate from the first one, so that the
+ * other slabs fill up and the empty ones can be released. */
+static TOR_LIST_HEAD(packed_cell_slab_list_t, packed_cell_slab_t)
+  partial_slabs = TOR_LIST_HEAD_INITIALIZER(partial_slabs);
+/** Slabs with no allocated cell. */
+static struct packed_cell_slab_list_t empty_slabs =
+  TOR_LIST_HEAD_INITIALIZER(empty_slabs);
+/** Number of slabs in empty_slabs. */
+static int n_empty_slabs = 0;
+/** Total number of slabs. */
+static size_t n_slabs = 0;
+
+/** Allocate a slab, with all its cells free. */
+static packed_cell_slab_t *
+packed_cell_slab_new(void)
+{
+  packed_cell_slab_t *slab = tor_malloc(sizeof(packed_cell_slab_t));
+  int i;
+
+  slab->free_cells = NULL;
+  for (i = PACKED_CELL_SLAB_N_CELLS - 1; i >= 0; --i) {
+    slab->cells[i].next.sqe_next = slab->free_cells;
+    slab->free_cells = &slab->cells[i];
+  }
+  slab->n_free = PACKED_CELL_SLAB_N_CELLS;
+  ++n_slabs;
+  return slab;
+}
+
+/** Release storage held by the slab <b>slab</b>, which must be empty and in
+ * no list. */
+static void
+packed_cell_slab_free(packed_cell_slab_t *slab)
+{
+  tor_assert(slab->n_free == PACKED_CELL_SLAB_N_CELLS);
+  --n_slabs;
+  tor_free(slab);
+}
+
+/** The slab <b>slab</b>, in no list, has no allocated cell: keep it for
+ * reuse or release it. */
+static void
+packed_cell_slab_retire(packed_cell_slab_t *slab)
+{
+  if (n_empty_slabs >= PACKED_CELL_MAX_EMPTY_SLABS) {
+    packed_cell_slab_free(slab);
+  } else {
+    TOR_LIST_INSERT_HEAD(&empty_slabs, slab, node);
+    ++n_empty_slabs;
+  }
+}
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
+  packed_cell_slab_t *slab = cell->slab;
+  packed_cell_slab_t *head;
+
   --total_cells_allocated;
-  tor_free(cell);
+  if (BUG(slab == NULL)) {
+    /* Not one of ours, so it wasn't allocated by packed_cell_new(). */
+    return;
+  }
+
+  cell->next.sqe_next = slab->free_cells;
+  slab->free_cells = cell;
+  head = TOR_LIST_FIRST(&partial_slabs);
+  if (slab->n_free++ == 0) {
+    /* The slab was full: it becomes the one we allocate from. The previous
+     * one might have no allocated cell left, see below. */
+    TOR_LIST_INSERT_HEAD(&partial_slabs, slab, node);
+    if (head && head->n_free == PACKED_CELL_SLAB_N_CELLS) {
+      TOR_LIST_REMOVE(head, node);
+      packed_cell_slab_retire(head);
+    }
+  } else if (slab->n_free == PACKED_CELL_SLAB_N_CELLS && slab != head) {
+    TOR_LIST_REMOVE(slab, node);
+    packed_cell_slab_retire(slab);
+  }
+  /* The slab we allocate from stays where it is even once it has no
+   * allocated cell left, so that a circuit queueing and flushing a cell at a
+   * time doesn't move it from list to list. */
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  packed_cell_slab_t *slab = TOR_LIST_FIRST(&partial_slabs);
+  packed_cell_t *cell;
+
+  if (slab == NULL) {
+    slab = TOR_LIST_FIRST(&empty_slabs);
+    if (slab) {
+      TOR_LIST_REMOVE(slab, node);
+      --n_empty_slabs;
+    } else {
+      slab = packed_cell_slab_new();
+    }
+    TOR_LIST_INSERT_HEAD(&partial_slabs, slab, node);
+  }
+
+  cell = slab->free_cells;
+  slab->free_cells = cell->next.sqe_next;
+  if (--slab->n_free == 0) {
+    /* The slab is full. */
+    TOR_LIST_REMOVE(slab, node);
+  }
+
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  memset(cell, 0, sizeof(*cell));
+  cell->slab = slab;
+  return cell;
+}
+
+/** Release every slab that has no allocated cell. Return the number of bytes
+ * released. */
+size_t
+packed_cell_release_empty_slabs(void)
+{
+  packed_cell_slab_t *slab;
+  size_t released = 0;
+
+  while ((slab = TOR_LIST_FIRST(&empty_slabs))) {
+    TOR_LIST_REMOVE(slab, node);
+    packed_cell_slab_free(slab);
+    released += sizeof(packed_cell_slab_t);
+  }
+  n_empty_slabs = 0;
+
+  /* The slab we allocate from is the only partial one that can be empty. */
+  slab = TOR_LIST_FIRST(&partial_slabs);
+  if (slab && slab->n_free == PACKED_CELL_SLAB_N_CELLS) {
+    TOR_LIST_REMOVE(slab, node);
+    packed_cell_slab_free(slab);
+    released += sizeof(packed_cell_slab_t);
+  }
+  return released;
+}
+
+/** Release the packed cell slabs that are not in use. */
+void
+packed_cell_free_all(void)
+{
+  packed_cell_release_empty_slabs();
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2542,6 +2724,9 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "%d cell slabs of %d cells allocated, %d of them empty.",
+          (int)n_slabs, PACKED_CELL_SLAB_N_CELLS, n_empty_slabs);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2688,11 +2873,21 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
+/** Return the number of bytes in one slab of packed cells. */
+size_t
+packed_cell_slab_mem_cost(void)
+{
+  return sizeof(packed_cell_slab_t);
+}
+
+/** Return the number of bytes used by packed cells. We count whole slabs,
+ * whether their cells are allocated or not: a single live cell keeps its
+ * slab around, so counting cells would let fragmented slabs grow past
+ * MaxMemInQueues unseen. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return n_slabs * packed_cell_slab_mem_cost();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2709,6 +2904,7 @@ cell_queues_check_size(void)
   time_t now = time(NULL);
   size_t alloc = cell_queues_get_total_allocation();
   alloc += half_streams_get_total_allocation();
+  alloc += cpuworker_relay_crypto_get_total_allocation();
   alloc += buf_get_total_allocation();
   alloc += tor_compress_get_total_allocation();
   const size_t rend_cache_total = rend_cache_get_total_allocation();
@@ -2721,6 +2917,8 @@ cell_queues_check_size(void)
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
+      /* Cell slabs we keep for reuse are the cheapest memory to give back. */
+      alloc -= packed_cell_release_empty_slabs();
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -19,6 +19,10 @@ extern uint64_t stats_n_circ_max_cell_reached;
 void relay_consensus_has_changed(const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                       cell_direction_t cell_direction,
+                                       crypt_path_t *layer_hint,
+                                       char recognized);
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -51,6 +55,7 @@ extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
+size_t packed_cell_slab_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
 
@@ -58,6 +63,8 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+size_t packed_cell_release_empty_slabs(void);
+void packed_cell_free_all(void);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
@@ -99,6 +106,9 @@ circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
 uint8_t packed_cell_get_command(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
+/** Number of packed cells carved out of each slab. */
+#define PACKED_CELL_SLAB_N_CELLS 64
+
 STATIC int
 handle_relay_cell_command(cell_t *cell, circuit_t *circ,
                      edge_connection_t *conn, crypt_path_t *layer_hint,
@@ -29,6 +29,9 @@ struct relay_crypto_t {
   struct crypto_digest_t *f_digest; /* for integrity checking */
   /** Digest state for cells heading away from the OR at this step. */
   struct crypto_digest_t *b_digest;
+  /** Spare digest state of the same kind as f_digest and b_digest, used to
+   * check whether a cell is for us without disturbing them. */
+  struct crypto_digest_t *scratch_digest;
 
   /** Digest used for the next SENDME cell if any. */
   uint8_t sendme_digest[DIGEST_LEN];
@@ -708,3 +708,15 @@ sendme_record_sending_cell_digest(circuit_t *circ, crypt_path_t *cpath)
  end:
   return;
 }
+
+/* Return true iff the digest of the next cell we encrypt for sending on
+ * <b>circ</b> (towards <b>cpath</b> if we are the origin) is the one that
+ * sendme_record_sending_cell_digest() would record. */
+bool
+sendme_sending_cell_digest_is_next(const circuit_t *circ,
+                                   const crypt_path_t *cpath)
+{
+  tor_assert(circ);
+  return circuit_sendme_cell_is_next(cpath ? cpath->package_window :
+                                             circ->package_window);
+}
@@ -17,6 +17,7 @@
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_client.h"
 #include "feature/hs/hs_descriptor.h"
+#include "feature/hs/hs_metrics.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/rend/rendcache.h"
@@ -44,25 +45,97 @@ entry_has_decrypted_descriptor(const hs_cache_client_descriptor_t *entry)
   return (entry->desc != NULL);
 }
 
+/** Helper function: Set <b>rev_out</b> to the revision counter of the
+ * descriptor in the cache <b>entry</b> and return true. Return false if we
+ * can't know it because the descriptor could not be decrypted and we don't
+ * have its plaintext layer. */
+static bool
+entry_get_revision_counter(const hs_cache_client_descriptor_t *entry,
+                           uint64_t *rev_out)
+{
+  tor_assert(entry);
+  tor_assert(rev_out);
+
+  if (entry_has_decrypted_descriptor(entry)) {
+    *rev_out = entry->desc->plaintext_data.revision_counter;
+    return true;
+  }
+  if (entry->plaintext_data) {
+    *rev_out = entry->plaintext_data->revision_counter;
+    return true;
+  }
+  return false;
+}
+
+/** Helper for smartlist_sort(): order client cache entries from the least to
+ * the most recently used. */
+static int
+compare_client_entry_last_used_(const void **a, const void **b)
+{
+  const hs_cache_client_descriptor_t *entry_a = *a, *entry_b = *b;
+  if (entry_a->last_used_ts < entry_b->last_used_ts) {
+    return -1;
+  } else if (entry_a->last_used_ts > entry_b->last_used_ts) {
+    return 1;
+  }
+  return 0;
+}
+
 /********************** Directory HS cache ******************/
 
 /** Directory descriptor cache. Map indexed by blinded key. */
 static digest256map_t *hs_cache_v3_dir;
 
+/** Every entry of the directory descriptor cache, from the least to the most
+ * recently stored or looked up. */
+static TOR_TAILQ_HEAD(hs_cache_dir_lru_t, hs_cache_dir_descriptor_t)
+  hs_cache_v3_dir_lru = TOR_TAILQ_HEAD_INITIALIZER(hs_cache_v3_dir_lru);
+
+/** Total size in bytes of the entries of the directory descriptor cache. */
+static size_t hs_cache_v3_dir_bytes;
+
+/** Return the size of a cache entry in bytes. */
+static size_t
+cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+{
+  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
+          + strlen(entry->encoded_desc));
+}
+
+/** Unlink a given descriptor from the least recently used list and the
+ * size accounting of the cache. The caller removes it from the map. */
+static void
+cache_dir_lru_unlink(hs_cache_dir_descriptor_t *desc)
+{
+  size_t entry_size = cache_get_dir_entry_size(desc);
+
+  TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, desc, lru_next);
+  hs_cache_v3_dir_bytes -= entry_size;
+  hs_metrics_hsdir_cache_bytes(-(int64_t) entry_size);
+}
+
 /** Remove a given descriptor from our cache. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_remove(hs_cache_v3_dir, desc->key);
+  cache_dir_lru_unlink(desc);
 }
 
 /** Store a given descriptor in our cache. */
 static void
 store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
+  size_t entry_size;
+
   tor_assert(desc);
   digest256map_set(hs_cache_v3_dir, desc->key, desc);
+
+  entry_size = cache_get_dir_entry_size(desc);
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, desc, lru_next);
+  hs_cache_v3_dir_bytes += entry_size;
+  hs_metrics_hsdir_cache_bytes(entry_size);
 }
 
 /** Query our cache and return the entry or NULL if not found. */
@@ -126,14 +199,6 @@ cache_dir_desc_new(const char *desc)
   return NULL;
 }
 
-/** Return the size of a cache entry in bytes. */
-static size_t
-cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
-{
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
-}
-
 /** Try to store a valid version 3 descriptor in the directory cache. Return 0
  * on success else a negative value is returned indicating that we have a
  * newer version in our cache. On error, caller is responsible to free the
@@ -181,6 +246,20 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
     rep_hist_hsdir_stored_maybe_new_v3_onion(desc->key);
   }
 
+  /* Make room within our budget, if any, but never at the expense of the
+   * descriptor we just stored. */
+  {
+    const uint64_t max_bytes = get_options()->MaxHSDirCacheBytes;
+    if (max_bytes && hs_cache_v3_dir_bytes > max_bytes) {
+      const size_t entry_size = cache_get_dir_entry_size(desc);
+      /* Evicting from the head, the new descriptor at the tail goes last. */
+      if (hs_cache_v3_dir_bytes > entry_size) {
+        cache_evict_v3_as_dir(MIN(hs_cache_v3_dir_bytes - max_bytes,
+                                  hs_cache_v3_dir_bytes - entry_size));
+      }
+    }
+  }
+
   return 0;
 
  err:
@@ -197,7 +276,7 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
 {
   int found = 0;
   ed25519_public_key_t blinded_key;
-  const hs_cache_dir_descriptor_t *entry;
+  hs_cache_dir_descriptor_t *entry;
 
   tor_assert(query);
 
@@ -214,6 +293,12 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
     if (desc_out) {
       *desc_out = entry->encoded_desc;
     }
+    /* Popular descriptors stay at the tail, furthest from eviction. */
+    TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, entry, lru_next);
+    TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, entry, lru_next);
+    hs_metrics_hsdir_cache_hit();
+  } else {
+    hs_metrics_hsdir_cache_miss();
   }
 
   return found;
@@ -254,12 +339,14 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     }
     /* Here, our entry has expired, remove and free. */
     MAP_DEL_CURRENT(key);
+    cache_dir_lru_unlink(entry);
     entry_size = cache_get_dir_entry_size(entry);
     bytes_removed += entry_size;
     /* Entry is not in the cache anymore, destroy it. */
     cache_dir_desc_free(entry);
     /* Update our cache entry allocation size for the OOM. */
     rend_cache_decrement_allocation(entry_size);
+    hs_metrics_hsdir_cache_expired();
     /* Logging. */
     {
       char key_b64[BASE64_DIGEST256_LEN + 1];
@@ -272,6 +359,34 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
   return bytes_removed;
 }
 
+/** Evict entries from the v3 cache, least recently used first, until at
+ * least <b>min_remove_bytes</b> have been removed or the cache is empty.
+ * Return the number of bytes removed. */
+STATIC size_t
+cache_evict_v3_as_dir(size_t min_remove_bytes)
+{
+  size_t bytes_removed = 0;
+  hs_cache_dir_descriptor_t *entry;
+
+  while (bytes_removed < min_remove_bytes &&
+         (entry = TOR_TAILQ_FIRST(&hs_cache_v3_dir_lru)) != NULL) {
+    size_t entry_size = cache_get_dir_entry_size(entry);
+    {
+      char key_b64[BASE64_DIGEST256_LEN + 1];
+      digest256_to_base64(key_b64, (const char *) entry->key);
+      log_info(LD_REND, "Evicting least recently used v3 descriptor '%s' "
+                        "from HSDir cache", safe_str_client(key_b64));
+    }
+    remove_v3_desc_as_dir(entry);
+    cache_dir_desc_free(entry);
+    rend_cache_decrement_allocation(entry_size);
+    bytes_removed += entry_size;
+    hs_metrics_hsdir_cache_evicted();
+  }
+
+  return bytes_removed;
+}
+
 /** Given an encoded descriptor, store it in the directory cache depending on
  * which version it is. Return a negative value on error. On success, 0 is
  * returned. */
@@ -376,6 +491,10 @@ cache_get_client_entry_size(const hs_cache_client_descriptor_t *entry)
     size += hs_desc_obj_size(entry->desc);
   }
 
+  if (entry->plaintext_data) {
+    size += hs_desc_plaintext_obj_size(entry->plaintext_data);
+  }
+
  end:
   return size;
 }
@@ -426,6 +545,9 @@ lookup_v3_desc_as_client(const uint8_t *key)
 /** Parse the encoded descriptor in <b>desc_str</b> using
  * <b>service_identity_pk</b> to decrypt it first.
  *
+ * With ClientOnionLazyDecryption, only the plaintext layer is decoded and
+ * the returned entry is flagged so the rest is decrypted on first lookup.
+ *
  * If everything goes well, allocate and return a new
  * hs_cache_client_descriptor_t object. In case of error, return NULL. */
 static hs_cache_client_descriptor_t *
@@ -435,11 +557,26 @@ cache_client_desc_new(const char *desc_str,
 {
   hs_desc_decode_status_t ret;
   hs_descriptor_t *desc = NULL;
+  hs_desc_plaintext_data_t *plaintext = NULL;
   hs_cache_client_descriptor_t *client_desc = NULL;
 
   tor_assert(desc_str);
   tor_assert(service_identity_pk);
 
+  if (get_options()->ClientOnionLazyDecryption) {
+    plaintext = tor_malloc_zero(sizeof(*plaintext));
+    ret = hs_client_decode_descriptor_plaintext(desc_str, service_identity_pk,
+                                                plaintext);
+    if (ret != HS_DESC_DECODE_OK) {
+      hs_desc_plaintext_data_free(plaintext);
+      goto end;
+    }
+    /* The encoded descriptor we keep already contains this blob. */
+    tor_free(plaintext->superencrypted_blob);
+    plaintext->superencrypted_blob_size = 0;
+    goto make_entry;
+  }
+
   /* Decode the descriptor we just fetched. */
   ret = hs_client_decode_descriptor(desc_str, service_identity_pk, &desc);
   if (ret != HS_DESC_DECODE_OK &&
@@ -460,6 +597,7 @@ cache_client_desc_new(const char *desc_str,
     }
   }
 
+ make_entry:
   /* All is good: make a cache object for this descriptor */
   client_desc = tor_malloc_zero(sizeof(hs_cache_client_descriptor_t));
   ed25519_pubkey_copy(&client_desc->key, service_identity_pk);
@@ -469,6 +607,9 @@ cache_client_desc_new(const char *desc_str,
   client_desc->expiration_ts = hs_get_start_time_of_next_time_period(0);
   client_desc->desc = desc;
   client_desc->encoded_desc = tor_strdup(desc_str);
+  client_desc->plaintext_data = plaintext;
+  client_desc->decrypt_pending = (plaintext != NULL);
+  client_desc->last_used_ts = approx_time();
 
  end:
   if (decode_status_out) {
@@ -488,6 +629,7 @@ cache_client_desc_free_(hs_cache_client_descriptor_t *desc)
     return;
   }
   hs_descriptor_free(desc->desc);
+  hs_desc_plaintext_data_free(desc->plaintext_data);
   memwipe(&desc->key, 0, sizeof(desc->key));
   memwipe(desc->encoded_desc, 0, strlen(desc->encoded_desc));
   tor_free(desc->encoded_desc);
@@ -694,24 +836,22 @@ cache_store_as_client(hs_cache_client_descriptor_t *client_desc)
    * client authorization. */
   cache_entry = lookup_v3_desc_as_client(client_desc->key.pubkey);
   if (cache_entry != NULL) {
+    uint64_t cached_rev, new_rev;
+
     /* If the current or the new cache entry don't have a decrypted descriptor
-     * (missing client authorization), we always replace the current one with
-     * the new one. Reason is that we can't inspect the revision counter
-     * within the plaintext data so we blindly replace. */
-    if (!entry_has_decrypted_descriptor(cache_entry) ||
-        !entry_has_decrypted_descriptor(client_desc)) {
+     * (missing client authorization) nor a plaintext layer, we always replace
+     * the current one with the new one. Reason is that we can't inspect the
+     * revision counter within the plaintext data so we blindly replace. */
+    if (!entry_get_revision_counter(cache_entry, &cached_rev) ||
+        !entry_get_revision_counter(client_desc, &new_rev)) {
       remove_v3_desc_as_client(cache_entry);
       cache_client_desc_free(cache_entry);
       goto store;
     }
 
-    /* From this point on, we know that the decrypted descriptor is in the
-     * current entry and new object thus safe to access. */
-
     /* If we have an entry in our cache that has a revision counter greater
      * than the one we just fetched, discard the one we fetched. */
-    if (cache_entry->desc->plaintext_data.revision_counter >
-        client_desc->desc->plaintext_data.revision_counter) {
+    if (cached_rev > new_rev) {
       cache_client_desc_free(client_desc);
       goto done;
     }
@@ -720,8 +860,11 @@ cache_store_as_client(hs_cache_client_descriptor_t *client_desc)
 
     /* We just removed an old descriptor and will replace it. We'll close all
      * intro circuits related to this old one so we don't have leftovers. We
-     * leave the rendezvous circuits opened because they could be in use. */
-    hs_client_close_intro_circuits_from_desc(cache_entry->desc);
+     * leave the rendezvous circuits opened because they could be in use. A
+     * lazily stored descriptor that was never decrypted has no circuits. */
+    if (entry_has_decrypted_descriptor(cache_entry)) {
+      hs_client_close_intro_circuits_from_desc(cache_entry->desc);
+    }
 
     /* Free it. */
     cache_client_desc_free(cache_entry);
@@ -810,6 +953,100 @@ cache_clean_v3_as_client(time_t now)
   return bytes_removed;
 }
 
+/** Decode the encoded descriptor of the cache <b>entry</b> which doesn't
+ * have a decrypted descriptor, keeping the OOM accounting of the entry up to
+ * date. Return the decode status.
+ *
+ * On missing or bad client authorization, the entry is kept without a
+ * decrypted descriptor as if it had been decoded when stored. On any other
+ * error, a lazily stored entry is removed from the cache and freed so the
+ * caller MUST NOT use it anymore. */
+static hs_desc_decode_status_t
+cache_client_entry_decrypt(hs_cache_client_descriptor_t *entry)
+{
+  hs_desc_decode_status_t ret;
+  hs_descriptor_t *desc = NULL;
+
+  tor_assert(entry);
+  tor_assert(!entry_has_decrypted_descriptor(entry));
+
+  ret = hs_client_decode_descriptor(entry->encoded_desc, &entry->key, &desc);
+  if (ret == HS_DESC_DECODE_OK) {
+    entry->desc = desc;
+    entry->decrypt_pending = 0;
+    rend_cache_increment_allocation(hs_desc_obj_size(desc));
+    goto end;
+  }
+  hs_descriptor_free(desc);
+
+  if (ret == HS_DESC_DECODE_NEED_CLIENT_AUTH ||
+      ret == HS_DESC_DECODE_BAD_CLIENT_AUTH) {
+    entry->decrypt_pending = 0;
+    goto end;
+  }
+
+  if (entry->decrypt_pending) {
+    log_info(LD_REND, "Lazily stored descriptor of service %s failed to "
+                      "decode (status %d). Removing it from client cache.",
+             safe_str_client(ed25519_fmt(&entry->key)), ret);
+    remove_v3_desc_as_client(entry);
+    cache_client_desc_free(entry);
+  }
+
+ end:
+  return ret;
+}
+
+/** Drop the decrypted descriptor of lazily stored client cache entries,
+ * least recently used first, until at least <b>min_remove_bytes</b> have
+ * been freed or no such entry is left. The encoded descriptor is kept so the
+ * entry is decrypted again on its next lookup. Return the amount of bytes
+ * freed. */
+STATIC size_t
+cache_client_drop_decrypted(size_t min_remove_bytes)
+{
+  size_t bytes_removed = 0;
+  smartlist_t *entries;
+
+  if (!hs_cache_v3_client) {
+    return 0;
+  }
+
+  entries = smartlist_new();
+  DIGEST256MAP_FOREACH(hs_cache_v3_client, key,
+                       hs_cache_client_descriptor_t *, entry) {
+    (void) key;
+    if (entry->plaintext_data && entry_has_decrypted_descriptor(entry)) {
+      smartlist_add(entries, entry);
+    }
+  } DIGEST256MAP_FOREACH_END;
+  smartlist_sort(entries, compare_client_entry_last_used_);
+
+  SMARTLIST_FOREACH_BEGIN(entries, hs_cache_client_descriptor_t *, entry) {
+    size_t desc_size;
+
+    if (bytes_removed >= min_remove_bytes) {
+      break;
+    }
+    /* Intro circuits are found through the descriptor so don't leave any
+     * behind, like when the entry itself is removed. */
+    hs_client_close_intro_circuits_from_desc(entry->desc);
+    desc_size = hs_desc_obj_size(entry->desc);
+    hs_descriptor_free(entry->desc);
+    entry->decrypt_pending = 1;
+    rend_cache_decrement_allocation(desc_size);
+    bytes_removed += desc_size;
+  } SMARTLIST_FOREACH_END(entry);
+  smartlist_free(entries);
+
+  if (bytes_removed) {
+    log_info(LD_REND, "Dropped %" TOR_PRIuSZ " bytes of decrypted onion "
+                      "service descriptors from the client cache.",
+             bytes_removed);
+  }
+  return bytes_removed;
+}
+
 /** Public API: Given the HS ed25519 identity public key in <b>key</b>, return
  *  its HS encoded descriptor if it's stored in our cache, or NULL if not. */
 const char *
@@ -840,13 +1077,45 @@ hs_cache_lookup_as_client(const ed25519_public_key_t *key)
   tor_assert(key);
 
   cached_desc = lookup_v3_desc_as_client(key->pubkey);
+  if (cached_desc && cached_desc->decrypt_pending) {
+    if (cache_client_entry_decrypt(cached_desc) != HS_DESC_DECODE_OK) {
+      return NULL;
+    }
+  }
   if (cached_desc && entry_has_decrypted_descriptor(cached_desc)) {
+    cached_desc->last_used_ts = approx_time();
     return cached_desc->desc;
   }
 
   return NULL;
 }
 
+/** Public API: Decrypt the cached descriptor of the service with the HS
+ *  ed25519 identity public key <b>key</b> if it was stored lazily and not
+ *  decrypted yet. Return the decode status the descriptor would have had if
+ *  fully decoded when stored; a missing entry is a generic error.
+ *
+ *  Like at store time, a descriptor failing to decode for any other reason
+ *  than client authorization is removed from the cache. */
+hs_desc_decode_status_t
+hs_cache_decrypt_as_client(const ed25519_public_key_t *key)
+{
+  hs_cache_client_descriptor_t *cached_desc = NULL;
+
+  tor_assert(key);
+
+  cached_desc = lookup_v3_desc_as_client(key->pubkey);
+  if (!cached_desc) {
+    return HS_DESC_DECODE_GENERIC_ERROR;
+  }
+  if (cached_desc->decrypt_pending) {
+    return cache_client_entry_decrypt(cached_desc);
+  }
+  /* We don't remember which client authorization status it was. */
+  return entry_has_decrypted_descriptor(cached_desc) ?
+    HS_DESC_DECODE_OK : HS_DESC_DECODE_NEED_CLIENT_AUTH;
+}
+
 /** Public API: Given an encoded descriptor, store it in the client HS cache.
  *  Return a decode status which changes how we handle the SOCKS connection
  *  depending on its value:
@@ -1048,8 +1317,7 @@ hs_cache_client_new_auth_parse(const ed25519_public_key_t *service_pk)
   }
 
   /* Attempt a decode. If we are successful, inform the caller. */
-  if (hs_client_decode_descriptor(cached_desc->encoded_desc, service_pk,
-                                  &cached_desc->desc) == HS_DESC_DECODE_OK) {
+  if (cache_client_entry_decrypt(cached_desc) == HS_DESC_DECODE_OK) {
     ret = true;
   }
 
@@ -1072,44 +1340,58 @@ hs_cache_handle_oom(time_t now, size_t min_remove_bytes)
   /* Our OOM handler called with 0 bytes to remove is a code flow error. */
   tor_assert(min_remove_bytes != 0);
 
+  /* Decrypted descriptors of lazily stored client entries can be decrypted
+   * again from their encoded form so drop those first. */
+  bytes_removed += cache_client_drop_decrypted(min_remove_bytes);
+  if (bytes_removed >= min_remove_bytes) {
+    return bytes_removed;
+  }
+
   /* The algorithm is as follow. K is the oldest expected descriptor age.
    *
-   *   1) Deallocate all entries from v2 cache that are older than K hours.
+   *   0) Drop the decrypted form of lazily stored client descriptors.
+   *      0.1) If the amount of remove bytes has been reached, stop.
+   *   1) Deallocate all entries from v3 cache that have expired.
    *      1.1) If the amount of remove bytes has been reached, stop.
-   *   2) Deallocate all entries from v3 cache that are older than K hours
+   *   2) Deallocate all entries from v2 cache that are older than K hours.
    *      2.1) If the amount of remove bytes has been reached, stop.
-   *   3) Set K = K - RendPostPeriod and repeat process until K is < 0.
+   *   3) Set K = K - RendPostPeriod and repeat 2) until K is < 0.
+   *   4) Deallocate the least recently used entries from v3 cache until the
+   *      amount of remove bytes has been reached.
    *
-   * This ends up being O(Kn).
+   * This ends up being O(Kn) for v2 and O(n) for v3. Evicting v3 entries by
+   * use rather than by age keeps the popular descriptors that clients would
+   * otherwise refetch right away.
    */
 
+  bytes_removed += cache_clean_v3_as_dir(now, 0);
+  if (bytes_removed >= min_remove_bytes) {
+    return bytes_removed;
+  }
+
   /* Set K to the oldest expected age in seconds which is the maximum
-   * lifetime of a cache entry. We'll use the v2 lifetime because it's much
-   * bigger than the v3 thus leading to cleaning older descriptors. */
+   * lifetime of a cache entry. */
   k = rend_cache_max_entry_lifetime();
 
   do {
     time_t cutoff;
 
-    /* If K becomes negative, it means we've empty the caches so stop and
-     * return what we were able to cleanup. */
+    /* If K becomes negative, it means we've empty the cache so stop. */
     if (k < 0) {
       break;
     }
     /* Compute a cutoff value with K and the current time. */
     cutoff = now - k;
 
-    /* Start by cleaning the v2 cache with that cutoff. */
     bytes_removed += rend_cache_clean_v2_descs_as_dir(cutoff);
-
-    if (bytes_removed < min_remove_bytes) {
-      /* We haven't remove enough bytes so clean v3 cache. */
-      bytes_removed += cache_clean_v3_as_dir(now, cutoff);
-      /* Decrement K by a post period to shorten the cutoff. */
-      k -= get_options()->RendPostPeriod;
-    }
+    /* Decrement K by a post period to shorten the cutoff. */
+    k -= get_options()->RendPostPeriod;
   } while (bytes_removed < min_remove_bytes);
 
+  if (bytes_removed < min_remove_bytes) {
+    bytes_removed += cache_evict_v3_as_dir(min_remove_bytes - bytes_removed);
+  }
+
   return bytes_removed;
 }
 
@@ -1143,6 +1425,9 @@ hs_cache_free_all(void)
 {
   digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
   hs_cache_v3_dir = NULL;
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_lru);
+  hs_cache_v3_dir_bytes = 0;
+  hs_metrics_hsdir_cache_free();
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
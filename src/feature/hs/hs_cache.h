@@ -11,6 +11,7 @@
 
 #include <stdint.h>
 
+#include "ext/tor_queue.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/rend/rendcommon.h"
@@ -61,6 +62,10 @@ typedef struct hs_cache_dir_descriptor_t {
   /** Encoded descriptor which is basically in text form. It's a NUL terminated
    * string thus safe to strlen(). */
   char *encoded_desc;
+
+  /** Entry in the least recently used list of the cache. Lookups move the
+   * entry to the tail and evictions take it from the head. */
+  TOR_TAILQ_ENTRY(hs_cache_dir_descriptor_t) lru_next;
 } hs_cache_dir_descriptor_t;
 
 /* Public API */
@@ -85,6 +90,8 @@ const char *
 hs_cache_lookup_encoded_as_client(const struct ed25519_public_key_t *key);
 hs_desc_decode_status_t hs_cache_store_as_client(const char *desc_str,
                            const struct ed25519_public_key_t *identity_pk);
+hs_desc_decode_status_t hs_cache_decrypt_as_client(
+                                   const struct ed25519_public_key_t *key);
 void hs_cache_remove_as_client(const struct ed25519_public_key_t *key);
 void hs_cache_clean_as_client(time_t now);
 void hs_cache_purge_as_client(void);
@@ -123,12 +130,29 @@ typedef struct hs_cache_client_descriptor_t {
 
   /** Encoded descriptor in string form. Can't be NULL. */
   char *encoded_desc;
+
+  /** Decoded plaintext layer of the descriptor. Only set when the entry was
+   * stored with ClientOnionLazyDecryption, in which case desc is only
+   * decrypted from encoded_desc when first looked up. Its superencrypted
+   * blob is not kept since encoded_desc already holds it. */
+  hs_desc_plaintext_data_t *plaintext_data;
+
+  /** Set if desc is NULL because it has not been decrypted yet (or was
+   * dropped under memory pressure) rather than because of missing or bad
+   * client authorization. */
+  unsigned int decrypt_pending : 1;
+
+  /** Last time the decrypted descriptor was looked up. Decrypted forms are
+   * dropped least recently used first by the OOM handler. */
+  time_t last_used_ts;
 } hs_cache_client_descriptor_t;
 
 STATIC size_t cache_clean_v3_as_dir(time_t now, time_t global_cutoff);
+STATIC size_t cache_evict_v3_as_dir(size_t min_remove_bytes);
 
 STATIC hs_cache_client_descriptor_t *
 lookup_v3_desc_as_client(const uint8_t *key);
+STATIC size_t cache_client_drop_decrypted(size_t min_remove_bytes);
 
 #endif /* defined(HS_CACHE_PRIVATE) */
 
@@ -797,13 +797,13 @@ hs_cell_parse_intro_established(const uint8_t *payload, size_t payload_len)
   return ret;
 }
 
-/** HRPR: Parse the cell PoW solution extension TODO
- * could verify here without building a solution struct?
- * need to pass the solution back or store in one big struct... */
+/** HRPR: Parse the cell PoW solution extension into pow_sol. The solution is
+ * not verified here: hs_circ_handle_introduce2() hands it to a worker thread
+ * along with other pending INTRODUCE2 cells. Return 0 on success and -1 if
+ * the extension is malformed. */
 static int
 handle_introduce2_encrypted_cell_pow_extension(
-    const hs_service_t *service, const trn_cell_extension_field_t *field,
-    hs_pow_solution_t *pow_sol)
+    const trn_cell_extension_field_t *field, hs_pow_solution_t *pow_sol)
 {
   int ret = -1;
   trn_cell_extension_pow_t *pow = NULL;
@@ -834,16 +834,7 @@ handle_introduce2_encrypted_cell_pow_extension(
   log_err(LD_REND, "(S: %s)",
           hex_str(&pow_sol->equix_solution, 16));
 
-  // HRPR TODO We don't need to memcpy sol and nonce before we free 'pow', and
-  // we only need to bring out the effort to the calling func
-  if (verify_pow(service->state.pow_state, pow_sol)) {
-    log_err(LD_REND, "verify_pow failed.");
-    goto end;
-  } else {
-    log_err(LD_REND, "verify_pow succeeded.");
-  }
-
-  /* Successfully parsed and verified the PoW solution */
+  /* Successfully parsed the PoW solution */
   ret = 0;
 end:
   trn_cell_extension_pow_free(pow);
@@ -855,13 +846,11 @@ end:
  */
 static int
 handle_introduce2_encrypted_cell_extensions(
-    const hs_service_t *service,
     const trn_cell_introduce_encrypted_t *enc_cell,
     hs_cell_introduce2_data_t *data)
 {
   int ret = -1;
   const trn_cell_extension_t *extensions;
-  hs_pow_solution_t *pow_sol;
 
   tor_assert(enc_cell);
 
@@ -883,19 +872,13 @@ handle_introduce2_encrypted_cell_extensions(
     switch (trn_cell_extension_field_get_field_type(field)) {
     case TRUNNEL_CELL_EXTENSION_TYPE_POW:
       /* Handle PoW solution extension. */
-      pow_sol = tor_malloc_zero(sizeof(hs_pow_solution_t));
-      if (handle_introduce2_encrypted_cell_pow_extension(service, field,
-                                                         pow_sol)) {
+      if (handle_introduce2_encrypted_cell_pow_extension(
+                                             field, &data->pow_solution)) {
         log_err(LD_REND,
                 "handle_introduce2_encrypted_cell_pow_extension failed.");
         goto end;
       }
-      // HRPR TODO following is broken, and i assume for eqxsol too.
-      // Not sure why, but it doesn't matter if we verify the pow within
-      // handle_..._pow_extension.
-      // log_err(LD_REND, "test pow_sol nonce");
-      // log_err(LD_REND, "PARSED N: %s", hex_str(&pow_sol->nonce, 16));
-      data->pow_effort = pow_sol->effort;
+      data->pow_effort = data->pow_solution.effort;
       ret = 0;
       break;
     default:
@@ -1081,7 +1064,7 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   /* HRPR Handle extensions. As of now the PoW defense is the only extension so
    * we only need to do this if we have PoW defenses enabled. */
   if (service->config.has_pow_defenses_enabled) {
-    if (handle_introduce2_encrypted_cell_extensions(service, enc_cell, data)) {
+    if (handle_introduce2_encrypted_cell_extensions(enc_cell, data)) {
       log_err(LD_REND, "handle_introduce2_encrypted_cell_extensions failed.");
       goto done;
     }
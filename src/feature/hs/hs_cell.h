@@ -86,6 +86,10 @@ typedef struct hs_cell_introduce2_data_t {
 
   /** HRPR TODO Just need effort depending on when we verify. */
   uint32_t pow_effort;
+  /** HRPR: PoW solution taken from the INTRODUCE2 encrypted section. It is
+   * parsed but not verified: the caller verifies it, possibly in a batch on a
+   * worker thread. */
+  hs_pow_solution_t pow_solution;
 } hs_cell_introduce2_data_t;
 
 /* Build cell API. */
@@ -26,6 +26,7 @@
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_metrics.h"
 // HRPR TODO Importing mainloop for pqueue event, but maybe move
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/hs/hs_metrics.h"
 #include "feature/hs/hs_service.h"
@@ -37,6 +38,7 @@
 #include "lib/crypt_ops/crypto_dh.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 
 /* Trunnel. */
 #include "trunnel/ed25519_cert.h"
@@ -636,6 +638,9 @@ cleanup_on_close_client_circ(circuit_t *circ)
 {
   tor_assert(circ);
 
+  /* Nobody will use the PoW solution we might be computing for it. */
+  hs_pow_cancel_work(TO_ORIGIN_CIRCUIT(circ));
+
   if (circuit_is_hs_v3(circ)) {
     hs_client_circuit_cleanup_on_close(circ);
   }
@@ -650,6 +655,10 @@ cleanup_on_free_client_circ(circuit_t *circ)
 {
   tor_assert(circ);
 
+  hs_pow_cancel_work(TO_ORIGIN_CIRCUIT(circ));
+  /* Another intro circuit can use the solution this one never sent. */
+  hs_client_pow_reclaim_solution(TO_ORIGIN_CIRCUIT(circ));
+
   if (circuit_is_hs_v2(circ)) {
     rend_client_circuit_cleanup_on_free(circ);
   } else if (circuit_is_hs_v3(circ)) {
@@ -1017,6 +1026,336 @@ get_subcredential_for_handling_intro2_cell(
   return 0;
 }
 
+/** Maximum number of INTRODUCE2 cells whose PoW solution is verified by a
+ * single cpuworker job. A larger backlog is split across several jobs so that
+ * it is verified by several threads at once. */
+#define HS_POW_VERIFY_BATCH_MAX 32
+
+/** An INTRODUCE2 cell waiting for its PoW solution to be verified. */
+typedef struct pow_verify_request_t {
+  /** Identity key of the service and auth key of the intro point the cell
+   * came in on. We look both up again once verified since either can go away
+   * meanwhile. */
+  ed25519_public_key_t service_pk;
+  ed25519_public_key_t ip_auth_pk;
+  /** The seed the solution was computed with. Copied because the service can
+   * rotate its seeds while we verify. */
+  uint8_t seed[HS_POW_SEED_LEN];
+  /** The parsed cell. It goes to the rendezvous priority queue if the
+   * solution is valid. */
+  hs_cell_introduce2_data_t *data;
+  /** Output of the worker: 0 if the solution is valid and -1 otherwise. */
+  int result;
+} pow_verify_request_t;
+
+/** INTRODUCE2 cells of every service waiting to be handed to a cpuworker. */
+static smartlist_t *pending_pow_verify = NULL;
+/** Hands the pending INTRODUCE2 cells to the cpuworkers once the main loop is
+ * done with the cells it is currently reading. */
+static mainloop_event_t *pow_verify_flush_ev = NULL;
+
+/** Release all storage held by the given PoW verification request. */
+static void
+pow_verify_request_free(pow_verify_request_t *req)
+{
+  if (!req)
+    return;
+  if (req->data) {
+    link_specifier_smartlist_free(req->data->link_specifiers);
+    memwipe(req->data, 0, sizeof(*req->data));
+    tor_free(req->data);
+  }
+  memwipe(req, 0, sizeof(*req));
+  tor_free(req);
+}
+
+/** Release a batch of PoW verification requests and the list holding them. */
+static void
+pow_verify_batch_free(smartlist_t *batch)
+{
+  if (!batch)
+    return;
+  SMARTLIST_FOREACH(batch, pow_verify_request_t *, req,
+                    pow_verify_request_free(req));
+  smartlist_free(batch);
+}
+
+/** Worker thread function: verify the PoW solution of every INTRODUCE2 cell
+ * of the batch. This only does the blake2b and E-quiX checks; everything that
+ * depends on the service state is done on the main thread. */
+static workqueue_reply_t
+pow_verify_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  smartlist_t *batch = work_;
+  /* One context for the whole batch: no one else uses it until we give it
+   * back to the pool. */
+  equix_ctx *ctx = hs_pow_verify_ctx_acquire();
+
+  SMARTLIST_FOREACH_BEGIN(batch, pow_verify_request_t *, req) {
+    if (ctx == NULL) {
+      req->result = -1;
+      continue;
+    }
+    req->result = hs_pow_verify_solution(ctx, req->seed,
+                                         &req->data->pow_solution);
+  } SMARTLIST_FOREACH_END(req);
+
+  hs_pow_verify_ctx_release(ctx);
+  return WQ_RPL_REPLY;
+}
+
+/** The PoW solution of req has been checked by a worker. If it is valid and
+ * still acceptable, move its INTRODUCE2 data to the rendezvous priority queue
+ * of its service, which then owns it. Else, leave it for the caller to
+ * free. */
+static void
+pow_verify_request_finish(pow_verify_request_t *req)
+{
+  hs_service_t *service;
+  hs_service_intro_point_t *ip;
+  const hs_pow_solution_t *pow_solution = &req->data->pow_solution;
+
+  if (req->result < 0) {
+    log_info(LD_REND, "Invalid PoW solution in INTRODUCE2 cell. Dropping.");
+    return;
+  }
+
+  service = hs_service_find(&req->service_pk);
+  if (service == NULL || !service->config.has_pow_defenses_enabled) {
+    log_info(LD_REND, "Service of a verified INTRODUCE2 cell is gone or "
+                      "disabled its PoW defenses. Dropping.");
+    return;
+  }
+  ip = hs_service_intro_point_find(service, &req->ip_auth_pk);
+  if (ip == NULL) {
+    log_info(LD_REND, "Intro point of a verified INTRODUCE2 cell is gone. "
+                      "Dropping.");
+    return;
+  }
+
+  /* The seed might have expired, or another copy of this solution might have
+   * been verified, since we queued it. */
+  if (hs_pow_check_solution_params(service->state.pow_state, pow_solution,
+                                   NULL) < 0) {
+    log_info(LD_REND, "PoW solution in INTRODUCE2 cell is no longer "
+                      "acceptable. Dropping.");
+    return;
+  }
+  if (hs_pow_replay_cache_add(service->state.pow_state, pow_solution) < 0) {
+    log_info(LD_REND, "Replayed PoW solution in INTRODUCE2 cell. Dropping.");
+    hs_metrics_new_pow_replay(&service->keys.identity_pk);
+    return;
+  }
+  hs_metrics_pow_replay_cache_entries(service, 1);
+
+  enqueue_rend_request(service, ip, req->data, req->data->pow_effort);
+  req->data = NULL;
+}
+
+/** Main thread function: a worker verified a batch of INTRODUCE2 cells. Queue
+ * a rendezvous for each valid one. */
+static void
+pow_verify_replyfn(void *work_)
+{
+  smartlist_t *batch = work_;
+
+  SMARTLIST_FOREACH(batch, pow_verify_request_t *, req,
+                    pow_verify_request_finish(req));
+  pow_verify_batch_free(batch);
+}
+
+/** Hand every pending INTRODUCE2 cell to the cpuworkers, in batches of at
+ * most HS_POW_VERIFY_BATCH_MAX cells. */
+static void
+pow_verify_flush(void)
+{
+  smartlist_t *pending = pending_pow_verify;
+  smartlist_t *batch = NULL;
+
+  if (pending == NULL) {
+    return;
+  }
+  pending_pow_verify = NULL;
+
+  SMARTLIST_FOREACH_BEGIN(pending, pow_verify_request_t *, req) {
+    if (batch == NULL) {
+      batch = smartlist_new();
+    }
+    smartlist_add(batch, req);
+    if (smartlist_len(batch) < HS_POW_VERIFY_BATCH_MAX &&
+        req_sl_idx < req_sl_len - 1) {
+      continue;
+    }
+    if (!cpuworker_queue_work(WQ_PRI_MED, pow_verify_threadfn,
+                              pow_verify_replyfn, batch)) {
+      log_warn(LD_BUG, "Couldn't queue INTRODUCE2 PoW verification on the "
+                       "threadpool. Dropping %d cells.",
+               smartlist_len(batch));
+      pow_verify_batch_free(batch);
+    }
+    batch = NULL;
+  } SMARTLIST_FOREACH_END(req);
+
+  smartlist_free(pending);
+}
+
+/** Mainloop callback: hand the pending INTRODUCE2 cells to the
+ * cpuworkers. */
+static void
+pow_verify_flush_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+  pow_verify_flush();
+}
+
+/** Queue the parsed INTRODUCE2 cell data, received on the given intro point of
+ * service, for PoW verification on a cpuworker. The checks that only need the
+ * service state are done right away. On success, return 0 and take ownership
+ * of data. Return -1 if the solution is unacceptable, in which case data is
+ * left to the caller. */
+static int
+queue_introduce2_pow_verify(const hs_service_t *service,
+                            const hs_service_intro_point_t *ip,
+                            hs_cell_introduce2_data_t *data)
+{
+  const uint8_t *seed = NULL;
+  pow_verify_request_t *req;
+
+  if (hs_pow_check_solution_params(service->state.pow_state,
+                                   &data->pow_solution, &seed) < 0) {
+    log_info(LD_REND, "Unacceptable PoW solution in INTRODUCE2 cell. "
+                      "Dropping.");
+    return -1;
+  }
+  /* Don't spend a worker on a solution we already accepted. */
+  if (hs_pow_replay_cache_contains(service->state.pow_state,
+                                   &data->pow_solution)) {
+    log_info(LD_REND, "Replayed PoW solution in INTRODUCE2 cell. Dropping.");
+    hs_metrics_new_pow_replay(&service->keys.identity_pk);
+    return -1;
+  }
+
+  req = tor_malloc_zero(sizeof(*req));
+  ed25519_pubkey_copy(&req->service_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&req->ip_auth_pk, &ip->auth_key_kp.pubkey);
+  memcpy(req->seed, seed, sizeof(req->seed));
+  req->data = data;
+  req->result = -1;
+
+  if (pending_pow_verify == NULL) {
+    pending_pow_verify = smartlist_new();
+  }
+  smartlist_add(pending_pow_verify, req);
+
+  /* A full batch goes right away. Else, wait for the cells the main loop is
+   * about to read so they are verified together. */
+  if (smartlist_len(pending_pow_verify) >= HS_POW_VERIFY_BATCH_MAX) {
+    pow_verify_flush();
+    return 0;
+  }
+  if (pow_verify_flush_ev == NULL) {
+    pow_verify_flush_ev = mainloop_event_new(pow_verify_flush_cb, NULL);
+  }
+  mainloop_event_activate(pow_verify_flush_ev);
+  return 0;
+}
+
+/** Release every INTRODUCE2 cell waiting to be handed to a cpuworker for PoW
+ * verification. Cells already handed over are released on reply. */
+void
+hs_circ_pow_verify_free_all(void)
+{
+  pow_verify_batch_free(pending_pow_verify);
+  pending_pow_verify = NULL;
+  mainloop_event_free(pow_verify_flush_ev);
+}
+
+/** Number of INTRODUCE2 cells, across all services, admitted for decryption
+ * during the current run of the main loop. */
+static uint32_t introduce2_admitted_this_loop = 0;
+/** Event run once the current run of the main loop is done, which resets
+ * introduce2_admitted_this_loop. */
+static mainloop_event_t *introduce2_loop_ev = NULL;
+
+/** Post-loop callback: a new run of the main loop starts, so start counting
+ * the admitted INTRODUCE2 cells from zero again. */
+STATIC void
+introduce2_loop_done_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+
+  introduce2_admitted_this_loop = 0;
+}
+
+/** Return true iff we can decrypt an INTRODUCE2 cell received on the intro
+ * point ip of the given service, and account for it.
+ *
+ * This is called before anything is done with the cell. The ntor handshake
+ * needed to decrypt it is what a flood of INTRODUCE2 cells costs us, so the
+ * cells over the intro point token bucket or over the per main loop run
+ * limit are dropped here. Replays are caught by the intro point replay cache,
+ * which hs_cell_parse_introduce2() checks before computing any key. */
+STATIC bool
+introduce2_admit(const hs_service_t *service, hs_service_intro_point_t *ip)
+{
+  const uint32_t rate = service->config.introduce2_rate_per_sec;
+  const uint32_t burst = service->config.introduce2_burst_per_sec;
+  const uint32_t max_per_loop =
+    (uint32_t) get_options()->HiddenServiceIntroduce2MaxPerLoop;
+  token_bucket_ctr_t *bucket = &ip->introduce2_bucket;
+
+  if (rate) {
+    /* Set the bucket up on the first cell, and follow configuration changes
+     * since the intro point outlives a reload. */
+    if (bucket->cfg.rate == 0) {
+      token_bucket_ctr_init(bucket, rate, burst, (uint32_t) approx_time());
+    } else if (bucket->cfg.rate != rate ||
+               bucket->cfg.burst != (int32_t) burst) {
+      token_bucket_ctr_adjust(bucket, rate, burst);
+    }
+    token_bucket_ctr_refill(bucket, (uint32_t) approx_time());
+    if (token_bucket_ctr_get(bucket) == 0) {
+      log_info(LD_REND, "INTRODUCE2 rate limit reached on an intro point of "
+                        "service %s. Dropping cell.",
+               safe_str_client(service->onion_address));
+      return false;
+    }
+  }
+
+  if (max_per_loop && introduce2_admitted_this_loop >= max_per_loop) {
+    log_info(LD_REND, "Already decrypted %" PRIu32 " INTRODUCE2 cells in "
+                      "this main loop run. Dropping cell for service %s.",
+             introduce2_admitted_this_loop,
+             safe_str_client(service->onion_address));
+    return false;
+  }
+
+  if (rate) {
+    token_bucket_ctr_dec(bucket, 1);
+  }
+  if (max_per_loop) {
+    if (introduce2_admitted_this_loop++ == 0) {
+      if (introduce2_loop_ev == NULL) {
+        introduce2_loop_ev =
+          mainloop_event_postloop_new(introduce2_loop_done_cb, NULL);
+      }
+      mainloop_event_activate(introduce2_loop_ev);
+    }
+  }
+  return true;
+}
+
+/** Release the global state of the INTRODUCE2 admission. */
+void
+hs_circ_introduce2_free_all(void)
+{
+  introduce2_admitted_this_loop = 0;
+  mainloop_event_free(introduce2_loop_ev);
+}
+
 /** We just received an INTRODUCE2 cell on the established introduction circuit
  * circ.  Handle the INTRODUCE2 payload of size payload_len for the given
  * circuit and service. This cell is associated with the intro point object ip
@@ -1032,18 +1371,20 @@ hs_circ_handle_introduce2(const hs_service_t *service,
   time_t elapsed;
   hs_cell_introduce2_data_t data;
 
-  /* HRPR TODO For bodged fix below. feb 25 */
-  hs_cell_introduce2_data_t *data_copy;
-  data_copy = tor_malloc_zero(sizeof(hs_cell_introduce2_data_t));
-
   tor_assert(service);
   tor_assert(circ);
   tor_assert(ip);
   tor_assert(subcredential);
   tor_assert(payload);
 
+  /* Drop the cell before any work if we are over our limits. */
+  if (!introduce2_admit(service, ip)) {
+    return -1;
+  }
+
   /* Populate the data structure with everything we need for the cell to be
    * parsed, decrypted and key material computed correctly. */
+  memset(&data, 0, sizeof(data));
   data.auth_pk = &ip->auth_key_kp.pubkey;
   data.enc_kp = &ip->enc_key_kp;
   data.payload = payload;
@@ -1083,22 +1424,33 @@ hs_circ_handle_introduce2(const hs_service_t *service,
    * so increment our counter that we've seen one on this intro point. */
   ip->introduce2_count++;
 
-  /* HRPR Add the rendezvous request to the priority queue if PoW defenses are
-   * enabled, otherwise rendezvous as usual. */
+  /* HRPR If PoW defenses are enabled, verify the PoW solution on a cpuworker.
+   * Once valid, the rendezvous request goes to the priority queue. Otherwise
+   * rendezvous as usual. */
   if (service->config.has_pow_defenses_enabled) {
-    log_err(LD_REND, "Adding to pqueue with effort: %u", data.pow_effort);
-
-    // HRPR TODO Come back to this bodged fix and think about it more.
-    memcpy(data_copy, &data, sizeof(hs_cell_introduce2_data_t));
-    enqueue_rend_request(service, ip, data_copy, data_copy->pow_effort);
-
-    /* Successfully added rend circuit to priority queue. */
-    ret = 0;
-
-    /* Increase the total effort in valid requests received this period. */
-    service->state.pow_state->total_effort += data_copy->pow_effort;
+    hs_cell_introduce2_data_t *data_copy = tor_memdup(&data, sizeof(data));
+
+    /* The copy outlives this cell, and maybe the intro point and descriptor
+     * too: clear the pointers it doesn't own. What remains is all that
+     * launch_rendezvous_point_circuit() needs. */
+    data_copy->auth_pk = NULL;
+    data_copy->enc_kp = NULL;
+    data_copy->n_subcredentials = 0;
+    data_copy->subcredentials = NULL;
+    data_copy->payload = NULL;
+    data_copy->payload_len = 0;
+    data_copy->replay_cache = NULL;
+
+    if (queue_introduce2_pow_verify(service, ip, data_copy) < 0) {
+      /* The link specifiers are still owned by data. */
+      tor_free(data_copy);
+      goto done;
+    }
 
-    return ret;
+    /* Successfully queued for verification. data_copy owns the link
+     * specifiers now. */
+    memwipe(&data, 0, sizeof(data));
+    return 0;
   } else {
     /* Launch rendezvous circuit with the onion key and rend cookie. */
     launch_rendezvous_point_circuit(service, ip, &data);
@@ -1307,23 +1659,108 @@ err:
   return -1;
 }
 
-/** HRPR TODO Move somewhere else? Own file? Service? */
+/** Maximum number of rendezvous circuits launched from the PoW priority queue
+ * in one run of the main loop, so that a full token bucket doesn't stall
+ * it. */
+#define MAX_REND_REQUEST_PER_MAINLOOP 16
+
+/** How long to wait before looking at the PoW priority queue again once the
+ * dequeue token bucket is empty. */
+#define REND_PQUEUE_RETRY_MSEC 100
+
+/* HRPR TODO Move somewhere else? Own file? Service? */
+
+/** Compare two pending rendezvous requests for the priority queue. The heap
+ * pops its lowest element first, so the higher effort sorts first and, for
+ * the same effort, the older request. */
 static int
 compare_rend_request_by_effort_(const void *_a, const void *_b)
 {
   const pending_rend_t *a = _a, *b = _b;
-  // HRPR TODO check this is correct...
-  if (a->pow_effort < b->pow_effort)
+  if (a->pow_effort > b->pow_effort)
     return -1;
-  else if (a->pow_effort == b->pow_effort)
-    return 0;
-  else
+  else if (a->pow_effort < b->pow_effort)
     return 1;
+  else if (a->enqueued_ts < b->enqueued_ts)
+    return -1;
+  else if (a->enqueued_ts > b->enqueued_ts)
+    return 1;
+  else
+    return 0;
+}
+
+/** Release all storage held by the given pending rendezvous request. */
+static void
+free_pending_rend(pending_rend_t *req)
+{
+  if (!req)
+    return;
+  if (req->data) {
+    link_specifier_smartlist_free(req->data->link_specifiers);
+    memwipe(req->data, 0, sizeof(*req->data));
+    tor_free(req->data);
+  }
+  memwipe(req, 0, sizeof(*req));
+  tor_free(req);
+}
+
+/** Drop the pending rendezvous request req from the PoW priority queue of
+ * pow_state, noting its effort for the suggested effort update. */
+static void
+drop_pending_rend(hs_service_pow_state_t *pow_state, pending_rend_t *req)
+{
+  pow_state->max_trimmed_effort = MAX(pow_state->max_trimmed_effort,
+                                      req->pow_effort);
+  free_pending_rend(req);
+}
+
+/** Return true iff the pending rendezvous request req has waited in the
+ * priority queue of service for longer than the service allows at time
+ * now. */
+static int
+rend_request_is_too_old(const hs_service_t *service,
+                        const pending_rend_t *req, time_t now)
+{
+  return now - req->enqueued_ts > (time_t) service->config.pow_queue_max_age;
+}
+
+/** The PoW priority queue of service is full: only keep its highest priority
+ * half, minus the requests that are too old at time now, and drop the
+ * rest. */
+static void
+trim_rend_pqueue(const hs_service_t *service, time_t now)
+{
+  hs_service_pow_state_t *pow_state = service->state.pow_state;
+  smartlist_t *old_pqueue = pow_state->rend_request_pqueue;
+  smartlist_t *new_pqueue = smartlist_new();
+  int keep = MAX(1, (int) (service->config.pow_queue_max_depth / 2));
+
+  log_info(LD_REND, "PoW priority queue is full with %d requests. Dropping "
+                    "the lowest effort ones.", smartlist_len(old_pqueue));
+
+  while (smartlist_len(new_pqueue) < keep && smartlist_len(old_pqueue) > 0) {
+    pending_rend_t *req =
+      smartlist_pqueue_pop(old_pqueue, compare_rend_request_by_effort_,
+                           offsetof(pending_rend_t, idx));
+    if (rend_request_is_too_old(service, req, now)) {
+      drop_pending_rend(pow_state, req);
+      continue;
+    }
+    smartlist_pqueue_add(new_pqueue, compare_rend_request_by_effort_,
+                         offsetof(pending_rend_t, idx), req);
+  }
+
+  /* What is left has the lowest priority. */
+  SMARTLIST_FOREACH(old_pqueue, pending_rend_t *, req,
+                    drop_pending_rend(pow_state, req));
+  smartlist_free(old_pqueue);
+  pow_state->rend_request_pqueue = new_pqueue;
 }
 
 /** HRPR: Given the information needed to launch a rendezvous circuit and an
  * effort value, enqueue the rendezvous request in the service's PoW priority
- * queue with the effort being the priority. */
+ * queue with the effort being the priority. The queue takes ownership of
+ * data. */
 void
 enqueue_rend_request(const hs_service_t *service, hs_service_intro_point_t *ip,
                      hs_cell_introduce2_data_t *data,
@@ -1331,76 +1768,106 @@ enqueue_rend_request(const hs_service_t *service, hs_service_intro_point_t *ip,
 {
   pending_rend_t *rend_request = NULL;
   hs_service_pow_state_t *pow_state = service->state.pow_state;
+  time_t now = approx_time();
 
   rend_request = tor_malloc_zero(sizeof(pending_rend_t));
 
-  rend_request->ip = ip;
+  ed25519_pubkey_copy(&rend_request->ip_auth_pk, &ip->auth_key_kp.pubkey);
   rend_request->data = data;
   rend_request->pow_effort = pow_effort;
+  rend_request->enqueued_ts = now;
   rend_request->idx = -1;
 
-  log_err(LD_REND, "Current pqueue length: %d",
-          smartlist_len(pow_state->rend_request_pqueue));
-
-  log_err(LD_REND, "Adding pending rend circuit to pqueue...");
   smartlist_pqueue_add(pow_state->rend_request_pqueue,
                        compare_rend_request_by_effort_,
                        offsetof(pending_rend_t, idx), rend_request);
 
-  log_err(LD_REND, "Current pqueue length: %d",
-          smartlist_len(pow_state->rend_request_pqueue));
+  /* Keep memory bounded under a flood. */
+  if (smartlist_len(pow_state->rend_request_pqueue) >=
+      (int) service->config.pow_queue_max_depth) {
+    trim_rend_pqueue(service, now);
+  }
 
   /* Initialize the priority queue event if it hasn't been done so already. */
   if (pow_state->pop_pqueue_ev == NULL) {
-    log_err(LD_REND, "Initiating pqueue pop event...");
     pow_state->pop_pqueue_ev =
         mainloop_event_new(handle_rend_pqueue_cb, (void *)service);
   }
 
-  log_err(LD_REND, "Activating pqueue pop event...");
-  // HRPR TODO - Dodgy logic? I think we are activating this too many times if
-  // we also activate on pops
   mainloop_event_activate(pow_state->pop_pqueue_ev);
 }
 
+/** HRPR: Mainloop callback: launch rendezvous circuits for the highest
+ * priority requests of the service's PoW priority queue, as fast as its
+ * dequeue token bucket allows. Requests that waited too long, or whose intro
+ * point is gone, are dropped. */
 void
 handle_rend_pqueue_cb(mainloop_event_t *ev, void *arg)
 {
   (void)ev; /* Not using the returned event, make compiler happy. */
   hs_service_t *service = arg;
   hs_service_pow_state_t *pow_state = service->state.pow_state;
-  pending_rend_t *rend_request = tor_malloc_zero(sizeof(pending_rend_t));
-
-  log_err(LD_REND, "Current pqueue length: %d",
-          smartlist_len(pow_state->rend_request_pqueue));
-
-  log_err(LD_REND, "Popping from pqueue...");
-  rend_request = smartlist_pqueue_pop(pow_state->rend_request_pqueue,
-                                      compare_rend_request_by_effort_,
-                                      offsetof(pending_rend_t, idx));
+  time_t now = approx_time();
+  int n_launched = 0;
+
+  token_bucket_ctr_refill(&pow_state->pqueue_bucket, (uint32_t) now);
+
+  while (n_launched < MAX_REND_REQUEST_PER_MAINLOOP &&
+         smartlist_len(pow_state->rend_request_pqueue) > 0) {
+    pending_rend_t *rend_request;
+    hs_service_intro_point_t *ip;
+
+    /* We are launching as fast as the service can take. Try again once the
+     * bucket had a chance to refill. */
+    if (token_bucket_ctr_get(&pow_state->pqueue_bucket) == 0) {
+      const struct timeval delay_tv = { 0, REND_PQUEUE_RETRY_MSEC * 1000 };
+      mainloop_event_schedule(pow_state->pop_pqueue_ev, &delay_tv);
+      return;
+    }
 
-  log_err(LD_REND, "Popped pending rend circuit, which had effort: %u",
-          rend_request->pow_effort);
+    rend_request = smartlist_pqueue_pop(pow_state->rend_request_pqueue,
+                                        compare_rend_request_by_effort_,
+                                        offsetof(pending_rend_t, idx));
 
-  log_err(LD_REND, "Current pqueue length: %d",
-          smartlist_len(pow_state->rend_request_pqueue));
+    if (rend_request_is_too_old(service, rend_request, now)) {
+      log_info(LD_REND, "Rendezvous request with effort %u waited too long "
+                        "in the PoW priority queue. Dropping.",
+               rend_request->pow_effort);
+      drop_pending_rend(pow_state, rend_request);
+      continue;
+    }
 
-  log_err(LD_REND, "Launching rendezvous point circuit...");
-  launch_rendezvous_point_circuit(service, rend_request->ip,
-                                  rend_request->data);
-  log_err(LD_REND, "Finished launching.");
+    ip = hs_service_intro_point_find(service, &rend_request->ip_auth_pk);
+    if (ip == NULL) {
+      log_info(LD_REND, "Intro point of a queued rendezvous request is gone. "
+                        "Dropping.");
+      free_pending_rend(rend_request);
+      continue;
+    }
 
-  // HRPR TODO Idk if this is correct, check later
-  link_specifier_smartlist_free(rend_request->data->link_specifiers);
-  memwipe(rend_request->data, 0, sizeof(rend_request->data));
+    launch_rendezvous_point_circuit(service, ip, rend_request->data);
+    token_bucket_ctr_dec(&pow_state->pqueue_bucket, 1);
+    /* Account for this request in the next suggested effort update. */
+    pow_state->total_effort += rend_request->pow_effort;
+    pow_state->rend_handled++;
+    free_pending_rend(rend_request);
+    n_launched++;
+  }
 
   /* If there are still some pending rendezvous circuits in the pqueue then
    * reschedule the event in order to continue handling them. */
-  // HRPR TODO Disabled for now. See above.
-  // if (smartlist_len(pow_state->rend_request_pqueue)) {
-  //   log_err(LD_REND, "Still pending circuits in pqueue, reactivating pop event...");
-  //   mainloop_event_activate(pow_state->pop_pqueue_ev);
-  // }
+  if (smartlist_len(pow_state->rend_request_pqueue) > 0) {
+    mainloop_event_activate(pow_state->pop_pqueue_ev);
+  }
+}
+
+/** HRPR: Release every request of the PoW priority queue in pow_state. */
+void
+rend_pqueue_clear(hs_service_pow_state_t *pow_state)
+{
+  SMARTLIST_FOREACH(pow_state->rend_request_pqueue, pending_rend_t *, req,
+                    free_pending_rend(req));
+  smartlist_clear(pow_state->rend_request_pqueue);
 }
 
 /** Circuit cleanup strategy:
@@ -73,23 +73,31 @@ bool hs_circ_is_rend_sent_in_intro1(const origin_circuit_t *circ);
 
 /* HRPR TODO Putting this here for now... */
 typedef struct pending_rend_t {
-  /** Rendezvous circuit params */
-  hs_service_intro_point_t *ip;
+  /** Rendezvous circuit params. We keep the auth key of the intro point
+   * rather than the object itself since it can go away while we wait. */
+  ed25519_public_key_t ip_auth_pk;
   hs_cell_introduce2_data_t *data;
 
   /** Effort client exerted in PoW */
   uint32_t pow_effort;
 
+  /** When the request was added to the queue. */
+  time_t enqueued_ts;
+
   /** Position of element in the heap */
   int idx;
 } pending_rend_t;
 
-void enqueue_rend_circuit(const hs_service_t *service,
+void enqueue_rend_request(const hs_service_t *service,
                           hs_service_intro_point_t *ip,
                           hs_cell_introduce2_data_t *data,
                           const uint32_t pow_effort);
 
 void handle_rend_pqueue_cb(mainloop_event_t *ev, void *arg);
+void rend_pqueue_clear(hs_service_pow_state_t *pow_state);
+
+void hs_circ_pow_verify_free_all(void);
+void hs_circ_introduce2_free_all(void);
 
 #ifdef HS_CIRCUIT_PRIVATE
 
@@ -107,6 +115,10 @@ launch_rendezvous_point_circuit,(const hs_service_t *service,
                                  const hs_service_intro_point_t *ip,
                                 const struct hs_cell_introduce2_data_t *data));
 
+STATIC void introduce2_loop_done_cb(mainloop_event_t *ev, void *arg);
+STATIC bool introduce2_admit(const hs_service_t *service,
+                             hs_service_intro_point_t *ip);
+
 #endif /* defined(HS_CIRCUIT_PRIVATE) */
 
 #endif /* !defined(TOR_HS_CIRCUIT_H) */
\ No newline at end of file
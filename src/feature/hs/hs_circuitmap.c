@@ -23,64 +23,116 @@
 
 /************************** HS circuitmap code *******************************/
 
+/** Initial number of slots of the circuitmap. Must be a power of 2. */
+#define HS_CIRCUITMAP_INITIAL_SLOTS 64
+
 /** This is the hidden service circuitmap. It's a hash table that maps
    introduction and rendezvous tokens to specific circuits such that given a
    token it's easy to find the corresponding circuit. */
 static struct hs_circuitmap_ht *the_hs_circuitmap = NULL;
 
-/** This is a helper function used by the hash table code (HT_). It returns 1
- * if two circuits have the same HS token. */
-static int
-hs_circuits_have_same_token(const circuit_t *first_circuit,
-                            const circuit_t *second_circuit)
+/** Return true iff the two HS tokens are the same. Tokens are zero padded to
+ * a fixed size so there is no length to look at. */
+static inline int
+hs_tokens_are_equal(const hs_token_t *first_token,
+                    const hs_token_t *second_token)
 {
-  const hs_token_t *first_token;
-  const hs_token_t *second_token;
-
-  tor_assert(first_circuit);
-  tor_assert(second_circuit);
+  return first_token->type == second_token->type &&
+         tor_memeq(first_token->token, second_token->token,
+                   sizeof(first_token->token));
+}
 
-  first_token = first_circuit->hs_token;
-  second_token = second_circuit->hs_token;
+/** Hash an HS token into an unsigned int for use as a key by the circuitmap.
+ * The hash is keyed so that the tokens, which can be chosen by remote
+ * parties, can't be picked to collide. */
+static inline unsigned int
+hs_token_hash(const hs_token_t *token)
+{
+  return (unsigned) siphash24g(token->token, sizeof(token->token)) ^
+         (unsigned) token->type;
+}
 
-  /* Both circs must have a token */
-  if (BUG(!first_token) || BUG(!second_token)) {
-    return 0;
-  }
+/** Return the index of the slot of <b>map</b> holding <b>token</b> which
+ * hashes to <b>hash</b>, or -1 if no such slot. Lookups stop at the first
+ * empty slot since removal never leaves holes in a probe sequence. */
+static int
+hs_circuitmap_find_slot(const hs_circuitmap_ht *map, const hs_token_t *token,
+                        unsigned int hash)
+{
+  const unsigned int mask = map->n_slots - 1;
 
-  if (first_token->type != second_token->type) {
-    return 0;
+  for (unsigned int idx = hash & mask; ; idx = (idx + 1) & mask) {
+    const hs_circuitmap_slot_t *slot = &map->slots[idx];
+    if (slot->circ == NULL) {
+      return -1;
+    }
+    if (slot->hash == hash && hs_tokens_are_equal(&slot->token, token)) {
+      return (int) idx;
+    }
   }
+}
 
-  if (first_token->token_len != second_token->token_len)
-    return 0;
+/** Put <b>circ</b> with <b>token</b> in the first free slot of its probe
+ * sequence in <b>map</b>. The map must have a free slot. */
+static void
+hs_circuitmap_place(hs_circuitmap_ht *map, circuit_t *circ,
+                    const hs_token_t *token, unsigned int hash)
+{
+  const unsigned int mask = map->n_slots - 1;
+  unsigned int idx = hash & mask;
 
-  return tor_memeq(first_token->token,
-                   second_token->token,
-                   first_token->token_len);
+  while (map->slots[idx].circ) {
+    idx = (idx + 1) & mask;
+  }
+  memcpy(&map->slots[idx].token, token, sizeof(*token));
+  map->slots[idx].hash = hash;
+  map->slots[idx].circ = circ;
 }
 
-/** This is a helper function for the hash table code (HT_). It hashes a
- * circuit HS token into an unsigned int for use as a key by the hash table
- * routines.*/
-static inline unsigned int
-hs_circuit_hash_token(const circuit_t *circuit)
+/** Double the number of slots of <b>map</b> and rehash its entries. */
+static void
+hs_circuitmap_grow(hs_circuitmap_ht *map)
 {
-  tor_assert(circuit->hs_token);
-
-  return (unsigned) siphash24g(circuit->hs_token->token,
-                               circuit->hs_token->token_len);
+  hs_circuitmap_slot_t *old_slots = map->slots;
+  const unsigned int old_n_slots = map->n_slots;
+
+  map->n_slots *= 2;
+  map->slots = tor_calloc(map->n_slots, sizeof(hs_circuitmap_slot_t));
+  for (unsigned int i = 0; i < old_n_slots; i++) {
+    if (old_slots[i].circ) {
+      hs_circuitmap_place(map, old_slots[i].circ, &old_slots[i].token,
+                          old_slots[i].hash);
+    }
+  }
+  tor_free(old_slots);
 }
 
-/** Register the circuitmap hash table */
-HT_PROTOTYPE(hs_circuitmap_ht, // The name of the hashtable struct
-             circuit_t,    // The name of the element struct,
-             hs_circuitmap_node,        // The name of HT_ENTRY member
-             hs_circuit_hash_token, hs_circuits_have_same_token);
+/** Empty the slot at <b>idx</b> of <b>map</b>. The entries that follow it in
+ * the same probe sequence are shifted back so lookups can keep stopping at
+ * the first empty slot. */
+static void
+hs_circuitmap_clear_slot(hs_circuitmap_ht *map, unsigned int idx)
+{
+  const unsigned int mask = map->n_slots - 1;
+  unsigned int hole = idx, next = idx;
 
-HT_GENERATE2(hs_circuitmap_ht, circuit_t, hs_circuitmap_node,
-             hs_circuit_hash_token, hs_circuits_have_same_token,
-             0.6, tor_reallocarray, tor_free_);
+  for (;;) {
+    next = (next + 1) & mask;
+    if (map->slots[next].circ == NULL) {
+      break;
+    }
+    /* Distance from the home slot of the next entry to where it is, and to
+     * the hole. It can move into the hole only if that doesn't put it
+     * before its home slot. */
+    const unsigned int home = map->slots[next].hash & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      map->slots[hole] = map->slots[next];
+      hole = next;
+    }
+  }
+  memset(&map->slots[hole], 0, sizeof(map->slots[hole]));
+  map->n_entries--;
+}
 
 #ifdef TOR_UNIT_TESTS
 
@@ -95,18 +147,28 @@ get_hs_circuitmap(void)
 
 /****************** HS circuitmap utility functions **************************/
 
-/** Return a new HS token of type <b>type</b> containing <b>token</b>. */
-static hs_token_t *
-hs_token_new(hs_token_type_t type, size_t token_len,
+/** Fill <b>hs_token</b> with a token of type <b>type</b> containing
+ * <b>token</b>. */
+static void
+hs_token_set(hs_token_t *hs_token, hs_token_type_t type, size_t token_len,
              const uint8_t *token)
 {
   tor_assert(token);
+  tor_assert(token_len <= sizeof(hs_token->token));
 
-  hs_token_t *hs_token = tor_malloc_zero(sizeof(hs_token_t));
+  memset(hs_token, 0, sizeof(*hs_token));
   hs_token->type = type;
   hs_token->token_len = token_len;
-  hs_token->token = tor_memdup(token, token_len);
+  memcpy(hs_token->token, token, token_len);
+}
 
+/** Return a new HS token of type <b>type</b> containing <b>token</b>. */
+static hs_token_t *
+hs_token_new(hs_token_type_t type, size_t token_len,
+             const uint8_t *token)
+{
+  hs_token_t *hs_token = tor_malloc(sizeof(hs_token_t));
+  hs_token_set(hs_token, type, token_len, token);
   return hs_token;
 }
 
@@ -117,24 +179,20 @@ hs_token_new(hs_token_type_t type, size_t token_len,
 static void
 hs_token_free_(hs_token_t *hs_token)
 {
-  if (!hs_token) {
-    return;
-  }
-
-  tor_free(hs_token->token);
   tor_free(hs_token);
 }
 
 /** Return the circuit from the circuitmap with token <b>search_token</b>. */
 static circuit_t *
-get_circuit_with_token(hs_token_t *search_token)
+get_circuit_with_token(const hs_token_t *search_token)
 {
+  int idx;
+
   tor_assert(the_hs_circuitmap);
 
-  /* We use a dummy circuit object for the hash table search routine. */
-  circuit_t search_circ;
-  search_circ.hs_token = search_token;
-  return HT_FIND(hs_circuitmap_ht, the_hs_circuitmap, &search_circ);
+  idx = hs_circuitmap_find_slot(the_hs_circuitmap, search_token,
+                                hs_token_hash(search_token));
+  return (idx < 0) ? NULL : the_hs_circuitmap->slots[idx].circ;
 }
 
 /** Helper function that registers <b>circ</b> with <b>token</b> on the HS
@@ -165,9 +223,14 @@ hs_circuitmap_register_impl(circuit_t *circ, hs_token_t *token)
     }
   }
 
-  /* Register circuit and token to circuitmap. */
+  /* Register circuit and token to circuitmap. Keep the load under a half so
+   * probe sequences stay short. */
   circ->hs_token = token;
-  HT_INSERT(hs_circuitmap_ht, the_hs_circuitmap, circ);
+  if ((the_hs_circuitmap->n_entries + 1) * 2 > the_hs_circuitmap->n_slots) {
+    hs_circuitmap_grow(the_hs_circuitmap);
+  }
+  hs_circuitmap_place(the_hs_circuitmap, circ, token, hs_token_hash(token));
+  the_hs_circuitmap->n_entries++;
 }
 
 /** Helper function: Register <b>circ</b> of <b>type</b> on the HS
@@ -205,10 +268,9 @@ hs_circuitmap_get_circuit_impl(hs_token_type_t type,
 
   /* Check the circuitmap if we have a circuit with this token */
   {
-    hs_token_t *search_hs_token = hs_token_new(type, token_len, token);
-    tor_assert(search_hs_token);
-    found_circ = get_circuit_with_token(search_hs_token);
-    hs_token_free(search_hs_token);
+    hs_token_t search_hs_token;
+    hs_token_set(&search_hs_token, type, token_len, token);
+    found_circ = get_circuit_with_token(&search_hs_token);
   }
 
   /* Check that the circuit is useful to us */
@@ -279,11 +341,13 @@ hs_circuitmap_get_or_circuit(hs_token_type_t type,
 smartlist_t *
 hs_circuitmap_get_all_intro_circ_relay_side(void)
 {
-  circuit_t **iter;
   smartlist_t *circuit_list = smartlist_new();
 
-  HT_FOREACH(iter, hs_circuitmap_ht, the_hs_circuitmap) {
-    circuit_t *circ = *iter;
+  for (unsigned int i = 0; i < the_hs_circuitmap->n_slots; i++) {
+    circuit_t *circ = the_hs_circuitmap->slots[i].circ;
+    if (!circ) {
+      continue;
+    }
 
     /* An origin circuit or purpose is wrong or the hs token is not set to be
      * a v2 or v3 intro relay side type, we ignore the circuit. Else, we have
@@ -577,11 +641,12 @@ hs_circuitmap_remove_circuit(circuit_t *circ)
   }
 
   /* Remove circ from circuitmap */
-  circuit_t *tmp;
-  tmp = HT_REMOVE(hs_circuitmap_ht, the_hs_circuitmap, circ);
+  int idx = hs_circuitmap_find_slot(the_hs_circuitmap, circ->hs_token,
+                                    hs_token_hash(circ->hs_token));
   /* ... and ensure the removal was successful. */
-  if (tmp) {
-    tor_assert(tmp == circ);
+  if (idx >= 0) {
+    tor_assert(the_hs_circuitmap->slots[idx].circ == circ);
+    hs_circuitmap_clear_slot(the_hs_circuitmap, idx);
   } else {
     log_warn(LD_BUG, "Could not find circuit (%u) in circuitmap.",
              circ->n_circ_id);
@@ -599,7 +664,9 @@ hs_circuitmap_init(void)
   tor_assert(!the_hs_circuitmap);
 
   the_hs_circuitmap = tor_malloc_zero(sizeof(struct hs_circuitmap_ht));
-  HT_INIT(hs_circuitmap_ht, the_hs_circuitmap);
+  the_hs_circuitmap->n_slots = HS_CIRCUITMAP_INITIAL_SLOTS;
+  the_hs_circuitmap->slots = tor_calloc(the_hs_circuitmap->n_slots,
+                                        sizeof(hs_circuitmap_slot_t));
 }
 
 /** Public function: Free all memory allocated by the global HS circuitmap. */
@@ -607,7 +674,7 @@ void
 hs_circuitmap_free_all(void)
 {
   if (the_hs_circuitmap) {
-    HT_CLEAR(hs_circuitmap_ht, the_hs_circuitmap);
+    tor_free(the_hs_circuitmap->slots);
     tor_free(the_hs_circuitmap);
   }
 }
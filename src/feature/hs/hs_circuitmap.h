@@ -9,7 +9,7 @@
 #ifndef TOR_HS_CIRCUITMAP_H
 #define TOR_HS_CIRCUITMAP_H
 
-typedef HT_HEAD(hs_circuitmap_ht, circuit_t) hs_circuitmap_ht;
+typedef struct hs_circuitmap_ht hs_circuitmap_ht;
 
 typedef struct hs_token_t hs_token_t;
 struct or_circuit_t;
@@ -91,6 +91,9 @@ typedef enum {
   HS_TOKEN_REND_CLIENT_SIDE,
 } hs_token_type_t;
 
+/** Size of the largest HS token, a v3 introduction point pubkey. */
+#define HS_TOKEN_MAX_LEN 32
+
 /** Represents a token used in the HS protocol. Each such token maps to a
  *  specific introduction or rendezvous circuit. */
 struct hs_token_t {
@@ -100,8 +103,29 @@ struct hs_token_t {
   /* The size of the token (depends on the type). */
   size_t token_len;
 
-  /* The token itself. Memory allocated at runtime. */
-  uint8_t *token;
+  /* The token itself, zero padded so that every token has the same size. */
+  uint8_t token[HS_TOKEN_MAX_LEN];
+};
+
+/** A slot of the circuitmap. The token is a copy of the one of the circuit
+ * so that probing never has to follow a pointer. */
+typedef struct hs_circuitmap_slot_t {
+  /* The token of the circuit. */
+  hs_token_t token;
+  /* Hash of the token. Compared first to skip most token comparisons. */
+  unsigned int hash;
+  /* The circuit, or NULL if the slot is free. */
+  struct circuit_t *circ;
+} hs_circuitmap_slot_t;
+
+/** The HS circuitmap: an open addressing hash table with linear probing. */
+struct hs_circuitmap_ht {
+  /* Array of n_slots slots. */
+  hs_circuitmap_slot_t *slots;
+  /* Number of slots, always a power of 2. */
+  unsigned int n_slots;
+  /* Number of used slots. */
+  unsigned int n_entries;
 };
 
 #endif /* defined(HS_CIRCUITMAP_PRIVATE) */
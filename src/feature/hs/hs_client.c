@@ -51,6 +51,10 @@
  * public key to hs_client_service_authorization_t *. */
 static digest256map_t *client_auths = NULL;
 
+/** PoW state of the onion services with PoW defenses we introduced ourselves
+ * to, indexed by service identity key. */
+static digest256map_t *client_pow_states = NULL;
+
 #include "trunnel/hs/cell_introduce1.h"
 
 /** Return a human-readable string for the client fetch status code. */
@@ -579,6 +583,234 @@ find_desc_intro_point_by_legacy_id(const char *legacy_id,
   return ret_ip;
 }
 
+/** Release all storage held by the given client PoW state. */
+static void
+client_pow_state_free_(hs_client_pow_state_t *state)
+{
+  if (!state)
+    return;
+  SMARTLIST_FOREACH(state->solutions, hs_pow_solution_t *, sol,
+                    tor_free(sol));
+  smartlist_free(state->solutions);
+  tor_free(state);
+}
+#define client_pow_state_free(s) \
+  FREE_AND_NULL(hs_client_pow_state_t, client_pow_state_free_, (s))
+
+/** Helper for digest256map_free(). */
+static void
+client_pow_state_free_void(void *state)
+{
+  client_pow_state_free_(state);
+}
+
+/** Return the PoW state of the service with identity key service_pk, or NULL
+ * if we have none. If create is true, create it if needed. A state unused for
+ * HS_CLIENT_POW_STATE_LIFETIME is forgotten. */
+STATIC hs_client_pow_state_t *
+client_pow_state_get(const ed25519_public_key_t *service_pk, int create)
+{
+  hs_client_pow_state_t *state;
+  time_t now = approx_time();
+
+  tor_assert(service_pk);
+
+  if (client_pow_states == NULL) {
+    if (!create) {
+      return NULL;
+    }
+    client_pow_states = digest256map_new();
+  }
+
+  state = digest256map_get(client_pow_states, service_pk->pubkey);
+  if (state && state->last_used + HS_CLIENT_POW_STATE_LIFETIME < now &&
+      !state->precompute_pending) {
+    digest256map_remove(client_pow_states, service_pk->pubkey);
+    client_pow_state_free(state);
+  }
+  if (state == NULL && create) {
+    state = tor_malloc_zero(sizeof(*state));
+    state->solutions = smartlist_new();
+    digest256map_set(client_pow_states, service_pk->pubkey, state);
+  }
+  if (state) {
+    state->last_used = now;
+  }
+  return state;
+}
+
+/** Forget the cached solutions of state if they are not for the seed starting
+ * with seed_head, or if they expired. */
+static void
+client_pow_state_check_seed(hs_client_pow_state_t *state, uint32_t seed_head)
+{
+  if (state->seed_head == seed_head &&
+      state->expiration_time >= approx_time()) {
+    return;
+  }
+  SMARTLIST_FOREACH(state->solutions, hs_pow_solution_t *, sol,
+                    tor_free(sol));
+  smartlist_clear(state->solutions);
+  state->seed_head = seed_head;
+  state->expiration_time = 0;
+}
+
+/** Return the effort to use for our next introduction to the service with
+ * identity key service_pk, given its descriptor PoW parameters: the
+ * suggested effort, or more if the service didn't answer us at that
+ * effort. */
+uint32_t
+hs_client_pow_get_effort(const ed25519_public_key_t *service_pk,
+                         const hs_desc_pow_params_t *pow_params)
+{
+  const hs_client_pow_state_t *state;
+  uint32_t effort = pow_params->suggested_effort;
+
+  state = client_pow_state_get(service_pk, 0);
+  if (state) {
+    effort = MAX(effort, MIN(state->effort, HS_CLIENT_POW_MAX_EFFORT));
+  }
+  return effort;
+}
+
+/** Return a solution computed earlier for the current seed of the service with
+ * identity key service_pk, of at least the given effort, or NULL if we have
+ * none. The caller owns the solution. */
+hs_pow_solution_t *
+hs_client_pow_take_solution(const ed25519_public_key_t *service_pk,
+                            const hs_desc_pow_params_t *pow_params,
+                            uint32_t effort)
+{
+  hs_client_pow_state_t *state;
+
+  state = client_pow_state_get(service_pk, 0);
+  if (state == NULL) {
+    return NULL;
+  }
+  client_pow_state_check_seed(state, get_uint32(pow_params->seed));
+
+  SMARTLIST_FOREACH_BEGIN(state->solutions, hs_pow_solution_t *, sol) {
+    if (sol->effort >= effort) {
+      SMARTLIST_DEL_CURRENT_KEEPORDER(state->solutions, sol);
+      return sol;
+    }
+  } SMARTLIST_FOREACH_END(sol);
+  return NULL;
+}
+
+/** Keep a copy of pow_solution, which we never sent, for a future
+ * introduction to the service with identity key service_pk. It is valid
+ * until expiration_time. */
+void
+hs_client_pow_note_solution(const ed25519_public_key_t *service_pk,
+                            const hs_pow_solution_t *pow_solution,
+                            time_t expiration_time)
+{
+  hs_client_pow_state_t *state;
+
+  tor_assert(pow_solution);
+
+  if (expiration_time < approx_time()) {
+    return;
+  }
+  state = client_pow_state_get(service_pk, 1);
+  client_pow_state_check_seed(state, pow_solution->seed_head);
+  if (smartlist_len(state->solutions) >= HS_CLIENT_POW_MAX_CACHED_SOLUTIONS) {
+    return;
+  }
+  state->expiration_time = expiration_time;
+  smartlist_add(state->solutions,
+                tor_memdup(pow_solution, sizeof(*pow_solution)));
+}
+
+/** A solution computed ahead of time for the service with identity key
+ * service_pk is done. It is NULL if the solve failed. */
+void
+hs_client_pow_precompute_done(const ed25519_public_key_t *service_pk,
+                              const hs_pow_solution_t *pow_solution,
+                              time_t expiration_time)
+{
+  hs_client_pow_state_t *state;
+
+  /* Purged meanwhile: we don't want it anymore. */
+  state = client_pow_state_get(service_pk, 0);
+  if (state == NULL) {
+    return;
+  }
+  state->precompute_pending = 0;
+  if (pow_solution) {
+    hs_client_pow_note_solution(service_pk, pow_solution, expiration_time);
+  }
+}
+
+/** The intro circuit intro_circ is going away. If it holds a PoW solution it
+ * never sent, keep it for the next introduction to its service. */
+void
+hs_client_pow_reclaim_solution(origin_circuit_t *intro_circ)
+{
+  const hs_descriptor_t *desc;
+
+  tor_assert(intro_circ);
+
+  if (intro_circ->hs_pow_solution == NULL || intro_circ->hs_ident == NULL) {
+    return;
+  }
+  desc = hs_cache_lookup_as_client(&intro_circ->hs_ident->identity_pk);
+  if (desc && desc->encrypted_data.pow_params_present) {
+    hs_client_pow_note_solution(&intro_circ->hs_ident->identity_pk,
+                         intro_circ->hs_pow_solution,
+                         desc->encrypted_data.pow_params->expiration_time);
+  }
+  tor_free(intro_circ->hs_pow_solution);
+}
+
+/** We just sent an INTRODUCE1 cell with a PoW solution to the service with
+ * identity key service_pk. If we keep coming back to it, compute the
+ * solution for the next introduction ahead of time. */
+static void
+client_pow_note_introduced(const ed25519_public_key_t *service_pk,
+                           const hs_desc_pow_params_t *pow_params)
+{
+  hs_client_pow_state_t *state = client_pow_state_get(service_pk, 1);
+
+  state->n_introductions++;
+  client_pow_state_check_seed(state, get_uint32(pow_params->seed));
+  if (state->n_introductions < HS_CLIENT_POW_PRECOMPUTE_MIN_INTROS ||
+      state->precompute_pending || smartlist_len(state->solutions) > 0) {
+    return;
+  }
+  if (hs_pow_queue_precompute(service_pk, pow_params,
+                              hs_client_pow_get_effort(service_pk,
+                                                       pow_params)) == 0) {
+    state->precompute_pending = 1;
+  }
+}
+
+/** The rendezvous circuit rend_circ, for which we sent an INTRODUCE1 cell,
+ * joined with the service if success is true. Else, the service never
+ * rendezvoused with us. Adjust the effort of our next introduction. */
+STATIC void
+client_pow_note_rendezvous(const origin_circuit_t *rend_circ, int success)
+{
+  hs_client_pow_state_t *state;
+  uint32_t effort = rend_circ->hs_pow_effort;
+
+  if (!rend_circ->hs_with_pow_circ || rend_circ->hs_ident == NULL) {
+    return;
+  }
+  state = client_pow_state_get(&rend_circ->hs_ident->identity_pk, 1);
+  if (success) {
+    /* It worked, stick to it. */
+    state->effort = effort;
+  } else {
+    /* Not enough to get through the service queue in time. Clamp before
+     * doubling so that a huge effort can't overflow. */
+    state->effort = MIN(MAX(effort, 1), HS_CLIENT_POW_MAX_EFFORT / 2) * 2;
+    log_info(LD_REND, "Service didn't rendezvous with us at PoW effort %u. "
+                      "Using %u next time.", effort, state->effort);
+  }
+}
+
 /** Send an INTRODUCE1 cell along the intro circuit and populate the rend
  * circuit identifier with the needed key material for the e2e encryption.
  * Return 0 on success, -1 if there is a transient error such that an action
@@ -592,7 +824,8 @@ send_introduce1(origin_circuit_t *intro_circ,
   char onion_address[HS_SERVICE_ADDR_LEN_BASE32 + 1];
   const ed25519_public_key_t *service_identity_pk = NULL;
   const hs_desc_intro_point_t *ip;
-  hs_pow_solution_t *pow_solution = NULL;
+  const hs_pow_solution_t *pow_solution = NULL;
+  uint32_t pow_effort = 0;
 
   tor_assert(rend_circ);
   if (intro_circ_is_ok(intro_circ) < 0) {
@@ -641,7 +874,6 @@ send_introduce1(origin_circuit_t *intro_circ,
   /* HRPR: If the descriptor contains PoW parameters then the service is
    * expecting a PoW solution in the INTRODUCE cell, which we solve here. */
   if (desc->encrypted_data.pow_params_present) {
-    pow_solution = tor_malloc_zero(sizeof(hs_pow_solution_t));
     log_err(LD_REND, "PoW params present in descriptor.");
     /* If the PoW params in the descriptor have expired then maybe we have a
      * cached version, so we should refetch and try again. HRPR TODO is this
@@ -652,15 +884,47 @@ send_introduce1(origin_circuit_t *intro_circ,
       goto tran_err;
     }
 
-    if (solve_pow(desc->encrypted_data.pow_params, pow_solution)) {
-      log_err(LD_REND, "PoW solve returned non zero.");
+    /* A solution for a seed the service no longer advertises is useless. */
+    if (intro_circ->hs_pow_solution &&
+        intro_circ->hs_pow_solution->seed_head !=
+          get_uint32(desc->encrypted_data.pow_params->seed)) {
+      tor_free(intro_circ->hs_pow_solution);
+    }
+
+    /* We might have a solution for this seed that we never sent, e.g.
+     * because the intro circuit it was for went away. */
+    if (intro_circ->hs_pow_solution == NULL) {
+      pow_effort = hs_client_pow_get_effort(service_identity_pk,
+                                        desc->encrypted_data.pow_params);
+      intro_circ->hs_pow_solution =
+        hs_client_pow_take_solution(service_identity_pk,
+                                    desc->encrypted_data.pow_params,
+                                    pow_effort);
+    }
+
+    /* Solving can take a long time so it is done by a cpuworker. Once it
+     * replies, the pending streams are retried and we end up here again with
+     * the solution. */
+    if (intro_circ->hs_pow_solution == NULL) {
+      if (hs_pow_queue_work(intro_circ, desc->encrypted_data.pow_params,
+                            pow_effort)) {
+        log_warn(LD_REND, "Unable to queue PoW solve for service %s.",
+                 safe_str_client(onion_address));
+        goto perm_err;
+      }
+      log_info(LD_REND, "Solving PoW for service %s before sending the "
+               "INTRODUCE1 cell on circuit %u.",
+               safe_str_client(onion_address),
+               TO_CIRCUIT(intro_circ)->n_circ_id);
       goto tran_err;
     }
+    pow_solution = intro_circ->hs_pow_solution;
 
     /* Set flag to reflect that the HS we are attempting to rendezvous has PoW
      * defenses enabled, and as such we will need to be more lenient with
      * timing out while waiting for the circuit to be built. */
     rend_circ->hs_with_pow_circ = 1;
+    rend_circ->hs_pow_effort = pow_solution->effort;
 
   } else {
     log_err(LD_REND, "PoW params not present in descriptor.");
@@ -686,6 +950,14 @@ send_introduce1(origin_circuit_t *intro_circ,
     goto tran_err;
   }
 
+  /* The service has seen this solution now: never use it again. */
+  if (pow_solution) {
+    client_pow_note_introduced(service_identity_pk,
+                               desc->encrypted_data.pow_params);
+    tor_free(intro_circ->hs_pow_solution);
+    pow_solution = NULL;
+  }
+
   /* Cell has been sent successfully. Copy the introduction point
    * authentication and encryption key in the rendezvous circuit identifier so
    * we can compute the ntor keys when we receive the RENDEZVOUS2 cell. */
@@ -1294,6 +1566,7 @@ handle_rendezvous2(origin_circuit_t *circ, const uint8_t *payload,
     goto err;
   }
   /* Success. Hidden service connection finalized! */
+  client_pow_note_rendezvous(circ, 1);
   ret = 0;
   goto end;
 
@@ -1519,6 +1792,16 @@ client_dir_fetch_200(dir_connection_t *dir_conn,
   /* We got something: Try storing it in the cache. */
   decode_status = hs_cache_store_as_client(body,
                                            &dir_conn->hs_ident->identity_pk);
+  /* A lazily stored descriptor only had its plaintext layer decoded. We
+   * have connections waiting on it so decrypt it now to learn if it's
+   * usable. Descriptors fetched without any, such as with HSFETCH, stay
+   * encrypted until needed. */
+  if (decode_status == HS_DESC_DECODE_OK &&
+      get_options()->ClientOnionLazyDecryption &&
+      smartlist_len(entry_conns) > 0) {
+    decode_status =
+      hs_cache_decrypt_as_client(&dir_conn->hs_ident->identity_pk);
+  }
   switch (decode_status) {
   case HS_DESC_DECODE_OK:
   case HS_DESC_DECODE_NEED_CLIENT_AUTH:
@@ -1922,6 +2205,11 @@ hs_client_circuit_cleanup_on_close(const circuit_t *circ)
   has_timed_out =
     (circ->marked_for_close_orig_reason == END_CIRC_REASON_TIMEOUT);
 
+  /* The service got our introduction but never rendezvoused with us. */
+  if (circ->purpose == CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED) {
+    client_pow_note_rendezvous(CONST_TO_ORIGIN_CIRCUIT(circ), 0);
+  }
+
   switch (circ->purpose) {
   case CIRCUIT_PURPOSE_C_ESTABLISH_REND:
   case CIRCUIT_PURPOSE_C_REND_READY:
@@ -2065,6 +2353,50 @@ hs_client_decode_descriptor(const char *desc_str,
   return ret;
 }
 
+/** Decode only the plaintext layer of the encoded descriptor <b>desc_str</b>
+ * into <b>plaintext</b>, and validate its signing key certificate against
+ * the current blinded key of <b>service_identity_pk</b>. The encrypted layers
+ * are left untouched; this is what the client cache keeps for a descriptor
+ * it decrypts lazily.
+ *
+ * Return HS_DESC_DECODE_OK on success else an error status. The content of
+ * plaintext must be freed by the caller in both cases. */
+hs_desc_decode_status_t
+hs_client_decode_descriptor_plaintext(
+                     const char *desc_str,
+                     const ed25519_public_key_t *service_identity_pk,
+                     hs_desc_plaintext_data_t *plaintext)
+{
+  hs_desc_decode_status_t ret;
+  ed25519_public_key_t blinded_pubkey;
+
+  tor_assert(desc_str);
+  tor_assert(service_identity_pk);
+  tor_assert(plaintext);
+
+  ret = hs_desc_decode_plaintext(desc_str, plaintext);
+  if (ret != HS_DESC_DECODE_OK) {
+    goto end;
+  }
+
+  hs_build_blinded_pubkey(service_identity_pk, NULL, 0,
+                          hs_get_time_period_num(0), &blinded_pubkey);
+  /* Same cross certification as in hs_client_decode_descriptor(). When the
+   * descriptor is fully decoded, a wrong blinded key would also fail the
+   * decryption but here we never get that far. */
+  if (tor_cert_checksig(plaintext->signing_key_cert,
+                        &blinded_pubkey, approx_time()) < 0) {
+    log_warn(LD_GENERAL, "Descriptor signing key certificate signature "
+             "doesn't validate with computed blinded key: %s",
+             tor_cert_describe_signature_status(plaintext->signing_key_cert));
+    ret = HS_DESC_DECODE_GENERIC_ERROR;
+    goto end;
+  }
+
+ end:
+  return ret;
+}
+
 /** Return true iff there are at least one usable intro point in the service
  * descriptor desc. */
 int
@@ -2607,6 +2939,7 @@ hs_client_free_all(void)
   /* Purge the hidden service request cache. */
   hs_purge_last_hid_serv_requests();
   client_service_authorization_free_all();
+  digest256map_free(client_pow_states, client_pow_state_free_void);
 }
 
 /** Purge all potentially remotely-detectable state held in the hidden
@@ -2625,6 +2958,10 @@ hs_client_purge_state(void)
   hs_purge_last_hid_serv_requests();
   /* Purge ephemeral client authorization. */
   purge_ephemeral_client_auth();
+  /* Purge the PoW efforts and solutions we kept per service. */
+  digest256map_free(client_pow_states, client_pow_state_free_void);
+  /* Purge the blinded keys of the services we looked up. */
+  hs_purge_blinded_key_cache();
 
   log_info(LD_REND, "Hidden service client state has been purged.");
 }
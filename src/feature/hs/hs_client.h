@@ -78,6 +78,53 @@ typedef struct hs_client_service_authorization_t {
   int flags;
 } hs_client_service_authorization_t;
 
+/** Upper bound on the PoW effort we back off to when a service doesn't
+ * answer our introductions. */
+#define HS_CLIENT_POW_MAX_EFFORT 10000
+/** Number of solutions we keep ahead of time for a single service. */
+#define HS_CLIENT_POW_MAX_CACHED_SOLUTIONS 4
+/** Once we introduced ourselves this many times to a service, keep a
+ * solution computed ahead of time for the next introduction. */
+#define HS_CLIENT_POW_PRECOMPUTE_MIN_INTROS 2
+/** We forget the PoW state of a service we haven't used for this long, in
+ * seconds. */
+#define HS_CLIENT_POW_STATE_LIFETIME (60*60)
+
+/** Client-side PoW state for one onion service with PoW defenses. */
+typedef struct hs_client_pow_state_t {
+  /** Effort to solve for next, at least the suggested one. It is the last
+   * effort that got us a rendezvous, raised every time the service doesn't
+   * rendezvous with us. */
+  uint32_t effort;
+  /** Solutions we computed but never sent, all for the seed starting with
+   * seed_head and valid until expiration_time. The service never saw them,
+   * so they aren't replays. */
+  smartlist_t *solutions;
+  uint32_t seed_head;
+  time_t expiration_time;
+  /** Number of INTRODUCE1 cells with a PoW solution we sent to the
+   * service. */
+  uint32_t n_introductions;
+  /** Last time we used this state. */
+  time_t last_used;
+  /** True iff we are computing a solution ahead of time. */
+  unsigned int precompute_pending : 1;
+} hs_client_pow_state_t;
+
+uint32_t hs_client_pow_get_effort(const ed25519_public_key_t *service_pk,
+                                  const hs_desc_pow_params_t *pow_params);
+hs_pow_solution_t *hs_client_pow_take_solution(
+                                  const ed25519_public_key_t *service_pk,
+                                  const hs_desc_pow_params_t *pow_params,
+                                  uint32_t effort);
+void hs_client_pow_note_solution(const ed25519_public_key_t *service_pk,
+                                 const hs_pow_solution_t *pow_solution,
+                                 time_t expiration_time);
+void hs_client_pow_precompute_done(const ed25519_public_key_t *service_pk,
+                                   const hs_pow_solution_t *pow_solution,
+                                   time_t expiration_time);
+void hs_client_pow_reclaim_solution(origin_circuit_t *intro_circ);
+
 hs_client_register_auth_status_t
 hs_client_register_auth_credentials(hs_client_service_authorization_t *creds);
 
@@ -104,6 +151,10 @@ hs_desc_decode_status_t hs_client_decode_descriptor(
                      const char *desc_str,
                      const ed25519_public_key_t *service_identity_pk,
                      hs_descriptor_t **desc);
+hs_desc_decode_status_t hs_client_decode_descriptor_plaintext(
+                     const char *desc_str,
+                     const ed25519_public_key_t *service_identity_pk,
+                     hs_desc_plaintext_data_t *plaintext);
 int hs_client_any_intro_points_usable(const ed25519_public_key_t *service_pk,
                                       const hs_descriptor_t *desc);
 int hs_client_refetch_hsdesc(const ed25519_public_key_t *identity_pk);
@@ -168,6 +219,11 @@ STATIC void retry_all_socks_conn_waiting_for_desc(void);
 
 STATIC void purge_ephemeral_client_auth(void);
 
+STATIC hs_client_pow_state_t *
+client_pow_state_get(const ed25519_public_key_t *service_pk, int create);
+STATIC void client_pow_note_rendezvous(const origin_circuit_t *rend_circ,
+                                       int success);
+
 #ifdef TOR_UNIT_TESTS
 
 STATIC void set_hs_client_auths_map(digest256map_t *map);
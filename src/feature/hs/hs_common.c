@@ -25,6 +25,7 @@
 #include "feature/hs/hs_dos.h"
 #include "feature/hs/hs_ob.h"
 #include "feature/hs/hs_ident.h"
+#include "feature/hs/hs_pow.h"
 #include "feature/hs/hs_service.h"
 #include "feature/hs_common/shared_random_client.h"
 #include "feature/nodelist/describe.h"
@@ -109,69 +110,154 @@ add_unix_port(smartlist_t *ports, rend_service_port_config_t *p)
 
 #endif /* defined(HAVE_SYS_UN_H) */
 
-/** Helper function: The key is a digest that we compare to a node_t object
- * current hsdir_index. */
+/** One entry of an HSDir hash ring: a copy of the node's hsdir index for
+ * that ring, so that searching the ring never dereferences a node_t. */
+typedef struct hs_hsdir_ring_entry_t {
+  uint8_t hsdir_index[DIGEST256_LEN];
+  const node_t *node;
+} hs_hsdir_ring_entry_t;
+
+/** An HSDir hash ring: every usable HSDir of a consensus, sorted by one of
+ * their hsdir indices, stored in a contiguous array. */
+struct hs_hsdir_ring_t {
+  hs_hsdir_ring_entry_t *entries;
+  int n_entries;
+  int capacity;
+};
+
+/** Which of the node_t hsdir indices a cached hash ring is sorted by. */
+typedef enum {
+  HSDIR_RING_FETCH        = 0,
+  HSDIR_RING_STORE_FIRST  = 1,
+  HSDIR_RING_STORE_SECOND = 2,
+} hsdir_ring_type_t;
+#define HSDIR_RING_N_TYPES 3
+
+/** Hash rings built from the consensus <b>hsdir_rings_consensus</b>, lazily
+ * per type. They are dropped by hs_hsdir_rings_invalidate() whenever the
+ * nodelist changes in a way that can alter the set of HSDirs or their
+ * indices, which in practice happens on consensus or descriptor changes. */
+static hs_hsdir_ring_t *hsdir_rings[HSDIR_RING_N_TYPES];
+/** The consensus the cached rings were built from, and its valid-after time
+ * so that a new consensus reusing the same address isn't mistaken for it. */
+static const networkstatus_t *hsdir_rings_consensus = NULL;
+static time_t hsdir_rings_valid_after = 0;
+
+/** Helper for qsort(): order two ring entries by hsdir index. */
 static int
-compare_digest_to_fetch_hsdir_index(const void *_key, const void **_member)
+compare_hsdir_ring_entries_(const void *a, const void *b)
 {
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index.fetch, DIGEST256_LEN);
+  const hs_hsdir_ring_entry_t *e1 = a, *e2 = b;
+  /* The hsdir indices are computed from public data so they don't need a
+   * constant time comparison. */
+  return fast_memcmp(e1->hsdir_index, e2->hsdir_index, DIGEST256_LEN);
 }
 
-/** Helper function: The key is a digest that we compare to a node_t object
- * next hsdir_index. */
-static int
-compare_digest_to_store_first_hsdir_index(const void *_key,
-                                          const void **_member)
+/** Allocate and return a new empty hash ring with room for <b>capacity</b>
+ * nodes. */
+hs_hsdir_ring_t *
+hs_hsdir_ring_new(int capacity)
 {
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index.store_first, DIGEST256_LEN);
+  hs_hsdir_ring_t *ring = tor_malloc_zero(sizeof(*ring));
+  ring->capacity = MAX(capacity, 1);
+  ring->entries = tor_calloc(ring->capacity, sizeof(*ring->entries));
+  return ring;
 }
 
-/** Helper function: The key is a digest that we compare to a node_t object
- * next hsdir_index. */
-static int
-compare_digest_to_store_second_hsdir_index(const void *_key,
-                                          const void **_member)
+/** Free the given hash ring. The nodes are not owned by it. */
+void
+hs_hsdir_ring_free_(hs_hsdir_ring_t *ring)
 {
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index.store_second, DIGEST256_LEN);
+  if (!ring) {
+    return;
+  }
+  tor_free(ring->entries);
+  tor_free(ring);
 }
 
-/** Helper function: Compare two node_t objects current hsdir_index. */
-static int
-compare_node_fetch_hsdir_index(const void **a, const void **b)
+/** Add <b>node</b> to <b>ring</b> at position <b>hsdir_index</b>. The ring
+ * must be sorted with hs_hsdir_ring_sort() before being searched. */
+void
+hs_hsdir_ring_add(hs_hsdir_ring_t *ring, const uint8_t *hsdir_index,
+                  const node_t *node)
 {
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index.fetch,
-                    node2->hsdir_index.fetch,
-                    DIGEST256_LEN);
+  tor_assert(ring);
+  tor_assert(hsdir_index);
+  tor_assert(node);
+
+  if (ring->n_entries == ring->capacity) {
+    ring->capacity *= 2;
+    ring->entries = tor_reallocarray(ring->entries, ring->capacity,
+                                     sizeof(*ring->entries));
+  }
+  memcpy(ring->entries[ring->n_entries].hsdir_index, hsdir_index,
+         DIGEST256_LEN);
+  ring->entries[ring->n_entries].node = node;
+  ring->n_entries++;
 }
 
-/** Helper function: Compare two node_t objects next hsdir_index. */
-static int
-compare_node_store_first_hsdir_index(const void **a, const void **b)
+/** Sort the nodes of <b>ring</b> by hsdir index. */
+void
+hs_hsdir_ring_sort(hs_hsdir_ring_t *ring)
 {
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index.store_first,
-                    node2->hsdir_index.store_first,
-                    DIGEST256_LEN);
+  tor_assert(ring);
+  qsort(ring->entries, ring->n_entries, sizeof(*ring->entries),
+        compare_hsdir_ring_entries_);
 }
 
-/** Helper function: Compare two node_t objects next hsdir_index. */
-static int
-compare_node_store_second_hsdir_index(const void **a, const void **b)
+/** Return the number of nodes in <b>ring</b>. */
+int
+hs_hsdir_ring_len(const hs_hsdir_ring_t *ring)
+{
+  tor_assert(ring);
+  return ring->n_entries;
+}
+
+/** Return the node at position <b>idx</b> of <b>ring</b>. */
+const node_t *
+hs_hsdir_ring_get_node(const hs_hsdir_ring_t *ring, int idx)
 {
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index.store_second,
-                    node2->hsdir_index.store_second,
-                    DIGEST256_LEN);
+  tor_assert(ring);
+  tor_assert(idx >= 0 && idx < ring->n_entries);
+  return ring->entries[idx].node;
+}
+
+/** Return the position in the sorted <b>ring</b> of the first node whose
+ * hsdir index is greater than or equal to <b>hs_index</b>, wrapping around
+ * to 0 if there is none. The ring must not be empty. */
+int
+hs_hsdir_ring_find_idx(const hs_hsdir_ring_t *ring, const uint8_t *hs_index)
+{
+  int lo = 0, hi;
+
+  tor_assert(ring);
+  tor_assert(ring->n_entries > 0);
+  tor_assert(hs_index);
+
+  hi = ring->n_entries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fast_memcmp(ring->entries[mid].hsdir_index, hs_index,
+                    DIGEST256_LEN) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo == ring->n_entries) ? 0 : lo;
+}
+
+/** Drop every cached HSDir hash ring. This must be called whenever the
+ * nodelist changes the set of HSDirs, their descriptors or their hsdir
+ * indices, and whenever a node_t is freed. */
+void
+hs_hsdir_rings_invalidate(void)
+{
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    hs_hsdir_ring_free(hsdir_rings[i]);
+  }
+  hsdir_rings_consensus = NULL;
+  hsdir_rings_valid_after = 0;
 }
 
 /** Allocate and return a string containing the path to filename in directory.
@@ -676,11 +762,32 @@ get_second_cached_disaster_srv(void)
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
+/** Build the nonce used in the blinding key parameter of the time period
+ * period_num of length period_length, and put it in nonce_out. The
+ * construction is as follow:
+ *    N = "key-blind" || INT_8(period_num) || INT_8(period_length) */
+static void
+build_blinded_key_nonce(uint64_t period_num, uint64_t period_length,
+                        uint8_t *nonce_out)
+{
+  size_t offset = 0;
+
+  tor_assert(nonce_out);
+
+  memcpy(nonce_out, HS_KEYBLIND_NONCE_PREFIX, HS_KEYBLIND_NONCE_PREFIX_LEN);
+  offset += HS_KEYBLIND_NONCE_PREFIX_LEN;
+  set_uint64(nonce_out + offset, tor_htonll(period_num));
+  offset += sizeof(uint64_t);
+  set_uint64(nonce_out + offset, tor_htonll(period_length));
+  offset += sizeof(uint64_t);
+  tor_assert(offset == HS_KEYBLIND_NONCE_LEN);
+}
+
 /** When creating a blinded key, we need a parameter which construction is as
  * follow: H(pubkey | [secret] | ed25519-basepoint | nonce).
  *
- * The nonce has a pre-defined format which uses the time period number
- * period_num and the start of the period in second start_time_period.
+ * The nonce has a pre-defined format, see build_blinded_key_nonce(), which
+ * uses the time period number and the length of the period.
  *
  * The secret of size secret_len is optional meaning that it can be NULL and
  * thus will be ignored for the param construction.
@@ -689,27 +796,15 @@ get_second_cached_disaster_srv(void)
 static void
 build_blinded_key_param(const ed25519_public_key_t *pubkey,
                         const uint8_t *secret, size_t secret_len,
-                        uint64_t period_num, uint64_t period_length,
-                        uint8_t *param_out)
+                        const uint8_t *nonce, uint8_t *param_out)
 {
-  size_t offset = 0;
   const char blind_str[] = "Derive temporary signing key";
-  uint8_t nonce[HS_KEYBLIND_NONCE_LEN];
   crypto_digest_t *digest;
 
   tor_assert(pubkey);
+  tor_assert(nonce);
   tor_assert(param_out);
 
-  /* Create the nonce N. The construction is as follow:
-   *    N = "key-blind" || INT_8(period_num) || INT_8(period_length) */
-  memcpy(nonce, HS_KEYBLIND_NONCE_PREFIX, HS_KEYBLIND_NONCE_PREFIX_LEN);
-  offset += HS_KEYBLIND_NONCE_PREFIX_LEN;
-  set_uint64(nonce + offset, tor_htonll(period_num));
-  offset += sizeof(uint64_t);
-  set_uint64(nonce + offset, tor_htonll(period_length));
-  offset += sizeof(uint64_t);
-  tor_assert(offset == HS_KEYBLIND_NONCE_LEN);
-
   /* Generate the parameter h and the construction is as follow:
    *    h = H(BLIND_STRING | pubkey | [secret] | ed25519-basepoint | N) */
   digest = crypto_digest256_new(DIGEST_SHA3_256);
@@ -721,13 +816,11 @@ build_blinded_key_param(const ed25519_public_key_t *pubkey,
   }
   crypto_digest_add_bytes(digest, str_ed25519_basepoint,
                           strlen(str_ed25519_basepoint));
-  crypto_digest_add_bytes(digest, (char *) nonce, sizeof(nonce));
+  crypto_digest_add_bytes(digest, (char *) nonce, HS_KEYBLIND_NONCE_LEN);
 
   /* Extract digest and put it in the param. */
   crypto_digest_get_digest(digest, (char *) param_out, DIGEST256_LEN);
   crypto_digest_free(digest);
-
-  memwipe(nonce, 0, sizeof(nonce));
 }
 
 /** Using an ed25519 public key and version to build the checksum of an
@@ -1042,10 +1135,176 @@ hs_build_address(const ed25519_public_key_t *key, uint8_t version,
   tor_assert(hs_address_is_valid(addr_out));
 }
 
+/** How many time periods the blinded key cache remembers per identity key.
+ * Clients and services only use the previous, current and next ones, and we
+ * keep one spare slot for the rollover. */
+#define BLINDED_KEY_CACHE_N_PERIODS 4
+/** Maximum number of identity keys in the blinded key cache. When it's full,
+ * new blinded keys are not cached until the next cleanup. */
+#define BLINDED_KEY_CACHE_MAX_ENTRIES 8192
+
+/** The blinded public keys we know of an identity key. */
+typedef struct blinded_key_cache_entry_t {
+  struct {
+    uint64_t time_period_num;
+    uint64_t period_length;
+    ed25519_public_key_t blinded_pk;
+    unsigned int is_set : 1;
+  } periods[BLINDED_KEY_CACHE_N_PERIODS];
+  /** Slot to overwrite when all of them are in use. */
+  int next_slot;
+} blinded_key_cache_entry_t;
+
+/** Cache of blinded public keys (without secret) indexed by identity public
+ * key. Deriving a blinded public key costs an ed25519 point multiplication
+ * which clients would otherwise redo on every descriptor lookup, and which
+ * both sides redo for the same service and time period. */
+static digest256map_t *blinded_key_cache = NULL;
+
+/** Lookup the blinded key of <b>pk</b> for the time period
+ * <b>time_period_num</b> of length <b>period_length</b>. Return true and set
+ * <b>blinded_pk_out</b> if found, else return false. */
+static bool
+blinded_key_cache_lookup(const ed25519_public_key_t *pk,
+                         uint64_t time_period_num, uint64_t period_length,
+                         ed25519_public_key_t *blinded_pk_out)
+{
+  const blinded_key_cache_entry_t *entry;
+
+  if (!blinded_key_cache) {
+    return false;
+  }
+  entry = digest256map_get(blinded_key_cache, pk->pubkey);
+  if (!entry) {
+    return false;
+  }
+  for (int i = 0; i < BLINDED_KEY_CACHE_N_PERIODS; i++) {
+    if (entry->periods[i].is_set &&
+        entry->periods[i].time_period_num == time_period_num &&
+        entry->periods[i].period_length == period_length) {
+      memcpy(blinded_pk_out, &entry->periods[i].blinded_pk,
+             sizeof(*blinded_pk_out));
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Remember that <b>blinded_pk</b> is the blinded key of <b>pk</b> for the
+ * time period <b>time_period_num</b> of length <b>period_length</b>. */
+static void
+blinded_key_cache_store(const ed25519_public_key_t *pk,
+                        uint64_t time_period_num, uint64_t period_length,
+                        const ed25519_public_key_t *blinded_pk)
+{
+  blinded_key_cache_entry_t *entry;
+  int slot = -1;
+
+  if (!blinded_key_cache) {
+    blinded_key_cache = digest256map_new();
+  }
+  entry = digest256map_get(blinded_key_cache, pk->pubkey);
+  if (!entry) {
+    if (digest256map_size(blinded_key_cache) >=
+        BLINDED_KEY_CACHE_MAX_ENTRIES) {
+      return;
+    }
+    entry = tor_malloc_zero(sizeof(*entry));
+    digest256map_set(blinded_key_cache, pk->pubkey, entry);
+  }
+
+  for (int i = 0; i < BLINDED_KEY_CACHE_N_PERIODS; i++) {
+    if (!entry->periods[i].is_set) {
+      if (slot < 0) {
+        slot = i;
+      }
+    } else if (entry->periods[i].time_period_num == time_period_num &&
+               entry->periods[i].period_length == period_length) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    slot = entry->next_slot;
+    entry->next_slot = (slot + 1) % BLINDED_KEY_CACHE_N_PERIODS;
+  }
+  entry->periods[slot].time_period_num = time_period_num;
+  entry->periods[slot].period_length = period_length;
+  memcpy(&entry->periods[slot].blinded_pk, blinded_pk,
+         sizeof(*blinded_pk));
+  entry->periods[slot].is_set = 1;
+}
+
+/** Remove from the blinded key cache every key of a time period older than
+ * the previous one. This is called periodically. */
+void
+hs_clean_blinded_key_cache(void)
+{
+  uint64_t oldest_tp;
+
+  if (!blinded_key_cache) {
+    return;
+  }
+
+  oldest_tp = hs_get_previous_time_period_num(0);
+  DIGEST256MAP_FOREACH_MODIFY(blinded_key_cache, key,
+                              blinded_key_cache_entry_t *, entry) {
+    int n_set = 0;
+    for (int i = 0; i < BLINDED_KEY_CACHE_N_PERIODS; i++) {
+      if (entry->periods[i].time_period_num < oldest_tp) {
+        memset(&entry->periods[i], 0, sizeof(entry->periods[i]));
+      }
+      n_set += entry->periods[i].is_set;
+    }
+    if (n_set == 0) {
+      MAP_DEL_CURRENT(key);
+      tor_free(entry);
+    }
+  } DIGEST256MAP_FOREACH_END;
+}
+
+#ifdef TOR_UNIT_TESTS
+
+/** Return the blinded key cache. Only used by unittests. */
+STATIC digest256map_t *
+get_blinded_key_cache(void)
+{
+  return blinded_key_cache;
+}
+
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Helper for digest256map_free(). */
+static void
+blinded_key_cache_entry_free_void(void *entry)
+{
+  memwipe(entry, 0, sizeof(blinded_key_cache_entry_t));
+  tor_free(entry);
+}
+
+/** Release the blinded key cache. */
+static void
+blinded_key_cache_free_all(void)
+{
+  digest256map_free(blinded_key_cache, blinded_key_cache_entry_free_void);
+}
+
+/** Forget every blinded key we know. Its keys tell which onion services we
+ * visited, so clients drop it along with their other onion service state,
+ * e.g. on NEWNYM. */
+void
+hs_purge_blinded_key_cache(void)
+{
+  blinded_key_cache_free_all();
+}
+
 /** From a given ed25519 public key pk and an optional secret, compute a
  * blinded public key and put it in blinded_pk_out. This is only useful to
  * the client side because the client only has access to the identity public
- * key of the service. */
+ * key of the service.
+ *
+ * Without a secret, the blinded key is taken from, or added to, the blinded
+ * key cache. */
 void
 hs_build_blinded_pubkey(const ed25519_public_key_t *pk,
                         const uint8_t *secret, size_t secret_len,
@@ -1054,42 +1313,91 @@ hs_build_blinded_pubkey(const ed25519_public_key_t *pk,
 {
   /* Our blinding key API requires a 32 bytes parameter. */
   uint8_t param[DIGEST256_LEN];
+  uint8_t nonce[HS_KEYBLIND_NONCE_LEN];
+  uint64_t period_length;
 
   tor_assert(pk);
   tor_assert(blinded_pk_out);
   tor_assert(!fast_mem_is_zero((char *) pk, ED25519_PUBKEY_LEN));
 
-  build_blinded_key_param(pk, secret, secret_len,
-                          time_period_num, get_time_period_length(), param);
+  period_length = get_time_period_length();
+  if (!secret && blinded_key_cache_lookup(pk, time_period_num, period_length,
+                                          blinded_pk_out)) {
+    return;
+  }
+
+  build_blinded_key_nonce(time_period_num, period_length, nonce);
+  build_blinded_key_param(pk, secret, secret_len, nonce, param);
   ed25519_public_blind(blinded_pk_out, pk, param);
+  if (!secret) {
+    blinded_key_cache_store(pk, time_period_num, period_length,
+                            blinded_pk_out);
+  }
 
   memwipe(param, 0, sizeof(param));
+  memwipe(nonce, 0, sizeof(nonce));
 }
 
 /** From a given ed25519 keypair kp and an optional secret, compute a blinded
  * keypair for the current time period and put it in blinded_kp_out. This is
  * only useful by the service side because the client doesn't have access to
- * the identity secret key. */
+ * the identity secret key.
+ *
+ * Only the blinded public key is put in the blinded key cache, never the
+ * secret key. */
 void
 hs_build_blinded_keypair(const ed25519_keypair_t *kp,
                          const uint8_t *secret, size_t secret_len,
                          uint64_t time_period_num,
                          ed25519_keypair_t *blinded_kp_out)
+{
+  hs_build_blinded_keypairs(&kp, 1, secret, secret_len, time_period_num,
+                            blinded_kp_out);
+}
+
+/** Compute the blinded keypairs of the <b>n_kps</b> keypairs of <b>kps</b>
+ * for the time period <b>time_period_num</b> in one pass, using the optional
+ * <b>secret</b>, and put them in <b>blinded_kps_out</b> which must have room
+ * for <b>n_kps</b> keypairs.
+ *
+ * The key blinding parameter nonce only depends on the time period so it is
+ * computed once for the whole batch. */
+void
+hs_build_blinded_keypairs(const ed25519_keypair_t **kps, int n_kps,
+                          const uint8_t *secret, size_t secret_len,
+                          uint64_t time_period_num,
+                          ed25519_keypair_t *blinded_kps_out)
 {
   /* Our blinding key API requires a 32 bytes parameter. */
   uint8_t param[DIGEST256_LEN];
+  uint8_t nonce[HS_KEYBLIND_NONCE_LEN];
+  uint64_t period_length;
+
+  tor_assert(kps);
+  tor_assert(n_kps >= 0);
+  tor_assert(blinded_kps_out);
 
-  tor_assert(kp);
-  tor_assert(blinded_kp_out);
-  /* Extra safety. A zeroed key is bad. */
-  tor_assert(!fast_mem_is_zero((char *) &kp->pubkey, ED25519_PUBKEY_LEN));
-  tor_assert(!fast_mem_is_zero((char *) &kp->seckey, ED25519_SECKEY_LEN));
+  period_length = get_time_period_length();
+  build_blinded_key_nonce(time_period_num, period_length, nonce);
 
-  build_blinded_key_param(&kp->pubkey, secret, secret_len,
-                          time_period_num, get_time_period_length(), param);
-  ed25519_keypair_blind(blinded_kp_out, kp, param);
+  for (int i = 0; i < n_kps; i++) {
+    const ed25519_keypair_t *kp = kps[i];
+
+    tor_assert(kp);
+    /* Extra safety. A zeroed key is bad. */
+    tor_assert(!fast_mem_is_zero((char *) &kp->pubkey, ED25519_PUBKEY_LEN));
+    tor_assert(!fast_mem_is_zero((char *) &kp->seckey, ED25519_SECKEY_LEN));
+
+    build_blinded_key_param(&kp->pubkey, secret, secret_len, nonce, param);
+    ed25519_keypair_blind(&blinded_kps_out[i], kp, param);
+    if (!secret) {
+      blinded_key_cache_store(&kp->pubkey, time_period_num, period_length,
+                              &blinded_kps_out[i].pubkey);
+    }
+  }
 
   memwipe(param, 0, sizeof(param));
+  memwipe(nonce, 0, sizeof(nonce));
 }
 
 /** Return true if we are currently in the time segment between a new time
@@ -1332,6 +1640,61 @@ node_has_hsdir_index(const node_t *node)
   return 1;
 }
 
+/** Return the hash ring of type <b>type</b> for the consensus <b>c</b>,
+ * building it if it isn't cached. The returned ring may be empty. */
+static const hs_hsdir_ring_t *
+get_hsdir_ring(const networkstatus_t *c, hsdir_ring_type_t type)
+{
+  hs_hsdir_ring_t *ring;
+
+  tor_assert(c);
+
+  if (hsdir_rings_consensus != c ||
+      hsdir_rings_valid_after != c->valid_after) {
+    hs_hsdir_rings_invalidate();
+    hsdir_rings_consensus = c;
+    hsdir_rings_valid_after = c->valid_after;
+  }
+  if (hsdir_rings[type]) {
+    return hsdir_rings[type];
+  }
+
+  ring = hs_hsdir_ring_new(smartlist_len(c->routerstatus_list));
+
+  /* Add every node_t that support HSDir v3 for which we do have a valid
+   * hsdir_index already computed for them for this consensus. */
+  SMARTLIST_FOREACH_BEGIN(c->routerstatus_list, const routerstatus_t *, rs) {
+    const node_t *n = node_get_mutable_by_id(rs->identity_digest);
+    const uint8_t *hsdir_index;
+    tor_assert(n);
+    if (!node_supports_v3_hsdir(n) || !rs->is_hs_dir) {
+      continue;
+    }
+    if (!node_has_hsdir_index(n)) {
+      log_info(LD_GENERAL, "Node %s was found without hsdir index.",
+               node_describe(n));
+      continue;
+    }
+    switch (type) {
+    case HSDIR_RING_FETCH:
+      hsdir_index = n->hsdir_index.fetch;
+      break;
+    case HSDIR_RING_STORE_FIRST:
+      hsdir_index = n->hsdir_index.store_first;
+      break;
+    case HSDIR_RING_STORE_SECOND:
+    default:
+      hsdir_index = n->hsdir_index.store_second;
+      break;
+    }
+    hs_hsdir_ring_add(ring, hsdir_index, n);
+  } SMARTLIST_FOREACH_END(rs);
+
+  hs_hsdir_ring_sort(ring);
+  hsdir_rings[type] = ring;
+  return ring;
+}
+
 /** For a given blinded key and time period number, get the responsible HSDir
  * and put their routerstatus_t object in the responsible_dirs list. If
  * 'use_second_hsdir_index' is true, use the second hsdir_index of the node_t
@@ -1340,24 +1703,20 @@ node_has_hsdir_index(const node_t *node)
  * can't fail but it is possible that the responsible_dirs list contains fewer
  * nodes than expected.
  *
- * This function goes over the latest consensus routerstatus list and sorts it
- * by their node_t hsdir_index then does a binary search to find the closest
- * node. All of this makes it a bit CPU intensive so use it wisely. */
+ * The HSDirs of the latest consensus are kept in hash rings sorted by their
+ * node_t hsdir_index, which are only rebuilt when the nodelist changes, and
+ * a binary search finds the closest node for each replica. */
 void
 hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
                           uint64_t time_period_num, int use_second_hsdir_index,
                           int for_fetching, smartlist_t *responsible_dirs)
 {
-  smartlist_t *sorted_nodes;
-  /* The compare function used for the smartlist bsearch. We have two
-   * different depending on is_next_period. */
-  int (*cmp_fct)(const void *, const void **);
+  const hs_hsdir_ring_t *ring;
+  hsdir_ring_type_t ring_type;
 
   tor_assert(blinded_pk);
   tor_assert(responsible_dirs);
 
-  sorted_nodes = smartlist_new();
-
   /* Make sure we actually have a live consensus */
   networkstatus_t *c =
     networkstatus_get_reasonably_live_consensus(approx_time(),
@@ -1365,54 +1724,32 @@ hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
   if (!c || smartlist_len(c->routerstatus_list) == 0) {
       log_warn(LD_REND, "No live consensus so we can't get the responsible "
                "hidden service directories.");
-      goto done;
+      return;
   }
 
   /* Ensure the nodelist is fresh, since it contains the HSDir indices. */
   nodelist_ensure_freshness(c);
 
-  /* Add every node_t that support HSDir v3 for which we do have a valid
-   * hsdir_index already computed for them for this consensus. */
-  {
-    SMARTLIST_FOREACH_BEGIN(c->routerstatus_list, const routerstatus_t *, rs) {
-      /* Even though this node_t object won't be modified and should be const,
-       * we can't add const object in a smartlist_t. */
-      node_t *n = node_get_mutable_by_id(rs->identity_digest);
-      tor_assert(n);
-      if (node_supports_v3_hsdir(n) && rs->is_hs_dir) {
-        if (!node_has_hsdir_index(n)) {
-          log_info(LD_GENERAL, "Node %s was found without hsdir index.",
-                   node_describe(n));
-          continue;
-        }
-        smartlist_add(sorted_nodes, n);
-      }
-    } SMARTLIST_FOREACH_END(rs);
-  }
-  if (smartlist_len(sorted_nodes) == 0) {
-    log_warn(LD_REND, "No nodes found to be HSDir or supporting v3.");
-    goto done;
-  }
-
-  /* First thing we have to do is sort all node_t by hsdir_index. The
-   * is_next_period tells us if we want the current or the next one. Set the
-   * bsearch compare function also while we are at it. */
+  /* The ring to use depends on if we fetch, or on which descriptor we store
+   * when we are uploading. */
   if (for_fetching) {
-    smartlist_sort(sorted_nodes, compare_node_fetch_hsdir_index);
-    cmp_fct = compare_digest_to_fetch_hsdir_index;
+    ring_type = HSDIR_RING_FETCH;
   } else if (use_second_hsdir_index) {
-    smartlist_sort(sorted_nodes, compare_node_store_second_hsdir_index);
-    cmp_fct = compare_digest_to_store_second_hsdir_index;
+    ring_type = HSDIR_RING_STORE_SECOND;
   } else {
-    smartlist_sort(sorted_nodes, compare_node_store_first_hsdir_index);
-    cmp_fct = compare_digest_to_store_first_hsdir_index;
+    ring_type = HSDIR_RING_STORE_FIRST;
+  }
+  ring = get_hsdir_ring(c, ring_type);
+  if (hs_hsdir_ring_len(ring) == 0) {
+    log_warn(LD_REND, "No nodes found to be HSDir or supporting v3.");
+    return;
   }
 
   /* For all replicas, we'll select a set of HSDirs using the consensus
-   * parameters and the sorted list. The replica starting at value 1 is
+   * parameters and the sorted ring. The replica starting at value 1 is
    * defined by the specification. */
   for (int replica = 1; replica <= hs_get_hsdir_n_replicas(); replica++) {
-    int idx, start, found, n_added = 0;
+    int idx, start, n_added = 0;
     uint8_t hs_index[DIGEST256_LEN] = {0};
     /* Number of node to add to the responsible dirs list depends on if we are
      * trying to fetch or store. A client always fetches. */
@@ -1421,35 +1758,25 @@ hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
 
     /* Get the index that we should use to select the node. */
     hs_build_hs_index(replica, blinded_pk, time_period_num, hs_index);
-    /* The compare function pointer has been set correctly earlier. */
-    start = idx = smartlist_bsearch_idx(sorted_nodes, hs_index, cmp_fct,
-                                        &found);
-    /* Getting the length of the list if no member is greater than the key we
-     * are looking for so start at the first element. */
-    if (idx == smartlist_len(sorted_nodes)) {
-      start = idx = 0;
-    }
+    start = idx = hs_hsdir_ring_find_idx(ring, hs_index);
     while (n_added < n_to_add) {
-      const node_t *node = smartlist_get(sorted_nodes, idx);
+      const node_t *node = hs_hsdir_ring_get_node(ring, idx);
       /* If the node has already been selected which is possible between
        * replicas, the specification says to skip over. */
       if (!smartlist_contains(responsible_dirs, node->rs)) {
         smartlist_add(responsible_dirs, node->rs);
         ++n_added;
       }
-      if (++idx == smartlist_len(sorted_nodes)) {
-        /* Wrap if we've reached the end of the list. */
+      if (++idx == hs_hsdir_ring_len(ring)) {
+        /* Wrap if we've reached the end of the ring. */
         idx = 0;
       }
       if (idx == start) {
-        /* We've gone over the whole list, stop and avoid infinite loop. */
+        /* We've gone over the whole ring, stop and avoid infinite loop. */
         break;
       }
     }
   }
-
- done:
-  smartlist_free(sorted_nodes);
 }
 
 /*********************** HSDir request tracking ***************************/
@@ -1828,6 +2155,7 @@ hs_init(void)
   hs_circuitmap_init();
   hs_service_init();
   hs_cache_init();
+  hs_pow_init();
 }
 
 /** Release and cleanup all memory of the HS subsystem (all version). This is
@@ -1840,6 +2168,9 @@ hs_free_all(void)
   hs_cache_free_all();
   hs_client_free_all();
   hs_ob_free_all();
+  hs_pow_free_all();
+  hs_hsdir_rings_invalidate();
+  blinded_key_cache_free_all();
 }
 
 /** For the given origin circuit circ, decrement the number of rendezvous
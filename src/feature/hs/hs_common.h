@@ -192,6 +192,13 @@ void hs_build_blinded_keypair(const struct ed25519_keypair_t *kp,
                               const uint8_t *secret, size_t secret_len,
                               uint64_t time_period_num,
                               struct ed25519_keypair_t *kp_out);
+void hs_build_blinded_keypairs(const struct ed25519_keypair_t **kps,
+                               int n_kps,
+                               const uint8_t *secret, size_t secret_len,
+                               uint64_t time_period_num,
+                               struct ed25519_keypair_t *kps_out);
+void hs_clean_blinded_key_cache(void);
+void hs_purge_blinded_key_cache(void);
 int hs_service_requires_uptime_circ(const smartlist_t *ports);
 
 void rend_data_free_(rend_data_t *data);
@@ -243,6 +250,22 @@ int32_t hs_get_hsdir_n_replicas(void);
 int32_t hs_get_hsdir_spread_fetch(void);
 int32_t hs_get_hsdir_spread_store(void);
 
+/** A sorted array of HSDirs, searchable by hs_index. See hs_common.c. */
+typedef struct hs_hsdir_ring_t hs_hsdir_ring_t;
+
+hs_hsdir_ring_t *hs_hsdir_ring_new(int capacity);
+void hs_hsdir_ring_free_(hs_hsdir_ring_t *ring);
+#define hs_hsdir_ring_free(ring) \
+  FREE_AND_NULL(hs_hsdir_ring_t, hs_hsdir_ring_free_, (ring))
+void hs_hsdir_ring_add(hs_hsdir_ring_t *ring, const uint8_t *hsdir_index,
+                       const node_t *node);
+void hs_hsdir_ring_sort(hs_hsdir_ring_t *ring);
+int hs_hsdir_ring_len(const hs_hsdir_ring_t *ring);
+const node_t *hs_hsdir_ring_get_node(const hs_hsdir_ring_t *ring, int idx);
+int hs_hsdir_ring_find_idx(const hs_hsdir_ring_t *ring,
+                           const uint8_t *hs_index);
+void hs_hsdir_rings_invalidate(void);
+
 void hs_get_responsible_hsdirs(const struct ed25519_public_key_t *blinded_pk,
                               uint64_t time_period_num,
                               int use_second_hsdir_index,
@@ -288,6 +311,7 @@ STATIC uint64_t get_time_period_length(void);
 
 STATIC uint8_t *get_first_cached_disaster_srv(void);
 STATIC uint8_t *get_second_cached_disaster_srv(void);
+STATIC digest256map_t *get_blinded_key_cache(void);
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
@@ -277,6 +277,12 @@ config_has_invalid_options(const config_line_t *line_,
     "HiddenServiceEnableIntroDoSBurstPerSec",
     "HiddenServiceOnionBalanceInstance",
     "HiddenServicePoWDefensesEnabled", /* HRPR */
+    "HiddenServicePoWQueueRate",
+    "HiddenServicePoWQueueBurst",
+    "HiddenServicePoWQueueMaxDepth",
+    "HiddenServicePoWQueueMaxAge",
+    "HiddenServiceIntroduce2RatePerSec",
+    "HiddenServiceIntroduce2BurstPerSec",
     NULL /* End marker. */
   };
 
@@ -357,6 +363,25 @@ config_validate_service(const hs_service_config_t *config)
     goto invalid;
   }
 
+  /* PoW rendezvous queue validation values. */
+  if (config->has_pow_defenses_enabled &&
+      (config->pow_queue_burst < config->pow_queue_rate)) {
+    log_warn(LD_CONFIG, "Hidden service PoW queue burst (%" PRIu32 ") can "
+                        "not be smaller than the rate value (%" PRIu32 ").",
+             config->pow_queue_burst, config->pow_queue_rate);
+    goto invalid;
+  }
+
+  /* INTRODUCE2 rate limiting validation values. */
+  if (config->introduce2_rate_per_sec &&
+      (config->introduce2_burst_per_sec < config->introduce2_rate_per_sec)) {
+    log_warn(LD_CONFIG, "Hidden service INTRODUCE2 burst (%" PRIu32 ") can "
+                        "not be smaller than the rate value (%" PRIu32 ").",
+             config->introduce2_burst_per_sec,
+             config->introduce2_rate_per_sec);
+    goto invalid;
+  }
+
   /* Valid. */
   return 0;
  invalid:
@@ -433,6 +458,50 @@ config_service_v3(const hs_opts_t *hs_opts,
   log_err(LD_REND, "Parsed config, PoW defenses are %s.",
           config->has_pow_defenses_enabled ? "enabled" : "disabled");
 
+  /* Dequeue rate and burst of the PoW rendezvous queue. */
+  if (CHECK_OOB(hs_opts, HiddenServicePoWQueueRate,
+                HS_CONFIG_V3_POW_QUEUE_RATE_MIN,
+                HS_CONFIG_V3_POW_QUEUE_RATE_MAX)) {
+    goto err;
+  }
+  config->pow_queue_rate = hs_opts->HiddenServicePoWQueueRate;
+  if (CHECK_OOB(hs_opts, HiddenServicePoWQueueBurst,
+                HS_CONFIG_V3_POW_QUEUE_BURST_MIN,
+                HS_CONFIG_V3_POW_QUEUE_BURST_MAX)) {
+    goto err;
+  }
+  config->pow_queue_burst = hs_opts->HiddenServicePoWQueueBurst;
+
+  /* Bounds of the PoW rendezvous queue. */
+  if (CHECK_OOB(hs_opts, HiddenServicePoWQueueMaxDepth,
+                HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_MIN,
+                HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_MAX)) {
+    goto err;
+  }
+  config->pow_queue_max_depth = hs_opts->HiddenServicePoWQueueMaxDepth;
+  if (CHECK_OOB(hs_opts, HiddenServicePoWQueueMaxAge,
+                HS_CONFIG_V3_POW_QUEUE_MAX_AGE_MIN,
+                HS_CONFIG_V3_POW_QUEUE_MAX_AGE_MAX)) {
+    goto err;
+  }
+  config->pow_queue_max_age = hs_opts->HiddenServicePoWQueueMaxAge;
+
+  /* Rate and burst of the INTRODUCE2 cells we decrypt per intro point. */
+  if (CHECK_OOB(hs_opts, HiddenServiceIntroduce2RatePerSec,
+                HS_CONFIG_V3_INTRO2_RATE_PER_SEC_MIN,
+                HS_CONFIG_V3_INTRO2_RATE_PER_SEC_MAX)) {
+    goto err;
+  }
+  config->introduce2_rate_per_sec =
+    hs_opts->HiddenServiceIntroduce2RatePerSec;
+  if (CHECK_OOB(hs_opts, HiddenServiceIntroduce2BurstPerSec,
+                HS_CONFIG_V3_INTRO2_BURST_PER_SEC_MIN,
+                HS_CONFIG_V3_INTRO2_BURST_PER_SEC_MAX)) {
+    goto err;
+  }
+  config->introduce2_burst_per_sec =
+    hs_opts->HiddenServiceIntroduce2BurstPerSec;
+
   /* We do not load the key material for the service at this stage. This is
    * done later once tor can confirm that it is in a running state. */
 
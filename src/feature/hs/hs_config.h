@@ -27,7 +27,29 @@
 /* HRPR Default values for the HS anti-DoS PoW defenses. */
 #define HS_CONFIG_V3_POW_DEFENSES_DEFAULT 0
 #define HS_CONFIG_V3_POW_DEFENSES_MIN_EFFORT_DEFAULT 100 // HRPR TODO Temp
-#define HS_CONFIG_V3_POW_DEFENSES_SVC_BOTTOM_CAPACITY_DEFAULT 100
+/* Default values for the rendezvous priority queue of the PoW defenses. The
+ * MIN/MAX are inclusive. */
+#define HS_CONFIG_V3_POW_QUEUE_RATE_DEFAULT 250
+#define HS_CONFIG_V3_POW_QUEUE_RATE_MIN 1
+#define HS_CONFIG_V3_POW_QUEUE_RATE_MAX INT32_MAX
+#define HS_CONFIG_V3_POW_QUEUE_BURST_DEFAULT 2500
+#define HS_CONFIG_V3_POW_QUEUE_BURST_MIN 1
+#define HS_CONFIG_V3_POW_QUEUE_BURST_MAX INT32_MAX
+#define HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_DEFAULT 16384
+#define HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_MIN 2
+#define HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_MAX INT32_MAX
+#define HS_CONFIG_V3_POW_QUEUE_MAX_AGE_DEFAULT 30
+#define HS_CONFIG_V3_POW_QUEUE_MAX_AGE_MIN 1
+#define HS_CONFIG_V3_POW_QUEUE_MAX_AGE_MAX 3600
+/* Values for the INTRODUCE2 rate limiting done by the service before
+ * decrypting the cells. A rate of 0 disables it. The MIN/MAX are
+ * inclusive. */
+#define HS_CONFIG_V3_INTRO2_RATE_PER_SEC_DEFAULT 0
+#define HS_CONFIG_V3_INTRO2_RATE_PER_SEC_MIN 0
+#define HS_CONFIG_V3_INTRO2_RATE_PER_SEC_MAX INT32_MAX
+#define HS_CONFIG_V3_INTRO2_BURST_PER_SEC_DEFAULT 200
+#define HS_CONFIG_V3_INTRO2_BURST_PER_SEC_MIN 1
+#define HS_CONFIG_V3_INTRO2_BURST_PER_SEC_MAX INT32_MAX
 
 /* API */
 
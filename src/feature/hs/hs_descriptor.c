@@ -199,15 +199,16 @@ build_mac(const uint8_t *mac_key, size_t mac_key_len,
   crypto_digest_free(digest);
 }
 
-/** Using a secret data and a given descriptor object, build the secret
- * input needed for the KDF.
+/** Using a secret data and the subcredential and revision counter of a
+ * descriptor, build the secret input needed for the KDF.
  *
  * secret_input = SECRET_DATA | subcredential | INT_8(revision_counter)
  *
  * Then, set the newly allocated buffer in secret_input_out and return the
  * length of the buffer. */
 static size_t
-build_secret_input(const hs_descriptor_t *desc,
+build_secret_input(const hs_subcredential_t *subcredential,
+                   uint64_t revision_counter,
                    const uint8_t *secret_data,
                    size_t secret_data_len,
                    uint8_t **secret_input_out)
@@ -216,7 +217,7 @@ build_secret_input(const hs_descriptor_t *desc,
   size_t secret_input_len = secret_data_len + DIGEST256_LEN + sizeof(uint64_t);
   uint8_t *secret_input = NULL;
 
-  tor_assert(desc);
+  tor_assert(subcredential);
   tor_assert(secret_data);
   tor_assert(secret_input_out);
 
@@ -226,11 +227,10 @@ build_secret_input(const hs_descriptor_t *desc,
   memcpy(secret_input, secret_data, secret_data_len);
   offset += secret_data_len;
   /* Copy subcredential. */
-  memcpy(secret_input + offset, desc->subcredential.subcred, DIGEST256_LEN);
+  memcpy(secret_input + offset, subcredential->subcred, DIGEST256_LEN);
   offset += DIGEST256_LEN;
   /* Copy revision counter value. */
-  set_uint64(secret_input + offset,
-             tor_htonll(desc->plaintext_data.revision_counter));
+  set_uint64(secret_input + offset, tor_htonll(revision_counter));
   offset += sizeof(uint64_t);
   tor_assert(secret_input_len == offset);
 
@@ -242,7 +242,8 @@ build_secret_input(const hs_descriptor_t *desc,
 /** Do the KDF construction and put the resulting data in key_out which is of
  * key_out_len length. It uses SHAKE-256 as specified in the spec. */
 static void
-build_kdf_key(const hs_descriptor_t *desc,
+build_kdf_key(const hs_subcredential_t *subcredential,
+              uint64_t revision_counter,
               const uint8_t *secret_data,
               size_t secret_data_len,
               const uint8_t *salt, size_t salt_len,
@@ -253,14 +254,15 @@ build_kdf_key(const hs_descriptor_t *desc,
   size_t secret_input_len;
   crypto_xof_t *xof;
 
-  tor_assert(desc);
+  tor_assert(subcredential);
   tor_assert(secret_data);
   tor_assert(salt);
   tor_assert(key_out);
 
   /* Build the secret input for the KDF computation. */
-  secret_input_len = build_secret_input(desc, secret_data,
-                                        secret_data_len, &secret_input);
+  secret_input_len = build_secret_input(subcredential, revision_counter,
+                                        secret_data, secret_data_len,
+                                        &secret_input);
 
   xof = crypto_xof_new();
   /* Feed our KDF. [SHAKE it like a polaroid picture --Yawning]. */
@@ -284,11 +286,13 @@ build_kdf_key(const hs_descriptor_t *desc,
   tor_free(secret_input);
 }
 
-/** Using the given descriptor, secret data, and salt, run it through our
- * KDF function and then extract a secret key in key_out, the IV in iv_out
- * and MAC in mac_out. This function can't fail. */
+/** Using the given descriptor subcredential and revision counter, secret
+ * data, and salt, run it through our KDF function and then extract a secret
+ * key in key_out, the IV in iv_out and MAC in mac_out. This function can't
+ * fail. */
 static void
-build_secret_key_iv_mac(const hs_descriptor_t *desc,
+build_secret_key_iv_mac(const hs_subcredential_t *subcredential,
+                        uint64_t revision_counter,
                         const uint8_t *secret_data,
                         size_t secret_data_len,
                         const uint8_t *salt, size_t salt_len,
@@ -300,14 +304,14 @@ build_secret_key_iv_mac(const hs_descriptor_t *desc,
   size_t offset = 0;
   uint8_t kdf_key[HS_DESC_ENCRYPTED_KDF_OUTPUT_LEN];
 
-  tor_assert(desc);
+  tor_assert(subcredential);
   tor_assert(secret_data);
   tor_assert(salt);
   tor_assert(key_out);
   tor_assert(iv_out);
   tor_assert(mac_out);
 
-  build_kdf_key(desc, secret_data, secret_data_len,
+  build_kdf_key(subcredential, revision_counter, secret_data, secret_data_len,
                 salt, salt_len, kdf_key, sizeof(kdf_key),
                 is_superencrypted_layer);
   /* Copy the bytes we need for both the secret key and IV. */
@@ -608,12 +612,14 @@ build_encrypted(const uint8_t *key, const uint8_t *iv, const char *plaintext,
   return encrypted_len;
 }
 
-/** Encrypt the given <b>plaintext</b> buffer using <b>desc</b> and
- * <b>secret_data</b> to get the keys. Set encrypted_out with the encrypted
- * data and return the length of it. <b>is_superencrypted_layer</b> is set
- * if this is the outer encrypted layer of the descriptor. */
+/** Encrypt the given <b>plaintext</b> buffer using the descriptor
+ * <b>subcredential</b> and <b>revision_counter</b> and <b>secret_data</b> to
+ * get the keys. Set encrypted_out with the encrypted data and return the
+ * length of it. <b>is_superencrypted_layer</b> is set if this is the outer
+ * encrypted layer of the descriptor. */
 static size_t
-encrypt_descriptor_data(const hs_descriptor_t *desc,
+encrypt_descriptor_data(const hs_subcredential_t *subcredential,
+                        uint64_t revision_counter,
                         const uint8_t *secret_data,
                         size_t secret_data_len,
                         const char *plaintext,
@@ -626,7 +632,7 @@ encrypt_descriptor_data(const hs_descriptor_t *desc,
   uint8_t secret_key[HS_DESC_ENCRYPTED_KEY_LEN], secret_iv[CIPHER_IV_LEN];
   uint8_t mac_key[DIGEST256_LEN], mac[DIGEST256_LEN];
 
-  tor_assert(desc);
+  tor_assert(subcredential);
   tor_assert(secret_data);
   tor_assert(plaintext);
   tor_assert(encrypted_out);
@@ -636,7 +642,8 @@ encrypt_descriptor_data(const hs_descriptor_t *desc,
 
   /* KDF construction resulting in a key from which the secret key, IV and MAC
    * key are extracted which is what we need for the encryption. */
-  build_secret_key_iv_mac(desc, secret_data, secret_data_len,
+  build_secret_key_iv_mac(subcredential, revision_counter,
+                          secret_data, secret_data_len,
                           salt, sizeof(salt),
                           secret_key, sizeof(secret_key),
                           secret_iv, sizeof(secret_iv),
@@ -816,16 +823,19 @@ get_inner_encrypted_layer_plaintext(const hs_descriptor_t *desc)
     }
   }
 
-  /* Build the introduction point(s) section. */
+  /* Build the introduction point(s) section. An intro point that was part of
+   * a previous encoding of the descriptor is not encoded again. */
   SMARTLIST_FOREACH_BEGIN(desc->encrypted_data.intro_points,
-                          const hs_desc_intro_point_t *, ip) {
-    char *encoded_ip = encode_intro_point(&desc->plaintext_data.signing_pubkey,
-                                          ip);
-    if (encoded_ip == NULL) {
+                          hs_desc_intro_point_t *, ip) {
+    if (ip->encoded == NULL) {
+      ip->encoded = encode_intro_point(&desc->plaintext_data.signing_pubkey,
+                                       ip);
+    }
+    if (ip->encoded == NULL) {
       log_err(LD_BUG, "HS desc intro point is malformed.");
       goto err;
     }
-    smartlist_add(lines, encoded_ip);
+    smartlist_add_strdup(lines, ip->encoded);
   } SMARTLIST_FOREACH_END(ip);
 
   /* Build the entire encrypted data section into one encoded plaintext and
@@ -839,14 +849,13 @@ get_inner_encrypted_layer_plaintext(const hs_descriptor_t *desc)
   return encoded_str;
 }
 
-/** Create the middle layer of the descriptor, which includes the client auth
- * data and the encrypted inner layer (provided as a base64 string at
- * <b>layer2_b64_ciphertext</b>). Return a newly-allocated string with the
- * layer plaintext. It's the responsibility of the caller to free the returned
- * string. Can not fail. */
+/** Create the middle layer of the descriptor up to its encrypted section,
+ * which includes the client auth data. Return a newly-allocated string with
+ * the layer plaintext, to which the encrypted inner layer is appended by
+ * hs_desc_encode_job_run(). It's the responsibility of the caller to wipe
+ * and free the returned string. Can not fail. */
 static char *
-get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
-                                    const char *layer2_b64_ciphertext)
+get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc)
 {
   char *layer1_str = NULL;
   smartlist_t *lines = smartlist_new();
@@ -875,16 +884,6 @@ get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
     smartlist_add(lines, auth_client_lines);
   }
 
-  /* create encrypted section */
-  {
-    smartlist_add_asprintf(lines,
-                           "%s\n"
-                           "-----BEGIN MESSAGE-----\n"
-                           "%s"
-                           "-----END MESSAGE-----",
-                           str_encrypted, layer2_b64_ciphertext);
-  }
-
   layer1_str = smartlist_join_strings(lines, "", 0, NULL);
 
   /* We need to memwipe all lines because it contains the ephemeral key */
@@ -896,13 +895,15 @@ get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
 }
 
 /** Encrypt <b>encoded_str</b> into an encrypted blob and then base64 it before
- * returning it. <b>desc</b> is provided to derive the encryption
- * keys. <b>secret_data</b> is also proved to derive the encryption keys.
+ * returning it. The descriptor <b>subcredential</b> and
+ * <b>revision_counter</b> are provided to derive the encryption keys.
+ * <b>secret_data</b> is also proved to derive the encryption keys.
  * <b>is_superencrypted_layer</b> is set if <b>encoded_str</b> is the
  * middle (superencrypted) layer of the descriptor. It's the responsibility of
  * the caller to free the returned string. */
 static char *
-encrypt_desc_data_and_base64(const hs_descriptor_t *desc,
+encrypt_desc_data_and_base64(const hs_subcredential_t *subcredential,
+                             uint64_t revision_counter,
                              const uint8_t *secret_data,
                              size_t secret_data_len,
                              const char *encoded_str,
@@ -912,7 +913,8 @@ encrypt_desc_data_and_base64(const hs_descriptor_t *desc,
   ssize_t enc_b64_len, ret_len, enc_len;
   char *encrypted_blob = NULL;
 
-  enc_len = encrypt_descriptor_data(desc, secret_data, secret_data_len,
+  enc_len = encrypt_descriptor_data(subcredential, revision_counter,
+                                    secret_data, secret_data_len,
                                     encoded_str, &encrypted_blob,
                                     is_superencrypted_layer);
   /* Get the encoded size plus a NUL terminating byte. */
@@ -975,31 +977,57 @@ build_secret_data(const ed25519_public_key_t *blinded_pubkey,
   return secret_data_len;
 }
 
-/** Generate and encode the superencrypted portion of <b>desc</b>. This also
- * involves generating the encrypted portion of the descriptor, and performing
- * the superencryption. A newly allocated NUL-terminated string pointer
- * containing the encrypted encoded blob is put in encrypted_blob_out. Return 0
- * on success else a negative value. */
-static int
-encode_superencrypted_data(const hs_descriptor_t *desc,
-                           const uint8_t *descriptor_cookie,
-                           char **encrypted_blob_out)
+/** A v3 descriptor of ours with its plaintext sections encoded, ready to be
+ * encrypted and signed. It holds copies of everything it needs from the
+ * descriptor so this can be done off the main thread. */
+struct hs_desc_encode_job_t {
+  /** The plaintext section of the descriptor up to the revision counter line
+   * included. */
+  char *plaintext_head;
+  /** Plaintext of the inner layer: the intro points and PoW parameters. */
+  char *layer2_str;
+  /** Plaintext of the middle layer, up to its encrypted section. */
+  char *layer1_head;
+  /** Secret data the inner layer is encrypted with: the blinded key and the
+   * descriptor cookie if client authorization is enabled. */
+  uint8_t *secret_data;
+  size_t secret_data_len;
+  /** Key material the layers are encrypted and the descriptor signed with. */
+  ed25519_public_key_t blinded_pubkey;
+  hs_subcredential_t subcredential;
+  uint64_t revision_counter;
+  ed25519_keypair_t signing_kp;
+  /** The descriptor must be smaller than this once encoded. */
+  size_t max_encoded_len;
+};
+
+/** Build the encoding job of the v3 descriptor desc, to be signed by
+ * signing_kp. Return it or NULL on error. */
+static hs_desc_encode_job_t *
+desc_encode_v3_job_new(const hs_descriptor_t *desc,
+                       const ed25519_keypair_t *signing_kp,
+                       const uint8_t *descriptor_cookie)
 {
-  int ret = -1;
-  uint8_t *secret_data = NULL;
-  size_t secret_data_len = 0;
+  hs_desc_encode_job_t *job = NULL;
   char *layer2_str = NULL;
-  char *layer2_b64_ciphertext = NULL;
-  char *layer1_str = NULL;
-  char *layer1_b64_ciphertext = NULL;
+  char *encoded_cert = NULL;
+  smartlist_t *lines = NULL;
 
   tor_assert(desc);
-  tor_assert(encrypted_blob_out);
+  tor_assert(signing_kp);
+  tor_assert(desc->plaintext_data.version == 3);
 
-  /* Func logic: We first create the inner layer of the descriptor (layer2).
-   * We then encrypt it and use it to create the middle layer of the descriptor
-   * (layer1).  Finally we superencrypt the middle layer and return it to our
-   * caller. */
+  if (desc->plaintext_data.signing_key_cert->cert_type
+      != CERT_TYPE_SIGNING_HS_DESC) {
+    log_err(LD_BUG, "HS descriptor signing key has an unexpected cert type "
+            "(%d)", (int) desc->plaintext_data.signing_key_cert->cert_type);
+    goto err;
+  }
+  if (tor_cert_encode_ed22519(desc->plaintext_data.signing_key_cert,
+                              &encoded_cert) < 0) {
+    /* The function will print error logs. */
+    goto err;
+  }
 
   /* Create inner descriptor layer */
   layer2_str = get_inner_encrypted_layer_plaintext(desc);
@@ -1007,137 +1035,157 @@ encode_superencrypted_data(const hs_descriptor_t *desc,
     goto err;
   }
 
-  secret_data_len = build_secret_data(&desc->plaintext_data.blinded_pubkey,
-                                      descriptor_cookie,
-                                      &secret_data);
+  job = tor_malloc_zero(sizeof(*job));
+  job->layer2_str = layer2_str;
+  job->layer1_head = get_outer_encrypted_layer_plaintext(desc);
+  job->secret_data_len =
+    build_secret_data(&desc->plaintext_data.blinded_pubkey,
+                      descriptor_cookie, &job->secret_data);
+  memcpy(&job->blinded_pubkey, &desc->plaintext_data.blinded_pubkey,
+         sizeof(job->blinded_pubkey));
+  memcpy(&job->subcredential, &desc->subcredential,
+         sizeof(job->subcredential));
+  job->revision_counter = desc->plaintext_data.revision_counter;
+  memcpy(&job->signing_kp, signing_kp, sizeof(job->signing_kp));
+  job->max_encoded_len = hs_cache_get_max_descriptor_size();
 
-  /* Encrypt and b64 the inner layer */
-  layer2_b64_ciphertext =
-    encrypt_desc_data_and_base64(desc, secret_data, secret_data_len,
-                                 layer2_str, 0);
-  if (!layer2_b64_ciphertext) {
-    goto err;
-  }
+  /* Build the non-encrypted values. */
+  lines = smartlist_new();
+  /* Create the hs descriptor line. */
+  smartlist_add_asprintf(lines, "%s %" PRIu32, str_hs_desc,
+                         desc->plaintext_data.version);
+  /* Add the descriptor lifetime line (in minutes). */
+  smartlist_add_asprintf(lines, "%s %" PRIu32, str_lifetime,
+                         desc->plaintext_data.lifetime_sec / 60);
+  /* Create the descriptor certificate line. */
+  smartlist_add_asprintf(lines, "%s\n%s", str_desc_cert, encoded_cert);
+  /* Create the revision counter line. */
+  smartlist_add_asprintf(lines, "%s %" PRIu64, str_rev_counter,
+                         desc->plaintext_data.revision_counter);
+  job->plaintext_head = smartlist_join_strings(lines, "\n", 1, NULL);
+  SMARTLIST_FOREACH(lines, char *, l, tor_free(l));
+  smartlist_free(lines);
 
-  /* Now create middle descriptor layer given the inner layer */
-  layer1_str = get_outer_encrypted_layer_plaintext(desc,layer2_b64_ciphertext);
-  if (!layer1_str) {
-    goto err;
-  }
+ err:
+  tor_free(encoded_cert);
+  return job;
+}
 
-  /* Encrypt and base64 the middle layer */
-  layer1_b64_ciphertext =
-    encrypt_desc_data_and_base64(desc,
-                                 desc->plaintext_data.blinded_pubkey.pubkey,
-                                 ED25519_PUBKEY_LEN,
-                                 layer1_str, 1);
-  if (!layer1_b64_ciphertext) {
-    goto err;
+/** Release all storage held by the given encoding job. */
+void
+hs_desc_encode_job_free_(hs_desc_encode_job_t *job)
+{
+  if (!job) {
+    return;
   }
+  tor_free(job->plaintext_head);
+  tor_free(job->layer2_str);
+  if (job->layer1_head) {
+    memwipe(job->layer1_head, 0, strlen(job->layer1_head));
+    tor_free(job->layer1_head);
+  }
+  if (job->secret_data) {
+    memwipe(job->secret_data, 0, job->secret_data_len);
+    tor_free(job->secret_data);
+  }
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
 
-  /* Success! */
-  ret = 0;
-
- err:
-  memwipe(secret_data, 0, secret_data_len);
-  tor_free(secret_data);
-  tor_free(layer1_str);
-  tor_free(layer2_str);
-  tor_free(layer2_b64_ciphertext);
+/** Return a new encoding job for desc, to be signed with signing_kp and
+ * encrypted with descriptor_cookie if not NULL, or NULL on error.
+ *
+ * The plaintext sections are encoded right away so desc can change or go
+ * away afterwards. The encryption and signing, which is most of the work, is
+ * done by hs_desc_encode_job_run() which is safe to call from any thread. */
+hs_desc_encode_job_t *
+hs_desc_encode_job_new(const hs_descriptor_t *desc,
+                       const ed25519_keypair_t *signing_kp,
+                       const uint8_t *descriptor_cookie)
+{
+  tor_assert(desc);
 
-  *encrypted_blob_out = layer1_b64_ciphertext;
-  return ret;
+  /* Version 3 is the only one we know how to encode. */
+  if (desc->plaintext_data.version != 3) {
+    return NULL;
+  }
+  return desc_encode_v3_job_new(desc, signing_kp, descriptor_cookie);
 }
 
-/** Encode a v3 HS descriptor. Return 0 on success and set encoded_out to the
- * newly allocated string of the encoded descriptor. On error, -1 is returned
- * and encoded_out is untouched. */
-static int
-desc_encode_v3(const hs_descriptor_t *desc,
-               const ed25519_keypair_t *signing_kp,
-               const uint8_t *descriptor_cookie,
-               char **encoded_out)
+/** Encrypt and sign the descriptor of job. Return 0 on success and set
+ * encoded_out to the newly allocated string of the encoded descriptor. On
+ * error, -1 is returned and encoded_out is untouched. */
+int
+hs_desc_encode_job_run(const hs_desc_encode_job_t *job, char **encoded_out)
 {
   int ret = -1;
+  char *layer2_b64_ciphertext = NULL;
+  char *layer1_str = NULL;
+  char *layer1_b64_ciphertext = NULL;
+  char *signed_str = NULL;
   char *encoded_str = NULL;
-  size_t encoded_len;
-  smartlist_t *lines = smartlist_new();
 
-  tor_assert(desc);
-  tor_assert(signing_kp);
+  tor_assert(job);
   tor_assert(encoded_out);
-  tor_assert(desc->plaintext_data.version == 3);
 
-  /* Build the non-encrypted values. */
-  {
-    char *encoded_cert;
-    /* Encode certificate then create the first line of the descriptor. */
-    if (desc->plaintext_data.signing_key_cert->cert_type
-        != CERT_TYPE_SIGNING_HS_DESC) {
-      log_err(LD_BUG, "HS descriptor signing key has an unexpected cert type "
-              "(%d)", (int) desc->plaintext_data.signing_key_cert->cert_type);
-      goto err;
-    }
-    if (tor_cert_encode_ed22519(desc->plaintext_data.signing_key_cert,
-                                &encoded_cert) < 0) {
-      /* The function will print error logs. */
-      goto err;
-    }
-    /* Create the hs descriptor line. */
-    smartlist_add_asprintf(lines, "%s %" PRIu32, str_hs_desc,
-                           desc->plaintext_data.version);
-    /* Add the descriptor lifetime line (in minutes). */
-    smartlist_add_asprintf(lines, "%s %" PRIu32, str_lifetime,
-                           desc->plaintext_data.lifetime_sec / 60);
-    /* Create the descriptor certificate line. */
-    smartlist_add_asprintf(lines, "%s\n%s", str_desc_cert, encoded_cert);
-    tor_free(encoded_cert);
-    /* Create the revision counter line. */
-    smartlist_add_asprintf(lines, "%s %" PRIu64, str_rev_counter,
-                           desc->plaintext_data.revision_counter);
+  /* Func logic: We first encrypt the inner layer of the descriptor (layer2)
+   * and use it to complete the middle layer of the descriptor (layer1). We
+   * then superencrypt the middle layer and sign the whole descriptor. */
+
+  /* Encrypt and b64 the inner layer */
+  layer2_b64_ciphertext =
+    encrypt_desc_data_and_base64(&job->subcredential, job->revision_counter,
+                                 job->secret_data, job->secret_data_len,
+                                 job->layer2_str, 0);
+  if (!layer2_b64_ciphertext) {
+    goto err;
   }
 
-  /* Build the superencrypted data section. */
-  {
-    char *enc_b64_blob=NULL;
-    if (encode_superencrypted_data(desc, descriptor_cookie,
-                                   &enc_b64_blob) < 0) {
-      goto err;
-    }
-    smartlist_add_asprintf(lines,
-                           "%s\n"
-                           "-----BEGIN MESSAGE-----\n"
-                           "%s"
-                           "-----END MESSAGE-----",
-                           str_superencrypted, enc_b64_blob);
-    tor_free(enc_b64_blob);
+  /* Now complete the middle descriptor layer with its encrypted section. */
+  tor_asprintf(&layer1_str,
+               "%s%s\n"
+               "-----BEGIN MESSAGE-----\n"
+               "%s"
+               "-----END MESSAGE-----",
+               job->layer1_head, str_encrypted, layer2_b64_ciphertext);
+
+  /* Encrypt and base64 the middle layer */
+  layer1_b64_ciphertext =
+    encrypt_desc_data_and_base64(&job->subcredential, job->revision_counter,
+                                 job->blinded_pubkey.pubkey,
+                                 ED25519_PUBKEY_LEN, layer1_str, 1);
+  if (!layer1_b64_ciphertext) {
+    goto err;
   }
 
-  /* Join all lines in one string so we can generate a signature and append
-   * it to the descriptor. */
-  encoded_str = smartlist_join_strings(lines, "\n", 1, &encoded_len);
+  /* Append the superencrypted data section to the plaintext section so we
+   * can generate a signature and append it to the descriptor. */
+  tor_asprintf(&signed_str,
+               "%s%s\n"
+               "-----BEGIN MESSAGE-----\n"
+               "%s"
+               "-----END MESSAGE-----\n",
+               job->plaintext_head, str_superencrypted,
+               layer1_b64_ciphertext);
 
   /* Sign all fields of the descriptor with our short term signing key. */
   {
     ed25519_signature_t sig;
     char ed_sig_b64[ED25519_SIG_BASE64_LEN + 1];
     if (ed25519_sign_prefixed(&sig,
-                              (const uint8_t *) encoded_str, encoded_len,
-                              str_desc_sig_prefix, signing_kp) < 0) {
+                              (const uint8_t *) signed_str,
+                              strlen(signed_str),
+                              str_desc_sig_prefix, &job->signing_kp) < 0) {
       log_warn(LD_BUG, "Can't sign encoded HS descriptor!");
-      tor_free(encoded_str);
       goto err;
     }
     ed25519_signature_to_base64(ed_sig_b64, &sig);
     /* Create the signature line. */
-    smartlist_add_asprintf(lines, "%s %s", str_signature, ed_sig_b64);
+    tor_asprintf(&encoded_str, "%s%s %s\n", signed_str, str_signature,
+                 ed_sig_b64);
   }
-  /* Free previous string that we used so compute the signature. */
-  tor_free(encoded_str);
-  encoded_str = smartlist_join_strings(lines, "\n", 1, NULL);
-  *encoded_out = encoded_str;
 
-  if (strlen(encoded_str) >= hs_cache_get_max_descriptor_size()) {
+  if (strlen(encoded_str) >= job->max_encoded_len) {
     log_warn(LD_GENERAL, "We just made an HS descriptor that's too big (%d)."
              "Failing.", (int)strlen(encoded_str));
     tor_free(encoded_str);
@@ -1147,16 +1195,80 @@ desc_encode_v3(const hs_descriptor_t *desc,
   /* XXX: Trigger a control port event. */
 
   /* Success! */
+  *encoded_out = encoded_str;
   ret = 0;
 
  err:
-  SMARTLIST_FOREACH(lines, char *, l, tor_free(l));
-  smartlist_free(lines);
+  if (layer1_str) {
+    memwipe(layer1_str, 0, strlen(layer1_str));
+    tor_free(layer1_str);
+  }
+  tor_free(layer2_b64_ciphertext);
+  tor_free(layer1_b64_ciphertext);
+  tor_free(signed_str);
+  return ret;
+}
+
+/** Encode a v3 HS descriptor. Return 0 on success and set encoded_out to the
+ * newly allocated string of the encoded descriptor. On error, -1 is returned
+ * and encoded_out is untouched. */
+static int
+desc_encode_v3(const hs_descriptor_t *desc,
+               const ed25519_keypair_t *signing_kp,
+               const uint8_t *descriptor_cookie,
+               char **encoded_out)
+{
+  int ret = -1;
+  hs_desc_encode_job_t *job;
+
+  tor_assert(encoded_out);
+
+  job = desc_encode_v3_job_new(desc, signing_kp, descriptor_cookie);
+  if (job) {
+    ret = hs_desc_encode_job_run(job, encoded_out);
+  }
+  hs_desc_encode_job_free(job);
   return ret;
 }
 
 /* === DECODING === */
 
+/** Scratch space for decoding a descriptor. All the layers of a descriptor
+ * and all its introduction points are tokenized one after the other, so they
+ * share one memory area and one token list which are cleared in between
+ * rather than allocated and released for each of them. */
+typedef struct hs_desc_decode_scratch_t {
+  memarea_t *area;
+  smartlist_t *tokens;
+} hs_desc_decode_scratch_t;
+
+/** Initialize the given decoding scratch space. */
+static void
+decode_scratch_init(hs_desc_decode_scratch_t *scratch)
+{
+  scratch->area = memarea_new();
+  scratch->tokens = smartlist_new();
+}
+
+/** Forget everything tokenized in the given scratch space, keeping its
+ * memory for the next section to decode. */
+static void
+decode_scratch_reset(hs_desc_decode_scratch_t *scratch)
+{
+  SMARTLIST_FOREACH(scratch->tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(scratch->tokens);
+  memarea_clear(scratch->area);
+}
+
+/** Release the memory of the given scratch space. */
+static void
+decode_scratch_release(hs_desc_decode_scratch_t *scratch)
+{
+  SMARTLIST_FOREACH(scratch->tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(scratch->tokens);
+  memarea_drop_all(scratch->area);
+}
+
 /** Given the token tok for an auth client, decode it as
  * hs_desc_authorized_client_t. tok->args MUST contain at least 3 elements
  * Return 0 on success else -1 on failure. */
@@ -1656,7 +1768,9 @@ decrypt_desc_layer,(const hs_descriptor_t *desc,
 
   /* KDF construction resulting in a key from which the secret key, IV and MAC
    * key are extracted which is what we need for the decryption. */
-  build_secret_key_iv_mac(desc, secret_data, secret_data_len,
+  build_secret_key_iv_mac(&desc->subcredential,
+                          desc->plaintext_data.revision_counter,
+                          secret_data, secret_data_len,
                           salt, HS_DESC_ENCRYPTED_SALT_LEN,
                           secret_key, sizeof(secret_key),
                           secret_iv, sizeof(secret_iv),
@@ -1912,23 +2026,24 @@ set_intro_point_onion_key(curve25519_public_key_t *onion_key_out,
 }
 
 /** Given the start of a section and the end of it, decode a single
- * introduction point from that section. Return a newly allocated introduction
- * point object containing the decoded data. Return NULL if the section can't
- * be decoded. */
-STATIC hs_desc_intro_point_t *
-decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+ * introduction point from that section, in place, using the scratch space
+ * <b>scratch</b>. Return a newly allocated introduction point object
+ * containing the decoded data. Return NULL if the section can't be
+ * decoded. */
+static hs_desc_intro_point_t *
+decode_introduction_point_section(const hs_descriptor_t *desc,
+                                  const char *start, const char *end,
+                                  hs_desc_decode_scratch_t *scratch)
 {
   hs_desc_intro_point_t *ip = NULL;
-  memarea_t *area = NULL;
-  smartlist_t *tokens = NULL;
+  smartlist_t *tokens = scratch->tokens;
   const directory_token_t *tok;
 
   tor_assert(desc);
   tor_assert(start);
+  tor_assert(end);
 
-  area = memarea_new();
-  tokens = smartlist_new();
-  if (tokenize_string(area, start, start + strlen(start),
+  if (tokenize_string(scratch->area, start, end,
                       tokens, hs_desc_intro_point_v3_token_table, 0) < 0) {
     log_warn(LD_REND, "Introduction point is not parseable");
     goto err;
@@ -2031,63 +2146,69 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
   ip = NULL;
 
  done:
-  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-  smartlist_free(tokens);
-  if (area) {
-    memarea_drop_all(area);
-  }
+  decode_scratch_reset(scratch);
+  return ip;
+}
+
+#ifdef TOR_UNIT_TESTS
+
+/** Given the start of a NUL terminated section, decode a single introduction
+ * point from that section. Return a newly allocated introduction point object
+ * containing the decoded data. Return NULL if the section can't be
+ * decoded. */
+STATIC hs_desc_intro_point_t *
+decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+{
+  hs_desc_intro_point_t *ip;
+  hs_desc_decode_scratch_t scratch;
 
+  tor_assert(start);
+
+  decode_scratch_init(&scratch);
+  ip = decode_introduction_point_section(desc, start, start + strlen(start),
+                                         &scratch);
+  decode_scratch_release(&scratch);
   return ip;
 }
 
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Given a descriptor string at <b>data</b>, decode all possible introduction
  * points that we can find. Add the introduction point object to desc_enc as we
  * find them. This function can't fail and it is possible that zero
- * introduction points can be decoded. */
+ * introduction points can be decoded.
+ *
+ * Each introduction point section starts at an introduction point header and
+ * stops right before the next one, or at the end of the <b>data_len</b> bytes
+ * of <b>data</b>. Sections are tokenized where they are, without copying them
+ * out of <b>data</b>. */
 static void
 decode_intro_points(const hs_descriptor_t *desc,
                     hs_desc_encrypted_data_t *desc_enc,
-                    const char *data)
+                    const char *data, size_t data_len,
+                    hs_desc_decode_scratch_t *scratch)
 {
-  smartlist_t *chunked_desc = smartlist_new();
-  smartlist_t *intro_points = smartlist_new();
+  const char *section, *section_end;
+  const char *eos = data + data_len;
 
   tor_assert(desc);
   tor_assert(desc_enc);
   tor_assert(data);
   tor_assert(desc_enc->intro_points);
 
-  /* Take the desc string, and extract the intro point substrings out of it */
-  {
-    /* Split the descriptor string using the intro point header as delimiter */
-    smartlist_split_string(chunked_desc, data, str_intro_point_start, 0, 0);
-
-    /* Check if there are actually any intro points included. The first chunk
-     * should be other descriptor fields (e.g. create2-formats), so it's not an
-     * intro point. */
-    if (smartlist_len(chunked_desc) < 2) {
-      goto done;
-    }
-  }
-
-  /* Take the intro point substrings, and prepare them for parsing */
-  {
-    int i = 0;
-    /* Prepend the introduction-point header to all the chunks, since
-       smartlist_split_string() devoured it. */
-    SMARTLIST_FOREACH_BEGIN(chunked_desc, char *, chunk) {
-      /* Ignore first chunk. It's other descriptor fields. */
-      if (i++ == 0) {
-        continue;
-      }
-
-      smartlist_add_asprintf(intro_points, "%s %s", str_intro_point, chunk);
-    } SMARTLIST_FOREACH_END(chunk);
-  }
-
-  /* Parse the intro points! */
-  SMARTLIST_FOREACH_BEGIN(intro_points, const char *, intro_point) {
-    hs_desc_intro_point_t *ip = decode_introduction_point(desc, intro_point);
+  /* What comes before the first introduction point header is other
+   * descriptor fields (e.g. create2-formats) so skip it. */
+  section = tor_memstr(data, data_len, str_intro_point_start);
+  while (section) {
+    /* Skip the newline of the header. */
+    section++;
+    section_end = tor_memstr(section, eos - section, str_intro_point_start);
+
+    hs_desc_intro_point_t *ip =
+      decode_introduction_point_section(desc, section,
+                                        section_end ? section_end : eos,
+                                        scratch);
+    section = section_end;
     if (!ip) {
       /* Malformed introduction point section. We'll ignore this introduction
        * point and continue parsing. New or unknown fields are possible for
@@ -2095,13 +2216,7 @@ decode_intro_points(const hs_descriptor_t *desc,
       continue;
     }
     smartlist_add(desc_enc->intro_points, ip);
-  } SMARTLIST_FOREACH_END(intro_point);
-
- done:
-  SMARTLIST_FOREACH(chunked_desc, char *, a, tor_free(a));
-  smartlist_free(chunked_desc);
-  SMARTLIST_FOREACH(intro_points, char *, a, tor_free(a));
-  smartlist_free(intro_points);
+  }
 }
 
 /** Return 1 iff the given base64 encoded signature in b64_sig from the encoded
@@ -2265,19 +2380,20 @@ desc_decode_plaintext_v3(smartlist_t *tokens,
   return HS_DESC_DECODE_PLAINTEXT_ERROR;
 }
 
-/** Decode the version 3 superencrypted section of the given descriptor desc.
- * The desc_superencrypted_out will be populated with the decoded data. */
+/** Decode the version 3 superencrypted section of the given descriptor desc
+ * using the scratch space <b>scratch</b>. The desc_superencrypted_out will be
+ * populated with the decoded data. */
 static hs_desc_decode_status_t
 desc_decode_superencrypted_v3(const hs_descriptor_t *desc,
+                              hs_desc_decode_scratch_t *scratch,
                               hs_desc_superencrypted_data_t *
                               desc_superencrypted_out)
 {
   int ret = HS_DESC_DECODE_SUPERENC_ERROR;
   char *message = NULL;
   size_t message_len;
-  memarea_t *area = NULL;
   directory_token_t *tok;
-  smartlist_t *tokens = NULL;
+  smartlist_t *tokens = scratch->tokens;
   /* Rename the parameter because it is too long. */
   hs_desc_superencrypted_data_t *superencrypted = desc_superencrypted_out;
 
@@ -2293,9 +2409,7 @@ desc_decode_superencrypted_v3(const hs_descriptor_t *desc,
   }
   tor_assert(message);
 
-  area = memarea_new();
-  tokens = smartlist_new();
-  if (tokenize_string(area, message, message + message_len,
+  if (tokenize_string(scratch->area, message, message + message_len,
                       tokens, hs_desc_superencrypted_v3_token_table, 0) < 0) {
     log_warn(LD_REND, "Superencrypted service descriptor is not parseable.");
     goto err;
@@ -2366,32 +2480,27 @@ desc_decode_superencrypted_v3(const hs_descriptor_t *desc,
   hs_desc_superencrypted_data_free_contents(desc_superencrypted_out);
 
  done:
-  if (tokens) {
-    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-    smartlist_free(tokens);
-  }
-  if (area) {
-    memarea_drop_all(area);
-  }
+  decode_scratch_reset(scratch);
   if (message) {
     tor_free(message);
   }
   return ret;
 }
 
-/** Decode the version 3 encrypted section of the given descriptor desc. The
- * desc_encrypted_out will be populated with the decoded data. */
+/** Decode the version 3 encrypted section of the given descriptor desc using
+ * the scratch space <b>scratch</b>. The desc_encrypted_out will be populated
+ * with the decoded data. */
 static hs_desc_decode_status_t
 desc_decode_encrypted_v3(const hs_descriptor_t *desc,
                          const curve25519_secret_key_t *client_auth_sk,
+                         hs_desc_decode_scratch_t *scratch,
                          hs_desc_encrypted_data_t *desc_encrypted_out)
 {
   int ret = HS_DESC_DECODE_ENCRYPTED_ERROR;
   char *message = NULL;
   size_t message_len;
-  memarea_t *area = NULL;
   directory_token_t *tok;
-  smartlist_t *tokens = NULL;
+  smartlist_t *tokens = scratch->tokens;
 
   tor_assert(desc);
   tor_assert(desc_encrypted_out);
@@ -2422,9 +2531,7 @@ desc_decode_encrypted_v3(const hs_descriptor_t *desc,
   }
   tor_assert(message);
 
-  area = memarea_new();
-  tokens = smartlist_new();
-  if (tokenize_string(area, message, message + message_len,
+  if (tokenize_string(scratch->area, message, message + message_len,
                       tokens, hs_desc_encrypted_v3_token_table, 0) < 0) {
     log_warn(LD_REND, "Encrypted service descriptor is not parseable.");
     goto err;
@@ -2459,7 +2566,7 @@ desc_decode_encrypted_v3(const hs_descriptor_t *desc,
   /* HRPR: Parse DoS defense PoW params. Optional but only once. */
   tok = find_opt_by_keyword(tokens, R3_POW_PARAMS);
   if (tok) {
-    log_err(LD_REND, "PoW params found in descriptor.");
+    log_info(LD_REND, "PoW params found in descriptor.");
     desc_encrypted_out->pow_params_present = 1;
     hs_desc_pow_params_t *pow_params =
         tor_malloc_zero(sizeof(hs_desc_pow_params_t));
@@ -2467,17 +2574,22 @@ desc_decode_encrypted_v3(const hs_descriptor_t *desc,
       log_warn(LD_REND, "PoW params could not be decoded.");
       goto err;
     }
-    log_err(LD_REND, "PoW parse successful.");
+    log_info(LD_REND, "PoW parse successful.");
     desc_encrypted_out->pow_params = pow_params;
   } else {
-    log_err(LD_REND, "No PoW params found.");
+    log_info(LD_REND, "No PoW params found.");
     desc_encrypted_out->pow_params_present = 0; // HRPR TODO needed?
   }
 
+  /* We are done with the layer tokens: the introduction point sections are
+   * tokenized next in the same scratch space. */
+  decode_scratch_reset(scratch);
+
   /* Initialize the descriptor's introduction point list before we start
    * decoding. Having 0 intro point is valid. Then decode them all. */
   desc_encrypted_out->intro_points = smartlist_new();
-  decode_intro_points(desc, desc_encrypted_out, message);
+  decode_intro_points(desc, desc_encrypted_out, message, message_len,
+                      scratch);
 
   /* Validation of maximum introduction points allowed. */
   if (smartlist_len(desc_encrypted_out->intro_points) >
@@ -2500,13 +2612,7 @@ desc_decode_encrypted_v3(const hs_descriptor_t *desc,
   hs_desc_encrypted_data_free_contents(desc_encrypted_out);
 
  done:
-  if (tokens) {
-    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-    smartlist_free(tokens);
-  }
-  if (area) {
-    memarea_drop_all(area);
-  }
+  decode_scratch_reset(scratch);
   if (message) {
     tor_free(message);
   }
@@ -2519,19 +2625,21 @@ static hs_desc_decode_status_t
   (*decode_encrypted_handlers[])(
       const hs_descriptor_t *desc,
       const curve25519_secret_key_t *client_auth_sk,
+      hs_desc_decode_scratch_t *scratch,
       hs_desc_encrypted_data_t *desc_encrypted) =
 {
   /* v0 */ NULL, /* v1 */ NULL, /* v2 */ NULL,
   desc_decode_encrypted_v3,
 };
 
-/** Decode the encrypted data section of the given descriptor and store the
- * data in the given encrypted data object. Return 0 on success else a
- * negative value on error. */
-hs_desc_decode_status_t
-hs_desc_decode_encrypted(const hs_descriptor_t *desc,
-                         const curve25519_secret_key_t *client_auth_sk,
-                         hs_desc_encrypted_data_t *desc_encrypted)
+/** Decode the encrypted data section of the given descriptor using the
+ * scratch space <b>scratch</b> and store the data in the given encrypted data
+ * object. Return 0 on success else a negative value on error. */
+static hs_desc_decode_status_t
+decode_encrypted_with_scratch(const hs_descriptor_t *desc,
+                              const curve25519_secret_key_t *client_auth_sk,
+                              hs_desc_decode_scratch_t *scratch,
+                              hs_desc_encrypted_data_t *desc_encrypted)
 {
   int ret = HS_DESC_DECODE_ENCRYPTED_ERROR;
   uint32_t version;
@@ -2555,7 +2663,7 @@ hs_desc_decode_encrypted(const hs_descriptor_t *desc,
   tor_assert(decode_encrypted_handlers[version]);
 
   /* Run the version specific plaintext decoder. */
-  ret = decode_encrypted_handlers[version](desc, client_auth_sk,
+  ret = decode_encrypted_handlers[version](desc, client_auth_sk, scratch,
                                            desc_encrypted);
   if (ret < 0) {
     goto err;
@@ -2565,23 +2673,44 @@ hs_desc_decode_encrypted(const hs_descriptor_t *desc,
   return ret;
 }
 
+/** Decode the encrypted data section of the given descriptor and store the
+ * data in the given encrypted data object. Return 0 on success else a
+ * negative value on error. */
+hs_desc_decode_status_t
+hs_desc_decode_encrypted(const hs_descriptor_t *desc,
+                         const curve25519_secret_key_t *client_auth_sk,
+                         hs_desc_encrypted_data_t *desc_encrypted)
+{
+  hs_desc_decode_status_t ret;
+  hs_desc_decode_scratch_t scratch;
+
+  decode_scratch_init(&scratch);
+  ret = decode_encrypted_with_scratch(desc, client_auth_sk, &scratch,
+                                      desc_encrypted);
+  decode_scratch_release(&scratch);
+  return ret;
+}
+
 /** Table of superencrypted decode function version specific. The function are
  * indexed by the version number so v3 callback is at index 3 in the array. */
 static hs_desc_decode_status_t
   (*decode_superencrypted_handlers[])(
       const hs_descriptor_t *desc,
+      hs_desc_decode_scratch_t *scratch,
       hs_desc_superencrypted_data_t *desc_superencrypted) =
 {
   /* v0 */ NULL, /* v1 */ NULL, /* v2 */ NULL,
   desc_decode_superencrypted_v3,
 };
 
-/** Decode the superencrypted data section of the given descriptor and store
- * the data in the given superencrypted data object. */
-hs_desc_decode_status_t
-hs_desc_decode_superencrypted(const hs_descriptor_t *desc,
-                              hs_desc_superencrypted_data_t *
-                              desc_superencrypted)
+/** Decode the superencrypted data section of the given descriptor using the
+ * scratch space <b>scratch</b> and store the data in the given superencrypted
+ * data object. */
+static hs_desc_decode_status_t
+decode_superencrypted_with_scratch(const hs_descriptor_t *desc,
+                                   hs_desc_decode_scratch_t *scratch,
+                                   hs_desc_superencrypted_data_t *
+                                   desc_superencrypted)
 {
   int ret = HS_DESC_DECODE_SUPERENC_ERROR;
   uint32_t version;
@@ -2605,7 +2734,8 @@ hs_desc_decode_superencrypted(const hs_descriptor_t *desc,
   tor_assert(decode_superencrypted_handlers[version]);
 
   /* Run the version specific plaintext decoder. */
-  ret = decode_superencrypted_handlers[version](desc, desc_superencrypted);
+  ret = decode_superencrypted_handlers[version](desc, scratch,
+                                                desc_superencrypted);
   if (ret < 0) {
     goto err;
   }
@@ -2614,6 +2744,23 @@ hs_desc_decode_superencrypted(const hs_descriptor_t *desc,
   return ret;
 }
 
+/** Decode the superencrypted data section of the given descriptor and store
+ * the data in the given superencrypted data object. */
+hs_desc_decode_status_t
+hs_desc_decode_superencrypted(const hs_descriptor_t *desc,
+                              hs_desc_superencrypted_data_t *
+                              desc_superencrypted)
+{
+  hs_desc_decode_status_t ret;
+  hs_desc_decode_scratch_t scratch;
+
+  decode_scratch_init(&scratch);
+  ret = decode_superencrypted_with_scratch(desc, &scratch,
+                                           desc_superencrypted);
+  decode_scratch_release(&scratch);
+  return ret;
+}
+
 /** Table of plaintext decode function version specific. The function are
  * indexed by the version number so v3 callback is at index 3 in the array. */
 static hs_desc_decode_status_t
@@ -2627,15 +2774,15 @@ static hs_desc_decode_status_t
   desc_decode_plaintext_v3,
 };
 
-/** Fully decode the given descriptor plaintext and store the data in the
- * plaintext data object. */
-hs_desc_decode_status_t
-hs_desc_decode_plaintext(const char *encoded,
-                         hs_desc_plaintext_data_t *plaintext)
+/** Fully decode the given descriptor plaintext using the scratch space
+ * <b>scratch</b> and store the data in the plaintext data object. */
+static hs_desc_decode_status_t
+decode_plaintext_with_scratch(const char *encoded,
+                              hs_desc_decode_scratch_t *scratch,
+                              hs_desc_plaintext_data_t *plaintext)
 {
   int ok = 0, ret = HS_DESC_DECODE_PLAINTEXT_ERROR;
-  memarea_t *area = NULL;
-  smartlist_t *tokens = NULL;
+  smartlist_t *tokens = scratch->tokens;
   size_t encoded_len;
   directory_token_t *tok;
 
@@ -2650,10 +2797,8 @@ hs_desc_decode_plaintext(const char *encoded,
     goto err;
   }
 
-  area = memarea_new();
-  tokens = smartlist_new();
   /* Tokenize the descriptor so we can start to parse it. */
-  if (tokenize_string(area, encoded, encoded + encoded_len, tokens,
+  if (tokenize_string(scratch->area, encoded, encoded + encoded_len, tokens,
                       hs_desc_v3_token_table, 0) < 0) {
     log_warn(LD_REND, "Service descriptor is not parseable");
     goto err;
@@ -2690,13 +2835,22 @@ hs_desc_decode_plaintext(const char *encoded,
   ret = HS_DESC_DECODE_OK;
 
  err:
-  if (tokens) {
-    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-    smartlist_free(tokens);
-  }
-  if (area) {
-    memarea_drop_all(area);
-  }
+  decode_scratch_reset(scratch);
+  return ret;
+}
+
+/** Fully decode the given descriptor plaintext and store the data in the
+ * plaintext data object. */
+hs_desc_decode_status_t
+hs_desc_decode_plaintext(const char *encoded,
+                         hs_desc_plaintext_data_t *plaintext)
+{
+  hs_desc_decode_status_t ret;
+  hs_desc_decode_scratch_t scratch;
+
+  decode_scratch_init(&scratch);
+  ret = decode_plaintext_with_scratch(encoded, &scratch, plaintext);
+  decode_scratch_release(&scratch);
   return ret;
 }
 
@@ -2714,10 +2868,13 @@ hs_desc_decode_descriptor(const char *encoded,
 {
   hs_desc_decode_status_t ret = HS_DESC_DECODE_GENERIC_ERROR;
   hs_descriptor_t *desc;
+  hs_desc_decode_scratch_t scratch;
 
   tor_assert(encoded);
 
   desc = tor_malloc_zero(sizeof(hs_descriptor_t));
+  /* All layers are decoded with the same scratch space. */
+  decode_scratch_init(&scratch);
 
   /* Subcredentials are not optional. */
   if (BUG(!subcredential ||
@@ -2728,21 +2885,25 @@ hs_desc_decode_descriptor(const char *encoded,
 
   memcpy(&desc->subcredential, subcredential, sizeof(desc->subcredential));
 
-  ret = hs_desc_decode_plaintext(encoded, &desc->plaintext_data);
+  ret = decode_plaintext_with_scratch(encoded, &scratch,
+                                      &desc->plaintext_data);
   if (ret != HS_DESC_DECODE_OK) {
     goto err;
   }
 
-  ret = hs_desc_decode_superencrypted(desc, &desc->superencrypted_data);
+  ret = decode_superencrypted_with_scratch(desc, &scratch,
+                                           &desc->superencrypted_data);
   if (ret != HS_DESC_DECODE_OK) {
     goto err;
   }
 
-  ret = hs_desc_decode_encrypted(desc, client_auth_sk, &desc->encrypted_data);
+  ret = decode_encrypted_with_scratch(desc, client_auth_sk, &scratch,
+                                      &desc->encrypted_data);
   if (ret != HS_DESC_DECODE_OK) {
     goto err;
   }
 
+  decode_scratch_release(&scratch);
   if (desc_out) {
     *desc_out = desc;
   } else {
@@ -2751,6 +2912,7 @@ hs_desc_decode_descriptor(const char *encoded,
   return ret;
 
  err:
+  decode_scratch_release(&scratch);
   hs_descriptor_free(desc);
   if (desc_out) {
     *desc_out = NULL;
@@ -3002,6 +3164,7 @@ hs_desc_intro_point_free_(hs_desc_intro_point_t *ip)
   tor_cert_free(ip->enc_key_cert);
   crypto_pk_free(ip->legacy.key);
   tor_free(ip->legacy.cert.encoded);
+  tor_free(ip->encoded);
   tor_free(ip);
 }
 
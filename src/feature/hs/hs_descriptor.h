@@ -161,6 +161,11 @@ typedef struct hs_desc_intro_point_t {
   /** True iff the introduction point has passed the cross certification. Upon
    * decoding an intro point, this must be true. */
   unsigned int cross_certified : 1;
+
+  /** Encoding only: This introduction point as encoded in the inner layer of
+   * the descriptor, or NULL if it wasn't encoded yet. The object is not
+   * modified once set up, so a service uploading it again reuses this. */
+  char *encoded;
 } hs_desc_intro_point_t;
 
 /** Authorized client information located in a descriptor. */
@@ -307,6 +312,17 @@ MOCK_DECL(int,
                                      const uint8_t *descriptor_cookie,
                                      char **encoded_out));
 
+typedef struct hs_desc_encode_job_t hs_desc_encode_job_t;
+hs_desc_encode_job_t *hs_desc_encode_job_new(
+                                     const hs_descriptor_t *desc,
+                                     const ed25519_keypair_t *signing_kp,
+                                     const uint8_t *descriptor_cookie);
+int hs_desc_encode_job_run(const hs_desc_encode_job_t *job,
+                           char **encoded_out);
+void hs_desc_encode_job_free_(hs_desc_encode_job_t *job);
+#define hs_desc_encode_job_free(job) \
+  FREE_AND_NULL(hs_desc_encode_job_t, hs_desc_encode_job_free_, (job))
+
 int hs_desc_decode_descriptor(const char *encoded,
                               const hs_subcredential_t *subcredential,
                               const curve25519_secret_key_t *client_auth_sk,
@@ -354,9 +370,11 @@ STATIC size_t build_plaintext_padding(const char *plaintext,
                                       uint8_t **padded_out);
 /* Decoding. */
 STATIC smartlist_t *decode_link_specifiers(const char *encoded);
+#ifdef TOR_UNIT_TESTS
 STATIC hs_desc_intro_point_t *decode_introduction_point(
                                 const hs_descriptor_t *desc,
                                 const char *text);
+#endif
 STATIC int encrypted_data_length_is_valid(size_t len);
 STATIC int cert_is_valid(tor_cert_t *cert, uint8_t type,
                          const char *log_obj_type);
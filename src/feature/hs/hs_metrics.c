@@ -129,6 +129,35 @@ hs_metrics_update_by_ident(const hs_metrics_key_t key,
   hs_metrics_update_by_service(key, service, port, n);
 }
 
+/** Metrics store of the HSDir descriptor cache. Created on first update so
+ * only relays actually acting as HSDir export it. */
+static metrics_store_t *hsdir_cache_store = NULL;
+
+/** Update the HSDir cache metrics key entry by the value n. */
+void
+hs_metrics_update_hsdir_cache(const hs_metrics_hsdir_cache_key_t key,
+                              int64_t n)
+{
+  smartlist_t *entries;
+
+  if (!hsdir_cache_store) {
+    hsdir_cache_store = metrics_store_new();
+    for (size_t i = 0; i < hsdir_cache_metrics_size; ++i) {
+      metrics_store_add(hsdir_cache_store, hsdir_cache_metrics[i].type,
+                        hsdir_cache_metrics[i].name,
+                        hsdir_cache_metrics[i].help);
+    }
+  }
+
+  entries = metrics_store_get_all(hsdir_cache_store,
+                                  hsdir_cache_metrics[key].name);
+  if (BUG(!entries)) {
+    return;
+  }
+  SMARTLIST_FOREACH(entries, metrics_store_entry_t *, entry,
+                    metrics_store_entry_update(entry, n));
+}
+
 /** Return a list of all the onion service metrics stores. This is the
  * function attached to the .get_metrics() member of the subsys_t. */
 const smartlist_t *
@@ -140,6 +169,9 @@ hs_metrics_get_stores(void)
 
   smartlist_free(stores_list);
   stores_list = hs_service_get_metrics_stores();
+  if (hsdir_cache_store) {
+    smartlist_add(stores_list, hsdir_cache_store);
+  }
   return stores_list;
 }
 
@@ -167,3 +199,10 @@ hs_metrics_service_free(hs_service_t *service)
 
   metrics_store_free(service->metrics.store);
 }
+
+/** Free the metrics store of the HSDir descriptor cache. */
+void
+hs_metrics_hsdir_cache_free(void)
+{
+  metrics_store_free(hsdir_cache_store);
+}
@@ -19,6 +19,7 @@
 /* Init and Free. */
 void hs_metrics_service_init(hs_service_t *service);
 void hs_metrics_service_free(hs_service_t *service);
+void hs_metrics_hsdir_cache_free(void);
 
 /* Accessors. */
 const smartlist_t *hs_metrics_get_stores(void);
@@ -30,6 +31,28 @@ void hs_metrics_update_by_ident(const hs_metrics_key_t key,
 void hs_metrics_update_by_service(const hs_metrics_key_t key,
                                   hs_service_t *service, const uint16_t port,
                                   int64_t n);
+void hs_metrics_update_hsdir_cache(const hs_metrics_hsdir_cache_key_t key,
+                                   int64_t n);
+
+/** A descriptor lookup in the HSDir cache found a descriptor. */
+#define hs_metrics_hsdir_cache_hit() \
+  hs_metrics_update_hsdir_cache(HS_METRICS_HSDIR_CACHE_HITS, 1)
+
+/** A descriptor lookup in the HSDir cache found nothing. */
+#define hs_metrics_hsdir_cache_miss() \
+  hs_metrics_update_hsdir_cache(HS_METRICS_HSDIR_CACHE_MISSES, 1)
+
+/** An expired descriptor was removed from the HSDir cache. */
+#define hs_metrics_hsdir_cache_expired() \
+  hs_metrics_update_hsdir_cache(HS_METRICS_HSDIR_CACHE_EXPIRED, 1)
+
+/** The least recently used descriptor of the HSDir cache was evicted. */
+#define hs_metrics_hsdir_cache_evicted() \
+  hs_metrics_update_hsdir_cache(HS_METRICS_HSDIR_CACHE_EVICTED, 1)
+
+/** The HSDir cache grew, or shrank, by n bytes. */
+#define hs_metrics_hsdir_cache_bytes(n) \
+  hs_metrics_update_hsdir_cache(HS_METRICS_HSDIR_CACHE_BYTES, (n))
 
 /** New introducion request received. */
 #define hs_metrics_new_introduction(s) \
@@ -67,4 +90,15 @@ void hs_metrics_update_by_service(const hs_metrics_key_t key,
 #define hs_metrics_close_established_intro(i) \
   hs_metrics_update_by_ident(HS_METRICS_NUM_ESTABLISHED_INTRO, (i), 0, 1)
 
+/** PoW solutions were added to, or dropped from, the replay caches of the
+ * service. */
+#define hs_metrics_pow_replay_cache_entries(s, n) \
+  hs_metrics_update_by_service(HS_METRICS_POW_REPLAY_CACHE_ENTRIES, (s), 0, \
+                               (n))
+
+/** A PoW solution was rejected because it was already in the replay
+ * cache. */
+#define hs_metrics_new_pow_replay(i) \
+  hs_metrics_update_by_ident(HS_METRICS_POW_NUM_REPLAYS, (i), 0, 1)
+
 #endif /* !defined(TOR_FEATURE_HS_HS_METRICS_H) */
@@ -59,7 +59,60 @@ const hs_metrics_entry_t base_metrics[] =
     .name = METRICS_NAME(hs_intro_established_count),
     .help = "Total number of established introduction circuit",
   },
+  {
+    .key = HS_METRICS_POW_REPLAY_CACHE_ENTRIES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(hs_pow_replay_cache_entries_count),
+    .help = "Number of PoW solutions in the replay caches",
+  },
+  {
+    .key = HS_METRICS_POW_NUM_REPLAYS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(hs_pow_replay_num_total),
+    .help = "Total number of replayed PoW solutions rejected",
+  },
 };
 
 /** Size of base_metrics array that is number of entries. */
 const size_t base_metrics_size = ARRAY_LENGTH(base_metrics);
+
+/** The metrics of the HSDir descriptor cache. Unlike the base metrics, they
+ * are in a single store for the whole relay.
+ *
+ * The key member MUST be also the index of the entry in the array. */
+const hs_metrics_hsdir_cache_entry_t hsdir_cache_metrics[] =
+{
+  {
+    .key = HS_METRICS_HSDIR_CACHE_HITS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(hs_hsdir_cache_hit_total),
+    .help = "Total number of HSDir descriptor lookups that were found",
+  },
+  {
+    .key = HS_METRICS_HSDIR_CACHE_MISSES,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(hs_hsdir_cache_miss_total),
+    .help = "Total number of HSDir descriptor lookups that were not found",
+  },
+  {
+    .key = HS_METRICS_HSDIR_CACHE_EXPIRED,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(hs_hsdir_cache_expired_total),
+    .help = "Total number of expired HSDir descriptors removed",
+  },
+  {
+    .key = HS_METRICS_HSDIR_CACHE_EVICTED,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(hs_hsdir_cache_evicted_total),
+    .help = "Total number of least recently used HSDir descriptors evicted",
+  },
+  {
+    .key = HS_METRICS_HSDIR_CACHE_BYTES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(hs_hsdir_cache_bytes),
+    .help = "Number of bytes used by the HSDir descriptor cache",
+  },
+};
+
+/** Size of hsdir_cache_metrics array that is number of entries. */
+const size_t hsdir_cache_metrics_size = ARRAY_LENGTH(hsdir_cache_metrics);
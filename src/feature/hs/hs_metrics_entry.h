@@ -27,8 +27,27 @@ typedef enum {
   HS_METRICS_NUM_RDV = 4,
   /** Number of established introducton points. */
   HS_METRICS_NUM_ESTABLISHED_INTRO = 5,
+  /** Number of entries in the PoW replay caches. */
+  HS_METRICS_POW_REPLAY_CACHE_ENTRIES = 6,
+  /** Number of PoW solutions rejected as replays. */
+  HS_METRICS_POW_NUM_REPLAYS = 7,
 } hs_metrics_key_t;
 
+/** Metrics key of the HSDir descriptor cache, used as an index in the
+ * hsdir_cache_metrics array. */
+typedef enum {
+  /** Number of descriptor lookups that found a descriptor. */
+  HS_METRICS_HSDIR_CACHE_HITS = 0,
+  /** Number of descriptor lookups that found nothing. */
+  HS_METRICS_HSDIR_CACHE_MISSES = 1,
+  /** Number of descriptors removed because they expired. */
+  HS_METRICS_HSDIR_CACHE_EXPIRED = 2,
+  /** Number of descriptors evicted to make room. */
+  HS_METRICS_HSDIR_CACHE_EVICTED = 3,
+  /** Number of bytes used by the cached descriptors. */
+  HS_METRICS_HSDIR_CACHE_BYTES = 4,
+} hs_metrics_hsdir_cache_key_t;
+
 /** The metadata of an HS metrics. */
 typedef struct hs_metrics_entry_t {
   /* Metric key used as a static array index. */
@@ -43,9 +62,24 @@ typedef struct hs_metrics_entry_t {
   bool port_as_label;
 } hs_metrics_entry_t;
 
+/** The metadata of an HSDir cache metrics. */
+typedef struct hs_metrics_hsdir_cache_entry_t {
+  /* Metric key used as a static array index. */
+  hs_metrics_hsdir_cache_key_t key;
+  /* Metric type. */
+  metrics_type_t type;
+  /* Metrics output name. */
+  const char *name;
+  /* Metrics output help comment. */
+  const char *help;
+} hs_metrics_hsdir_cache_entry_t;
+
 extern const hs_metrics_entry_t base_metrics[];
 extern const size_t base_metrics_size;
 
+extern const hs_metrics_hsdir_cache_entry_t hsdir_cache_metrics[];
+extern const size_t hsdir_cache_metrics_size;
+
 #endif /* HS_METRICS_ENTRY_PRIVATE */
 
 #endif /* !defined(TOR_FEATURE_HS_METRICS_ENTRY_H) */
@@ -10,96 +10,176 @@
 typedef unsigned __int128 uint128_t;
 
 #include <stdio.h>
+#include "core/or/or.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/connection_edge.h"
+#include "app/config/config.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/lock/compat_mutex.h"
 #include "ext/libb2/src/blake2.h"
+#include "feature/hs/hs_client.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/hs/hs_pow.h"
-#include "ext/ht.h"
+#include "lib/container/bloomfilt.h"
+#include "ext/siphash.h"
+
+#include "core/or/origin_circuit_st.h"
+
+/** Replay cache of the solutions made with one seed. It is a list of Bloom
+ * filters of the nonces we accepted, each holding at most
+ * HS_POW_REPLAY_CACHE_MAX_ENTRIES nonces so that its false positive rate
+ * stays bounded. New nonces go to the last filter; once it is full, a fresh
+ * one is started and the full ones are only used for lookups. The whole
+ * cache is dropped at once when its seed is rotated out. */
+struct hs_pow_replay_cache_t {
+  /** List of bloomfilt_t of the nonces accepted for this seed, oldest
+   * first. */
+  smartlist_t *filters;
+  /** Number of nonces added to the last filter of the list. */
+  uint32_t n_entries_last;
+  /** Number of nonces added to all the filters. */
+  uint32_t n_entries;
+};
+
+/** Hash function for the nonces in the replay cache Bloom filter. */
+static uint64_t
+replay_cache_hash_nonce(const struct sipkey *key, const void *item)
+{
+  return siphash24(item, HS_POW_NONCE_LEN, key);
+}
 
-/** Replay cache set up */
-/** Cache entry for (nonce, seed) replay protection. */
-typedef struct nonce_cache_entry_t {
-  HT_ENTRY(nonce_cache_entry_t) node;
-  uint128_t nonce;
-  uint32_t seed_head;
-} nonce_cache_entry_t;
+/** Start a new, empty, Bloom filter at the end of the filters of cache. */
+static void
+replay_cache_add_filter(hs_pow_replay_cache_t *cache)
+{
+  uint8_t key[BLOOMFILT_KEY_LEN];
+
+  crypto_rand((char *) key, sizeof(key));
+  smartlist_add(cache->filters,
+                bloomfilt_new(HS_POW_REPLAY_CACHE_MAX_ENTRIES,
+                              replay_cache_hash_nonce, key));
+  memwipe(key, 0, sizeof(key));
+  cache->n_entries_last = 0;
+}
 
-/** Return true if the two (nonce, seed) replay cache entries are the same */
-static inline int
-nonce_cache_entries_eq_(const struct nonce_cache_entry_t *entry1,
-                        const struct nonce_cache_entry_t *entry2)
+/** Return a newly allocated, empty, replay cache. */
+static hs_pow_replay_cache_t *
+replay_cache_new(void)
 {
-  return entry1->nonce == entry2->nonce &&
-         entry1->seed_head == entry2->seed_head;
+  hs_pow_replay_cache_t *cache = tor_malloc_zero(sizeof(*cache));
+
+  cache->filters = smartlist_new();
+  replay_cache_add_filter(cache);
+  return cache;
 }
 
-/** Hash function to hash the (nonce, seed) tuple entry. */
-static inline unsigned
-nonce_cache_entry_hash_(const struct nonce_cache_entry_t *ent)
+/** Release all storage held by the given replay cache. */
+static void
+replay_cache_free_(hs_pow_replay_cache_t *cache)
 {
-  return (unsigned)siphash24g(&ent->nonce, HS_POW_NONCE_LEN) + ent->seed_head;
+  if (!cache)
+    return;
+  SMARTLIST_FOREACH(cache->filters, bloomfilt_t *, f, bloomfilt_free(f));
+  smartlist_free(cache->filters);
+  tor_free(cache);
 }
 
-static HT_HEAD(nonce_cache_table, nonce_cache_entry_t) nonce_cache_table;
+/** Return true iff the given nonce is probably in one of the filters of
+ * cache. */
+static int
+replay_cache_probably_contains(const hs_pow_replay_cache_t *cache,
+                               const void *nonce)
+{
+  SMARTLIST_FOREACH(cache->filters, const bloomfilt_t *, f, {
+    if (bloomfilt_probably_contains(f, nonce)) {
+      return 1;
+    }
+  });
+  return 0;
+}
+#define replay_cache_free(c) \
+  FREE_AND_NULL(hs_pow_replay_cache_t, replay_cache_free_, (c))
+
+/** Return a pointer to the replay cache slot of pow_state for the seed the
+ * given solution was made with, or NULL if the seed head matches neither our
+ * current nor previous seed. */
+static hs_pow_replay_cache_t **
+get_replay_cache_slot(hs_service_pow_state_t *pow_state,
+                      const hs_pow_solution_t *pow_solution)
+{
+  if (get_uint32(pow_state->seed_current) == pow_solution->seed_head) {
+    return &pow_state->replay_cache_current;
+  } else if (get_uint32(pow_state->seed_previous) == pow_solution->seed_head) {
+    return &pow_state->replay_cache_previous;
+  }
+  return NULL;
+}
 
-HT_PROTOTYPE(nonce_cache_table, nonce_cache_entry_t, node,
-             nonce_cache_entry_hash_, nonce_cache_entries_eq_);
+/** Return the number of solutions in the replay caches of pow_state. */
+uint32_t
+hs_pow_replay_cache_len(const hs_service_pow_state_t *pow_state)
+{
+  uint32_t n = 0;
 
-HT_GENERATE2(nonce_cache_table, nonce_cache_entry_t, node,
-             nonce_cache_entry_hash_, nonce_cache_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_);
+  tor_assert(pow_state);
 
-/** We use this to check if an entry in the replay cache is for a particular
- * seed head, so we know to remove it once the seed is no longer in use. */
-int
-nonce_cache_entry_has_seed(nonce_cache_entry_t *ent, uint32_t seed_head)
-{
-  log_err(LD_REND,
-          "Checking if replay cache entry matches seed: does %#06x == %#06x?",
-          ent->seed_head, seed_head);
-  /* Returning nonzero makes HT_FOREACH_FN remove the element from the HT */
-  return ent->seed_head == seed_head;
+  if (pow_state->replay_cache_current) {
+    n += pow_state->replay_cache_current->n_entries;
+  }
+  if (pow_state->replay_cache_previous) {
+    n += pow_state->replay_cache_previous->n_entries;
+  }
+  return n;
 }
 
-/** Remove entries from the (nonce, seed) replay cache which are for the seed
- * beginning with seed_head. */
-void
-scrub_nonce_cache_for_seed(uint32_t seed_head)
+/** The seeds of pow_state are about to be rotated: drop the replay cache of
+ * the previous seed and keep the one of the current seed as the previous one.
+ * Return the number of entries dropped. */
+uint32_t
+hs_pow_rotate_replay_cache(hs_service_pow_state_t *pow_state)
 {
-  log_err(LD_REND, "Replay cache HT length before scrub: %u",
-          HT_SIZE(&nonce_cache_table));
-  HT_FOREACH_FN(nonce_cache_table, &nonce_cache_table,
-                nonce_cache_entry_has_seed, seed_head);
-  log_err(LD_REND, "Replay cache HT length after scrub: %u",
-          HT_SIZE(&nonce_cache_table));
+  uint32_t n_dropped = 0;
+
+  tor_assert(pow_state);
+
+  if (pow_state->replay_cache_previous) {
+    n_dropped = pow_state->replay_cache_previous->n_entries;
+  }
+  log_debug(LD_REND, "Dropping %u entries from the replay cache.",
+            n_dropped);
+  replay_cache_free(pow_state->replay_cache_previous);
+  pow_state->replay_cache_previous = pow_state->replay_cache_current;
+  /* Allocated on the first solution for the new seed. */
+  pow_state->replay_cache_current = NULL;
+  return n_dropped;
 }
 
 /** Temp helper function to print an EquiX solution. */
 static void
 print_solution(const equix_solution *sol)
 {
-  log_err(LD_REND, "Printing EquiX solution:");
+  log_debug(LD_REND, "Printing EquiX solution:");
   for (int idx = 0; idx < EQUIX_NUM_IDX; ++idx) {
-    log_err(LD_REND, "%#06x%s", sol->idx[idx],
-            idx != EQUIX_NUM_IDX - 1 ? ", " : "");
+    log_debug(LD_REND, "%#06x%s", sol->idx[idx],
+              idx != EQUIX_NUM_IDX - 1 ? ", " : "");
   }
 }
 
-/** Solve the EquiX/blake2b PoW scheme using the parameters in pow_params, and
- * store the solution in pow_solution_out. Returns 0 on success and -1
- * otherwise. Called by a client. */
-int
-solve_pow(hs_desc_pow_params_t *pow_params,
-          hs_pow_solution_t *pow_solution_out)
+/** Solve the EquiX/blake2b PoW scheme using the seed in pow_params and the
+ * given effort, trying nonces upwards from nonce_start, and store the
+ * solution in pow_solution_out. If cancelled is not NULL, it is polled
+ * between nonces and the solve is abandoned as soon as it becomes nonzero.
+ * Returns 0 on success and -1 otherwise. */
+static int
+solve_pow_impl(const hs_desc_pow_params_t *pow_params, uint32_t effort,
+               uint128_t nonce_start, hs_pow_solution_t *pow_solution_out,
+               atomic_counter_t *cancelled)
 {
   int ret = -1;
-  uint128_t nonce;
-
-  /* Generate a random nonce so start with. */
-  crypto_rand((char *)&nonce, HS_POW_NONCE_LEN);
-
-  /* Select E (just using suggested for now) */
-  uint32_t effort = pow_params->suggested_effort;
+  uint128_t nonce = nonce_start;
 
   /* Build EquiX challenge (C || N || INT_32(E)), following logic of
    * build_secret_input from hsdesc.c */
@@ -117,28 +197,29 @@ solve_pow(hs_desc_pow_params_t *pow_params,
   offset += sizeof(uint32_t);
   tor_assert(challenge_len == offset);
 
-  /* Temporary logging */
-  log_err(LD_REND, "C: %s", hex_str(pow_params->seed, 32));
-  char hex_nonce[HS_POW_NONCE_LEN * 2 + 1];
-  memset(hex_nonce, 0, HS_POW_NONCE_LEN * 2 + 1);
-  base16_encode(hex_nonce, HS_POW_NONCE_LEN * 2 + 1, &nonce, HS_POW_NONCE_LEN);
-  log_err(LD_REND, "N: %s", hex_nonce);
-  log_err(LD_REND, "E: %u | Hex: %s", effort, hex_str(&effort, 4));
-
   /* Initialise EquiX and blake2b. */
   uint8_t success = 0;
   uint64_t count = 1;
 
   equix_ctx *ctx = NULL;
   equix_solution solution[EQUIX_MAX_SOLS];
-  ctx = equix_alloc(EQUIX_CTX_SOLVE); // TODO inside loop?
+  ctx = equix_alloc(EQUIX_CTX_SOLVE);
 
   uint8_t hash_result[HS_POW_HASH_LEN];
   blake2b_state S[1];
 
   /* Repeatedly increment the nonce until we find a valid solution. */
-  log_err(LD_REND, "Solving proof of work...");
+  log_debug(LD_REND, "Solving proof of work...");
   while (success == 0) {
+    /* The main thread no longer wants this solution, e.g. because the intro
+     * circuit it was for has closed. */
+    if (cancelled && atomic_counter_get(cancelled)) {
+      log_info(LD_REND, "PoW solve cancelled after %" PRIu64 " attempts.",
+               count);
+      equix_free(ctx);
+      break;
+    }
+
     /* Calculate S = equix_solve(C || N || E) */
 
     int num_solutions = 0;
@@ -157,26 +238,20 @@ solve_pow(hs_desc_pow_params_t *pow_params,
     /* HRPR TODO: Do we need to ensure endianness of S? */
 
     // HRPR TODO check this is behaving correctly (i.e. concat above correct)
-    if (blake2b_init(S, HS_POW_HASH_LEN) < 0)
-      return -1;
+    if (blake2b_init(S, HS_POW_HASH_LEN) < 0) {
+      equix_free(ctx);
+      break;
+    }
     blake2b_update(S, challenge, challenge_len);
     blake2b_update(S, &solution[0], HS_POW_EQX_SOL_LEN);
     blake2b_final(S, hash_result, HS_POW_HASH_LEN);
 
     /* Check if R * E <= UINT32_MAX, succeed if so. */
-    uint32_t hash_result_netorder = tor_htonl(get_uint32(hash_result)); // TODO
+    uint32_t hash_result_netorder = tor_htonl(get_uint32(hash_result));
     if ((uint64_t)hash_result_netorder * effort <= UINT32_MAX) {
       success = 1;
 
-      /* Temporary logging. */
-      log_err(LD_REND, "Success after %u attempts. INT_32(R)*E = %lu <= %u.",
-              count, (uint64_t)hash_result_netorder * effort, UINT32_MAX);
-      char hex_challenge[2 * challenge_len + 1];
-      memset(hex_challenge, 0, 2 * challenge_len + 1);
-      base16_encode(hex_challenge, 2 * challenge_len + 1, challenge,
-                    challenge_len);
-      log_err(LD_REND, "C || N || INT_32(E): %s", hex_challenge);
-      log_err(LD_REND, "S: %s", hex_str(&solution[0], 16));
+      log_debug(LD_REND, "PoW solved after %" PRIu64 " attempts.", count);
 
       /* Store the information required in a solution */
       pow_solution_out->nonce = nonce;
@@ -196,58 +271,575 @@ solve_pow(hs_desc_pow_params_t *pow_params,
     }
   }
 
+  tor_free(challenge);
   return ret;
 }
 
-/** Verify the solution in pow_solution using the service's current PoW
- * parameters found in pow_state. Returns 0 on success and -1 otherwise. Called
- * by the service. */
+/** Solve the EquiX/blake2b PoW scheme using the parameters in pow_params, and
+ * store the solution in pow_solution_out. The effort is the suggested one.
+ * Returns 0 on success and -1 otherwise. This blocks until a solution is
+ * found; the client uses hs_pow_queue_work() instead so the main loop keeps
+ * running. */
 int
-verify_pow(hs_service_pow_state_t *pow_state, hs_pow_solution_t *pow_solution)
+solve_pow(hs_desc_pow_params_t *pow_params,
+          hs_pow_solution_t *pow_solution_out)
 {
-  nonce_cache_entry_t search;
-  nonce_cache_entry_t *found;
-  int ret = -1;
-  uint8_t *seed;
+  uint128_t nonce;
+
+  /* Generate a random nonce so start with. */
+  crypto_rand((char *)&nonce, HS_POW_NONCE_LEN);
+
+  return solve_pow_impl(pow_params, pow_params->suggested_effort, nonce,
+                        pow_solution_out, NULL);
+}
+
+/** Upper bound on the number of cpuworkers a single solve is split across. */
+#define HS_POW_MAX_SOLVER_THREADS 128
+
+struct hs_pow_solve_job_t;
+
+/** One slice of a client-side PoW solve, handed to a cpuworker. The worker
+ * only touches nonce_start, result and solution here, and the pow_params and
+ * stop fields of its job. */
+typedef struct hs_pow_solve_worker_t {
+  /** The solve this slice belongs to. */
+  struct hs_pow_solve_job_t *job;
+  /** The workqueue entry, used to cancel the slice before a worker takes
+   * it. */
+  workqueue_entry_t *work;
+  /** First nonce of this slice of the nonce space. */
+  uint128_t nonce_start;
+  /** Output of the solve: 0 on success and -1 otherwise. */
+  int result;
+  /** The solution found by the worker, valid iff result is 0. */
+  hs_pow_solution_t solution;
+} hs_pow_solve_worker_t;
+
+/** A client-side PoW solve, split across one or more cpuworkers that each
+ * search a disjoint slice of the nonce space. */
+typedef struct hs_pow_solve_job_t {
+  /** Global identifier of the intro circuit the solution is for, or 0 if we
+   * are computing it ahead of time. We look the circuit up again on reply
+   * since it may have been freed meanwhile. */
+  uint32_t intro_circ_identifier;
+  /** Identity key of the service the solution is for, if we know it. A
+   * solution that its intro circuit doesn't want anymore is kept for the
+   * next introduction to that service. */
+  ed25519_public_key_t service_pk;
+  unsigned int has_service_pk : 1;
+  /** Copy of the descriptor PoW parameters, as the descriptor can go away
+   * while we solve. */
+  hs_desc_pow_params_t pow_params;
+  /** The effort we solve for. */
+  uint32_t effort;
+  /** Set once a worker finds a solution or the main thread no longer wants
+   * one. Every worker of this job stops when it sees it. */
+  atomic_counter_t stop;
+  /** Main thread only: set if the solve was cancelled. */
+  unsigned int abandoned : 1;
+  /** Main thread only: number of workers that haven't replied yet. The job
+   * is freed once this reaches zero. */
+  int n_pending;
+  /** Main thread only: all the slices of this solve. */
+  int n_workers;
+  hs_pow_solve_worker_t **workers;
+} hs_pow_solve_job_t;
+
+/** Release all storage held by the given PoW solve job. */
+static void
+hs_pow_solve_job_free(hs_pow_solve_job_t *job)
+{
+  if (!job)
+    return;
+  for (int i = 0; i < job->n_workers; i++) {
+    tor_free(job->workers[i]);
+  }
+  tor_free(job->workers);
+  atomic_counter_destroy(&job->stop);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Note that one worker of job is gone, and free the job if it was the last
+ * one. */
+static void
+hs_pow_solve_job_note_worker_done(hs_pow_solve_job_t *job)
+{
+  tor_assert(job->n_pending > 0);
+  if (--job->n_pending == 0) {
+    hs_pow_solve_job_free(job);
+  }
+}
+
+/** Return the number of cpuworkers a client PoW solve is split across. By
+ * default, leave at least one CPU's worth of the pool to other jobs, such as
+ * onionskins if we are also a relay. */
+static int
+get_pow_solver_threads(void)
+{
+  const or_options_t *options = get_options();
+  int n = options->ClientOnionPoWSolverThreads;
+
+  if (n == 0) {
+    n = get_num_cpus(options) - 1;
+  }
+  return MIN(MAX(n, 1), HS_POW_MAX_SOLVER_THREADS);
+}
+
+/** Worker thread function: search our slice of the nonce space. */
+static workqueue_reply_t
+hs_pow_worker_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  hs_pow_solve_worker_t *worker = work_;
+  hs_pow_solve_job_t *job = worker->job;
+
+  worker->result = solve_pow_impl(&job->pow_params, job->effort,
+                                  worker->nonce_start, &worker->solution,
+                                  &job->stop);
+  if (worker->result == 0) {
+    /* We won: the other workers can give up. */
+    atomic_counter_add(&job->stop, 1);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Keep the solution found by worker, which no intro circuit wants, for the
+ * next introduction to the service of its job. */
+static void
+hs_pow_worker_keep_solution(const hs_pow_solve_worker_t *worker)
+{
+  const hs_pow_solve_job_t *job = worker->job;
+
+  if (worker->result < 0 || !job->has_service_pk) {
+    return;
+  }
+  hs_client_pow_note_solution(&job->service_pk, &worker->solution,
+                              job->pow_params.expiration_time);
+}
+
+/** Main thread function: a worker finished (or abandoned) its slice of the
+ * solve. Hand the first solution to its intro circuit and retry the pending
+ * streams so the INTRODUCE1 cell goes out. */
+static void
+hs_pow_worker_replyfn(void *work_)
+{
+  hs_pow_solve_worker_t *worker = work_;
+  hs_pow_solve_job_t *job = worker->job;
+  origin_circuit_t *intro_circ;
+
+  /* The workqueue frees the entry once we return. */
+  worker->work = NULL;
+
+  /* Cancelled, or another worker already delivered its solution. A solution
+   * found meanwhile is still good for another introduction. */
+  if (job->abandoned) {
+    hs_pow_worker_keep_solution(worker);
+    goto done;
+  }
+
+  /* This slice failed but others might still succeed. */
+  if (worker->result < 0 && job->n_pending > 1) {
+    goto done;
+  }
+
+  job->abandoned = 1;
+
+  /* Computed ahead of time: it goes to the client cache. */
+  if (job->intro_circ_identifier == 0) {
+    hs_client_pow_precompute_done(&job->service_pk,
+                                  worker->result == 0 ? &worker->solution
+                                                      : NULL,
+                                  job->pow_params.expiration_time);
+    goto done;
+  }
+
+  intro_circ = circuit_get_by_global_id(job->intro_circ_identifier);
+  if (intro_circ == NULL || intro_circ->hs_pow_job != job) {
+    hs_pow_worker_keep_solution(worker);
+    goto done;
+  }
+  intro_circ->hs_pow_job = NULL;
+
+  if (worker->result < 0) {
+    log_info(LD_REND, "Unable to solve the PoW for intro circuit %u. "
+             "Closing it.", TO_CIRCUIT(intro_circ)->n_circ_id);
+    circuit_mark_for_close(TO_CIRCUIT(intro_circ), END_CIRC_REASON_INTERNAL);
+    goto done;
+  }
+
+  tor_free(intro_circ->hs_pow_solution);
+  intro_circ->hs_pow_solution = tor_memdup(&worker->solution,
+                                           sizeof(worker->solution));
+
+  /* The streams waiting on this intro circuit stalled while we solved; send
+   * the INTRODUCE1 cell now that we have a solution. */
+  connection_ap_attach_pending(1);
+
+ done:
+  hs_pow_solve_job_note_worker_done(job);
+}
+
+/** Return a new PoW solve job for the given descriptor PoW parameters and
+ * effort. */
+static hs_pow_solve_job_t *
+hs_pow_solve_job_new(const hs_desc_pow_params_t *pow_params, uint32_t effort,
+                     int n_workers)
+{
+  hs_pow_solve_job_t *job = tor_malloc_zero(sizeof(*job));
+
+  memcpy(&job->pow_params, pow_params, sizeof(job->pow_params));
+  /* The type string is owned by the descriptor; we don't need it. */
+  job->pow_params.type = NULL;
+  job->effort = effort;
+  atomic_counter_init(&job->stop);
+  job->workers = tor_calloc(n_workers, sizeof(hs_pow_solve_worker_t *));
+  return job;
+}
+
+/** Split the nonce space of job into n_workers disjoint slices and queue a
+ * cpuworker for each. Return the number of workers queued. If none could be,
+ * the job is freed.
+ *
+ * The slices run at low priority: a solve can take a long time, and must not
+ * hold back the other work of the cpuworkers. */
+static int
+hs_pow_solve_job_queue(hs_pow_solve_job_t *job, int n_workers)
+{
+  uint128_t nonce_base, slice_len;
+
+  /* Random start so that clients don't all walk the same nonces, then one
+   * equal slice of the 128-bit nonce space per worker. */
+  crypto_rand((char *) &nonce_base, HS_POW_NONCE_LEN);
+  slice_len = ((uint128_t) -1) / n_workers;
+
+  for (int i = 0; i < n_workers; i++) {
+    hs_pow_solve_worker_t *worker = tor_malloc_zero(sizeof(*worker));
+    worker->job = job;
+    worker->nonce_start = nonce_base + slice_len * i;
+    worker->result = -1;
+
+    worker->work = cpuworker_queue_work(WQ_PRI_LOW, hs_pow_worker_threadfn,
+                                        hs_pow_worker_replyfn, worker);
+    if (!worker->work) {
+      log_warn(LD_BUG, "Couldn't queue PoW solve on the threadpool");
+      tor_free(worker);
+      break;
+    }
+    job->workers[job->n_workers++] = worker;
+    job->n_pending++;
+  }
+
+  if (job->n_workers == 0) {
+    hs_pow_solve_job_free(job);
+    return 0;
+  }
+  return job->n_workers;
+}
+
+/** Queue a PoW solve at the given effort for the INTRODUCE1 cell we will send
+ * on intro_circ using the given descriptor PoW parameters. The nonce space is
+ * split into ClientOnionPoWSolverThreads disjoint slices, each searched by
+ * its own cpuworker; the first one to find a solution stops the others. On
+ * reply, the solution is stored in intro_circ->hs_pow_solution. Return 0 on
+ * success and -1 if the job could not be queued. */
+int
+hs_pow_queue_work(origin_circuit_t *intro_circ,
+                  const hs_desc_pow_params_t *pow_params, uint32_t effort)
+{
+  hs_pow_solve_job_t *job;
+  int n_workers;
+
+  tor_assert(intro_circ);
+  tor_assert(pow_params);
+
+  /* Already solving for this circuit. */
+  if (intro_circ->hs_pow_job) {
+    return 0;
+  }
+
+  n_workers = get_pow_solver_threads();
+
+  job = hs_pow_solve_job_new(pow_params, effort, n_workers);
+  job->intro_circ_identifier = intro_circ->global_identifier;
+  if (intro_circ->hs_ident) {
+    ed25519_pubkey_copy(&job->service_pk, &intro_circ->hs_ident->identity_pk);
+    job->has_service_pk = 1;
+  }
+
+  if (hs_pow_solve_job_queue(job, n_workers) == 0) {
+    return -1;
+  }
+
+  intro_circ->hs_pow_job = job;
+  return 0;
+}
+
+/** Queue a PoW solve at the given effort for a future introduction to the
+ * service with identity key service_pk, using the given descriptor PoW
+ * parameters. This is a background job: it uses a single cpuworker. On
+ * reply, the solution goes to hs_client_pow_precompute_done(). Return 0 on
+ * success and -1 if the job could not be queued. */
+int
+hs_pow_queue_precompute(const ed25519_public_key_t *service_pk,
+                        const hs_desc_pow_params_t *pow_params,
+                        uint32_t effort)
+{
+  hs_pow_solve_job_t *job;
+
+  tor_assert(service_pk);
+  tor_assert(pow_params);
+
+  job = hs_pow_solve_job_new(pow_params, effort, 1);
+  ed25519_pubkey_copy(&job->service_pk, service_pk);
+  job->has_service_pk = 1;
+
+  return hs_pow_solve_job_queue(job, 1) ? 0 : -1;
+}
+
+/** Cancel any PoW solve pending for intro_circ. This is safe to call on any
+ * origin circuit and more than once. */
+void
+hs_pow_cancel_work(origin_circuit_t *intro_circ)
+{
+  hs_pow_solve_job_t *job;
+
+  tor_assert(intro_circ);
+
+  job = intro_circ->hs_pow_job;
+  if (job == NULL) {
+    return;
+  }
+  intro_circ->hs_pow_job = NULL;
+  job->abandoned = 1;
+
+  /* Ask the running workers to stop; their replies free the job. */
+  atomic_counter_add(&job->stop, 1);
+
+  /* The slices no worker picked up yet will never reply. Careful: the job is
+   * freed with its last slice. */
+  for (int i = 0, n = job->n_workers; i < n; i++) {
+    hs_pow_solve_worker_t *worker = job->workers[i];
+    if (worker && worker->work && workqueue_entry_cancel(worker->work)) {
+      job->workers[i] = NULL;
+      tor_free(worker);
+      if (job->n_pending == 1) {
+        hs_pow_solve_job_note_worker_done(job);
+        return;
+      }
+      job->n_pending--;
+    }
+  }
+}
+
+/** Allocate a new E-quiX verification context, compiling HashX when the
+ * platform supports it. Verifying doesn't need the solver heap, so this is
+ * much cheaper than a solve context. Return NULL if the context can't be
+ * allocated. Safe to call from any thread. */
+equix_ctx *
+hs_pow_verify_ctx_new(void)
+{
+  equix_ctx *ctx = equix_alloc(EQUIX_CTX_VERIFY | EQUIX_CTX_COMPILE);
+  if (ctx == EQUIX_NOTSUPP) {
+    /* No HashX compiler for this platform: use the interpreter. */
+    ctx = equix_alloc(EQUIX_CTX_VERIFY);
+  }
+  if (ctx == EQUIX_NOTSUPP) {
+    ctx = NULL;
+  }
+  return ctx;
+}
+
+/** Upper bound on the number of idle verification contexts we keep around.
+ * One per cpuworker is all we need. */
+#define HS_POW_VERIFY_CTX_POOL_MAX 128
+
+/** Idle E-quiX verification contexts, shared by the cpuworkers. Each one owns
+ * a HashX JIT code buffer: reusing them saves an mmap() and munmap() of that
+ * buffer for every batch of solutions we verify. */
+static smartlist_t *verify_ctx_pool = NULL;
+/** Protects verify_ctx_pool. */
+static tor_mutex_t verify_ctx_pool_mutex;
+
+/** Take a verification context from the pool, or allocate a new one if the
+ * pool is empty. Give it back with hs_pow_verify_ctx_release() once done.
+ * Return NULL if the context can't be allocated. Safe to call from any
+ * thread. */
+equix_ctx *
+hs_pow_verify_ctx_acquire(void)
+{
+  equix_ctx *ctx = NULL;
+
+  if (verify_ctx_pool) {
+    tor_mutex_acquire(&verify_ctx_pool_mutex);
+    ctx = smartlist_pop_last(verify_ctx_pool);
+    tor_mutex_release(&verify_ctx_pool_mutex);
+  }
+  if (ctx == NULL) {
+    ctx = hs_pow_verify_ctx_new();
+  }
+  return ctx;
+}
+
+/** Give a verification context obtained from hs_pow_verify_ctx_acquire()
+ * back to the pool, or free it if the pool is full. Safe to call from any
+ * thread. */
+void
+hs_pow_verify_ctx_release(equix_ctx *ctx)
+{
+  if (!ctx)
+    return;
+
+  if (verify_ctx_pool) {
+    tor_mutex_acquire(&verify_ctx_pool_mutex);
+    if (smartlist_len(verify_ctx_pool) < HS_POW_VERIFY_CTX_POOL_MAX) {
+      smartlist_add(verify_ctx_pool, ctx);
+      ctx = NULL;
+    }
+    tor_mutex_release(&verify_ctx_pool_mutex);
+  }
+  equix_free(ctx);
+}
+
+/** Set up the pool of verification contexts. Until this is called, contexts
+ * are allocated and freed on every use. */
+void
+hs_pow_init(void)
+{
+  if (verify_ctx_pool)
+    return;
+  tor_mutex_init_nonrecursive(&verify_ctx_pool_mutex);
+  verify_ctx_pool = smartlist_new();
+}
+
+/** Free all the verification contexts of the pool. */
+void
+hs_pow_free_all(void)
+{
+  if (!verify_ctx_pool)
+    return;
+  SMARTLIST_FOREACH(verify_ctx_pool, equix_ctx *, ctx, equix_free(ctx));
+  smartlist_free(verify_ctx_pool);
+  tor_mutex_uninit(&verify_ctx_pool_mutex);
+}
+
+/** Return the E-quiX verification context of the given service PoW state,
+ * allocating it on first use. It is reused for every INTRODUCE2 cell. Return
+ * NULL if the context can't be allocated. */
+static equix_ctx *
+get_verify_ctx(hs_service_pow_state_t *pow_state)
+{
+  if (pow_state->verify_ctx == NULL) {
+    pow_state->verify_ctx = hs_pow_verify_ctx_acquire();
+  }
+  return pow_state->verify_ctx;
+}
+
+/** Release the resources held by the given service PoW state that were
+ * allocated by this module. */
+void
+hs_pow_free_service_state_resources(hs_service_pow_state_t *pow_state)
+{
+  if (!pow_state)
+    return;
+  hs_pow_verify_ctx_release(pow_state->verify_ctx);
+  pow_state->verify_ctx = NULL;
+  replay_cache_free(pow_state->replay_cache_current);
+  replay_cache_free(pow_state->replay_cache_previous);
+}
+
+/** Return the seed in pow_state that the given solution was computed with, or
+ * NULL if the seed head matches neither our current nor previous seed. */
+static const uint8_t *
+get_seed_for_solution(const hs_service_pow_state_t *pow_state,
+                      const hs_pow_solution_t *pow_solution)
+{
+  if (get_uint32(pow_state->seed_current) == pow_solution->seed_head) {
+    log_debug(LD_REND, "Seed head matched current seed.");
+    return pow_state->seed_current;
+  } else if (get_uint32(pow_state->seed_previous) == pow_solution->seed_head) {
+    log_debug(LD_REND, "Seed head matched previous seed.");
+    return pow_state->seed_previous;
+  }
+  log_debug(LD_REND, "Seed head didn't match either seed.");
+  return NULL;
+}
+
+/** Return true iff the (nonce, seed) tuple of pow_solution is in the replay
+ * cache of pow_state. The replay cache is made of Bloom filters, so this can
+ * wrongly return true for a fresh solution, with a probability of about
+ * 0.02% per HS_POW_REPLAY_CACHE_MAX_ENTRIES solutions seen with its seed.
+ * Main thread only. */
+int
+hs_pow_replay_cache_contains(const hs_service_pow_state_t *pow_state,
+                             const hs_pow_solution_t *pow_solution)
+{
+  hs_pow_replay_cache_t **slot;
+
+  tor_assert(pow_state);
+  tor_assert(pow_solution);
+
+  /* The state isn't modified, we only need the slot of the right seed. */
+  slot = get_replay_cache_slot((hs_service_pow_state_t *) pow_state,
+                               pow_solution);
+  if (slot == NULL || *slot == NULL) {
+    return 0;
+  }
+  return replay_cache_probably_contains(*slot, &pow_solution->nonce);
+}
+
+/** Do the checks on pow_solution that depend on the service state and are
+ * cheap: the effort is at least the minimum and the seed head is one of
+ * ours. On success, return 0 and set seed_out to the seed the solution was
+ * computed with. Return -1 otherwise. Replays are checked separately with
+ * hs_pow_replay_cache_contains(). Main thread only. */
+int
+hs_pow_check_solution_params(const hs_service_pow_state_t *pow_state,
+                             const hs_pow_solution_t *pow_solution,
+                             const uint8_t **seed_out)
+{
+  const uint8_t *seed;
+
+  tor_assert(pow_state);
+  tor_assert(pow_solution);
 
   /* Fail if E = POW_EFFORT is lower than the minimum effort. */
   if (pow_solution->effort < pow_state->min_effort) {
-    log_err(LD_REND, "Effort used in solution is less than the minimum effort "
-                     "required by the service.");
-    goto done;
+    log_debug(LD_REND, "Effort used in solution is less than the minimum "
+                       "effort required by the service.");
+    return -1;
   }
 
   /* Find a valid seed C that starts with the seed head. Fail if no such seed
    * exists. */
-  if (get_uint32(pow_state->seed_current) == pow_solution->seed_head) {
-    log_err(LD_REND, "Seed head matched current seed.");
-    seed = pow_state->seed_current;
-  } else if (get_uint32(pow_state->seed_previous) == pow_solution->seed_head) {
-    log_err(LD_REND, "Seed head matched previous seed.");
-    seed = pow_state->seed_previous;
-  } else {
-    log_err(LD_REND, "Seed head didn't match either seed.");
-    goto done;
+  seed = get_seed_for_solution(pow_state, pow_solution);
+  if (seed == NULL) {
+    return -1;
   }
 
-  /* HRPR TODO Fail if N = POW_NONCE is present in the replay cache. */
-  search.nonce = pow_solution->nonce;
-  search.seed_head = pow_solution->seed_head;
-  found = HT_FIND(nonce_cache_table, &nonce_cache_table, &search);
-  if (found) {
-    log_err(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
-    goto done;
-  } else {
-    log_err(LD_REND,
-            "The (nonce, seed) tuple was not already in the replay cache.");
+  if (seed_out) {
+    *seed_out = seed;
   }
+  return 0;
+}
+
+/** Check that pow_solution is a valid solution for the given seed: that
+ * R * E <= UINT32_MAX and that equix_verify() accepts it, using the
+ * verification context ctx. This touches no global state so it can run on a
+ * worker thread, given a ctx that only that thread uses. Return 0 if the
+ * solution is valid and -1 otherwise. */
+int
+hs_pow_verify_solution(equix_ctx *ctx, const uint8_t *seed,
+                       const hs_pow_solution_t *pow_solution)
+{
+  tor_assert(ctx);
+  tor_assert(seed);
+  tor_assert(pow_solution);
 
   /* Build EquiX challenge (C || N || INT_32(E)) */
   size_t offset = 0;
-  size_t challenge_len = HS_POW_SEED_LEN + HS_POW_NONCE_LEN + sizeof(uint32_t);
-  uint8_t *challenge = NULL;
-
-  challenge = tor_malloc_zero(challenge_len);
+  uint8_t challenge[HS_POW_SEED_LEN + HS_POW_NONCE_LEN + sizeof(uint32_t)];
+  const size_t challenge_len = sizeof(challenge);
 
   memcpy(challenge, seed, HS_POW_SEED_LEN);
   offset += HS_POW_SEED_LEN;
@@ -262,41 +854,99 @@ verify_pow(hs_service_pow_state_t *pow_state, hs_pow_solution_t *pow_solution)
   blake2b_state S[1];
 
   if (blake2b_init(S, HS_POW_HASH_LEN) < 0)
-    return -1; // TODO
+    return -1;
   blake2b_update(S, challenge, challenge_len);
-  blake2b_update(S, &pow_solution->equix_solution, HS_POW_EQX_SOL_LEN);
+  blake2b_update(S, (const uint8_t *) &pow_solution->equix_solution,
+                 HS_POW_EQX_SOL_LEN);
   blake2b_final(S, hash_result, HS_POW_HASH_LEN);
 
   uint32_t hash_result_netorder = tor_htonl(get_uint32(hash_result));
   if ((uint64_t)hash_result_netorder * pow_solution->effort > UINT32_MAX) {
-    log_err(LD_REND, "Product of b2 hash and effort was too large.");
-    goto done;
+    log_debug(LD_REND, "Product of b2 hash and effort was too large.");
+    return -1;
   }
 
   /* Fail if equix_verify(C || N || E, S) != EQUIX_OK */
-  equix_ctx *ctx = NULL;
-  equix_solution solution[EQUIX_MAX_SOLS];
-  ctx = equix_alloc(EQUIX_CTX_SOLVE);
-
-  int num_solutions = 0;
   equix_result result = equix_verify(ctx, challenge, challenge_len,
                                      &pow_solution->equix_solution);
   if (!(result == EQUIX_OK)) {
-    // log_err(LD_REND, "EquiX solution: OK, %d solutions", num_solutions);
-    log_err(LD_REND, "Verification of EquiX solution in PoW failed.");
-    goto done;
+    log_debug(LD_REND, "Verification of EquiX solution in PoW failed.");
+    return -1;
   }
 
-  /* PoW verified successfully. */
-  ret = 0;
+  return 0;
+}
+
+/** Add the (nonce, seed) tuple of a verified pow_solution to the replay
+ * cache of pow_state. Return 0 on success, or -1 if it was already there, in
+ * which case the solution is a replay and must be rejected, or if its seed is
+ * no longer ours. Main thread only. */
+int
+hs_pow_replay_cache_add(hs_service_pow_state_t *pow_state,
+                        const hs_pow_solution_t *pow_solution)
+{
+  hs_pow_replay_cache_t **slot;
+  hs_pow_replay_cache_t *cache;
 
-  /* Add the (nonce, seed) tuple to the replay cache HRPR TODO move? */
-  log_err(LD_REND, "Adding (nonce, seed) tuple to the replay cache.");
-  found = tor_malloc_zero(sizeof(nonce_cache_entry_t));
-  found->nonce = pow_solution->nonce;
-  found->seed_head = pow_solution->seed_head;
-  HT_INSERT(nonce_cache_table, &nonce_cache_table, found);
+  tor_assert(pow_state);
+  tor_assert(pow_solution);
 
-done:
-  return ret;
-}
\ No newline at end of file
+  slot = get_replay_cache_slot(pow_state, pow_solution);
+  if (slot == NULL) {
+    return -1;
+  }
+  if (*slot == NULL) {
+    *slot = replay_cache_new();
+  }
+  cache = *slot;
+
+  if (replay_cache_probably_contains(cache, &pow_solution->nonce)) {
+    log_debug(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
+    return -1;
+  }
+
+  /* Don't overfill a filter: its false positive rate would grow without
+   * bound. Keep it for lookups and add to a fresh one. */
+  if (cache->n_entries_last >= HS_POW_REPLAY_CACHE_MAX_ENTRIES) {
+    log_info(LD_REND, "PoW replay cache filter is full for this seed. "
+                      "Starting filter number %d.",
+             smartlist_len(cache->filters) + 1);
+    replay_cache_add_filter(cache);
+  }
+
+  log_debug(LD_REND, "Adding (nonce, seed) tuple to the replay cache.");
+  bloomfilt_add(smartlist_get(cache->filters,
+                              smartlist_len(cache->filters) - 1),
+                &pow_solution->nonce);
+  cache->n_entries_last++;
+  cache->n_entries++;
+  return 0;
+}
+
+/** Verify the solution in pow_solution using the service's current PoW
+ * parameters found in pow_state, and add it to the replay cache if it is
+ * valid. Returns 0 on success and -1 otherwise. Called by the service. */
+int
+verify_pow(hs_service_pow_state_t *pow_state, hs_pow_solution_t *pow_solution)
+{
+  const uint8_t *seed = NULL;
+  equix_ctx *ctx;
+
+  if (hs_pow_check_solution_params(pow_state, pow_solution, &seed) < 0 ||
+      hs_pow_replay_cache_contains(pow_state, pow_solution)) {
+    return -1;
+  }
+
+  ctx = get_verify_ctx(pow_state);
+  if (ctx == NULL) {
+    log_warn(LD_REND, "Unable to allocate an E-quiX verification context.");
+    return -1;
+  }
+
+  if (hs_pow_verify_solution(ctx, seed, pow_solution) < 0) {
+    return -1;
+  }
+
+  /* PoW verified successfully. */
+  return hs_pow_replay_cache_add(pow_state, pow_solution);
+}
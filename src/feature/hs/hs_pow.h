@@ -14,8 +14,10 @@ typedef unsigned __int128 uint128_t;
 
 #include <stdint.h>
 #include "ext/equix/include/equix.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
 /* HRPR TODO For event in state, which im not sure on */
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/token_bucket.h"
 
 #define HS_POW_SUGGESTED_EFFORT_DEFAULT 100 // HRPR TODO 5000
 /* Service updates the suggested effort every HS_UPDATE_PERIOD seconds. */
@@ -27,6 +29,12 @@ typedef unsigned __int128 uint128_t;
 #define HS_POW_EQX_SOL_LEN 16
 /** Length of blake2b hash result (R) used in the PoW scheme. */
 #define HS_POW_HASH_LEN 4
+/** Number of solutions each Bloom filter of a replay cache holds. Each filter
+ * takes about 4 bytes per entry (1 MiB), whether it fills up or not, and a
+ * seed gets another filter every time the last one is full. */
+#define HS_POW_REPLAY_CACHE_MAX_ENTRIES (1<<18)
+
+typedef struct hs_pow_replay_cache_t hs_pow_replay_cache_t;
 
 /** State and parameters of PoW defenses, stored in the service state. */
 typedef struct hs_service_pow_state_t {
@@ -40,6 +48,10 @@ typedef struct hs_service_pow_state_t {
    * the service's priority queue; higher effort is higher priority. */
   mainloop_event_t *pop_pqueue_ev;
 
+  /* Limits the rate at which we launch rendezvous circuits for the requests
+   * in the priority queue to what the service can sustain. */
+  token_bucket_ctr_t pqueue_bucket;
+
   /* The current seed being used in the PoW defenses. */
   uint8_t seed_current[HS_POW_SEED_LEN];
 
@@ -60,12 +72,31 @@ typedef struct hs_service_pow_state_t {
   /* The following values are used when calculating and updating the suggested
    * effort every HS_UPDATE_PERIOD seconds. */
 
-  /* Number of intro requests the service can handle per second. */
-  uint32_t svc_bottom_capacity;
   /* The next time at which to update the suggested effort. */
   time_t next_effort_update;
-  /* Sum of effort of all valid requests received since the last update. */
+  /* Sum of effort of the requests we launched a rendezvous circuit for since
+   * the last update. */
   uint64_t total_effort;
+  /* Number of requests we launched a rendezvous circuit for since the last
+   * update. */
+  uint32_t rend_handled;
+  /* Highest effort of the requests dropped from the priority queue since the
+   * last update, either because it was full or because they waited too
+   * long. */
+  uint32_t max_trimmed_effort;
+  /* True iff the priority queue wasn't empty at the last update. */
+  unsigned int had_queue : 1;
+
+  /* E-quiX context used to verify every solution we receive. Verification
+   * only needs a verify-mode context, so we allocate it once on first use
+   * rather than per INTRODUCE2 cell. */
+  equix_ctx *verify_ctx;
+
+  /* Replay caches of the solutions we accepted for the current and previous
+   * seed. The previous one is dropped as a whole when the seeds rotate.
+   * NULL until we accept a solution for that seed. */
+  hs_pow_replay_cache_t *replay_cache_current;
+  hs_pow_replay_cache_t *replay_cache_previous;
 } hs_service_pow_state_t;
 
 /* Struct to store a solution to the PoW challenge. */
@@ -86,9 +117,37 @@ typedef struct hs_pow_solution_t {
 } hs_pow_solution_t;
 
 /* API */
+void hs_pow_init(void);
+void hs_pow_free_all(void);
+
 int solve_pow(hs_desc_pow_params_t *pow_params,
               hs_pow_solution_t *pow_solution_out);
 
+struct origin_circuit_t;
+int hs_pow_queue_work(struct origin_circuit_t *intro_circ,
+                      const hs_desc_pow_params_t *pow_params,
+                      uint32_t effort);
+int hs_pow_queue_precompute(const ed25519_public_key_t *service_pk,
+                            const hs_desc_pow_params_t *pow_params,
+                            uint32_t effort);
+void hs_pow_cancel_work(struct origin_circuit_t *intro_circ);
+
 int verify_pow(hs_service_pow_state_t *pow_state, hs_pow_solution_t *pow_solution);
+void hs_pow_free_service_state_resources(hs_service_pow_state_t *pow_state);
+
+int hs_pow_check_solution_params(const hs_service_pow_state_t *pow_state,
+                                 const hs_pow_solution_t *pow_solution,
+                                 const uint8_t **seed_out);
+equix_ctx *hs_pow_verify_ctx_new(void);
+equix_ctx *hs_pow_verify_ctx_acquire(void);
+void hs_pow_verify_ctx_release(equix_ctx *ctx);
+int hs_pow_verify_solution(equix_ctx *ctx, const uint8_t *seed,
+                           const hs_pow_solution_t *pow_solution);
+int hs_pow_replay_cache_contains(const hs_service_pow_state_t *pow_state,
+                                 const hs_pow_solution_t *pow_solution);
+int hs_pow_replay_cache_add(hs_service_pow_state_t *pow_state,
+                            const hs_pow_solution_t *pow_solution);
+uint32_t hs_pow_replay_cache_len(const hs_service_pow_state_t *pow_state);
+uint32_t hs_pow_rotate_replay_cache(hs_service_pow_state_t *pow_state);
 
 #endif /* !defined(TOR_HS_POW_H) */
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include "app/config/config.h"
 #include "app/config/statefile.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
@@ -33,6 +34,7 @@
 #include "lib/crypt_ops/crypto_ope.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 
 #include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_common.h"
@@ -258,8 +260,12 @@ set_service_default_config(hs_service_config_t *c,
   /* HRPR */
   c->has_pow_defenses_enabled = HS_CONFIG_V3_POW_DEFENSES_DEFAULT;
   c->pow_min_effort = HS_CONFIG_V3_POW_DEFENSES_MIN_EFFORT_DEFAULT;
-  c->pow_svc_bottom_capacity =
-      HS_CONFIG_V3_POW_DEFENSES_SVC_BOTTOM_CAPACITY_DEFAULT;
+  c->pow_queue_rate = HS_CONFIG_V3_POW_QUEUE_RATE_DEFAULT;
+  c->pow_queue_burst = HS_CONFIG_V3_POW_QUEUE_BURST_DEFAULT;
+  c->pow_queue_max_depth = HS_CONFIG_V3_POW_QUEUE_MAX_DEPTH_DEFAULT;
+  c->pow_queue_max_age = HS_CONFIG_V3_POW_QUEUE_MAX_AGE_DEFAULT;
+  c->introduce2_rate_per_sec = HS_CONFIG_V3_INTRO2_RATE_PER_SEC_DEFAULT;
+  c->introduce2_burst_per_sec = HS_CONFIG_V3_INTRO2_BURST_PER_SEC_DEFAULT;
 }
 
 /** HRPR: Initialize PoW defenses */
@@ -280,10 +286,14 @@ initialize_pow_defenses(hs_service_t *service) {
   /* We recalculate and update the suggested effort every HS_UPDATE_PERIOD
    * seconds. */
   pow_state->suggested_effort = HS_POW_SUGGESTED_EFFORT_DEFAULT;
-  pow_state->svc_bottom_capacity = service->config.pow_svc_bottom_capacity;
   pow_state->total_effort = 0;
   pow_state->next_effort_update = (time(NULL) + HS_UPDATE_PERIOD);
 
+  token_bucket_ctr_init(&pow_state->pqueue_bucket,
+                        service->config.pow_queue_rate,
+                        service->config.pow_queue_burst,
+                        (uint32_t) approx_time());
+
   /* Generate the random seeds. We generate both as we don't want the previous
    * seed to be predictable even if it doesn't really exist yet, and it needs
    * to be different to the current nonce for the replay cache scrubbing to
@@ -315,11 +325,14 @@ static void
 free_pow_state(hs_service_t *service)
 {
   log_err(LD_REND, "Freeing rend_request_pqueue...");
+  rend_pqueue_clear(service->state.pow_state);
   smartlist_free(service->state.pow_state->rend_request_pqueue);
 
   log_err(LD_REND, "Freeing pop_pqueue_ev mainloop event...");
   mainloop_event_free(service->state.pow_state->pop_pqueue_ev);
 
+  hs_pow_free_service_state_resources(service->state.pow_state);
+
   log_err(LD_REND, "Freeing service pow_state...");
   tor_free(service->state.pow_state);
 }
@@ -625,9 +638,9 @@ service_intro_point_remove(const hs_service_t *service,
 
 /** For a given service and authentication key, return the intro point or NULL
  * if not found. This will check both descriptors in the service. */
-STATIC hs_service_intro_point_t *
-service_intro_point_find(const hs_service_t *service,
-                         const ed25519_public_key_t *auth_key)
+hs_service_intro_point_t *
+hs_service_intro_point_find(const hs_service_t *service,
+                            const ed25519_public_key_t *auth_key)
 {
   hs_service_intro_point_t *ip = NULL;
 
@@ -700,7 +713,7 @@ get_objects_from_ident(const hs_ident_circuit_t *ident,
   /* From the service object, get the intro point object of that circuit. The
    * following will query both descriptors intro points list. */
   if (s && ip) {
-    *ip = service_intro_point_find(s, &ident->intro_auth_pk);
+    *ip = hs_service_intro_point_find(s, &ident->intro_auth_pk);
   }
 
   /* Get the descriptor for this introduction point and service. */
@@ -979,8 +992,29 @@ move_hs_state(hs_service_t *src_service, hs_service_t *dst_service)
   }
 
   /* HRPR TODO What if we are enabling/disabling dynamically? */
-  if (src_service->config.has_pow_defenses_enabled) {
-    dst->pow_state = src->pow_state;
+  if (src->pow_defenses_initialized &&
+      dst_service->config.has_pow_defenses_enabled) {
+    hs_service_pow_state_t *pow_state = src->pow_state;
+
+    dst->pow_state = pow_state;
+    dst->pow_defenses_initialized = 1;
+    src->pow_state = NULL; /* steal pointer reference */
+    src->pow_defenses_initialized = 0;
+
+    /* The priority queue event points to the service object, which we are
+     * replacing. Pending requests are handled by the new one. */
+    mainloop_event_free(pow_state->pop_pqueue_ev);
+    if (smartlist_len(pow_state->rend_request_pqueue) > 0) {
+      pow_state->pop_pqueue_ev =
+        mainloop_event_new(handle_rend_pqueue_cb, dst_service);
+      mainloop_event_activate(pow_state->pop_pqueue_ev);
+    }
+    token_bucket_ctr_adjust(&pow_state->pqueue_bucket,
+                            dst_service->config.pow_queue_rate,
+                            dst_service->config.pow_queue_burst);
+    /* The replay caches now count in the new service's metrics. */
+    hs_metrics_pow_replay_cache_entries(dst_service,
+                                        hs_pow_replay_cache_len(pow_state));
   }
 }
 
@@ -1763,6 +1797,14 @@ setup_desc_intro_point(const ed25519_keypair_t *signing_kp,
   return ret;
 }
 
+/** Helper: free an hs_desc_intro_point_t object. This function is used by
+ * digest256map_free() which requires a void * pointer. */
+static void
+desc_intro_point_free_void(void *obj)
+{
+  hs_desc_intro_point_free_(obj);
+}
+
 /** Using the given descriptor from the given service, build the descriptor
  * intro point list so we can then encode the descriptor for publication. This
  * function does not pick intro points, they have to be in the descriptor
@@ -1773,14 +1815,30 @@ build_desc_intro_points(const hs_service_t *service,
                         hs_service_descriptor_t *desc, time_t now)
 {
   hs_desc_encrypted_data_t *encrypted;
+  digest256map_t *previous_ips;
+  time_t nearest_hour = now - (now % 3600);
 
   tor_assert(service);
   tor_assert(desc);
 
   /* Ease our life. */
   encrypted = &desc->desc->encrypted_data;
-  /* Cleanup intro points, we are about to set them from scratch. */
-  hs_descriptor_clear_intro_points(desc->desc);
+
+  /* Take out the intro points we previously built, indexed by auth key. The
+   * ones setup_desc_intro_point() would build the same way, that is with
+   * certificates from this hour, are reused along with their encoding. */
+  previous_ips = digest256map_new();
+  SMARTLIST_FOREACH_BEGIN(encrypted->intro_points,
+                          hs_desc_intro_point_t *, desc_ip) {
+    if (desc_ip->auth_key_cert &&
+        desc_ip->auth_key_cert->valid_until ==
+          nearest_hour + HS_DESC_CERT_LIFETIME) {
+      desc_ip = digest256map_set(previous_ips,
+                           desc_ip->auth_key_cert->signed_key.pubkey, desc_ip);
+    }
+    hs_desc_intro_point_free(desc_ip);
+  } SMARTLIST_FOREACH_END(desc_ip);
+  smartlist_clear(encrypted->intro_points);
 
   DIGEST256MAP_FOREACH(desc->intro_points.map, key,
                        const hs_service_intro_point_t *, ip) {
@@ -1793,14 +1851,21 @@ build_desc_intro_points(const hs_service_t *service,
        * prevents to publish an intro point without a circuit. */
       continue;
     }
-    hs_desc_intro_point_t *desc_ip = hs_desc_intro_point_new();
-    if (setup_desc_intro_point(&desc->signing_kp, ip, now, desc_ip) < 0) {
-      hs_desc_intro_point_free(desc_ip);
-      continue;
+    hs_desc_intro_point_t *desc_ip =
+      digest256map_remove(previous_ips, ip->auth_key_kp.pubkey.pubkey);
+    if (desc_ip == NULL) {
+      desc_ip = hs_desc_intro_point_new();
+      if (setup_desc_intro_point(&desc->signing_kp, ip, now, desc_ip) < 0) {
+        hs_desc_intro_point_free(desc_ip);
+        continue;
+      }
     }
     /* We have a valid descriptor intro point. Add it to the list. */
     smartlist_add(encrypted->intro_points, desc_ip);
   } DIGEST256MAP_FOREACH_END;
+
+  /* Whatever is left is for intro points we don't have anymore. */
+  digest256map_free(previous_ips, desc_intro_point_free_void);
 }
 
 /** Build the descriptor signing key certificate. */
@@ -1815,6 +1880,14 @@ build_desc_signing_key_cert(hs_service_descriptor_t *desc, time_t now)
   /* Ease our life a bit. */
   plaintext = &desc->desc->plaintext_data;
 
+  /* A fresh certificate would expire in the same hour as the one we have, so
+   * keep it rather than signing a new one. */
+  if (plaintext->signing_key_cert &&
+      plaintext->signing_key_cert->valid_until >=
+        now + HS_DESC_CERT_LIFETIME) {
+    return;
+  }
+
   /* Get rid of what we have right now. */
   tor_cert_free(plaintext->signing_key_cert);
 
@@ -1997,10 +2070,12 @@ generate_ope_cipher_for_desc(const hs_service_descriptor_t *hs_desc)
 
 /** For the given service and descriptor object, create the key material which
  * is the blinded keypair, the descriptor signing keypair, the ephemeral
- * keypair, and the descriptor cookie. Return 0 on success else -1 on error
- * where the generated keys MUST be ignored. */
+ * keypair, and the descriptor cookie. If blinded_kp is not NULL, it is the
+ * already computed blinded keypair for the descriptor time period. Return 0
+ * on success else -1 on error where the generated keys MUST be ignored. */
 static int
 build_service_desc_keys(const hs_service_t *service,
+                        const ed25519_keypair_t *blinded_kp,
                         hs_service_descriptor_t *desc)
 {
   int ret = -1;
@@ -2012,15 +2087,19 @@ build_service_desc_keys(const hs_service_t *service,
 
   /* XXX: Support offline key feature (#18098). */
 
-  /* Copy the identity keys to the keypair so we can use it to create the
-   * blinded key. */
-  memcpy(&kp.pubkey, &service->keys.identity_pk, sizeof(kp.pubkey));
-  memcpy(&kp.seckey, &service->keys.identity_sk, sizeof(kp.seckey));
-  /* Build blinded keypair for this time period. */
-  hs_build_blinded_keypair(&kp, NULL, 0, desc->time_period_num,
-                           &desc->blinded_kp);
-  /* Let's not keep too much traces of our keys in memory. */
-  memwipe(&kp, 0, sizeof(kp));
+  if (blinded_kp) {
+    memcpy(&desc->blinded_kp, blinded_kp, sizeof(desc->blinded_kp));
+  } else {
+    /* Copy the identity keys to the keypair so we can use it to create the
+     * blinded key. */
+    memcpy(&kp.pubkey, &service->keys.identity_pk, sizeof(kp.pubkey));
+    memcpy(&kp.seckey, &service->keys.identity_sk, sizeof(kp.seckey));
+    /* Build blinded keypair for this time period. */
+    hs_build_blinded_keypair(&kp, NULL, 0, desc->time_period_num,
+                             &desc->blinded_kp);
+    /* Let's not keep too much traces of our keys in memory. */
+    memwipe(&kp, 0, sizeof(kp));
+  }
 
   /* Compute the OPE cipher struct (it's tied to the current blinded key) */
   log_info(LD_GENERAL,
@@ -2070,9 +2149,9 @@ rotate_pow_seeds(hs_service_t *service)
 
   log_err(LD_REND, "Current C: %s", hex_str(pow_state->seed_current, 32));
 
-  /* Before we overwrite the previous seed lets scrub entries corresponding
-   * to it in the nonce replay cache. */
-  scrub_nonce_cache_for_seed(get_uint32(pow_state->seed_previous));
+  /* Before we overwrite the previous seed, drop its replay cache. */
+  hs_metrics_pow_replay_cache_entries(service,
+                            -(int64_t) hs_pow_rotate_replay_cache(pow_state));
 
   /* Keep track of the current seed that we are now rotating. */
   memcpy(pow_state->seed_previous, pow_state->seed_current, HS_POW_SEED_LEN);
@@ -2104,44 +2183,68 @@ rotate_pow_seeds(hs_service_t *service)
 }
 
 /** HRPR: Every HS_UPDATE_PERIOD seconds, and while PoW defenses are enabled,
- * the service updates its suggested effort for PoW solutions as
- * SUGGESTED_EFFORT = TOTAL_EFFORT / (SVC_BOTTOM_CAPACITY * HS_UPDATE_PERIOD)
- * where TOTAL_EFFORT is the sum of the effort of all valid requests that have
- * been received since the suggested_effort was last updated. */
-static void
-update_suggested_effort(hs_service_t *service)
+ * the service updates its suggested effort for PoW solutions. This is an
+ * additive-increase multiplicative-decrease controller driven by the
+ * rendezvous priority queue over the last period:
+ *
+ *  - Increase if we dropped requests with more than the suggested effort
+ *    from the queue, or if the queue never emptied and what is left in it is
+ *    at least what we served: clients using the suggested effort are being
+ *    starved. The new value is the average effort of the requests we served,
+ *    or one more than the current value if that is larger.
+ *  - Decrease by a third if the queue was empty at both ends of the period:
+ *    clients are paying more than they need to.
+ *
+ * The suggested effort never goes below the minimum effort. Whether the
+ * descriptors are uploaded again depends on how much it changed, see
+ * update_all_descriptors_pow_params(). */
+STATIC void
+update_suggested_effort(hs_service_t *service, time_t now)
 {
-  uint64_t denom;
   uint32_t previous_effort;
+  int queue_len;
 
   /* Make life easier */
   hs_service_pow_state_t *pow_state = service->state.pow_state;
 
-  log_err(LD_REND, "HS_UPDATE_PERIOD seconds have passed, recalculating and "
-                   "updating the suggested effort.");
-
-  log_err(LD_REND, "Current suggested effort: %u",
-          pow_state->suggested_effort);
-
-  /* Store the current suggested effort to compare the new one with. */
   previous_effort = pow_state->suggested_effort;
-
-  /* Calculate the new suggested effort. */
-  /* HRPR TODO Check for overflow in denominator? */
-  denom = (pow_state->svc_bottom_capacity * HS_UPDATE_PERIOD);
-  pow_state->suggested_effort = (pow_state->total_effort / denom);
-
-  log_err(LD_REND, "Recalculated suggested effort: %u",
-          pow_state->suggested_effort);
+  queue_len = smartlist_len(pow_state->rend_request_pqueue);
+
+  if (pow_state->max_trimmed_effort > pow_state->suggested_effort ||
+      (pow_state->had_queue && queue_len > 0 &&
+       (uint32_t) queue_len >= pow_state->rend_handled)) {
+    uint32_t effort = pow_state->suggested_effort;
+    if (effort < UINT32_MAX) {
+      effort++;
+    }
+    if (pow_state->rend_handled > 0) {
+      effort = MAX(effort, (uint32_t) (pow_state->total_effort /
+                                       pow_state->rend_handled));
+    }
+    pow_state->suggested_effort = effort;
+  } else if (!pow_state->had_queue && queue_len == 0) {
+    pow_state->suggested_effort = (uint32_t)
+      (((uint64_t) pow_state->suggested_effort * 2) / 3);
+  }
 
   /* Set suggested effort to max(min_effort, suggested_effort) */
   if (pow_state->suggested_effort < pow_state->min_effort)
     pow_state->suggested_effort = pow_state->min_effort;
 
-  /* Reset the total effort sum for this update period. */
-  log_err(LD_REND, "Resetting total effort and setting next update time...");
+  if (pow_state->suggested_effort != previous_effort) {
+    log_info(LD_REND, "Suggested PoW effort updated from %" PRIu32 " to "
+                      "%" PRIu32 " (queue: %d, served: %" PRIu32 ", highest "
+                      "dropped effort: %" PRIu32 ").",
+             previous_effort, pow_state->suggested_effort, queue_len,
+             pow_state->rend_handled, pow_state->max_trimmed_effort);
+  }
+
+  /* Reset the counters for the next update period. */
   pow_state->total_effort = 0;
-  pow_state->next_effort_update = (time(NULL) + HS_UPDATE_PERIOD);
+  pow_state->rend_handled = 0;
+  pow_state->max_trimmed_effort = 0;
+  pow_state->had_queue = queue_len > 0;
+  pow_state->next_effort_update = now + HS_UPDATE_PERIOD;
 }
 
 /** HRPR: Update or initialise PoW parameters in the descriptors if they do not
@@ -2207,7 +2310,7 @@ update_all_descriptors_pow_params(time_t now) {
       previous_effort = encrypted->pow_params->suggested_effort;
       if (pow_state->suggested_effort <= previous_effort * 0.85 ||
           previous_effort * 1.15 <= pow_state->suggested_effort) {
-        log_err(
+        log_info(
             LD_REND,
             "Suggested effort changed significantly, updating descriptors...");
         encrypted->pow_params->suggested_effort = pow_state->suggested_effort;
@@ -2217,7 +2320,7 @@ update_all_descriptors_pow_params(time_t now) {
         /* The change in suggested effort was not significant enough to
         warrant updating the descriptors, return 0 to reflect they are
         unchanged. */
-        log_err(
+        log_debug(
             LD_REND,
             "Change in suggested effort didn't warrant updating descriptors.");
       }
@@ -2235,11 +2338,13 @@ update_all_descriptors_pow_params(time_t now) {
 /** Given a service and the current time, build a descriptor for the service.
  * This function does not pick introduction point, this needs to be done by
  * the update function. On success, desc_out will point to the newly allocated
- * descriptor object.
+ * descriptor object. The blinded keypair for the time period is derived from
+ * the service identity unless the caller already computed it in blinded_kp.
  *
  * This can error if we are unable to create keys or certificate. */
 static void
 build_service_descriptor(hs_service_t *service, uint64_t time_period_num,
+                         const ed25519_keypair_t *blinded_kp,
                          hs_service_descriptor_t **desc_out)
 {
   char *encoded_desc;
@@ -2254,7 +2359,7 @@ build_service_descriptor(hs_service_t *service, uint64_t time_period_num,
   desc->time_period_num = time_period_num;
 
   /* Create the needed keys so we can setup the descriptor content. */
-  if (build_service_desc_keys(service, desc) < 0) {
+  if (build_service_desc_keys(service, blinded_kp, desc) < 0) {
     goto err;
   }
   /* Setup plaintext descriptor content. */
@@ -2338,18 +2443,65 @@ build_descriptors_for_new_service(hs_service_t *service, time_t now)
   }
 
   /* Build descriptors. */
-  build_service_descriptor(service, current_desc_tp, &service->desc_current);
-  build_service_descriptor(service, next_desc_tp, &service->desc_next);
+  build_service_descriptor(service, current_desc_tp, NULL,
+                           &service->desc_current);
+  build_service_descriptor(service, next_desc_tp, NULL, &service->desc_next);
   log_info(LD_REND, "Hidden service %s has just started. Both descriptors "
                     "built. Now scheduled for upload.",
            safe_str_client(service->onion_address));
 }
 
+/** Build the next descriptor of every service in <b>services</b>. This
+ * happens for all services at once when rotating descriptors so the blinded
+ * keys of the next time period are computed in a single batch. */
+static void
+build_next_descriptors(smartlist_t *services)
+{
+  uint64_t next_tp = hs_get_next_time_period_num(0);
+  int n_services = smartlist_len(services);
+  ed25519_keypair_t *identity_kps, *blinded_kps;
+  const ed25519_keypair_t **identity_kp_ptrs;
+
+  identity_kps = tor_calloc(n_services, sizeof(*identity_kps));
+  identity_kp_ptrs = tor_calloc(n_services, sizeof(*identity_kp_ptrs));
+  blinded_kps = tor_calloc(n_services, sizeof(*blinded_kps));
+
+  SMARTLIST_FOREACH_BEGIN(services, const hs_service_t *, service) {
+    memcpy(&identity_kps[service_sl_idx].pubkey,
+           &service->keys.identity_pk, sizeof(ed25519_public_key_t));
+    memcpy(&identity_kps[service_sl_idx].seckey,
+           &service->keys.identity_sk, sizeof(ed25519_secret_key_t));
+    identity_kp_ptrs[service_sl_idx] = &identity_kps[service_sl_idx];
+  } SMARTLIST_FOREACH_END(service);
+
+  hs_build_blinded_keypairs(identity_kp_ptrs, n_services, NULL, 0, next_tp,
+                            blinded_kps);
+  /* Let's not keep too much traces of our keys in memory. */
+  memwipe(identity_kps, 0, n_services * sizeof(*identity_kps));
+
+  SMARTLIST_FOREACH_BEGIN(services, hs_service_t *, service) {
+    build_service_descriptor(service, next_tp, &blinded_kps[service_sl_idx],
+                             &service->desc_next);
+    if (service->desc_next) {
+      log_info(LD_REND, "Hidden service %s next descriptor successfully "
+                        "built. Now scheduled for upload.",
+               safe_str_client(service->onion_address));
+    }
+  } SMARTLIST_FOREACH_END(service);
+  memwipe(blinded_kps, 0, n_services * sizeof(*blinded_kps));
+
+  tor_free(identity_kps);
+  tor_free(identity_kp_ptrs);
+  tor_free(blinded_kps);
+}
+
 /** Build descriptors for each service if needed. There are conditions to build
  * a descriptor which are details in the function. */
 STATIC void
 build_all_descriptors(time_t now)
 {
+  smartlist_t *need_next_desc = smartlist_new();
+
   FOR_EACH_SERVICE_BEGIN(service) {
 
     /* A service booting up will have both descriptors to NULL. No other cases
@@ -2369,13 +2521,14 @@ build_all_descriptors(time_t now)
     }
 
     if (service->desc_next == NULL) {
-      build_service_descriptor(service, hs_get_next_time_period_num(0),
-                               &service->desc_next);
-      log_info(LD_REND, "Hidden service %s next descriptor successfully "
-                        "built. Now scheduled for upload.",
-               safe_str_client(service->onion_address));
+      smartlist_add(need_next_desc, service);
     }
-  } FOR_EACH_DESCRIPTOR_END;
+  } FOR_EACH_SERVICE_END;
+
+  if (smartlist_len(need_next_desc) > 0) {
+    build_next_descriptors(need_next_desc);
+  }
+  smartlist_free(need_next_desc);
 }
 
 /** Randomly pick a node to become an introduction point but not present in the
@@ -2922,7 +3075,7 @@ run_housekeeping_event(time_t now)
       /* Update the suggested effort if HS_UPDATE_PERIOD seconds have passed
        * since we last did so. */
       if (now >= service->state.pow_state->next_effort_update) {
-        update_suggested_effort(service);
+        update_suggested_effort(service, now);
       }
     }
 
@@ -3139,10 +3292,9 @@ run_build_circuit_event(time_t now)
  * is false. */
 static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
-                           hs_service_descriptor_t *desc, const node_t *hsdir)
+                           hs_service_descriptor_t *desc, const node_t *hsdir,
+                           const char *encoded_desc)
 {
-  char *encoded_desc = NULL;
-
   tor_assert(service);
   tor_assert(desc);
   tor_assert(hsdir);
@@ -3155,10 +3307,8 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
     goto end;
   }
 
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
+  /* The encoding failed, which should NEVER happen. */
+  if (encoded_desc == NULL) {
     goto end;
   }
 
@@ -3196,7 +3346,6 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
   }
 
  end:
-  tor_free(encoded_desc);
   return;
 }
 
@@ -3273,13 +3422,31 @@ set_descriptor_revision_counter(hs_service_descriptor_t *hs_desc, time_t now,
   hs_desc->desc->plaintext_data.revision_counter = rev_counter;
 }
 
-/** Encode and sign the service descriptor desc and upload it to the
- * responsible hidden service directories. If for_next_period is true, the set
- * of directories are selected using the next hsdir_index. This does nothing
- * if PublishHidServDescriptors is false. */
-STATIC void
-upload_descriptor_to_all(const hs_service_t *service,
-                         hs_service_descriptor_t *desc)
+/** Set the time of the next periodic upload of desc. */
+static void
+set_descriptor_next_upload_time(const hs_service_t *service,
+                                hs_service_descriptor_t *desc)
+{
+  desc->next_upload_time =
+    (time(NULL) + crypto_rand_int_range(HS_SERVICE_NEXT_UPLOAD_TIME_MIN,
+                                        HS_SERVICE_NEXT_UPLOAD_TIME_MAX));
+  {
+    char fmt_next_time[ISO_TIME_LEN+1];
+    format_local_iso_time(fmt_next_time, desc->next_upload_time);
+    log_debug(LD_REND, "Service %s set to upload a descriptor at %s",
+              safe_str_client(service->onion_address), fmt_next_time);
+  }
+}
+
+/** Upload encoded_desc, the encoding of the service descriptor desc, to the
+ * responsible hidden service directories. If desc is the next descriptor, the
+ * set of directories are selected using the next hsdir_index. This does
+ * nothing if PublishHidServDescriptors is false, or if encoded_desc is NULL
+ * because the encoding failed. */
+static void
+upload_encoded_descriptor_to_all(const hs_service_t *service,
+                                 hs_service_descriptor_t *desc,
+                                 const char *encoded_desc)
 {
   smartlist_t *responsible_dirs = NULL;
 
@@ -3319,26 +3486,196 @@ upload_descriptor_to_all(const hs_service_t *service,
             (desc->desc->encrypted_data.pow_params_present)
                 ? hex_str(desc->desc->encrypted_data.pow_params->seed, 4)
                 : "N/A"); // HRPR
-    upload_descriptor_to_hsdir(service, desc, hsdir_node);
+    upload_descriptor_to_hsdir(service, desc, hsdir_node, encoded_desc);
   } SMARTLIST_FOREACH_END(hsdir_rs);
 
   /* Set the next upload time for this descriptor. Even if we are configured
    * to not upload, we still want to follow the right cycle of life for this
    * descriptor. */
-  desc->next_upload_time =
-    (time(NULL) + crypto_rand_int_range(HS_SERVICE_NEXT_UPLOAD_TIME_MIN,
-                                        HS_SERVICE_NEXT_UPLOAD_TIME_MAX));
-  {
-    char fmt_next_time[ISO_TIME_LEN+1];
-    format_local_iso_time(fmt_next_time, desc->next_upload_time);
-    log_debug(LD_REND, "Service %s set to upload a descriptor at %s",
-              safe_str_client(service->onion_address), fmt_next_time);
-  }
+  set_descriptor_next_upload_time(service, desc);
 
   smartlist_free(responsible_dirs);
   return;
 }
 
+/** Encode and sign the service descriptor desc and upload it to the
+ * responsible hidden service directories. If for_next_period is true, the set
+ * of directories are selected using the next hsdir_index. This does nothing
+ * if PublishHidServDescriptors is false. */
+STATIC void
+upload_descriptor_to_all(const hs_service_t *service,
+                         hs_service_descriptor_t *desc)
+{
+  char *encoded_desc = NULL;
+
+  tor_assert(service);
+  tor_assert(desc);
+
+  /* Every HSDir gets the same descriptor so encode it once. The layers are
+   * encrypted with keys bound to the revision counter which changes for
+   * every upload, so this is as much as can be reused. This should NEVER
+   * fail but just in case, the upload is skipped if it does. */
+  if (get_options()->PublishHidServDescriptors) {
+    if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
+                                      &encoded_desc) < 0)) {
+      encoded_desc = NULL;
+    }
+  }
+
+  upload_encoded_descriptor_to_all(service, desc, encoded_desc);
+  tor_free(encoded_desc);
+}
+
+/** A service descriptor handed to a cpuworker to be encoded for upload. */
+typedef struct desc_encode_request_t {
+  /** Identity key of the service and blinded key of the descriptor, to find
+   * them again once the worker is done. */
+  ed25519_public_key_t identity_pk;
+  ed25519_public_key_t blinded_pk;
+  /** Value of the encode_seq of the descriptor when it was queued. */
+  uint32_t encode_seq;
+  /** Input of the worker: everything it needs from the descriptor. */
+  hs_desc_encode_job_t *job;
+  /** Output of the worker: the encoded descriptor, or NULL on error. */
+  char *encoded;
+} desc_encode_request_t;
+
+/** Release a batch of descriptor encoding requests and the list holding
+ * them. */
+static void
+desc_encode_batch_free(smartlist_t *batch)
+{
+  if (!batch)
+    return;
+  SMARTLIST_FOREACH_BEGIN(batch, desc_encode_request_t *, req) {
+    hs_desc_encode_job_free(req->job);
+    tor_free(req->encoded);
+    tor_free(req);
+  } SMARTLIST_FOREACH_END(req);
+  smartlist_free(batch);
+}
+
+/** Worker thread function: encrypt and sign every descriptor of the batch.
+ * The requests hold copies of what they need from the descriptors so this
+ * doesn't touch any service state. */
+static workqueue_reply_t
+desc_encode_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  smartlist_t *batch = work_;
+
+  SMARTLIST_FOREACH_BEGIN(batch, desc_encode_request_t *, req) {
+    if (hs_desc_encode_job_run(req->job, &req->encoded) < 0) {
+      req->encoded = NULL;
+    }
+  } SMARTLIST_FOREACH_END(req);
+
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread function: a worker encoded a batch of descriptors. Upload the
+ * ones that weren't changed or removed meanwhile. */
+static void
+desc_encode_replyfn(void *work_)
+{
+  smartlist_t *batch = work_;
+
+  SMARTLIST_FOREACH_BEGIN(batch, desc_encode_request_t *, req) {
+    hs_service_t *service = hs_service_find(&req->identity_pk);
+    if (service == NULL) {
+      continue;
+    }
+    FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
+      if (desc->encode_seq != req->encode_seq ||
+          !ed25519_pubkey_eq(&desc->blinded_kp.pubkey, &req->blinded_pk)) {
+        continue;
+      }
+      /* This should NEVER happen as the descriptor was already encoded once
+       * when it was built. The upload is skipped. */
+      tor_assert_nonfatal(req->encoded);
+      upload_encoded_descriptor_to_all(service, desc, req->encoded);
+    } FOR_EACH_DESCRIPTOR_END;
+  } SMARTLIST_FOREACH_END(req);
+
+  desc_encode_batch_free(batch);
+}
+
+/** Hand the descriptor encoding requests in pending to the cpuworkers, in
+ * batches of at most HS_SERVICE_DESC_ENCODE_BATCH_MAX descriptors. Free
+ * pending. */
+static void
+desc_encode_flush(smartlist_t *pending)
+{
+  smartlist_t *batch = NULL;
+
+  SMARTLIST_FOREACH_BEGIN(pending, desc_encode_request_t *, req) {
+    if (batch == NULL) {
+      batch = smartlist_new();
+    }
+    smartlist_add(batch, req);
+    if (smartlist_len(batch) < HS_SERVICE_DESC_ENCODE_BATCH_MAX &&
+        req_sl_idx < req_sl_len - 1) {
+      continue;
+    }
+    if (!cpuworker_queue_work(WQ_PRI_LOW, desc_encode_threadfn,
+                              desc_encode_replyfn, batch)) {
+      /* Never mind, do it ourselves. */
+      log_warn(LD_BUG, "Couldn't queue descriptor encoding on the "
+                       "threadpool. Encoding %d descriptors now.",
+               smartlist_len(batch));
+      desc_encode_threadfn(NULL, batch);
+      desc_encode_replyfn(batch);
+    }
+    batch = NULL;
+  } SMARTLIST_FOREACH_END(req);
+
+  smartlist_free(pending);
+}
+
+/** Queue the upload of the service descriptor desc once a cpuworker has
+ * encoded it, by adding its encoding request to pending. The descriptor
+ * won't be uploaded again until then unless it changes. */
+static void
+queue_descriptor_upload(const hs_service_t *service,
+                        hs_service_descriptor_t *desc, smartlist_t *pending)
+{
+  desc_encode_request_t *req;
+  hs_desc_encode_job_t *job;
+  const uint8_t *descriptor_cookie = NULL;
+
+  tor_assert(service);
+  tor_assert(desc);
+  tor_assert(pending);
+
+  /* Nothing to encode if we don't publish. */
+  if (!get_options()->PublishHidServDescriptors) {
+    upload_descriptor_to_all(service, desc);
+    return;
+  }
+
+  if (service->config.is_client_auth_enabled) {
+    descriptor_cookie = desc->descriptor_cookie;
+  }
+  job = hs_desc_encode_job_new(desc->desc, &desc->signing_kp,
+                               descriptor_cookie);
+  /* This should NEVER fail. Go through the motions of an upload without a
+   * descriptor like if the encoding had failed. */
+  if (BUG(job == NULL)) {
+    upload_encoded_descriptor_to_all(service, desc, NULL);
+    return;
+  }
+
+  req = tor_malloc_zero(sizeof(*req));
+  ed25519_pubkey_copy(&req->identity_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&req->blinded_pk, &desc->blinded_kp.pubkey);
+  req->encode_seq = ++desc->encode_seq;
+  req->job = job;
+  smartlist_add(pending, req);
+
+  /* Don't queue it again on the next run. */
+  set_descriptor_next_upload_time(service, desc);
+}
+
 /** The set of HSDirs have changed: check if the change affects our descriptor
  *  HSDir placement, and if it does, reupload the desc. */
 STATIC int
@@ -3563,6 +3900,8 @@ refresh_service_descriptor(const hs_service_t *service,
 STATIC void
 run_upload_descriptor_event(time_t now)
 {
+  smartlist_t *pending = smartlist_new();
+
   /* Run v3+ check. */
   FOR_EACH_SERVICE_BEGIN(service) {
     FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
@@ -3591,11 +3930,14 @@ run_upload_descriptor_event(time_t now)
        * coherent descriptor. */
       refresh_service_descriptor(service, desc, now);
 
-      /* Proceed with the upload, the descriptor is ready to be encoded. */
-      upload_descriptor_to_all(service, desc);
+      /* Proceed with the upload, the descriptor is ready to be encoded. The
+       * encryption and signing are done by the cpuworkers. */
+      queue_descriptor_upload(service, desc, pending);
     } FOR_EACH_DESCRIPTOR_END;
   } FOR_EACH_SERVICE_END;
 
+  desc_encode_flush(pending);
+
   /* We are done considering whether to republish rend descriptors */
   consider_republishing_hs_descriptors = 0;
 }
@@ -4664,6 +5006,8 @@ hs_service_init(void)
 void
 hs_service_free_all(void)
 {
+  hs_circ_pow_verify_free_all();
+  hs_circ_introduce2_free_all();
   service_free_all();
   hs_config_free_all();
 }
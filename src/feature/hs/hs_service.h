@@ -36,6 +36,9 @@
 /** Maximum interval for uploading next descriptor (in seconds). */
 #define HS_SERVICE_NEXT_UPLOAD_TIME_MAX (120 * 60)
 
+/** Maximum number of descriptors a cpuworker encodes in one go. */
+#define HS_SERVICE_DESC_ENCODE_BATCH_MAX 16
+
 /** HRPR: PoW seed expiration time is set to RAND_TIME(now+7200, 900)
  * seconds. */
 #define HS_SERVICE_POW_SEED_ROTATE_TIME_MIN (7200 - 900)
@@ -93,6 +96,11 @@ typedef struct hs_service_intro_point_t {
    * prevent replay attacks. */
   replaycache_t *replay_cache;
 
+  /** Token bucket limiting the INTRODUCE2 cells from this intro point that we
+   * decrypt. Only used if the service has an INTRODUCE2 rate set, in which
+   * case it is set up on the first cell. */
+  token_bucket_ctr_t introduce2_bucket;
+
   /** Support the INTRO2 DoS defense. If set, the DoS extension described by
    * proposal 305 is sent. */
   unsigned int support_intro2_dos_defense : 1;
@@ -180,6 +188,11 @@ typedef struct hs_service_descriptor_t {
    *  is different from this list, this means we received new dirinfo and we
    *  need to reupload our descriptor. */
   smartlist_t *previous_hsdirs;
+
+  /** Mutable: Incremented every time this descriptor is handed to a
+   *  cpuworker to be encoded for upload, so that only the encoding of its
+   *  latest version is uploaded. */
+  uint32_t encode_seq;
 } hs_service_descriptor_t;
 
 /** Service key material. */
@@ -272,7 +285,22 @@ typedef struct hs_service_config_t {
   /** HRPR: True iff PoW anti-DoS defenses are enabled. */
   unsigned int has_pow_defenses_enabled : 1;
   uint32_t pow_min_effort;
-  uint32_t pow_svc_bottom_capacity;
+
+  /** Rate and burst, per second, at which we launch rendezvous circuits from
+   * the PoW priority queue. */
+  uint32_t pow_queue_rate;
+  uint32_t pow_queue_burst;
+  /** Maximum number of requests in the PoW priority queue. Once full, the
+   * lowest effort half is dropped. */
+  uint32_t pow_queue_max_depth;
+  /** Requests that waited longer than this many seconds in the PoW priority
+   * queue are dropped. */
+  uint32_t pow_queue_max_age;
+
+  /** Rate and burst, per second, of the INTRODUCE2 cells we accept to
+   * decrypt from each of our intro points. A rate of 0 disables the limit. */
+  uint32_t introduce2_rate_per_sec;
+  uint32_t introduce2_burst_per_sec;
 
   /** If set, contains the Onion Balance master ed25519 public key (taken from
    * an .onion addresses) that this tor instance serves as backend. */
@@ -366,6 +394,9 @@ void hs_service_free_(hs_service_t *service);
 #define hs_service_free(s) FREE_AND_NULL(hs_service_t, hs_service_free_, (s))
 
 hs_service_t *hs_service_find(const ed25519_public_key_t *ident_pk);
+hs_service_intro_point_t *
+hs_service_intro_point_find(const hs_service_t *service,
+                            const ed25519_public_key_t *auth_key);
 MOCK_DECL(unsigned int, hs_service_get_num_services, (void));
 void hs_service_stage_services(const smartlist_t *service_list);
 int hs_service_load_all_keys(void);
@@ -437,9 +468,6 @@ STATIC void service_intro_point_add(digest256map_t *map,
                                     hs_service_intro_point_t *ip);
 STATIC void service_intro_point_remove(const hs_service_t *service,
                                        const hs_service_intro_point_t *ip);
-STATIC hs_service_intro_point_t *
-service_intro_point_find(const hs_service_t *service,
-                         const ed25519_public_key_t *auth_key);
 /* Service descriptor functions. */
 STATIC hs_service_descriptor_t *service_descriptor_new(void);
 STATIC hs_service_descriptor_t *
@@ -492,6 +520,8 @@ service_authorized_client_config_equal(const hs_service_config_t *config1,
 
 STATIC void service_clear_config(hs_service_config_t *config);
 
+STATIC void update_suggested_effort(hs_service_t *service, time_t now);
+
 #endif /* defined(HS_SERVICE_PRIVATE) */
 
 #endif /* !defined(TOR_HS_SERVICE_H) */
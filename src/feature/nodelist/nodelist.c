@@ -362,6 +362,9 @@ node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
   tor_assert(node);
   tor_assert(ns);
 
+  /* The HSDir hash rings are sorted by these indices. */
+  hs_hsdir_rings_invalidate();
+
   if (!networkstatus_consensus_reasonably_live(ns, now)) {
     static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
     log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
@@ -527,6 +530,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  hs_hsdir_rings_invalidate();
 
   node_add_to_ed25519_map(node);
 
@@ -583,6 +587,7 @@ nodelist_add_microdesc(microdesc_t *md)
 
   node->md = md;
   md->held_by_nodes++;
+  hs_hsdir_rings_invalidate();
   /* Setting the HSDir index requires the ed25519 identity key which can
    * only be found either in the ri or md. This is why this is called here.
    * Only nodes supporting HSDir=2 protocol version needs this index. */
@@ -621,6 +626,9 @@ nodelist_set_consensus(const networkstatus_t *ns)
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
+  /* The HSDirs and their indices are about to change. */
+  hs_hsdir_rings_invalidate();
+
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
@@ -734,6 +742,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    hs_hsdir_rings_invalidate();
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
@@ -747,6 +756,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    hs_hsdir_rings_invalidate();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -761,6 +771,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
 {
   node_t *tmp;
   int idx;
+  /* The node is about to be freed: it can't stay in an HSDir hash ring. */
+  hs_hsdir_rings_invalidate();
   if (remove_from_ht) {
     tmp = HT_REMOVE(nodelist_map, &the_nodelist->nodes_by_id, node);
     tor_assert(tmp == node);
@@ -847,6 +859,7 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  hs_hsdir_rings_invalidate();
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
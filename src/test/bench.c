@@ -25,7 +25,10 @@
 #endif /* defined(ENABLE_OPENSSL) */
 
 #include "core/or/circuitlist.h"
+#include "core/or/connection_or.h"
+#include "core/or/relay.h"
 #include "app/config/config.h"
+#include "app/config/or_options_st.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
@@ -36,13 +39,25 @@
 #include "lib/compress/compress.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/container/order.h"
+#include "lib/evloop/compat_libevent.h"
 
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/hs/hs_circuit.h"
+#include "feature/hs/hs_circuitmap.h"
+#include "feature/hs/hs_common.h"
+#include "feature/hs/hs_descriptor.h"
+#include "feature/hs/hs_pow.h"
+#include "feature/hs/hs_service.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/torcert.h"
+#include "trunnel/ed25519_cert.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -524,6 +539,149 @@ bench_siphash(void)
   }
 }
 
+static void
+bench_hs_circuitmap(void)
+{
+  const int sizes[] = { 100, 10000, 100000, -1 };
+  const int lookups = 1000000;
+
+  for (int s = 0; sizes[s] > 0; ++s) {
+    const int n = sizes[s];
+    or_circuit_t *circs = tor_calloc(n, sizeof(or_circuit_t));
+    uint8_t *toks = tor_malloc(n * REND_TOKEN_LEN);
+    uint8_t miss[REND_TOKEN_LEN];
+    uint64_t start, pt2, pt3, end;
+    int i, found = 0;
+
+    crypto_rand((char *) toks, n * REND_TOKEN_LEN);
+    crypto_rand((char *) miss, sizeof(miss));
+    /* Bare circuits are enough since the circuitmap only looks at their
+     * purpose and token. */
+    for (i = 0; i < n; ++i) {
+      circs[i].base_.magic = OR_CIRCUIT_MAGIC;
+      circs[i].base_.purpose = CIRCUIT_PURPOSE_REND_POINT_WAITING;
+    }
+
+    hs_circuitmap_init();
+    reset_perftime();
+
+    start = perftime();
+    for (i = 0; i < n; ++i) {
+      hs_circuitmap_register_rend_circ_relay_side(&circs[i],
+                                                  toks + i * REND_TOKEN_LEN);
+    }
+    pt2 = perftime();
+    for (i = 0; i < lookups; ++i) {
+      const uint8_t *tok = toks + (i % n) * REND_TOKEN_LEN;
+      found += hs_circuitmap_get_rend_circ_relay_side(tok) != NULL;
+    }
+    pt3 = perftime();
+    for (i = 0; i < lookups; ++i) {
+      miss[0] = (uint8_t) i;
+      found += hs_circuitmap_get_rend_circ_relay_side(miss) != NULL;
+    }
+    end = perftime();
+
+    printf("hs_circuitmap with %d circuits: register %.2f ns, "
+           "lookup hit %.2f ns, lookup miss %.2f ns (found %d)\n",
+           n, NANOCOUNT(start, pt2, n), NANOCOUNT(pt2, pt3, lookups),
+           NANOCOUNT(pt3, end, lookups), found);
+
+    for (i = 0; i < n; ++i) {
+      hs_circuitmap_remove_circuit(TO_CIRCUIT(&circs[i]));
+    }
+    hs_circuitmap_free_all();
+    tor_free(circs);
+    tor_free(toks);
+  }
+}
+
+/** Helper for bench_hs_hsdir_ring(): compare two nodes by fetch index. */
+static int
+compare_node_fetch_index_(const void **a, const void **b)
+{
+  const node_t *n1 = *a, *n2 = *b;
+  return tor_memcmp(n1->hsdir_index.fetch, n2->hsdir_index.fetch,
+                    DIGEST256_LEN);
+}
+
+/** Helper for bench_hs_hsdir_ring(): compare a key to a node fetch index. */
+static int
+compare_key_to_node_fetch_index_(const void *key, const void **member)
+{
+  const node_t *n = *member;
+  return tor_memcmp(key, n->hsdir_index.fetch, DIGEST256_LEN);
+}
+
+/** Compare finding the responsible HSDirs of a consensus the size of the
+ * public network by sorting its HSDirs for each lookup, which is what
+ * hs_get_responsible_hsdirs() used to do, and by searching a precomputed
+ * hash ring. */
+static void
+bench_hs_hsdir_ring(void)
+{
+  const int n_nodes = 7000;
+  const int sort_iters = 200;
+  const int ring_iters = 1000000;
+  const int n_replicas = 2;
+  node_t *nodes = tor_calloc(n_nodes, sizeof(node_t));
+  smartlist_t *sorted = smartlist_new();
+  hs_hsdir_ring_t *ring;
+  uint8_t hs_index[DIGEST256_LEN];
+  uint64_t start, end;
+  int i, r, found, total = 0;
+
+  for (i = 0; i < n_nodes; ++i) {
+    crypto_rand((char *) nodes[i].hsdir_index.fetch, DIGEST256_LEN);
+  }
+  crypto_rand((char *) hs_index, sizeof(hs_index));
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < sort_iters; ++i) {
+    smartlist_clear(sorted);
+    for (int j = 0; j < n_nodes; ++j) {
+      smartlist_add(sorted, &nodes[j]);
+    }
+    smartlist_sort(sorted, compare_node_fetch_index_);
+    for (r = 0; r < n_replicas; ++r) {
+      hs_index[0] = (uint8_t) (i + r);
+      total += smartlist_bsearch_idx(sorted, hs_index,
+                                     compare_key_to_node_fetch_index_,
+                                     &found);
+    }
+  }
+  end = perftime();
+  printf("Sort %d HSDirs then search: %.2f usec/query\n", n_nodes,
+         NANOCOUNT(start, end, sort_iters) / 1000);
+
+  start = perftime();
+  ring = hs_hsdir_ring_new(n_nodes);
+  for (i = 0; i < n_nodes; ++i) {
+    hs_hsdir_ring_add(ring, nodes[i].hsdir_index.fetch, &nodes[i]);
+  }
+  hs_hsdir_ring_sort(ring);
+  end = perftime();
+  printf("Build a %d HSDir hash ring: %.2f usec\n", n_nodes,
+         NANOCOUNT(start, end, 1) / 1000);
+
+  start = perftime();
+  for (i = 0; i < ring_iters; ++i) {
+    for (r = 0; r < n_replicas; ++r) {
+      hs_index[0] = (uint8_t) (i + r);
+      hs_index[1] = (uint8_t) (i >> 8);
+      total += hs_hsdir_ring_find_idx(ring, hs_index);
+    }
+  }
+  end = perftime();
+  printf("Search a %d HSDir hash ring: %.2f nsec/query (%d)\n", n_nodes,
+         NANOCOUNT(start, end, ring_iters), total);
+
+  hs_hsdir_ring_free(ring);
+  smartlist_free(sorted);
+  tor_free(nodes);
+}
+
 static void
 bench_digest(void)
 {
@@ -584,17 +742,13 @@ bench_cell_ops(void)
   or_circ->base_.magic = OR_CIRCUIT_MAGIC;
   or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
 
-  /* Initialize crypto */
-  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
-  crypto_rand(key1, sizeof(key1));
-  crypto_rand(key2, sizeof(key2));
-  or_circ->crypto.f_crypto = crypto_cipher_new(key1);
-  or_circ->crypto.b_crypto = crypto_cipher_new(key2);
-  or_circ->crypto.f_digest = crypto_digest_new();
-  or_circ->crypto.b_digest = crypto_digest_new();
-
   reset_perftime();
 
+  /* Initialize crypto */
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  crypto_rand(keys, sizeof(keys));
+  relay_crypto_init(&or_circ->crypto, keys, sizeof(keys), 0, 0);
+
   for (outbound = 0; outbound <= 1; ++outbound) {
     cell_direction_t d = outbound ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
     start = perftime();
@@ -616,6 +770,124 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Decrypt outbound cells at a middle relay, and report how many cells per
+ * second it handles when they are for it, when they only look like they
+ * might be (recognized field of 0, but a bad digest), and when they are
+ * plainly for another hop. */
+static void
+bench_cell_digest(void)
+{
+  const int batch = 4096, n_batches = 16;
+  const char *kinds[] = { "recognized", "recognized=0, bad digest",
+                          "not recognized" };
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  relay_crypto_t sender, relay;
+  cell_t *cells = tor_calloc(batch, sizeof(cell_t));
+  uint64_t start, end, total;
+  int kind, b, i, n_recognized;
+
+  crypto_rand(keys, sizeof(keys));
+  memset(&sender, 0, sizeof(sender));
+  memset(&relay, 0, sizeof(relay));
+  relay_crypto_init(&sender, keys, sizeof(keys), 0, 0);
+  relay_crypto_init(&relay, keys, sizeof(keys), 0, 0);
+
+  reset_perftime();
+
+  for (kind = 0; kind < (int)ARRAY_LENGTH(kinds); ++kind) {
+    total = 0;
+    n_recognized = 0;
+    for (b = 0; b < n_batches; ++b) {
+      /* Build the cells the way the client would have sent them. */
+      for (i = 0; i < batch; ++i) {
+        uint8_t *payload = cells[i].payload;
+        crypto_rand((char*)payload, CELL_PAYLOAD_SIZE);
+        if (kind < 2)
+          memset(payload + 1, 0, 2); /* recognized */
+        if (kind == 0) {
+          memset(payload + 5, 0, 4); /* integrity */
+          relay_set_digest(sender.f_digest, &cells[i]);
+        }
+        relay_crypto_crypt_payloads(&sender, CELL_DIRECTION_OUT, payload, 1);
+      }
+      start = perftime();
+      for (i = 0; i < batch; ++i) {
+        char recognized = 0;
+        relay_crypto_crypt_relayed_cell(&relay, &cells[i], CELL_DIRECTION_OUT,
+                                        &recognized);
+        n_recognized += recognized;
+      }
+      end = perftime();
+      total += end - start;
+    }
+    printf("%s: %.2f ns per cell, %.0f cells per second "
+           "(%d of %d recognized)\n",
+           kinds[kind], NANOCOUNT(0, total, batch * n_batches),
+           1e9 / NANOCOUNT(0, total, batch * n_batches),
+           n_recognized, batch * n_batches);
+  }
+
+  relay_crypto_clear(&sender);
+  relay_crypto_clear(&relay);
+  tor_free(cells);
+}
+
+/** Queue and drain cells in batches of various sizes, comparing the packed
+ * cell slabs with allocating every cell with malloc. */
+static void
+bench_cell_alloc(void)
+{
+  const int iters = 1<<20;
+  const int batch_sizes[] = { 1, 64, 4096 };
+  cell_t *cell = tor_malloc_zero(sizeof(cell_t));
+  cell_queue_t queue;
+  packed_cell_t *pc;
+  uint64_t start, end;
+  unsigned b;
+  int i, j;
+
+  crypto_rand((char*)cell->payload, sizeof(cell->payload));
+  cell_queue_init(&queue);
+  reset_perftime();
+
+  for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    const int batch = batch_sizes[b];
+    double malloc_ns, slab_ns;
+
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      for (j = 0; j < batch; ++j) {
+        pc = tor_malloc_zero(sizeof(packed_cell_t));
+        cell_pack(pc, cell, 1);
+        pc->inserted_timestamp = monotime_coarse_get_stamp();
+        TOR_SIMPLEQ_INSERT_TAIL(&queue.head, pc, next);
+      }
+      while ((pc = TOR_SIMPLEQ_FIRST(&queue.head))) {
+        TOR_SIMPLEQ_REMOVE_HEAD(&queue.head, next);
+        tor_free(pc);
+      }
+    }
+    end = perftime();
+    malloc_ns = NANOCOUNT(start, end, iters);
+
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      for (j = 0; j < batch; ++j) {
+        cell_queue_append_packed_copy(NULL, &queue, 0, cell, 1, 0);
+      }
+      cell_queue_clear(&queue);
+    }
+    end = perftime();
+    slab_ns = NANOCOUNT(start, end, iters);
+
+    printf("%4d cells queued at once: malloc %.2f ns per cell, "
+           "slabs %.2f ns per cell\n", batch, malloc_ns, slab_ns);
+  }
+
+  packed_cell_free_all();
+  tor_free(cell);
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1010,467 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Helper for bench_hs_desc_decode(): return a new introduction point for a
+ * descriptor signed by <b>signing_kp</b>. */
+static hs_desc_intro_point_t *
+bench_build_intro_point(const ed25519_keypair_t *signing_kp, time_t now)
+{
+  hs_desc_intro_point_t *ip = hs_desc_intro_point_new();
+  link_specifier_t *ls_legacy = link_specifier_new();
+  link_specifier_t *ls_ip = link_specifier_new();
+  ed25519_keypair_t auth_kp, enc_ed_kp;
+  curve25519_keypair_t enc_kp;
+  int signbit;
+
+  link_specifier_set_ls_type(ls_legacy, LS_LEGACY_ID);
+  crypto_rand((char *) link_specifier_getarray_un_legacy_id(ls_legacy),
+              link_specifier_getlen_un_legacy_id(ls_legacy));
+  link_specifier_set_ls_type(ls_ip, LS_IPV4);
+  link_specifier_set_un_ipv4_addr(ls_ip, 0x01020304);
+  link_specifier_set_un_ipv4_port(ls_ip, 9001);
+  smartlist_add(ip->link_specifiers, ls_legacy);
+  smartlist_add(ip->link_specifiers, ls_ip);
+
+  curve25519_keypair_generate(&enc_kp, 0);
+  memcpy(&ip->onion_key, &enc_kp.pubkey, sizeof(ip->onion_key));
+
+  ed25519_keypair_generate(&auth_kp, 0);
+  ip->auth_key_cert = tor_cert_create_ed25519(signing_kp,
+                                              CERT_TYPE_AUTH_HS_IP_KEY,
+                                              &auth_kp.pubkey, now,
+                                              HS_DESC_CERT_LIFETIME,
+                                              CERT_FLAG_INCLUDE_SIGNING_KEY);
+
+  curve25519_keypair_generate(&enc_kp, 0);
+  ed25519_keypair_from_curve25519_keypair(&enc_ed_kp, &signbit, &enc_kp);
+  ip->enc_key_cert = tor_cert_create_ed25519(signing_kp,
+                                             CERT_TYPE_CROSS_HS_IP_KEYS,
+                                             &enc_ed_kp.pubkey, now,
+                                             HS_DESC_CERT_LIFETIME,
+                                             CERT_FLAG_INCLUDE_SIGNING_KEY);
+  memcpy(&ip->enc_key, &enc_kp.pubkey, sizeof(ip->enc_key));
+  return ip;
+}
+
+/** Encode a descriptor with a typical number of introduction points and
+ * measure how many descriptors per second we can fully decode. */
+static void
+bench_hs_desc_decode(void)
+{
+  const int n_intro_points[] = { 3, 20, -1 };
+  const int N = 500, n_rounds = 5;
+  time_t now = approx_time();
+  ed25519_keypair_t signing_kp, blinded_kp;
+  curve25519_keypair_t ephemeral_kp;
+  hs_subcredential_t subcredential;
+  uint64_t start, end, best = 0;
+
+  ed25519_keypair_generate(&signing_kp, 0);
+  hs_build_blinded_keypair(&signing_kp, NULL, 0, hs_get_time_period_num(now),
+                           &blinded_kp);
+  hs_get_subcredential(&signing_kp.pubkey, &blinded_kp.pubkey,
+                       &subcredential);
+
+  for (int n = 0; n_intro_points[n] > 0; ++n) {
+    hs_descriptor_t *desc = tor_malloc_zero(sizeof(*desc));
+    char *encoded = NULL;
+    int failures = 0;
+
+    desc->plaintext_data.version = HS_DESC_SUPPORTED_FORMAT_VERSION_MAX;
+    memcpy(&desc->plaintext_data.signing_pubkey, &signing_kp.pubkey,
+           sizeof(ed25519_public_key_t));
+    memcpy(&desc->plaintext_data.blinded_pubkey, &blinded_kp.pubkey,
+           sizeof(ed25519_public_key_t));
+    desc->plaintext_data.signing_key_cert =
+      tor_cert_create_ed25519(&blinded_kp, CERT_TYPE_SIGNING_HS_DESC,
+                              &signing_kp.pubkey, now, 3600,
+                              CERT_FLAG_INCLUDE_SIGNING_KEY);
+    desc->plaintext_data.revision_counter = 42;
+    desc->plaintext_data.lifetime_sec = 3 * 60 * 60;
+    memcpy(&desc->subcredential, &subcredential, sizeof(subcredential));
+
+    curve25519_keypair_generate(&ephemeral_kp, 0);
+    memcpy(&desc->superencrypted_data.auth_ephemeral_pubkey,
+           &ephemeral_kp.pubkey, sizeof(ephemeral_kp.pubkey));
+    desc->superencrypted_data.clients = smartlist_new();
+    for (int i = 0; i < HS_DESC_AUTH_CLIENT_MULTIPLE; i++) {
+      smartlist_add(desc->superencrypted_data.clients,
+                    hs_desc_build_fake_authorized_client());
+    }
+
+    desc->encrypted_data.create2_ntor = 1;
+    desc->encrypted_data.intro_points = smartlist_new();
+    for (int i = 0; i < n_intro_points[n]; i++) {
+      smartlist_add(desc->encrypted_data.intro_points,
+                    bench_build_intro_point(&signing_kp, now));
+    }
+
+    if (hs_desc_encode_descriptor(desc, &signing_kp, NULL, &encoded) < 0) {
+      printf("Couldn't encode descriptor.\n");
+      hs_descriptor_free(desc);
+      continue;
+    }
+
+    /* Decoding is dominated by signature checks, so keep the best of a few
+     * rounds to get numbers stable enough to compare the parsing. */
+    for (int round = 0; round < n_rounds; ++round) {
+      reset_perftime();
+      start = perftime();
+      for (int i = 0; i < N; ++i) {
+        hs_descriptor_t *decoded = NULL;
+        failures += hs_desc_decode_descriptor(encoded, &subcredential, NULL,
+                                              &decoded) != HS_DESC_DECODE_OK;
+        hs_descriptor_free(decoded);
+      }
+      end = perftime();
+      if (round == 0 || end - start < best) {
+        best = end - start;
+      }
+    }
+    printf("Decode descriptor with %d intro points (%d bytes): "
+           "%.2f usec, %.0f descriptors/sec (%d failures)\n",
+           n_intro_points[n], (int) strlen(encoded),
+           NANOCOUNT(0, best, N) / 1000, N / (best / 1e9), failures);
+
+    tor_free(encoded);
+    hs_descriptor_free(desc);
+  }
+}
+
+/** Run onion service PoW solve benchmarks at a range of efforts. */
+static void
+bench_hs_pow_solve(void)
+{
+  const int N = 8;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution;
+  uint64_t start, end;
+  uint32_t effort;
+  int i;
+
+  memset(&pow_params, 0, sizeof(pow_params));
+  crypto_rand((char *) pow_params.seed, sizeof(pow_params.seed));
+
+  reset_perftime();
+  for (effort = 1; effort <= 16; effort *= 2) {
+    pow_params.suggested_effort = effort;
+    start = perftime();
+    for (i = 0; i < N; ++i) {
+      if (solve_pow(&pow_params, &solution) < 0) {
+        printf("Couldn't solve the PoW challenge.\n");
+        return;
+      }
+    }
+    end = perftime();
+    printf("PoW solve, effort %2u: %.2f msec (%.2f solves/sec)\n", effort,
+           MICROCOUNT(start, end, N) / 1000.0,
+           1e9 / NANOCOUNT(start, end, N));
+  }
+}
+
+/** Run onion service PoW verification benchmarks: allocating an E-quiX
+ * context for every verification against reusing pooled ones, then
+ * verify_pow() with valid, invalid and replayed solutions. */
+static void
+bench_hs_pow_verify(void)
+{
+  const int N_SOLUTIONS = 100;
+  const int N_ROUNDS = 50;
+  const int iters = N_SOLUTIONS * N_ROUNDS;
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t *solutions;
+  uint64_t start, end, total;
+  int i, j, n_ok;
+  equix_ctx *ctx;
+
+  memset(&pow_state, 0, sizeof(pow_state));
+  crypto_rand((char *) pow_state.seed_current, HS_POW_SEED_LEN);
+  memset(&pow_params, 0, sizeof(pow_params));
+  memcpy(pow_params.seed, pow_state.seed_current, HS_POW_SEED_LEN);
+  pow_params.suggested_effort = 1;
+
+  solutions = tor_calloc(N_SOLUTIONS, sizeof(hs_pow_solution_t));
+  for (i = 0; i < N_SOLUTIONS; ++i) {
+    if (solve_pow(&pow_params, &solutions[i]) < 0) {
+      printf("Couldn't solve the PoW challenge.\n");
+      goto done;
+    }
+  }
+
+  reset_perftime();
+  n_ok = 0;
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < N_SOLUTIONS; ++i) {
+      ctx = hs_pow_verify_ctx_new();
+      n_ok += !hs_pow_verify_solution(ctx, pow_params.seed, &solutions[i]);
+      equix_free(ctx);
+    }
+  }
+  end = perftime();
+  tor_assert(n_ok == iters);
+  printf("PoW verify, new context: %.2f usec (%.0f verifies/sec)\n",
+         MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+
+  hs_pow_init();
+  n_ok = 0;
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < N_SOLUTIONS; ++i) {
+      ctx = hs_pow_verify_ctx_acquire();
+      n_ok += !hs_pow_verify_solution(ctx, pow_params.seed, &solutions[i]);
+      hs_pow_verify_ctx_release(ctx);
+    }
+  }
+  end = perftime();
+  tor_assert(n_ok == iters);
+  printf("PoW verify, pooled context: %.2f usec (%.0f verifies/sec)\n",
+         MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+
+  /* Valid solutions, with the replay cache emptied between rounds. */
+  n_ok = 0;
+  total = 0;
+  for (j = 0; j < N_ROUNDS; ++j) {
+    start = perftime();
+    for (i = 0; i < N_SOLUTIONS; ++i) {
+      n_ok += !verify_pow(&pow_state, &solutions[i]);
+    }
+    total += perftime() - start;
+    hs_pow_rotate_replay_cache(&pow_state);
+    hs_pow_rotate_replay_cache(&pow_state);
+  }
+  tor_assert(n_ok == iters);
+  printf("verify_pow, valid: %.2f usec (%.0f verifies/sec)\n",
+         MICROCOUNT(0, total, iters), 1e9 / NANOCOUNT(0, total, iters));
+
+  /* Replays: everything is in the replay cache after one pass. */
+  for (i = 0; i < N_SOLUTIONS; ++i) {
+    verify_pow(&pow_state, &solutions[i]);
+  }
+  n_ok = 0;
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < N_SOLUTIONS; ++i) {
+      n_ok += !verify_pow(&pow_state, &solutions[i]);
+    }
+  }
+  end = perftime();
+  tor_assert(n_ok == 0);
+  printf("verify_pow, replayed: %.2f usec (%.0f verifies/sec)\n",
+         MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+
+  /* Invalid solutions get through every cheap check. */
+  hs_pow_rotate_replay_cache(&pow_state);
+  hs_pow_rotate_replay_cache(&pow_state);
+  for (i = 0; i < N_SOLUTIONS; ++i) {
+    solutions[i].equix_solution.idx[0] ^= 1;
+  }
+  n_ok = 0;
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < N_SOLUTIONS; ++i) {
+      n_ok += !verify_pow(&pow_state, &solutions[i]);
+    }
+  }
+  end = perftime();
+  tor_assert(n_ok == 0);
+  printf("verify_pow, invalid: %.2f usec (%.0f verifies/sec)\n",
+         MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+
+  hs_pow_free_service_state_resources(&pow_state);
+  hs_pow_free_all();
+
+ done:
+  tor_free(solutions);
+}
+
+/** Number of simulated main loop turns per second in the intro flood. */
+#define FLOOD_TICKS_PER_SEC 100
+
+/** Where a request of the intro flood is. */
+typedef enum {
+  FLOOD_PENDING = 0,
+  FLOOD_QUEUED,
+  FLOOD_LAUNCHED,
+  FLOOD_DROPPED,
+} flood_req_state_t;
+
+/** One request of the intro flood. */
+typedef struct flood_req_t {
+  flood_req_state_t state;
+  uint32_t effort;
+  /** Simulated time at which it was queued and left the queue, in ticks. */
+  uint32_t queued_tick;
+  uint32_t done_tick;
+  /** Last scan of the priority queue that found it. */
+  uint32_t last_seen;
+} flood_req_t;
+
+/** Mark every request in the PoW priority queue of pow_state as seen by scan
+ * number scan. Requests are found by the index we put in their rendezvous
+ * cookie. */
+static void
+flood_scan_pqueue(const hs_service_pow_state_t *pow_state, flood_req_t *reqs,
+                  uint32_t scan)
+{
+  SMARTLIST_FOREACH(pow_state->rend_request_pqueue, const pending_rend_t *, r,
+    reqs[get_uint32(r->data->rendezvous_cookie)].last_seen = scan);
+}
+
+/** Requests of queued that scan number scan didn't find have left the
+ * priority queue at the given tick: record how, and remove them from
+ * queued. If launching is false, they were all dropped. Else, they were
+ * launched unless they waited longer than max_age seconds, the way the
+ * service tells. */
+static void
+flood_note_departures(smartlist_t *queued, flood_req_t *reqs, uint32_t scan,
+                      uint32_t tick, int launching, uint32_t max_age)
+{
+  SMARTLIST_FOREACH_BEGIN(queued, void *, idx_ptr) {
+    flood_req_t *req = &reqs[(uintptr_t) idx_ptr];
+    if (req->last_seen == scan)
+      continue;
+    req->done_tick = tick;
+    if (launching &&
+        tick / FLOOD_TICKS_PER_SEC - req->queued_tick / FLOOD_TICKS_PER_SEC <=
+        max_age) {
+      req->state = FLOOD_LAUNCHED;
+    } else {
+      req->state = FLOOD_DROPPED;
+    }
+    SMARTLIST_DEL_CURRENT(queued, idx_ptr);
+  } SMARTLIST_FOREACH_END(idx_ptr);
+}
+
+/** Print latency percentiles, in msec, of the launched requests of reqs
+ * with at least min_effort. */
+static void
+flood_print_latency(const char *what, const flood_req_t *reqs, int n_reqs,
+                    uint32_t min_effort)
+{
+  uint32_t *latency = tor_calloc(n_reqs, sizeof(uint32_t));
+  int n = 0;
+
+  for (int i = 0; i < n_reqs; ++i) {
+    if (reqs[i].state == FLOOD_LAUNCHED && reqs[i].effort >= min_effort) {
+      latency[n++] = (reqs[i].done_tick - reqs[i].queued_tick) *
+                     (1000 / FLOOD_TICKS_PER_SEC);
+    }
+  }
+  if (n > 0) {
+    /* Sorts latency, so read the percentiles from the bottom up. */
+    uint32_t p50 = find_nth_uint32(latency, n, n / 2);
+    printf("%s latency (msec, %d requests): p50 %u, p90 %u, p99 %u, "
+           "max %u\n", what, n, p50, latency[n * 9 / 10],
+           latency[n * 99 / 100], latency[n - 1]);
+  }
+  tor_free(latency);
+}
+
+/** Push a synthetic flood of INTRODUCE2 requests through the PoW priority
+ * queue of a service, faster than its rate limit lets it launch rendezvous
+ * circuits, and report how long requests wait in the queue. Time is
+ * simulated: the queue is served once per main loop turn, and there are
+ * FLOOD_TICKS_PER_SEC turns per second. The rendezvous circuits fail to
+ * launch right away since the requests have no link specifiers. */
+static void
+bench_hs_pow_intro_flood(void)
+{
+  const int N_REQUESTS = 20000;
+  const int ARRIVALS_PER_SEC = 1000;
+  const time_t start_time = 1000000000;
+  const uint32_t max_effort = 1000;
+  hs_service_t *service;
+  hs_service_pow_state_t *pow_state;
+  hs_service_intro_point_t *ip;
+  flood_req_t *reqs;
+  smartlist_t *queued = smartlist_new();
+  uint32_t tick = 0, scan = 0;
+  int next = 0, n_launched = 0, n_dropped = 0;
+  uint64_t start, end;
+
+  update_approx_time(start_time);
+
+  service = hs_service_new(get_options());
+  service->config.has_pow_defenses_enabled = 1;
+  service->desc_current = tor_malloc_zero(sizeof(hs_service_descriptor_t));
+  service->desc_current->intro_points.map = digest256map_new();
+  ip = tor_malloc_zero(sizeof(*ip));
+  ip->base.link_specifiers = smartlist_new();
+  ed25519_keypair_generate(&ip->auth_key_kp, 0);
+  digest256map_set(service->desc_current->intro_points.map,
+                   ip->auth_key_kp.pubkey.pubkey, ip);
+
+  pow_state = tor_malloc_zero(sizeof(*pow_state));
+  pow_state->rend_request_pqueue = smartlist_new();
+  token_bucket_ctr_init(&pow_state->pqueue_bucket,
+                        service->config.pow_queue_rate,
+                        service->config.pow_queue_burst,
+                        (uint32_t) start_time);
+  service->state.pow_state = pow_state;
+
+  reqs = tor_calloc(N_REQUESTS, sizeof(flood_req_t));
+  for (int i = 0; i < N_REQUESTS; ++i) {
+    reqs[i].effort = 1 + crypto_rand_int(max_effort);
+  }
+
+  reset_perftime();
+  start = perftime();
+  while (next < N_REQUESTS || smartlist_len(queued) > 0) {
+    update_approx_time(start_time + tick / FLOOD_TICKS_PER_SEC);
+
+    /* New requests for this turn. Queuing can drop some if it is full. */
+    while (next < N_REQUESTS &&
+           next < (int) ((uint64_t) (tick + 1) * ARRIVALS_PER_SEC /
+                         FLOOD_TICKS_PER_SEC)) {
+      hs_cell_introduce2_data_t *data = tor_malloc_zero(sizeof(*data));
+      data->link_specifiers = smartlist_new();
+      set_uint32(data->rendezvous_cookie, next);
+      reqs[next].state = FLOOD_QUEUED;
+      reqs[next].queued_tick = tick;
+      smartlist_add(queued, (void *) (uintptr_t) next);
+      enqueue_rend_request(service, ip, data, reqs[next].effort);
+      next++;
+    }
+    flood_scan_pqueue(pow_state, reqs, ++scan);
+    flood_note_departures(queued, reqs, scan, tick, 0, 0);
+
+    /* Serve the queue as the main loop would. */
+    handle_rend_pqueue_cb(pow_state->pop_pqueue_ev, service);
+    flood_scan_pqueue(pow_state, reqs, ++scan);
+    flood_note_departures(queued, reqs, scan, tick, 1,
+                          service->config.pow_queue_max_age);
+    tick++;
+  }
+  end = perftime();
+
+  for (int i = 0; i < N_REQUESTS; ++i) {
+    n_launched += reqs[i].state == FLOOD_LAUNCHED;
+    n_dropped += reqs[i].state == FLOOD_DROPPED;
+  }
+  tor_assert(n_launched == (int) pow_state->rend_handled);
+  printf("Intro flood: %d requests at %d/sec, dequeue rate %u/sec "
+         "(burst %u): %d launched, %d dropped in %.1f simulated sec\n",
+         N_REQUESTS, ARRIVALS_PER_SEC, service->config.pow_queue_rate,
+         service->config.pow_queue_burst, n_launched, n_dropped,
+         (double) tick / FLOOD_TICKS_PER_SEC);
+  flood_print_latency("All efforts", reqs, N_REQUESTS, 0);
+  flood_print_latency("Top 10% effort", reqs, N_REQUESTS,
+                      max_effort - max_effort / 10);
+  printf("Queue handling: %.2f usec per request\n",
+         MICROCOUNT(start, end, N_REQUESTS));
+
+  rend_pqueue_clear(pow_state);
+  smartlist_free(pow_state->rend_request_pqueue);
+  mainloop_event_free(pow_state->pop_pqueue_ev);
+  tor_free(pow_state);
+  service->state.pow_state = NULL;
+  hs_service_free(service);
+  smartlist_free(queued);
+  tor_free(reqs);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -751,6 +1484,8 @@ typedef struct benchmark_t {
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(siphash),
+  ENT(hs_circuitmap),
+  ENT(hs_hsdir_ring),
   ENT(digest),
   ENT(aes),
   ENT(onion_TAP),
@@ -760,6 +1495,8 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_digest),
+  ENT(cell_alloc),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +1505,10 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(hs_desc_decode),
+  ENT(hs_pow_solve),
+  ENT(hs_pow_verify),
+  ENT(hs_pow_intro_flood),
   {NULL,NULL,0}
 };
 
@@ -854,6 +1595,13 @@ main(int argc, const char **argv)
     return 1;
   }
 
+  {
+    /* Some benchmarks queue main loop events. */
+    struct tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+
   for (benchmark_t *b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
       printf("===== %s =====\n", b->name);
@@ -729,6 +729,7 @@ struct testgroup_t testgroups[] = {
   { "hs_control/", hs_control_tests },
   { "hs_descriptor/", hs_descriptor },
   { "hs_dos/", hs_dos_tests },
+  { "hs_pow/", hs_pow_tests },
   { "hs_intropoint/", hs_intropoint_tests },
   { "hs_metrics/", hs_metrics_tests },
   { "hs_ntor/", hs_ntor_tests },
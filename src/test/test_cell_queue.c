@@ -139,9 +139,61 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_packed_cell_slabs(void *arg)
+{
+  packed_cell_t *cells[200];
+  packed_cell_t *pc = NULL;
+  const size_t slab_cost = packed_cell_slab_mem_cost();
+  int i;
+  (void) arg;
+
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+  tt_u64_op(slab_cost, OP_GE,
+            PACKED_CELL_SLAB_N_CELLS * packed_cell_mem_cost());
+
+  /* Enough cells to take them from several slabs. We account for whole
+   * slabs. */
+  for (i = 0; i < 200; ++i) {
+    cells[i] = packed_cell_new();
+    tt_assert(fast_mem_is_zero(cells[i]->body, sizeof(cells[i]->body)));
+    memset(cells[i]->body, 0xff, sizeof(cells[i]->body));
+  }
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ, 4 * slab_cost);
+
+  /* Free cells are reused, and come back cleared. */
+  pc = cells[42];
+  packed_cell_free(cells[42]);
+  cells[42] = packed_cell_new();
+  tt_ptr_op(cells[42], OP_EQ, pc);
+  tt_assert(fast_mem_is_zero(pc->body, sizeof(pc->body)));
+
+  /* One live cell keeps its whole slab accounted for. */
+  for (i = 0; i < 200; ++i) {
+    if (i % PACKED_CELL_SLAB_N_CELLS) {
+      packed_cell_free(cells[i]);
+      cells[i] = NULL;
+    }
+  }
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ, 4 * slab_cost);
+
+  /* Slabs with no cell left are kept for reuse, and accounted for, until
+   * we release them. */
+  for (i = 0; i < 200; ++i) {
+    packed_cell_free(cells[i]);
+  }
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ, 4 * slab_cost);
+  packed_cell_free_all();
+  tt_u64_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  ;
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "packed_cell_slabs", test_packed_cell_slabs, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
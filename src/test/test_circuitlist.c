@@ -11,6 +11,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
 #include "feature/hs/hs_circuitmap.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
 
@@ -464,11 +465,60 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+/** Fill the HS circuitmap past a few resizes, then remove half of the
+ * circuits, and make sure every lookup still finds the right circuit. */
+static void
+test_hs_circuitmap_grow_and_remove(void *arg)
+{
+#define N_CIRCS 300
+  or_circuit_t *circs[N_CIRCS] = { NULL };
+  uint8_t toks[N_CIRCS][REND_TOKEN_LEN];
+
+  (void)arg;
+
+  hs_circuitmap_init();
+
+  for (int i = 0; i < N_CIRCS; i++) {
+    crypto_rand((char *) toks[i], sizeof(toks[i]));
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_REND_POINT_WAITING;
+    hs_circuitmap_register_rend_circ_relay_side(circs[i], toks[i]);
+  }
+  tt_uint_op(get_hs_circuitmap()->n_entries, OP_EQ, N_CIRCS);
+  tt_uint_op(get_hs_circuitmap()->n_slots, OP_GE, 2 * N_CIRCS);
+  for (int i = 0; i < N_CIRCS; i++) {
+    tt_ptr_op(circs[i], OP_EQ,
+              hs_circuitmap_get_rend_circ_relay_side(toks[i]));
+  }
+
+  /* Removing entries must not hide the ones later in the same probe
+   * sequence. */
+  for (int i = 0; i < N_CIRCS; i += 2) {
+    hs_circuitmap_remove_circuit(TO_CIRCUIT(circs[i]));
+    tt_ptr_op(TO_CIRCUIT(circs[i])->hs_token, OP_EQ, NULL);
+  }
+  tt_uint_op(get_hs_circuitmap()->n_entries, OP_EQ, N_CIRCS / 2);
+  for (int i = 0; i < N_CIRCS; i++) {
+    tt_ptr_op((i % 2) ? circs[i] : NULL, OP_EQ,
+              hs_circuitmap_get_rend_circ_relay_side(toks[i]));
+  }
+
+ done:
+  for (int i = 0; i < N_CIRCS; i++) {
+    if (circs[i]) {
+      circuit_free_(TO_CIRCUIT(circs[i]));
+    }
+  }
+#undef N_CIRCS
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
+  { "hs_circuitmap_grow_and_remove", test_hs_circuitmap_grow_and_remove,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -12,6 +12,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitbuild.h"
+#include "feature/hs/hs_service.h"
 #include "feature/nodelist/nodelist.h"
 
 #include "core/or/cpath_build_state_st.h"
@@ -215,6 +216,51 @@ test_needs_exit_circuits_ret_true_for_predicted_ports_and_path(void *arg)
     UNMOCK(router_have_consensus_path);
 }
 
+static unsigned int
+mock_hs_service_get_num_services(void)
+{
+  return 1;
+}
+
+static void
+test_needs_hs_server_circuits_for_pool(void *arg)
+{
+  (void)arg;
+  MOCK(router_have_consensus_path, mock_router_have_exit_consensus_path);
+  MOCK(hs_service_get_num_services, mock_hs_service_get_num_services);
+
+  time_t now = time(NULL);
+  /* Default pool. */
+  tt_int_op(1, OP_EQ, needs_hs_server_circuits(now, 2));
+  tt_int_op(0, OP_EQ, needs_hs_server_circuits(now, 3));
+
+  /* A pool smaller than the default doesn't shrink it. */
+  get_options_mutable()->HiddenServiceCircuitPool = 1;
+  tt_int_op(3, OP_EQ, hs_server_circuit_pool_size(get_options()));
+  tt_int_op(1, OP_EQ, needs_hs_server_circuits(now, 2));
+
+  get_options_mutable()->HiddenServiceCircuitPool = 50;
+  tt_int_op(50, OP_EQ, hs_server_circuit_pool_size(get_options()));
+  tt_int_op(1, OP_EQ, needs_hs_server_circuits(now, 3));
+  tt_int_op(1, OP_EQ, needs_hs_server_circuits(now, 49));
+  tt_int_op(0, OP_EQ, needs_hs_server_circuits(now, 50));
+
+  /* Only a pool larger than the default is refilled several circuits at a
+   * time, and never beyond the unused circuit limit. */
+  tt_int_op(8, OP_EQ, hs_server_circuits_to_launch(get_options(), 3, 20));
+  tt_int_op(2, OP_EQ, hs_server_circuits_to_launch(get_options(), 48, 20));
+  tt_int_op(5, OP_EQ, hs_server_circuits_to_launch(get_options(), 3, 5));
+  get_options_mutable()->HiddenServiceCircuitPool = 3;
+  tt_int_op(1, OP_EQ, hs_server_circuits_to_launch(get_options(), 0, 20));
+  get_options_mutable()->HiddenServiceCircuitPool = 0;
+  tt_int_op(1, OP_EQ, hs_server_circuits_to_launch(get_options(), 0, 20));
+
+  done:
+    get_options_mutable()->HiddenServiceCircuitPool = 0;
+    UNMOCK(router_have_consensus_path);
+    UNMOCK(hs_service_get_num_services);
+}
+
 static void
 test_needs_circuits_for_build_ret_false_consensus_path_unknown(void *arg)
 {
@@ -293,6 +339,10 @@ struct testcase_t circuituse_tests[] = {
    test_needs_exit_circuits_ret_true_for_predicted_ports_and_path,
    TT_FORK, NULL, NULL
  },
+ { "hs_server_pool",
+   test_needs_hs_server_circuits_for_pool,
+   TT_FORK, NULL, NULL
+ },
  { "consensus_path_unknown",
    test_needs_circuits_for_build_ret_false_consensus_path_unknown,
    TT_FORK, NULL, NULL
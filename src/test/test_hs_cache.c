@@ -13,7 +13,9 @@
 #define CHANNEL_OBJECT_PRIVATE
 
 #include "trunnel/ed25519_cert.h"
+#include "app/config/config.h"
 #include "feature/hs/hs_cache.h"
+#include "feature/hs/hs_metrics.h"
 #include "feature/rend/rendcache.h"
 #include "feature/dircache/dircache.h"
 #include "feature/dirclient/dirclient.h"
@@ -24,7 +26,10 @@
 #include "core/or/channel.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/metrics/metrics_store.h"
+#include "lib/metrics/metrics_store_entry.h"
 
+#include "app/config/or_options_st.h"
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/or_connection_st.h"
@@ -227,6 +232,103 @@ test_clean_as_dir(void *arg)
   tor_free(desc1_str);
 }
 
+/** Helper: return the value of the HSDir cache metrics <b>key</b>. */
+static int64_t
+get_hsdir_cache_metrics(hs_metrics_hsdir_cache_key_t key)
+{
+  const smartlist_t *stores = hs_metrics_get_stores();
+  const metrics_store_entry_t *entry;
+  smartlist_t *entries;
+
+  /* No onion service so the HSDir cache store is the only one. */
+  tor_assert(smartlist_len(stores) == 1);
+  entries = metrics_store_get_all(smartlist_get(stores, 0),
+                                  hsdir_cache_metrics[key].name);
+  tor_assert(entries && smartlist_len(entries) == 1);
+  entry = smartlist_get(entries, 0);
+  return metrics_store_entry_get_value(entry);
+}
+
+/** Test that the directory cache evicts the least recently used descriptors
+ * first and counts lookups and evictions. */
+static void
+test_lru_as_dir(void *arg)
+{
+  int ret;
+  size_t oom_size, alloc;
+  ed25519_keypair_t kp[4];
+  hs_descriptor_t *desc[4] = { NULL };
+  char *desc_str[4] = { NULL };
+  char query[4][256];
+
+  (void) arg;
+
+  init_test();
+
+  for (int i = 0; i < 4; i++) {
+    ret = ed25519_keypair_generate(&kp[i], 0);
+    tt_int_op(ret, OP_EQ, 0);
+    desc[i] = hs_helper_build_hs_desc_with_ip(&kp[i]);
+    tt_assert(desc[i]);
+    ret = hs_desc_encode_descriptor(desc[i], &kp[i], NULL, &desc_str[i]);
+    tt_int_op(ret, OP_EQ, 0);
+    strlcpy(query[i], helper_get_hsdir_query(desc[i]), sizeof(query[i]));
+  }
+
+  /* Store the first three and make the first one the most recently used. */
+  for (int i = 0; i < 3; i++) {
+    tt_int_op(hs_cache_store_as_dir(desc_str[i]), OP_EQ, 0);
+  }
+  tt_int_op(hs_cache_lookup_as_dir(3, query[0], NULL), OP_EQ, 1);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_HITS), OP_EQ, 1);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_BYTES), OP_EQ,
+            rend_cache_get_total_allocation());
+
+  /* The second one is now the least recently used. */
+  oom_size = hs_cache_handle_oom(time(NULL), 1);
+  tt_u64_op(oom_size, OP_GT, 0);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_EVICTED), OP_EQ,
+            1);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[1], NULL), OP_EQ, 0);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_MISSES), OP_EQ,
+            1);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[2], NULL), OP_EQ, 1);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[0], NULL), OP_EQ, 1);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_HITS), OP_EQ, 3);
+
+  /* With a budget of what is cached now, storing the fourth one evicts the
+   * least recently used, which is the third one. */
+  alloc = rend_cache_get_total_allocation();
+  get_options_mutable()->MaxHSDirCacheBytes = alloc;
+  tt_int_op(hs_cache_store_as_dir(desc_str[3]), OP_EQ, 0);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[2], NULL), OP_EQ, 0);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[0], NULL), OP_EQ, 1);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[3], NULL), OP_EQ, 1);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_LE, alloc);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_EVICTED), OP_EQ,
+            2);
+
+  /* A budget smaller than one descriptor still keeps the new one. */
+  get_options_mutable()->MaxHSDirCacheBytes = 1;
+  desc[1]->plaintext_data.revision_counter++;
+  tor_free(desc_str[1]);
+  ret = hs_desc_encode_descriptor(desc[1], &kp[1], NULL, &desc_str[1]);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(hs_cache_store_as_dir(desc_str[1]), OP_EQ, 0);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[1], NULL), OP_EQ, 1);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[0], NULL), OP_EQ, 0);
+  tt_int_op(hs_cache_lookup_as_dir(3, query[3], NULL), OP_EQ, 0);
+  tt_i64_op(get_hsdir_cache_metrics(HS_METRICS_HSDIR_CACHE_BYTES), OP_EQ,
+            rend_cache_get_total_allocation());
+
+ done:
+  for (int i = 0; i < 4; i++) {
+    hs_descriptor_free(desc[i]);
+    tor_free(desc_str[i]);
+  }
+  hs_cache_free_all();
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -702,12 +804,116 @@ test_client_cache_remove(void *arg)
   UNMOCK(networkstatus_get_reasonably_live_consensus);
 }
 
+/** Test that a descriptor stored with ClientOnionLazyDecryption is only
+ * decrypted when looked up and that its decrypted form can be dropped. */
+static void
+test_client_cache_lazy_decrypt(void *arg)
+{
+  int ret;
+  size_t lazy_alloc, decrypted_alloc;
+  ed25519_keypair_t service_kp;
+  hs_descriptor_t *desc = NULL;
+  char *encoded_old = NULL, *encoded_new = NULL;
+  hs_cache_client_descriptor_t *entry;
+  const hs_descriptor_t *search_desc;
+
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+
+  parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                     &mock_ns.valid_after);
+  parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                     &mock_ns.fresh_until);
+  parse_rfc1123_time("Sat, 26 Oct 1985 16:00:00 UTC",
+                     &mock_ns.valid_until);
+
+  get_options_mutable()->ClientOnionLazyDecryption = 1;
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&service_kp, 0));
+  /* Two revisions of the same descriptor. */
+  desc = hs_helper_build_hs_desc_with_rev_counter(&service_kp, 41);
+  tt_assert(desc);
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded_old);
+  tt_int_op(ret, OP_EQ, 0);
+  desc->plaintext_data.revision_counter = 42;
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &encoded_new);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* Store it: only the plaintext layer is decoded. */
+  ret = hs_cache_store_as_client(encoded_new, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  entry = lookup_v3_desc_as_client(service_kp.pubkey.pubkey);
+  tt_assert(entry);
+  tt_ptr_op(entry->desc, OP_EQ, NULL);
+  tt_assert(entry->decrypt_pending);
+  tt_assert(entry->plaintext_data);
+  tt_u64_op(entry->plaintext_data->revision_counter, OP_EQ, 42);
+  tt_ptr_op(entry->plaintext_data->superencrypted_blob, OP_EQ, NULL);
+  lazy_alloc = rend_cache_get_total_allocation();
+
+  /* An older revision is discarded without decrypting anything. */
+  ret = hs_cache_store_as_client(encoded_old, &service_kp.pubkey);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  tt_ptr_op(lookup_v3_desc_as_client(service_kp.pubkey.pubkey), OP_EQ,
+            entry);
+  tt_assert(entry->decrypt_pending);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, lazy_alloc);
+
+  /* The lookup decrypts it and accounts for it. */
+  search_desc = hs_cache_lookup_as_client(&service_kp.pubkey);
+  tt_assert(search_desc);
+  tt_ptr_op(search_desc, OP_EQ, entry->desc);
+  tt_assert(!entry->decrypt_pending);
+  tt_u64_op(search_desc->plaintext_data.revision_counter, OP_EQ, 42);
+  tt_int_op(smartlist_len(search_desc->encrypted_data.intro_points), OP_EQ,
+            smartlist_len(desc->encrypted_data.intro_points));
+  decrypted_alloc = rend_cache_get_total_allocation();
+  tt_u64_op(decrypted_alloc, OP_EQ,
+            lazy_alloc + hs_desc_obj_size(search_desc));
+  tt_int_op(hs_cache_decrypt_as_client(&service_kp.pubkey), OP_EQ,
+            HS_DESC_DECODE_OK);
+
+  /* Memory pressure drops the decrypted form but keeps the entry. */
+  tt_u64_op(cache_client_drop_decrypted(1), OP_EQ,
+            decrypted_alloc - lazy_alloc);
+  tt_ptr_op(entry->desc, OP_EQ, NULL);
+  tt_assert(entry->decrypt_pending);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, lazy_alloc);
+  /* Nothing left to drop. */
+  tt_u64_op(cache_client_drop_decrypted(1), OP_EQ, 0);
+
+  /* And it is decrypted again when needed. */
+  tt_int_op(hs_cache_decrypt_as_client(&service_kp.pubkey), OP_EQ,
+            HS_DESC_DECODE_OK);
+  tt_assert(entry->desc);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, decrypted_alloc);
+
+  /* Removing the entry gives all of it back. */
+  hs_cache_remove_as_client(&service_kp.pubkey);
+  tt_assert(!hs_cache_lookup_as_client(&service_kp.pubkey));
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  hs_descriptor_free(desc);
+  tor_free(encoded_old);
+  tor_free(encoded_new);
+  hs_free_all();
+
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+}
+
 struct testcase_t hs_cache[] = {
   /* Encoding tests. */
   { "directory", test_directory, TT_FORK,
     NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
+  { "lru_as_dir", test_lru_as_dir, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
@@ -718,6 +924,8 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "client_cache_remove", test_client_cache_remove, TT_FORK,
     NULL, NULL },
+  { "client_cache_lazy_decrypt", test_client_cache_lazy_decrypt, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
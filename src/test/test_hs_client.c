@@ -38,6 +38,7 @@
 #include "feature/hs/hs_config.h"
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_cache.h"
+#include "feature/hs/hs_pow.h"
 #include "feature/rend/rendcache.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitbuild.h"
@@ -1553,6 +1554,108 @@ test_purge_ephemeral_client_auth(void *arg)
   UNMOCK(write_str_to_file);
 }
 
+static void
+test_pow_effort_and_solutions(void *arg)
+{
+  ed25519_keypair_t service_kp;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t sol;
+  hs_pow_solution_t *taken = NULL;
+  origin_circuit_t *rend_circ = NULL;
+
+  (void) arg;
+
+  hs_init();
+  update_approx_time(time(NULL));
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&service_kp, 0));
+  memset(&pow_params, 0, sizeof(pow_params));
+  crypto_rand((char *) pow_params.seed, sizeof(pow_params.seed));
+  pow_params.suggested_effort = 3;
+  pow_params.expiration_time = approx_time() + 3600;
+
+  /* Nothing known about the service: go with what it suggests. */
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, 3);
+  tt_ptr_op(client_pow_state_get(&service_kp.pubkey, 0), OP_EQ, NULL);
+
+  /* The service never rendezvoused with us: double the effort. */
+  rend_circ = origin_circuit_new();
+  TO_CIRCUIT(rend_circ)->purpose = CIRCUIT_PURPOSE_C_REND_READY;
+  rend_circ->hs_ident = hs_ident_circuit_new(&service_kp.pubkey);
+  rend_circ->hs_with_pow_circ = 1;
+  rend_circ->hs_pow_effort = 5;
+  client_pow_note_rendezvous(rend_circ, 0);
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, 10);
+  /* Unless it suggests more. */
+  pow_params.suggested_effort = 20;
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, 20);
+  pow_params.suggested_effort = 3;
+
+  /* Capped however many times it fails. */
+  rend_circ->hs_pow_effort = HS_CLIENT_POW_MAX_EFFORT;
+  client_pow_note_rendezvous(rend_circ, 0);
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, HS_CLIENT_POW_MAX_EFFORT);
+  /* Even from an effort that doubling would overflow. */
+  rend_circ->hs_pow_effort = UINT32_C(1) << 31;
+  client_pow_note_rendezvous(rend_circ, 0);
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, HS_CLIENT_POW_MAX_EFFORT);
+
+  /* It worked: stick to that effort. */
+  rend_circ->hs_pow_effort = 7;
+  client_pow_note_rendezvous(rend_circ, 1);
+  tt_uint_op(hs_client_pow_get_effort(&service_kp.pubkey, &pow_params),
+             OP_EQ, 7);
+
+  /* An unsent solution is only handed back for the same seed and at least
+   * the requested effort, and only once. */
+  memset(&sol, 0, sizeof(sol));
+  sol.effort = 8;
+  sol.seed_head = get_uint32(pow_params.seed);
+  hs_client_pow_note_solution(&service_kp.pubkey, &sol,
+                              pow_params.expiration_time);
+  tt_ptr_op(hs_client_pow_take_solution(&service_kp.pubkey, &pow_params, 10),
+            OP_EQ, NULL);
+  taken = hs_client_pow_take_solution(&service_kp.pubkey, &pow_params, 8);
+  tt_assert(taken);
+  tt_uint_op(taken->effort, OP_EQ, 8);
+  tor_free(taken);
+  tt_ptr_op(hs_client_pow_take_solution(&service_kp.pubkey, &pow_params, 1),
+            OP_EQ, NULL);
+
+  /* No more than HS_CLIENT_POW_MAX_CACHED_SOLUTIONS are kept. */
+  for (int i = 0; i < HS_CLIENT_POW_MAX_CACHED_SOLUTIONS + 2; i++) {
+    hs_client_pow_note_solution(&service_kp.pubkey, &sol,
+                                pow_params.expiration_time);
+  }
+  tt_int_op(smartlist_len(client_pow_state_get(&service_kp.pubkey,
+                                               0)->solutions),
+            OP_EQ, HS_CLIENT_POW_MAX_CACHED_SOLUTIONS);
+
+  /* The seed rotated: the cached solutions are useless. */
+  pow_params.seed[0] ^= 0xff;
+  tt_ptr_op(hs_client_pow_take_solution(&service_kp.pubkey, &pow_params, 1),
+            OP_EQ, NULL);
+  tt_int_op(smartlist_len(client_pow_state_get(&service_kp.pubkey,
+                                               0)->solutions), OP_EQ, 0);
+
+  /* A new identity forgets all about the service. */
+  set_hs_client_auths_map(digest256map_new());
+  hs_client_purge_state();
+  tt_ptr_op(client_pow_state_get(&service_kp.pubkey, 0), OP_EQ, NULL);
+
+ done:
+  tor_free(taken);
+  if (rend_circ) {
+    circuit_free_(TO_CIRCUIT(rend_circ));
+  }
+  hs_free_all();
+}
+
 struct testcase_t hs_client_tests[] = {
   { "e2e_rend_circuit_setup_legacy", test_e2e_rend_circuit_setup_legacy,
     TT_FORK, NULL, NULL },
@@ -1584,5 +1687,9 @@ struct testcase_t hs_client_tests[] = {
   { "purge_ephemeral_client_auth", test_purge_ephemeral_client_auth, TT_FORK,
     NULL, NULL },
 
+  /* Proof of work. */
+  { "pow_effort_and_solutions", test_pow_effort_and_solutions, TT_FORK,
+    NULL, NULL },
+
   END_OF_TESTCASES
 };
@@ -410,6 +410,14 @@ test_responsible_hsdirs(void *arg)
    * The third relay was not an hsdir! */
   tt_int_op(smartlist_len(responsible_dirs), OP_EQ, 2);
 
+  /* A new HSDir must show up in the hash ring: adding it to the nodelist
+   * drops the cached rings. */
+  helper_add_hsdir_to_networkstatus(ns, 4, "zelda", 1);
+  smartlist_clear(responsible_dirs);
+  hs_get_responsible_hsdirs(&pubkey, time_period_num,
+                            0, 0, responsible_dirs);
+  tt_int_op(smartlist_len(responsible_dirs), OP_EQ, 3);
+
   /** TODO: Build a bigger network and do more tests here */
 
  done:
@@ -423,6 +431,115 @@ test_responsible_hsdirs(void *arg)
   UNMOCK(networkstatus_get_reasonably_live_consensus);
 }
 
+/** Test the blinded key cache and the batch blinded keypair derivation. */
+static void
+test_blinded_key_cache(void *arg)
+{
+  ed25519_keypair_t kps[3], blinded_kps[3], blinded_kp;
+  const ed25519_keypair_t *kp_ptrs[3];
+  ed25519_public_key_t blinded_pk, uncached_pk;
+  uint8_t secret[DIGEST256_LEN];
+  uint64_t tp = hs_get_time_period_num(approx_time());
+  (void) arg;
+
+  for (int i = 0; i < 3; i++) {
+    tt_int_op(ed25519_keypair_generate(&kps[i], 0), OP_EQ, 0);
+    kp_ptrs[i] = &kps[i];
+  }
+  memset(secret, 'A', sizeof(secret));
+
+  /* A first lookup computes the blinded key and caches it. */
+  hs_build_blinded_pubkey(&kps[0].pubkey, NULL, 0, tp, &uncached_pk);
+  tt_int_op(digest256map_size(get_blinded_key_cache()), OP_EQ, 1);
+  hs_build_blinded_pubkey(&kps[0].pubkey, NULL, 0, tp, &blinded_pk);
+  tt_mem_op(&blinded_pk, OP_EQ, &uncached_pk, sizeof(blinded_pk));
+
+  /* The batch gives the same keys as one at a time, and fills the cache
+   * with their public part. */
+  hs_build_blinded_keypairs(kp_ptrs, 3, NULL, 0, tp, blinded_kps);
+  tt_int_op(digest256map_size(get_blinded_key_cache()), OP_EQ, 3);
+  tt_mem_op(&blinded_kps[0].pubkey, OP_EQ, &uncached_pk,
+            sizeof(uncached_pk));
+  for (int i = 0; i < 3; i++) {
+    hs_build_blinded_keypair(&kps[i], NULL, 0, tp, &blinded_kp);
+    tt_mem_op(&blinded_kp, OP_EQ, &blinded_kps[i], sizeof(blinded_kp));
+    hs_build_blinded_pubkey(&kps[i].pubkey, NULL, 0, tp, &blinded_pk);
+    tt_mem_op(&blinded_pk, OP_EQ, &blinded_kps[i].pubkey,
+              sizeof(blinded_pk));
+  }
+
+  /* Another time period gives another key. */
+  hs_build_blinded_pubkey(&kps[0].pubkey, NULL, 0, tp + 1, &blinded_pk);
+  tt_mem_op(&blinded_pk, OP_NE, &uncached_pk, sizeof(blinded_pk));
+
+  /* Keys blinded with a secret never come from the cache. */
+  hs_build_blinded_pubkey(&kps[0].pubkey, secret, sizeof(secret), tp,
+                          &blinded_pk);
+  tt_mem_op(&blinded_pk, OP_NE, &uncached_pk, sizeof(blinded_pk));
+  hs_build_blinded_keypairs(kp_ptrs, 1, secret, sizeof(secret), tp,
+                            &blinded_kp);
+  tt_mem_op(&blinded_kp.pubkey, OP_EQ, &blinded_pk, sizeof(blinded_pk));
+
+  /* Time periods older than the previous one are cleaned up. */
+  hs_build_blinded_pubkey(&kps[0].pubkey, NULL, 0, tp - 5, &blinded_pk);
+  hs_clean_blinded_key_cache();
+  tt_int_op(digest256map_size(get_blinded_key_cache()), OP_EQ, 3);
+  update_approx_time(approx_time() + 10 * get_time_period_length() * 60);
+  hs_clean_blinded_key_cache();
+  tt_int_op(digest256map_size(get_blinded_key_cache()), OP_EQ, 0);
+
+  /* Purging forgets everything, as a client does on NEWNYM. */
+  hs_build_blinded_pubkey(&kps[0].pubkey, NULL, 0, tp, &blinded_pk);
+  tt_int_op(digest256map_size(get_blinded_key_cache()), OP_EQ, 1);
+  hs_purge_blinded_key_cache();
+  tt_ptr_op(get_blinded_key_cache(), OP_EQ, NULL);
+
+ done:
+  hs_free_all();
+}
+
+/** Test the sorted HSDir hash ring lookups. */
+static void
+test_hsdir_ring(void *arg)
+{
+  hs_hsdir_ring_t *ring = NULL;
+  node_t nodes[3];
+  uint8_t hsdir_index[DIGEST256_LEN], hs_index[DIGEST256_LEN];
+  (void) arg;
+
+  memset(nodes, 0, sizeof(nodes));
+
+  /* Start small to exercise growing the ring, and add out of order. */
+  ring = hs_hsdir_ring_new(1);
+  memset(hsdir_index, 0x30, sizeof(hsdir_index));
+  hs_hsdir_ring_add(ring, hsdir_index, &nodes[2]);
+  memset(hsdir_index, 0x10, sizeof(hsdir_index));
+  hs_hsdir_ring_add(ring, hsdir_index, &nodes[0]);
+  memset(hsdir_index, 0x20, sizeof(hsdir_index));
+  hs_hsdir_ring_add(ring, hsdir_index, &nodes[1]);
+  hs_hsdir_ring_sort(ring);
+  tt_int_op(hs_hsdir_ring_len(ring), OP_EQ, 3);
+  for (int i = 0; i < 3; i++) {
+    tt_ptr_op(hs_hsdir_ring_get_node(ring, i), OP_EQ, &nodes[i]);
+  }
+
+  /* Lookups land on the first node at or after the index. */
+  memset(hs_index, 0x00, sizeof(hs_index));
+  tt_int_op(hs_hsdir_ring_find_idx(ring, hs_index), OP_EQ, 0);
+  memset(hs_index, 0x10, sizeof(hs_index));
+  tt_int_op(hs_hsdir_ring_find_idx(ring, hs_index), OP_EQ, 0);
+  memset(hs_index, 0x15, sizeof(hs_index));
+  tt_int_op(hs_hsdir_ring_find_idx(ring, hs_index), OP_EQ, 1);
+  memset(hs_index, 0x30, sizeof(hs_index));
+  tt_int_op(hs_hsdir_ring_find_idx(ring, hs_index), OP_EQ, 2);
+  /* Past the last node, we wrap around. */
+  memset(hs_index, 0x31, sizeof(hs_index));
+  tt_int_op(hs_hsdir_ring_find_idx(ring, hs_index), OP_EQ, 0);
+
+ done:
+  hs_hsdir_ring_free(ring);
+}
+
 static void
 mock_directory_initiate_request(directory_request_t *req)
 {
@@ -1860,6 +1977,8 @@ struct testcase_t hs_common_tests[] = {
     TT_FORK, NULL, NULL },
   { "responsible_hsdirs", test_responsible_hsdirs, TT_FORK,
     NULL, NULL },
+  { "hsdir_ring", test_hsdir_ring, 0, NULL, NULL },
+  { "blinded_key_cache", test_blinded_key_cache, TT_FORK, NULL, NULL },
   { "desc_reupload_logic", test_desc_reupload_logic, TT_FORK,
     NULL, NULL },
   { "disaster_srv", test_disaster_srv, TT_FORK,
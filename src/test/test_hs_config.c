@@ -581,6 +581,23 @@ test_dos_parameters(void *arg)
     teardown_capture_of_logs();
   }
 
+  /* INTRODUCE2 burst is smaller than rate. */
+  {
+    const char *conf =
+      "HiddenServiceDir /tmp/tor-test-hs-RANDOM/hs3\n"
+      "HiddenServiceVersion 3\n"
+      "HiddenServicePort 22 1.1.1.1:22\n"
+      "HiddenServiceIntroduce2RatePerSec 42\n"
+      "HiddenServiceIntroduce2BurstPerSec 27\n";
+
+    setup_full_capture_of_logs(LOG_WARN);
+    ret = helper_config_service(conf, 0);
+    tt_int_op(ret, OP_EQ, -1);
+    expect_log_msg_containing("Hidden service INTRODUCE2 burst (27) can "
+                              "not be smaller than the rate value (42).");
+    teardown_capture_of_logs();
+  }
+
   /* Negative value. */
   {
     const char *conf =
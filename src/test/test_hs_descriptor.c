@@ -233,6 +233,94 @@ test_encode_descriptor(void *arg)
   hs_descriptor_free(desc);
 }
 
+static void
+test_encode_intro_point_reuse(void *arg)
+{
+  int ret;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+  smartlist_t *first_encoding = smartlist_new();
+  char *encoded = NULL;
+  uint8_t descriptor_cookie[HS_DESC_DESCRIPTOR_COOKIE_LEN];
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  tt_int_op(smartlist_len(desc->encrypted_data.intro_points), OP_GT, 0);
+  crypto_strongest_rand(descriptor_cookie, sizeof(descriptor_cookie));
+
+  /* The first encoding of an intro point is kept on it. */
+  ret = hs_desc_encode_descriptor(desc, &signing_kp,
+                                  descriptor_cookie, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tor_free(encoded);
+  SMARTLIST_FOREACH_BEGIN(desc->encrypted_data.intro_points,
+                          const hs_desc_intro_point_t *, ip) {
+    tt_assert(ip->encoded);
+    smartlist_add(first_encoding, ip->encoded);
+  } SMARTLIST_FOREACH_END(ip);
+
+  /* Encoding a new revision of the descriptor doesn't encode them again. */
+  desc->plaintext_data.revision_counter++;
+  ret = hs_desc_encode_descriptor(desc, &signing_kp,
+                                  descriptor_cookie, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_assert(encoded);
+  SMARTLIST_FOREACH_BEGIN(desc->encrypted_data.intro_points,
+                          const hs_desc_intro_point_t *, ip) {
+    tt_ptr_op(ip->encoded, OP_EQ,
+              smartlist_get(first_encoding, ip_sl_idx));
+  } SMARTLIST_FOREACH_END(ip);
+
+ done:
+  tor_free(encoded);
+  smartlist_free(first_encoding);
+  hs_descriptor_free(desc);
+}
+
+static void
+test_encode_job(void *arg)
+{
+  int ret;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+  hs_desc_encode_job_t *job = NULL;
+  char *encoded = NULL;
+  uint8_t descriptor_cookie[HS_DESC_DESCRIPTOR_COOKIE_LEN];
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  crypto_strongest_rand(descriptor_cookie, sizeof(descriptor_cookie));
+
+  /* Only version 3 can be encoded. */
+  desc->plaintext_data.version = 2;
+  tt_ptr_op(hs_desc_encode_job_new(desc, &signing_kp, descriptor_cookie),
+            OP_EQ, NULL);
+  desc->plaintext_data.version = 3;
+
+  /* The job doesn't need the descriptor anymore once built. */
+  job = hs_desc_encode_job_new(desc, &signing_kp, descriptor_cookie);
+  tt_assert(job);
+  hs_descriptor_free(desc);
+
+  ret = hs_desc_encode_job_run(job, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_assert(encoded);
+  tt_assert(!strcmpstart(encoded, "hs-descriptor 3\n"));
+  tt_assert(strstr(encoded, "\nsuperencrypted\n-----BEGIN MESSAGE-----\n"));
+  tt_assert(strstr(encoded, "-----END MESSAGE-----\nsignature "));
+
+ done:
+  tor_free(encoded);
+  hs_desc_encode_job_free(job);
+  hs_descriptor_free(desc);
+}
+
 static void
 test_decode_descriptor(void *arg)
 {
@@ -841,6 +929,10 @@ struct testcase_t hs_descriptor[] = {
     NULL, NULL },
   { "encode_descriptor", test_encode_descriptor, TT_FORK,
     NULL, NULL },
+  { "encode_intro_point_reuse", test_encode_intro_point_reuse, TT_FORK,
+    NULL, NULL },
+  { "encode_job", test_encode_job, TT_FORK,
+    NULL, NULL },
   { "descriptor_padding", test_descriptor_padding, TT_FORK,
     NULL, NULL },
 
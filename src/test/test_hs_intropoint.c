@@ -10,6 +10,7 @@
 #define HS_INTROPOINT_PRIVATE
 #define RENDSERVICE_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define HS_CIRCUITMAP_PRIVATE
 
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -598,7 +599,7 @@ test_intro_point_registration(void *arg)
   {
     the_hs_circuitmap = get_hs_circuitmap();
     tt_assert(the_hs_circuitmap);
-    tt_int_op(0, OP_EQ, HT_SIZE(the_hs_circuitmap));
+    tt_int_op(0, OP_EQ, the_hs_circuitmap->n_entries);
     /* Do a circuitmap query in any case */
     returned_intro_circ =hs_circuitmap_get_intro_circ_v3_relay_side(&auth_key);
     tt_ptr_op(returned_intro_circ, OP_EQ, NULL);
@@ -613,7 +614,7 @@ test_intro_point_registration(void *arg)
     /* Check that the intro point was registered on the HS circuitmap */
     the_hs_circuitmap = get_hs_circuitmap();
     tt_assert(the_hs_circuitmap);
-    tt_int_op(1, OP_EQ, HT_SIZE(the_hs_circuitmap));
+    tt_int_op(1, OP_EQ, the_hs_circuitmap->n_entries);
     get_auth_key_from_cell(&auth_key, RELAY_COMMAND_ESTABLISH_INTRO,
                            establish_intro_cell);
     returned_intro_circ =
@@ -633,7 +634,7 @@ test_intro_point_registration(void *arg)
     /* Check that the circuitmap now has two elements */
     the_hs_circuitmap = get_hs_circuitmap();
     tt_assert(the_hs_circuitmap);
-    tt_int_op(2, OP_EQ, HT_SIZE(the_hs_circuitmap));
+    tt_int_op(2, OP_EQ, the_hs_circuitmap->n_entries);
 
     /* Check that the new element is our legacy intro circuit. */
     retval = crypto_pk_get_digest(legacy_auth_key, key_digest);
@@ -0,0 +1,412 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_hs_pow.c
+ * \brief Test hidden service proof-of-work defenses.
+ */
+
+#define CIRCUITLIST_PRIVATE
+
+#include "test/test.h"
+#include "test/test_helpers.h"
+#include "test/log_test_helpers.h"
+
+#include "app/config/config.h"
+
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/hs/hs_descriptor.h"
+#include "feature/hs/hs_pow.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/workqueue.h"
+
+/** Low enough that a solve takes a handful of E-quiX iterations. */
+#define TEST_POW_EFFORT 1
+
+/** Fill in a service PoW state and matching descriptor params. */
+static void
+setup_pow_params(hs_service_pow_state_t *pow_state,
+                 hs_desc_pow_params_t *pow_params)
+{
+  memset(pow_state, 0, sizeof(*pow_state));
+  memset(pow_params, 0, sizeof(*pow_params));
+
+  crypto_rand((char *) pow_state->seed_current, HS_POW_SEED_LEN);
+  crypto_rand((char *) pow_state->seed_previous, HS_POW_SEED_LEN);
+  /* Seed heads must differ for the service to tell them apart. */
+  pow_state->seed_previous[0] = pow_state->seed_current[0] ^ 0xff;
+  pow_state->min_effort = 0;
+
+  pow_params->type = (char *) "v1";
+  memcpy(pow_params->seed, pow_state->seed_current, HS_POW_SEED_LEN);
+  pow_params->suggested_effort = TEST_POW_EFFORT;
+  pow_params->expiration_time = approx_time() + 3600;
+}
+
+static void
+test_solve_and_verify(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution;
+
+  (void) arg;
+
+  setup_pow_params(&pow_state, &pow_params);
+
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+  tt_uint_op(solution.effort, OP_EQ, TEST_POW_EFFORT);
+  tt_uint_op(solution.seed_head, OP_EQ, get_uint32(pow_state.seed_current));
+
+  /* Valid the first time, then caught by the replay cache. */
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, 0);
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, -1);
+
+  /* Unknown seed. */
+  solution.seed_head ^= 0xffffffff;
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, -1);
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+}
+
+static void
+test_verify_ctx_reused(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution;
+  equix_ctx *ctx;
+
+  (void) arg;
+
+  setup_pow_params(&pow_state, &pow_params);
+  tt_ptr_op(pow_state.verify_ctx, OP_EQ, NULL);
+
+  /* The context is allocated by the first verification... */
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, 0);
+  ctx = pow_state.verify_ctx;
+  tt_assert(ctx);
+
+  /* ...and reused by the next ones, including failing ones. */
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+  solution.equix_solution.idx[0] ^= 1;
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, -1);
+  solution.equix_solution.idx[0] ^= 1;
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, 0);
+  tt_ptr_op(pow_state.verify_ctx, OP_EQ, ctx);
+
+  hs_pow_free_service_state_resources(&pow_state);
+  tt_ptr_op(pow_state.verify_ctx, OP_EQ, NULL);
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+}
+
+static void
+test_verify_ctx_pool(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution;
+  equix_ctx *ctx = NULL, *ctx2 = NULL;
+
+  (void) arg;
+
+  hs_pow_init();
+  setup_pow_params(&pow_state, &pow_params);
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+
+  /* A released context is handed out again... */
+  ctx = hs_pow_verify_ctx_acquire();
+  tt_assert(ctx);
+  tt_int_op(hs_pow_verify_solution(ctx, pow_state.seed_current, &solution),
+            OP_EQ, 0);
+  hs_pow_verify_ctx_release(ctx);
+  ctx2 = hs_pow_verify_ctx_acquire();
+  tt_ptr_op(ctx2, OP_EQ, ctx);
+  tt_int_op(hs_pow_verify_solution(ctx2, pow_state.seed_current, &solution),
+            OP_EQ, 0);
+
+  /* ...but never to two users at once. */
+  ctx = hs_pow_verify_ctx_acquire();
+  tt_assert(ctx);
+  tt_ptr_op(ctx, OP_NE, ctx2);
+
+  /* The service context comes from, and goes back to, the pool too. */
+  hs_pow_verify_ctx_release(ctx2);
+  ctx2 = NULL;
+  tt_int_op(verify_pow(&pow_state, &solution), OP_EQ, 0);
+  tt_assert(pow_state.verify_ctx);
+  hs_pow_free_service_state_resources(&pow_state);
+  ctx2 = hs_pow_verify_ctx_acquire();
+  tt_assert(ctx2);
+
+ done:
+  hs_pow_verify_ctx_release(ctx);
+  hs_pow_verify_ctx_release(ctx2);
+  hs_pow_free_service_state_resources(&pow_state);
+  hs_pow_free_all();
+}
+
+static void
+test_verify_in_stages(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution;
+  const uint8_t *seed = NULL;
+  equix_ctx *ctx = NULL;
+
+  (void) arg;
+
+  setup_pow_params(&pow_state, &pow_params);
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+
+  /* The service state checks pick the seed the solution was made with... */
+  tt_int_op(hs_pow_check_solution_params(&pow_state, &solution, &seed),
+            OP_EQ, 0);
+  tt_ptr_op(seed, OP_EQ, pow_state.seed_current);
+
+  /* ...which is all a worker needs to verify it. */
+  ctx = hs_pow_verify_ctx_new();
+  tt_assert(ctx);
+  tt_int_op(hs_pow_verify_solution(ctx, seed, &solution), OP_EQ, 0);
+  solution.equix_solution.idx[0] ^= 1;
+  tt_int_op(hs_pow_verify_solution(ctx, seed, &solution), OP_EQ, -1);
+  solution.equix_solution.idx[0] ^= 1;
+
+  /* Only the first verified copy makes it to the replay cache. */
+  tt_assert(!hs_pow_replay_cache_contains(&pow_state, &solution));
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &solution), OP_EQ, 0);
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &solution), OP_EQ, -1);
+  tt_assert(hs_pow_replay_cache_contains(&pow_state, &solution));
+
+  /* Not enough effort. */
+  tt_int_op(solve_pow(&pow_params, &solution), OP_EQ, 0);
+  pow_state.min_effort = TEST_POW_EFFORT + 1;
+  tt_int_op(hs_pow_check_solution_params(&pow_state, &solution, NULL),
+            OP_EQ, -1);
+
+ done:
+  equix_free(ctx);
+  hs_pow_free_service_state_resources(&pow_state);
+}
+
+static void
+test_replay_cache_rotation(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t sol_current, sol_previous;
+
+  (void) arg;
+
+  setup_pow_params(&pow_state, &pow_params);
+  tt_int_op(solve_pow(&pow_params, &sol_current), OP_EQ, 0);
+  memcpy(pow_params.seed, pow_state.seed_previous, HS_POW_SEED_LEN);
+  tt_int_op(solve_pow(&pow_params, &sol_previous), OP_EQ, 0);
+
+  /* Each seed gets its own cache, allocated on first use. */
+  tt_ptr_op(pow_state.replay_cache_current, OP_EQ, NULL);
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &sol_current), OP_EQ, 0);
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &sol_previous), OP_EQ, 0);
+  tt_assert(pow_state.replay_cache_current);
+  tt_assert(pow_state.replay_cache_previous);
+  tt_uint_op(hs_pow_replay_cache_len(&pow_state), OP_EQ, 2);
+
+  /* The same nonce with the other seed is not a replay. */
+  sol_previous.nonce = sol_current.nonce;
+  tt_assert(!hs_pow_replay_cache_contains(&pow_state, &sol_previous));
+
+  /* Unknown seed: nothing to add it to. */
+  sol_previous.seed_head ^= 0xffffffff;
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &sol_previous), OP_EQ, -1);
+
+  /* Rotating drops the previous seed's cache and keeps the current one. */
+  tt_uint_op(hs_pow_rotate_replay_cache(&pow_state), OP_EQ, 1);
+  tt_ptr_op(pow_state.replay_cache_current, OP_EQ, NULL);
+  tt_uint_op(hs_pow_replay_cache_len(&pow_state), OP_EQ, 1);
+  memcpy(pow_state.seed_previous, pow_state.seed_current, HS_POW_SEED_LEN);
+  pow_state.seed_current[0] ^= 0xff;
+  tt_assert(hs_pow_replay_cache_contains(&pow_state, &sol_current));
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &sol_current), OP_EQ, -1);
+
+  tt_uint_op(hs_pow_rotate_replay_cache(&pow_state), OP_EQ, 1);
+  tt_uint_op(hs_pow_rotate_replay_cache(&pow_state), OP_EQ, 0);
+  tt_uint_op(hs_pow_replay_cache_len(&pow_state), OP_EQ, 0);
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+}
+
+static void
+test_replay_cache_full(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  hs_pow_solution_t solution, first;
+  uint64_t i = 0;
+
+  (void) arg;
+
+  setup_pow_params(&pow_state, &pow_params);
+  memset(&solution, 0, sizeof(solution));
+  solution.seed_head = get_uint32(pow_state.seed_current);
+
+  /* Fill the first filter. A few fresh nonces are lost to false
+   * positives. */
+  while (hs_pow_replay_cache_len(&pow_state) <
+         HS_POW_REPLAY_CACHE_MAX_ENTRIES) {
+    set_uint64(&solution.nonce, i++);
+    hs_pow_replay_cache_add(&pow_state, &solution);
+  }
+  tt_u64_op(i, OP_LT, HS_POW_REPLAY_CACHE_MAX_ENTRIES + 1000);
+
+  /* The next one goes to a fresh filter... */
+  set_uint64(&solution.nonce, UINT64_MAX);
+  first = solution;
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &solution), OP_EQ, 0);
+  tt_uint_op(hs_pow_replay_cache_len(&pow_state), OP_EQ,
+             HS_POW_REPLAY_CACHE_MAX_ENTRIES + 1);
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &solution), OP_EQ, -1);
+
+  /* ...and the full one is still used for lookups. */
+  set_uint64(&solution.nonce, 0);
+  tt_assert(hs_pow_replay_cache_contains(&pow_state, &solution));
+  tt_int_op(hs_pow_replay_cache_add(&pow_state, &solution), OP_EQ, -1);
+  tt_assert(hs_pow_replay_cache_contains(&pow_state, &first));
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+}
+
+/** Reply functions and arguments of the queued work, so the test can
+ * deliver the replies as the main loop would. */
+#define MAX_QUEUED_WORK 8
+static void (*queued_reply_fn[MAX_QUEUED_WORK])(void *);
+static void *queued_arg[MAX_QUEUED_WORK];
+static int n_queued = 0;
+
+/** Do the work right away, as if a cpuworker did it, and hold the reply. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) priority;
+
+  tor_assert(n_queued < MAX_QUEUED_WORK);
+  fn(NULL, arg);
+  queued_reply_fn[n_queued] = reply_fn;
+  queued_arg[n_queued] = arg;
+  n_queued++;
+  /* Never dereferenced: the tests don't cancel work. */
+  return (workqueue_entry_t *) arg;
+}
+
+static void
+test_solve_on_cpuworker(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  origin_circuit_t *intro_circ = NULL;
+
+  (void) arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  n_queued = 0;
+  get_options_mutable()->ClientOnionPoWSolverThreads = 1;
+
+  setup_pow_params(&pow_state, &pow_params);
+  intro_circ = origin_circuit_new();
+  TO_CIRCUIT(intro_circ)->purpose = CIRCUIT_PURPOSE_C_INTRODUCING;
+
+  tt_int_op(hs_pow_queue_work(intro_circ, &pow_params, TEST_POW_EFFORT), OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 1);
+  tt_assert(intro_circ->hs_pow_job);
+  tt_ptr_op(intro_circ->hs_pow_solution, OP_EQ, NULL);
+
+  /* Queueing again while solving is a no-op. */
+  tt_int_op(hs_pow_queue_work(intro_circ, &pow_params, TEST_POW_EFFORT), OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 1);
+
+  /* The reply hands the solution to the intro circuit. */
+  queued_reply_fn[0](queued_arg[0]);
+  tt_ptr_op(intro_circ->hs_pow_job, OP_EQ, NULL);
+  tt_assert(intro_circ->hs_pow_solution);
+  tt_int_op(verify_pow(&pow_state, intro_circ->hs_pow_solution), OP_EQ, 0);
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+  circuit_free_(TO_CIRCUIT(intro_circ));
+  UNMOCK(cpuworker_queue_work);
+}
+
+static void
+test_solve_split_across_workers(void *arg)
+{
+  hs_service_pow_state_t pow_state;
+  hs_desc_pow_params_t pow_params;
+  origin_circuit_t *intro_circ = NULL;
+
+  (void) arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  n_queued = 0;
+  get_options_mutable()->ClientOnionPoWSolverThreads = 4;
+
+  setup_pow_params(&pow_state, &pow_params);
+  intro_circ = origin_circuit_new();
+  TO_CIRCUIT(intro_circ)->purpose = CIRCUIT_PURPOSE_C_INTRODUCING;
+
+  /* The mock runs each slice as it is queued, so the first one solves it and
+   * the others see the stop flag and give up. */
+  tt_int_op(hs_pow_queue_work(intro_circ, &pow_params, TEST_POW_EFFORT), OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 4);
+
+  /* Failed slices don't fail the solve while another one may still
+   * succeed. */
+  for (int i = n_queued - 1; i > 0; i--) {
+    queued_reply_fn[i](queued_arg[i]);
+    tt_assert(intro_circ->hs_pow_job);
+    tt_ptr_op(intro_circ->hs_pow_solution, OP_EQ, NULL);
+    tt_assert(!TO_CIRCUIT(intro_circ)->marked_for_close);
+  }
+
+  /* The winning slice delivers its solution. */
+  queued_reply_fn[0](queued_arg[0]);
+  tt_ptr_op(intro_circ->hs_pow_job, OP_EQ, NULL);
+  tt_assert(intro_circ->hs_pow_solution);
+  tt_int_op(verify_pow(&pow_state, intro_circ->hs_pow_solution), OP_EQ, 0);
+
+ done:
+  hs_pow_free_service_state_resources(&pow_state);
+  circuit_free_(TO_CIRCUIT(intro_circ));
+  UNMOCK(cpuworker_queue_work);
+}
+
+struct testcase_t hs_pow_tests[] = {
+  { "solve_and_verify", test_solve_and_verify, TT_FORK,
+    NULL, NULL },
+  { "verify_ctx_reused", test_verify_ctx_reused, TT_FORK,
+    NULL, NULL },
+  { "verify_ctx_pool", test_verify_ctx_pool, TT_FORK,
+    NULL, NULL },
+  { "verify_in_stages", test_verify_in_stages, TT_FORK,
+    NULL, NULL },
+  { "replay_cache_rotation", test_replay_cache_rotation, TT_FORK,
+    NULL, NULL },
+  { "replay_cache_full", test_replay_cache_full, TT_FORK,
+    NULL, NULL },
+  { "solve_on_cpuworker", test_solve_on_cpuworker, TT_FORK,
+    NULL, NULL },
+  { "solve_split_across_workers", test_solve_split_across_workers, TT_FORK,
+    NULL, NULL },
+
+  END_OF_TESTCASES
+};
@@ -749,9 +749,9 @@ test_service_intro_point(void *arg)
     tt_assert(service->desc_current);
     /* Add intropoint to descriptor map. */
     service_intro_point_add(service->desc_current->intro_points.map, ip);
-    query = service_intro_point_find(service, &ip->auth_key_kp.pubkey);
+    query = hs_service_intro_point_find(service, &ip->auth_key_kp.pubkey);
     tt_mem_op(query, OP_EQ, ip, sizeof(hs_service_intro_point_t));
-    query = service_intro_point_find(service, &garbage);
+    query = hs_service_intro_point_find(service, &garbage);
     tt_ptr_op(query, OP_EQ, NULL);
 
     /* While at it, can I find the descriptor with the intro point? */
@@ -762,7 +762,7 @@ test_service_intro_point(void *arg)
 
     /* Remove object from service descriptor and make sure it is out. */
     service_intro_point_remove(service, ip);
-    query = service_intro_point_find(service, &ip->auth_key_kp.pubkey);
+    query = hs_service_intro_point_find(service, &ip->auth_key_kp.pubkey);
     tt_ptr_op(query, OP_EQ, NULL);
   }
 
@@ -1153,7 +1153,7 @@ test_closing_intro_circs(void *arg)
    * job of the cleanup routine. */
   circuit_free_(TO_CIRCUIT(intro_circ));
   intro_circ = NULL;
-  entry = service_intro_point_find(service, &ip->auth_key_kp.pubkey);
+  entry = hs_service_intro_point_find(service, &ip->auth_key_kp.pubkey);
   tt_assert(entry);
   /* The free should also remove the circuit from the circuitmap. */
   tmp_circ =
@@ -2545,6 +2545,244 @@ test_intro2_handling(void *arg)
   UNMOCK(launch_rendezvous_point_circuit);
 }
 
+/** Efforts of the rendezvous requests launched from the PoW priority queue,
+ * in launch order. */
+static uint32_t launched_efforts[8];
+static int n_launched_efforts = 0;
+
+static void
+mock_launch_rendezvous_point_circuit_record(const hs_service_t *service,
+                                        const hs_service_intro_point_t *ip,
+                                        const hs_cell_introduce2_data_t *data)
+{
+  (void) service;
+  (void) ip;
+  tor_assert(n_launched_efforts < (int) ARRAY_LENGTH(launched_efforts));
+  launched_efforts[n_launched_efforts++] = data->pow_effort;
+}
+
+/* Helper: Queue a rendezvous request with the given effort for ip. */
+static void
+helper_enqueue_rend_request(const hs_service_t *service,
+                            hs_service_intro_point_t *ip, uint32_t effort)
+{
+  hs_cell_introduce2_data_t *data = tor_malloc_zero(sizeof(*data));
+  data->link_specifiers = smartlist_new();
+  data->pow_effort = effort;
+  enqueue_rend_request(service, ip, data, effort);
+}
+
+/** Test that the PoW priority queue serves the highest effort first, stays
+ * bounded, drops stale requests and is rate limited. */
+static void
+test_pow_rend_pqueue(void *arg)
+{
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  hs_service_pow_state_t *pow_state = NULL;
+  time_t now = 0101010101;
+
+  (void) arg;
+
+  hs_init();
+  update_approx_time(now);
+  MOCK(launch_rendezvous_point_circuit,
+       mock_launch_rendezvous_point_circuit_record);
+  n_launched_efforts = 0;
+
+  service = helper_create_service();
+  service->config.has_pow_defenses_enabled = 1;
+  service->config.pow_queue_max_depth = 4;
+  service->config.pow_queue_max_age = 30;
+  ip = helper_create_service_ip();
+  service_intro_point_add(service->desc_current->intro_points.map, ip);
+
+  pow_state = tor_malloc_zero(sizeof(*pow_state));
+  pow_state->rend_request_pqueue = smartlist_new();
+  /* One launch per second. */
+  token_bucket_ctr_init(&pow_state->pqueue_bucket, 1, 1, (uint32_t) now);
+  service->state.pow_state = pow_state;
+
+  /* Filling the queue drops its lowest effort half. */
+  helper_enqueue_rend_request(service, ip, 5);
+  helper_enqueue_rend_request(service, ip, 1);
+  helper_enqueue_rend_request(service, ip, 9);
+  tt_int_op(smartlist_len(pow_state->rend_request_pqueue), OP_EQ, 3);
+  helper_enqueue_rend_request(service, ip, 3);
+  tt_int_op(smartlist_len(pow_state->rend_request_pqueue), OP_EQ, 2);
+
+  /* Highest effort first, and only as many as the bucket allows. */
+  handle_rend_pqueue_cb(NULL, service);
+  tt_int_op(n_launched_efforts, OP_EQ, 1);
+  tt_uint_op(launched_efforts[0], OP_EQ, 9);
+  tt_int_op(smartlist_len(pow_state->rend_request_pqueue), OP_EQ, 1);
+
+  /* Much later, the request left with effort 5 is stale. */
+  now += 31;
+  update_approx_time(now);
+  helper_enqueue_rend_request(service, ip, 2);
+  helper_enqueue_rend_request(service, ip, 7);
+  handle_rend_pqueue_cb(NULL, service);
+  tt_int_op(n_launched_efforts, OP_EQ, 2);
+  tt_uint_op(launched_efforts[1], OP_EQ, 7);
+
+  update_approx_time(now + 1);
+  handle_rend_pqueue_cb(NULL, service);
+  tt_int_op(n_launched_efforts, OP_EQ, 3);
+  tt_uint_op(launched_efforts[2], OP_EQ, 2);
+  tt_int_op(smartlist_len(pow_state->rend_request_pqueue), OP_EQ, 0);
+
+ done:
+  if (pow_state) {
+    rend_pqueue_clear(pow_state);
+    smartlist_free(pow_state->rend_request_pqueue);
+    mainloop_event_free(pow_state->pop_pqueue_ev);
+    tor_free(pow_state);
+  }
+  if (service) {
+    service->state.pow_state = NULL;
+    helper_destroy_service(service);
+  }
+  UNMOCK(launch_rendezvous_point_circuit);
+  hs_free_all();
+}
+
+/** Test that INTRODUCE2 cells over the intro point rate or over the per main
+ * loop run limit are not admitted for decryption. */
+static void
+test_introduce2_admission(void *arg)
+{
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  time_t now = 0101010101;
+  int i;
+
+  (void) arg;
+
+  hs_init();
+  update_approx_time(now);
+
+  service = helper_create_service();
+  ip = helper_create_service_ip();
+  service_intro_point_add(service->desc_current->intro_points.map, ip);
+
+  /* No limit by default. */
+  for (i = 0; i < 1000; i++) {
+    tt_assert(introduce2_admit(service, ip));
+  }
+
+  /* Two cells per second, with a burst of four. */
+  service->config.introduce2_rate_per_sec = 2;
+  service->config.introduce2_burst_per_sec = 4;
+  for (i = 0; i < 4; i++) {
+    tt_assert(introduce2_admit(service, ip));
+  }
+  tt_assert(!introduce2_admit(service, ip));
+  update_approx_time(now + 1);
+  tt_assert(introduce2_admit(service, ip));
+  tt_assert(introduce2_admit(service, ip));
+  tt_assert(!introduce2_admit(service, ip));
+
+  /* A new rate applies to the existing bucket. */
+  service->config.introduce2_rate_per_sec = 3;
+  update_approx_time(now + 2);
+  for (i = 0; i < 3; i++) {
+    tt_assert(introduce2_admit(service, ip));
+  }
+  tt_assert(!introduce2_admit(service, ip));
+
+  /* Three cells per main loop run. */
+  service->config.introduce2_rate_per_sec = 0;
+  get_options_mutable()->HiddenServiceIntroduce2MaxPerLoop = 3;
+  for (i = 0; i < 3; i++) {
+    tt_assert(introduce2_admit(service, ip));
+  }
+  tt_assert(!introduce2_admit(service, ip));
+  introduce2_loop_done_cb(NULL, NULL);
+  tt_assert(introduce2_admit(service, ip));
+
+ done:
+  get_options_mutable()->HiddenServiceIntroduce2MaxPerLoop = 0;
+  helper_destroy_service(service);
+  hs_free_all();
+}
+
+/** Test the suggested effort controller of the PoW defenses. */
+static void
+test_pow_suggested_effort(void *arg)
+{
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  hs_service_pow_state_t *pow_state = NULL;
+  time_t now = 0101010101;
+
+  (void) arg;
+
+  hs_init();
+  update_approx_time(now);
+
+  service = helper_create_service();
+  service->config.has_pow_defenses_enabled = 1;
+  service->config.pow_queue_max_depth = 16;
+  service->config.pow_queue_max_age = 30;
+  ip = helper_create_service_ip();
+  service_intro_point_add(service->desc_current->intro_points.map, ip);
+
+  pow_state = tor_malloc_zero(sizeof(*pow_state));
+  pow_state->rend_request_pqueue = smartlist_new();
+  pow_state->min_effort = 10;
+  pow_state->suggested_effort = 90;
+  service->state.pow_state = pow_state;
+
+  /* Idle for a whole period: decrease by a third... */
+  update_suggested_effort(service, now);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 60);
+  tt_uint_op(pow_state->next_effort_update, OP_EQ, now + HS_UPDATE_PERIOD);
+  /* ...but never under the minimum effort. */
+  pow_state->suggested_effort = 12;
+  update_suggested_effort(service, now);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 10);
+
+  /* High effort requests were dropped: increase to the average served
+   * effort. */
+  pow_state->suggested_effort = 60;
+  pow_state->max_trimmed_effort = 100;
+  pow_state->total_effort = 3 * 200;
+  pow_state->rend_handled = 3;
+  update_suggested_effort(service, now);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 200);
+  tt_uint_op(pow_state->total_effort, OP_EQ, 0);
+  tt_uint_op(pow_state->rend_handled, OP_EQ, 0);
+  tt_uint_op(pow_state->max_trimmed_effort, OP_EQ, 0);
+
+  /* A backlog that doesn't drain: increase by at least one. */
+  helper_enqueue_rend_request(service, ip, 5);
+  update_suggested_effort(service, now);
+  tt_assert(pow_state->had_queue);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 200);
+  update_suggested_effort(service, now);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 201);
+
+  /* The backlog drains faster than it fills: leave it alone. */
+  pow_state->total_effort = 50 * 201;
+  pow_state->rend_handled = 50;
+  update_suggested_effort(service, now);
+  tt_uint_op(pow_state->suggested_effort, OP_EQ, 201);
+
+ done:
+  if (pow_state) {
+    rend_pqueue_clear(pow_state);
+    smartlist_free(pow_state->rend_request_pqueue);
+    mainloop_event_free(pow_state->pop_pqueue_ev);
+    tor_free(pow_state);
+  }
+  if (service) {
+    service->state.pow_state = NULL;
+    helper_destroy_service(service);
+  }
+  hs_free_all();
+}
+
 static void
 test_cannot_upload_descriptors(void *arg)
 {
@@ -2733,6 +2971,10 @@ struct testcase_t hs_service_tests[] = {
   { "export_client_circuit_id", test_export_client_circuit_id, TT_FORK,
     NULL, NULL },
   { "intro2_handling", test_intro2_handling, TT_FORK, NULL, NULL },
+  { "pow_rend_pqueue", test_pow_rend_pqueue, TT_FORK, NULL, NULL },
+  { "pow_suggested_effort", test_pow_suggested_effort, TT_FORK, NULL, NULL },
+  { "introduce2_admission", test_introduce2_admission, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -117,17 +117,19 @@ static void
 test_oom_circbuf(void *arg)
 {
   or_options_t *options = get_options_mutable();
-  circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL, *c4 = NULL;
+  circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL, *c4 = NULL, *c5 = NULL;
   uint64_t now_ns = 1389631048 * (uint64_t)1000000000;
   const uint64_t start_ns = now_ns;
+  const size_t slab_cost = packed_cell_slab_mem_cost();
+  const int n_slab = PACKED_CELL_SLAB_N_CELLS;
 
   (void) arg;
 
   monotime_enable_test_mocking();
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 256*packed_cell_mem_cost();
+  /* Far too low for real life. Cells are accounted for by the slab. */
+  options->MaxMemInQueues = 5*slab_cost;
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -137,32 +139,29 @@ test_oom_circbuf(void *arg)
   /* Now we're going to fake up some circuits and get them added to the global
      circuit list. */
   monotime_coarse_set_mock_time_nsec(now_ns);
-  c1 = dummy_origin_circuit_new(30);
+  c1 = dummy_origin_circuit_new(n_slab);
 
   now_ns += 10 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
-  c2 = dummy_or_circuit_new(20, 20);
+  c2 = dummy_or_circuit_new(n_slab / 2, n_slab / 2);
 
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
             sizeof(packed_cell_t));
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 70);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 2);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
 
   now_ns += 10 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
-  c3 = dummy_or_circuit_new(100, 85);
+  c3 = dummy_or_circuit_new(n_slab, n_slab);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 255);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 4);
 
   now_ns += 10 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
-  /* Adding this cell will trigger our OOM handler. */
+  /* Adding these cells will start a new slab and trigger our OOM handler. */
   c4 = dummy_or_circuit_new(2, 0);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 257);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 5);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
 
@@ -171,13 +170,13 @@ test_oom_circbuf(void *arg)
   tt_assert(! c3->marked_for_close);
   tt_assert(! c4->marked_for_close);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+  /* The slab of c1 is empty, and was released. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 4);
 
   circuit_free(c1);
 
   monotime_coarse_set_mock_time_nsec(start_ns); /* go back in time */
-  c1 = dummy_or_circuit_new(90, 0);
+  c1 = dummy_or_circuit_new(n_slab + n_slab / 2, 0);
 
   now_ns += 10 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
@@ -189,14 +188,35 @@ test_oom_circbuf(void *arg)
   tt_assert(! c3->marked_for_close);
   tt_assert(! c4->marked_for_close);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+  /* Most of the cells of c1 were in the slab c4 still uses: only the slab
+   * with its last cells was released. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 4);
+
+  /* Now c1 fills the slab of c4, and a new circuit starts another one.
+   * Killing c1 releases no slab, so c2 has to go too. */
+  circuit_free(c1);
+  monotime_coarse_set_mock_time_nsec(start_ns);
+  c1 = dummy_or_circuit_new(n_slab - 2, 0);
+  now_ns += 10 * 1000000;
+  monotime_coarse_set_mock_time_nsec(now_ns);
+  c5 = dummy_or_circuit_new(2, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 5);
+
+  tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
+
+  tt_assert(c1->marked_for_close);
+  tt_assert(c2->marked_for_close);
+  tt_assert(! c3->marked_for_close);
+  tt_assert(! c4->marked_for_close);
+  tt_assert(! c5->marked_for_close);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, slab_cost * 4);
 
  done:
   circuit_free(c1);
   circuit_free(c2);
   circuit_free(c3);
   circuit_free(c4);
+  circuit_free(c5);
 
   UNMOCK(circuit_mark_for_close_);
   monotime_disable_test_mocking();
@@ -219,8 +239,9 @@ test_oom_streambuf(void *arg)
 
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 81*packed_cell_mem_cost() + 4096 * 34;
+  /* Far too low for real life. Cells are accounted for by the slab, and
+   * c5 will take a third one. */
+  options->MaxMemInQueues = 3*packed_cell_slab_mem_cost() + 4096 * 34;
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -242,7 +263,7 @@ test_oom_streambuf(void *arg)
   monotime_coarse_set_mock_time_nsec(start_ns + 530 * 1000000);
   c4 = dummy_or_circuit_new(0,0);
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+            packed_cell_slab_mem_cost() * 2);
 
   now_ns = start_ns + 600 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
@@ -300,7 +321,7 @@ test_oom_streambuf(void *arg)
   ts_is_approx(circuit_max_queued_item_age(c4, tvts), 370);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+            packed_cell_slab_mem_cost() * 2);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*16*2);
 
   /* Now give c4 a very old buffer of modest size */
@@ -320,10 +341,10 @@ test_oom_streambuf(void *arg)
   /* And run over the limit. */
   now_ns += 800*1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
-  c5 = dummy_or_circuit_new(0,5);
+  c5 = dummy_or_circuit_new(0,50);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+            packed_cell_slab_mem_cost() * 3);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*17*2);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
@@ -336,7 +357,7 @@ test_oom_streambuf(void *arg)
   tt_assert(! c5->marked_for_close);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+            packed_cell_slab_mem_cost() * 3);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*8*2);
 
  done:
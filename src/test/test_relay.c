@@ -5,6 +5,9 @@
 #define RELAY_PRIVATE
 #define BWHIST_PRIVATE
 #include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
@@ -16,6 +19,7 @@
 
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
 
 #define RESOLVE_ADDR_PRIVATE
 #include "feature/nodelist/dirlist.h"
@@ -24,6 +28,8 @@
 #include "feature/dirclient/dir_server_st.h"
 
 #include "app/config/resolve_addr.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/workqueue.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -207,6 +213,251 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/* Cpuworker mocking code, as in test_consdiffmgr.c: capture the jobs so we
+ * can run them in the main thread. */
+static smartlist_t *fake_cpuworker_queue = NULL;
+typedef struct fake_work_queue_ent_t {
+  enum workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} fake_work_queue_ent_t;
+static struct workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          enum workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) prio;
+
+  if (! fake_cpuworker_queue)
+    fake_cpuworker_queue = smartlist_new();
+
+  fake_work_queue_ent_t *ent = tor_malloc_zero(sizeof(*ent));
+  ent->fn = fn;
+  ent->reply_fn = reply_fn;
+  ent->arg = arg;
+  smartlist_add(fake_cpuworker_queue, ent);
+  return (struct workqueue_entry_t *)ent;
+}
+/* Run the oldest pending job and handle its reply. Return 0 if there was no
+ * job to run. */
+static int
+mock_cpuworker_run_one(void)
+{
+  fake_work_queue_ent_t *ent;
+  if (! fake_cpuworker_queue || ! smartlist_len(fake_cpuworker_queue))
+    return 0;
+  ent = smartlist_get(fake_cpuworker_queue, 0);
+  smartlist_del_keeporder(fake_cpuworker_queue, 0);
+  tt_int_op(ent->fn(NULL, ent->arg), OP_EQ, WQ_RPL_REPLY);
+  ent->reply_fn(ent->arg);
+ done:
+  tor_free(ent);
+  return 1;
+}
+
+static void
+test_relay_offload_crypto(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  relay_crypto_t ref;
+  char key[CPATH_KEY_MATERIAL_LEN];
+  cell_t cells[4], expected[4];
+  char recognized;
+  int i, hdr_len;
+  size_t item_cost;
+  packed_cell_t *packed;
+
+  (void)arg;
+  memset(&ref, 0, sizeof(ref));
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(server_mode, mock_server_mode_true);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  get_options_mutable()->OffloadRelayCellCrypto = 1;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  /* Give the circuit and a reference the same known keys. */
+  memset(key, 'k', sizeof(key));
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(relay_crypto_init(&orcirc->crypto, key, sizeof(key), 0, 0),
+            OP_EQ, 0);
+  tt_int_op(relay_crypto_init(&ref, key, sizeof(key), 0, 0), OP_EQ, 0);
+
+  /* Three cells to relay away from the origin, and one that we originate
+   * towards it. */
+  for (i = 0; i < 4; ++i) {
+    memset(&cells[i], 0, sizeof(cells[i]));
+    cells[i].command = CELL_RELAY;
+    crypto_rand((char *) cells[i].payload, CELL_PAYLOAD_SIZE);
+    memcpy(&expected[i], &cells[i], sizeof(cell_t));
+  }
+  for (i = 0; i < 3; ++i) {
+    relay_crypto_crypt_relayed_cell(&ref, &expected[i], CELL_DIRECTION_OUT,
+                                    &recognized);
+    tt_int_op(recognized, OP_EQ, 0);
+  }
+  relay_crypto_encrypt_cell_inbound(&ref, &expected[3], false);
+
+  /* The first cell goes to a cpuworker along with the crypto state; the
+   * others wait behind it. */
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(circuit_receive_relay_cell(&cells[i], TO_CIRCUIT(orcirc),
+                                         CELL_DIRECTION_OUT), OP_EQ, 0);
+  }
+  tt_assert(cpuworker_circ_relay_crypto_in_flight(orcirc));
+  tt_ptr_op(orcirc->crypto.f_crypto, OP_EQ, NULL);
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 1);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 0);
+  /* The cells waiting for a cpuworker count towards MaxMemInQueues. */
+  item_cost = cpuworker_relay_crypto_get_total_allocation() / 3;
+  tt_uint_op(item_cost, OP_GE, sizeof(cell_t));
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ,
+             3 * item_cost);
+
+  /* A cell we originate meanwhile must wait for the crypto state too. */
+  tt_int_op(circuit_package_relay_cell(&cells[3], TO_CIRCUIT(orcirc),
+                                       CELL_DIRECTION_IN, NULL, 0,
+                                       __FILE__, __LINE__), OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ,
+             4 * item_cost);
+
+  /* The first job relays its cell and hands the rest to a second one. */
+  tt_int_op(mock_cpuworker_run_one(), OP_EQ, 1);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 1);
+  tt_assert(cpuworker_circ_relay_crypto_in_flight(orcirc));
+  tt_int_op(mock_cpuworker_run_one(), OP_EQ, 1);
+  tt_int_op(mock_cpuworker_run_one(), OP_EQ, 0);
+  tt_assert(! cpuworker_circ_relay_crypto_in_flight(orcirc));
+  tt_ptr_op(orcirc->crypto.f_crypto, OP_NE, NULL);
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ, 0);
+
+  /* Everything came out in order, crypted as it would have been here. */
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 3);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+  hdr_len = nchan->wide_circ_ids ? 5 : 3;
+  i = 0;
+  TOR_SIMPLEQ_FOREACH(packed, &orcirc->base_.n_chan_cells.head, next) {
+    tt_mem_op(packed->body + hdr_len, OP_EQ, expected[i].payload,
+              CELL_PAYLOAD_SIZE);
+    ++i;
+  }
+  hdr_len = pchan->wide_circ_ids ? 5 : 3;
+  packed = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head);
+  tt_mem_op(packed->body + hdr_len, OP_EQ, expected[3].payload,
+            CELL_PAYLOAD_SIZE);
+
+  /* Get rid of the fake channels */
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  channel_mark_for_close(nchan);
+  channel_mark_for_close(pchan);
+  UNMOCK(scheduler_release_channel);
+
+  /* Shut down channels */
+  channel_free_all();
+
+ done:
+  relay_crypto_clear(&ref);
+  if (orcirc) {
+    cpuworker_cancel_circ_relay_crypto(orcirc);
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+  }
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  smartlist_free(fake_cpuworker_queue);
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(server_mode);
+  UNMOCK(cpuworker_queue_work);
+}
+
+/* Cells waiting for a cpuworker on a circuit that the OOM handler kills are
+ * freed at once, except for those of the job in flight. */
+static void
+test_relay_offload_crypto_oom(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  char key[CPATH_KEY_MATERIAL_LEN];
+  cell_t cell;
+  size_t item_cost;
+  int i;
+
+  (void)arg;
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(server_mode, mock_server_mode_true);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  get_options_mutable()->OffloadRelayCellCrypto = 1;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  memset(key, 'k', sizeof(key));
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(relay_crypto_init(&orcirc->crypto, key, sizeof(key), 0, 0),
+            OP_EQ, 0);
+
+  /* One cell goes to a cpuworker, and four wait behind it. */
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ, 0);
+  for (i = 0; i < 5; ++i) {
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_RELAY;
+    crypto_rand((char *) cell.payload, CELL_PAYLOAD_SIZE);
+    tt_int_op(circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                         CELL_DIRECTION_OUT), OP_EQ, 0);
+  }
+  tt_assert(cpuworker_circ_relay_crypto_in_flight(orcirc));
+  item_cost = cpuworker_relay_crypto_get_total_allocation() / 5;
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ,
+             5 * item_cost);
+
+  /* Killing the circuit frees the waiting cells. */
+  TO_CIRCUIT(orcirc)->marked_for_close = __LINE__;
+  tt_uint_op(cpuworker_circ_relay_crypto_free_queued(orcirc), OP_EQ,
+             4 * item_cost);
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ,
+             item_cost);
+  tt_uint_op(cpuworker_circ_relay_crypto_free_queued(orcirc), OP_EQ, 0);
+
+  /* The job in flight frees its own cell when it comes back, and relays
+   * nothing on the dead circuit. */
+  tt_int_op(mock_cpuworker_run_one(), OP_EQ, 1);
+  tt_int_op(mock_cpuworker_run_one(), OP_EQ, 0);
+  tt_uint_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 0);
+
+ done:
+  if (orcirc) {
+    cpuworker_cancel_circ_relay_crypto(orcirc);
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+  }
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  smartlist_free(fake_cpuworker_queue);
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(server_mode);
+  UNMOCK(cpuworker_queue_work);
+}
+
 static void
 test_suggested_address(void *arg)
 {
@@ -364,6 +615,10 @@ struct testcase_t relay_tests[] = {
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "offload_crypto", test_relay_offload_crypto,
+    TT_FORK, NULL, NULL },
+  { "offload_crypto_oom", test_relay_offload_crypto_oom,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
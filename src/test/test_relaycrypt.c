@@ -181,12 +181,67 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* Send cells whose recognized field is zero but whose digest is wrong to the
+ * last hop, between real ones. Check that it does not recognize them, hands
+ * them on unchanged, and still recognizes the real cells after them. */
+static void
+test_relaycrypt_bad_digest(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig;
+  cell_t encrypted;
+  int i, j;
+
+  for (i = 0; i < 20; ++i) {
+    const int forged = i & 1;
+    crypto_rand((char *)&orig, sizeof(orig));
+
+    relay_header_unpack(&rh, orig.payload);
+    rh.recognized = 0;
+    if (!forged)
+      memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig.payload, &rh);
+
+    memcpy(&encrypted, &orig, sizeof(orig));
+
+    if (forged) {
+      /* Encrypt the cell for every hop, without setting its digest. */
+      crypt_path_t *hop = cs->origin_circ->cpath->prev;
+      for (j = 0; j < 3; ++j, hop = hop->prev)
+        cpath_crypt_cell(hop, encrypted.payload, false);
+    } else {
+      relay_encrypt_cell_outbound(&encrypted, cs->origin_circ,
+                                  cs->origin_circ->cpath->prev);
+    }
+
+    for (j = 0; j < 3; ++j) {
+      crypt_path_t *layer_hint = NULL;
+      char recognized = 0;
+      int r = relay_decrypt_cell(TO_CIRCUIT(cs->or_circ[j]),
+                                 &encrypted,
+                                 CELL_DIRECTION_OUT,
+                                 &layer_hint, &recognized);
+      tt_int_op(r, OP_EQ, 0);
+      tt_int_op(recognized != 0, OP_EQ, j == 2 && !forged);
+    }
+
+    tt_mem_op(orig.payload, OP_EQ, encrypted.payload, CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  ;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(bad_digest),
   END_OF_TESTCASES
 };
 